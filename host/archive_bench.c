@@ -0,0 +1,335 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "EPD_7in5_V2.h"
+
+#include "archive.h"
+#include "frame.h"
+#include "render.h"
+#include "store.h"
+#include "host.h"
+
+/**
+ * Renders a corpus of comics offscreen the way the archive pre-renders them, then compares the
+ * frame encodings on the resulting frames: size against the 48KB raw frame and encode/decode
+ * throughput over -r passes, with every decode checked against the original. With -d it also
+ * runs the archive in that directory: every comic is added in turn with -s slots and a -b KB
+ * budget, one comic is shown whenever an add finds no room, and the index is reloaded from disk
+ * and checked at the end. -f runs it in a frame store backed by that file instead, like the
+ * frames partition on the device.
+ *
+ *   archive_bench [-r repeat] [-d dir | -f store] [-s slots] [-b budget_kb] comic.png ...
+ **/
+
+#define STRIDE (EPD_7IN5_V2_WIDTH / 8)
+#define HEIGHT EPD_7IN5_V2_HEIGHT
+#define FRAME_SIZE (STRIDE * HEIGHT)
+// Same as the frames partition in partitions.csv and the archive's records on the device
+#define STORE_SIZE 0x100000
+#define STORE_ARCHIVE 16
+
+static const char *encoding_names[] = { "raw", "packbits", "packbits+delta" };
+
+static unsigned char *read_file(const char *fname, size_t *len)
+{
+  FILE *f = fopen(fname, "rb");
+  if(f == NULL)
+  {
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  *len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  unsigned char *buf = malloc(*len);
+  if(buf != NULL && fread(buf, 1, *len, f) != *len)
+  {
+    free(buf);
+    buf = NULL;
+  }
+  fclose(f);
+  return buf;
+}
+
+// Renders fname offscreen into location as comic num.
+static int render_to(const char *fname, int num, const struct frame_location *location,
+                     enum frame_encoding encoding)
+{
+  struct render_session session;
+  size_t len;
+  char title[32];
+
+  unsigned char *png = read_file(fname, &len);
+  if(png == NULL)
+  {
+    return 1;
+  }
+  snprintf(title, sizeof(title), "Comic %d", num);
+  int failed = render_begin_offscreen(&session, title, "Alt text under the comic.", num,
+                                      location, encoding);
+  if(!failed)
+  {
+    render_feed(&session, png, len);
+    failed = render_end(&session);
+  }
+  free(png);
+  return failed;
+}
+
+// Encodes every frame, returns the total encoded size.
+static size_t encode_all(uint8_t **frames, int count, enum frame_encoding encoding,
+                         uint8_t **encoded, uint16_t **lengths)
+{
+  size_t total = 0;
+  for(int i = 0; i < count; i++)
+  {
+    uint8_t *dst = encoded[i];
+    for(int y = 0; y < HEIGHT; y++)
+    {
+      const uint8_t *prev = y > 0 ? &frames[i][(y - 1) * STRIDE] : NULL;
+      lengths[i][y] = frame_encode_row(&frames[i][y * STRIDE], prev, STRIDE, encoding, dst);
+      dst += lengths[i][y];
+      total += lengths[i][y] + (encoding == FRAME_RAW ? 0 : 2);
+    }
+  }
+  return total;
+}
+
+static int decode_all(int count, enum frame_encoding encoding, uint8_t **encoded,
+                      uint16_t **lengths, uint8_t *out)
+{
+  for(int i = 0; i < count; i++)
+  {
+    const uint8_t *src = encoded[i];
+    for(int y = 0; y < HEIGHT; y++)
+    {
+      const uint8_t *prev = y > 0 ? &out[(y - 1) * STRIDE] : NULL;
+      if(frame_decode_row(src, lengths[i][y], prev, &out[y * STRIDE], STRIDE, encoding))
+      {
+        return 1;
+      }
+      src += lengths[i][y];
+    }
+  }
+  return 0;
+}
+
+static int bench_encodings(uint8_t **frames, int count, int repeat)
+{
+  uint8_t **encoded = malloc(count * sizeof(*encoded));
+  uint16_t **lengths = malloc(count * sizeof(*lengths));
+  uint8_t *out = malloc(FRAME_SIZE);
+  int errors = 0;
+
+  for(int i = 0; i < count; i++)
+  {
+    encoded[i] = malloc(HEIGHT * FRAME_PACKED_MAX(STRIDE));
+    lengths[i] = malloc(HEIGHT * sizeof(uint16_t));
+  }
+  for(int encoding = FRAME_RAW; encoding <= FRAME_PACKBITS_DELTA; encoding++)
+  {
+    size_t total = 0;
+    int64_t start = host_time_us();
+    for(int r = 0; r < repeat; r++)
+    {
+      total = encode_all(frames, count, encoding, encoded, lengths);
+    }
+    int64_t encode_us = host_time_us() - start;
+
+    // Round trip every frame once, then time the decodes
+    for(int i = 0; i < count; i++)
+    {
+      if(decode_all(1, encoding, &encoded[i], &lengths[i], out)
+         || memcmp(out, frames[i], FRAME_SIZE))
+      {
+        fprintf(stderr, "%s: frame %d doesn't round trip\n", encoding_names[encoding], i);
+        errors++;
+      }
+    }
+    start = host_time_us();
+    for(int r = 0; r < repeat; r++)
+    {
+      errors += decode_all(count, encoding, encoded, lengths, out);
+    }
+    int64_t decode_us = host_time_us() - start;
+
+    double mb = (double)FRAME_SIZE * count * repeat / 1e6;
+    printf("%-15s %7zu bytes/frame (%5.1fx)  encode %7.1f MB/s  decode %7.1f MB/s\n",
+           encoding_names[encoding], total / count, (double)FRAME_SIZE * count / total,
+           mb / (encode_us / 1e6), mb / (decode_us / 1e6));
+  }
+  for(int i = 0; i < count; i++)
+  {
+    free(encoded[i]);
+    free(lengths[i]);
+  }
+  free(encoded);
+  free(lengths);
+  free(out);
+  return errors;
+}
+
+// Adds every comic to an archive at home, showing one whenever there's no room.
+static int run_archive(const struct frame_location *home, int slots, uint32_t budget,
+                       char **files, int count)
+{
+  struct archive archive;
+  struct frame_location location;
+  char path[ARCHIVE_PATH_LEN];
+  uint32_t settings = render_settings();
+  uint32_t frame_max = FRAME_FILE_MAX(STRIDE, HEIGHT);
+  int added = 0, shown = 0, errors = 0;
+
+  if(home->store != NULL)
+  {
+    frame_max = store_size(frame_max);
+  }
+  archive_open(&archive, home, slots, budget, frame_max);
+  // Newest first, like prefetching walks back from the latest comic
+  int32_t latest = count + 1;
+  int32_t num;
+  while((num = archive_next(&archive, latest, settings)) > 0)
+  {
+    int slot = archive_reserve(&archive, settings);
+    if(slot < 0)
+    {
+      // Full of unseen comics, show the next one to make room
+      int pick = archive_pick(&archive, settings);
+      if(pick < 0)
+      {
+        fprintf(stderr, "no room and no comic to show\n");
+        return errors + 1;
+      }
+      archive_location(&archive, pick, &location, path);
+      errors += render_frame(&location, archive.entries[pick].comic_num) != 0;
+      archive_touch(&archive, pick);
+      shown++;
+      continue;
+    }
+    archive_location(&archive, slot, &location, path);
+    archive_skip(&archive, num);
+    if(render_to(files[count - num], num, &location, FRAME_PACKBITS_DELTA)
+       || archive_commit(&archive, slot, num, settings))
+    {
+      fprintf(stderr, "failed to archive %s\n", files[count - num]);
+      errors++;
+      continue;
+    }
+    added++;
+  }
+  archive_save(&archive);
+
+  // What's on disk has to match what's in memory
+  struct archive reloaded;
+  if(archive_open(&reloaded, home, slots, budget, archive.frame_max)
+     || memcmp(reloaded.entries, archive.entries, sizeof(archive.entries))
+     || reloaded.cursor != archive.cursor)
+  {
+    fprintf(stderr, "reloaded index doesn't match\n");
+    errors++;
+  }
+  for(int slot = 0; slot < archive.slots; slot++)
+  {
+    if(archive.entries[slot].comic_num != 0)
+    {
+      archive_location(&archive, slot, &location, path);
+      errors += render_frame(&location, archive.entries[slot].comic_num) != 0;
+    }
+  }
+  printf("archive: %d added, %d shown to make room, %d kept in %u bytes, next pick comic %d\n",
+         added, shown, archive_count(&archive), (unsigned)archive_bytes(&archive),
+         archive_pick(&archive, settings) >= 0
+         ? (int)archive.entries[archive_pick(&archive, settings)].comic_num : 0);
+  return errors;
+}
+
+int main(int argc, char **argv)
+{
+  int repeat = 20;
+  const char *dir = NULL;
+  const char *store_file = NULL;
+  int slots = 40;
+  uint32_t budget_kb = 384;
+  int opt;
+
+  while((opt = getopt(argc, argv, "r:d:f:s:b:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'r': repeat = atoi(optarg); break;
+      case 'd': dir = optarg; break;
+      case 'f': store_file = optarg; break;
+      case 's': slots = atoi(optarg); break;
+      case 'b': budget_kb = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-r repeat] [-d dir | -f store] [-s slots] [-b budget_kb]"
+                " comic.png ...\n", argv[0]);
+        return 2;
+    }
+  }
+  int count = argc - optind;
+  if(count <= 0)
+  {
+    fprintf(stderr, "no comics given\n");
+    return 2;
+  }
+
+  char tmp[] = "/tmp/archive_benchXXXXXX";
+  if(mkdtemp(tmp) == NULL)
+  {
+    perror("mkdtemp");
+    return 1;
+  }
+  char path[sizeof(tmp) + 16];
+  snprintf(path, sizeof(path), "%s/frame", tmp);
+  struct frame_location location = { path, NULL, 0 };
+
+  uint8_t **frames = malloc(count * sizeof(*frames));
+  int errors = 0;
+  int64_t start = host_time_us();
+  for(int i = 0; i < count; i++)
+  {
+    struct frame_key key = { i + 1, render_settings(), 0, 1 };
+    frames[i] = malloc(FRAME_SIZE);
+    if(render_to(argv[optind + i], i + 1, &location, FRAME_RAW)
+       || frame_load(&location, &key, frames[i], STRIDE, HEIGHT))
+    {
+      fprintf(stderr, "failed to render %s\n", argv[optind + i]);
+      return 1;
+    }
+  }
+  printf("rendered %d comics in %.1f ms\n", count, (host_time_us() - start) / 1000.0);
+  remove(path);
+  rmdir(tmp);
+
+  errors += bench_encodings(frames, count, repeat);
+  if(dir != NULL)
+  {
+    char prefix[ARCHIVE_PATH_LEN];
+    snprintf(prefix, sizeof(prefix), "%s/arc", dir);
+    struct frame_location home = { prefix, NULL, 0 };
+    errors += run_archive(&home, slots, budget_kb * 1024, &argv[optind], count);
+  }
+  else if(store_file != NULL)
+  {
+    struct store store;
+    if(partition_sim_attach("frames", store_file, STORE_SIZE)
+       || store_open(&store, "frames", FRAME_FILE_MAX(STRIDE, HEIGHT)))
+    {
+      fprintf(stderr, "failed to open the frame store in %s\n", store_file);
+      return 1;
+    }
+    struct frame_location home = { NULL, &store, STORE_ARCHIVE };
+    errors += run_archive(&home, slots, budget_kb * 1024, &argv[optind], count);
+    printf("store: %d records in %u bytes, %u sectors erased, %u records moved\n", store.count,
+           (unsigned)store_used(&store), (unsigned)store.erases, (unsigned)store.moves);
+  }
+  for(int i = 0; i < count; i++)
+  {
+    free(frames[i]);
+  }
+  free(frames);
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,345 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pngle.h"
+
+#include "dither.h"
+#include "host.h"
+
+/**
+ * Pixels/sec of the dither + pack stage for every dither kernel, against the original per-pixel
+ * path (floating point luma, int error lines, a divide and modulo per packed bit) as a baseline.
+ * Quality is the PSNR between the greyscale image and the dithered one after both went through
+ * a 5x5 box filter, roughly what the eye does at reading distance (unfiltered, every kernel
+ * scores about the same few dB). The comics given on the command line are used as the corpus,
+ * otherwise a synthetic one is generated.
+ *
+ *   dither_bench [-w width] [-h height] [-r repeat] [comic.png ...]
+ **/
+
+#define BLUR_RADIUS 2
+
+struct image
+{
+  int width;
+  int height;
+  uint8_t *rgba;
+};
+
+// The per-pixel path as it was in on_draw/dither_patch, kept only as the baseline.
+static void legacy_dither_patch(int *curr_line, int *next_line, int i, uint32_t length,
+                                const uint8_t rgba[4])
+{
+  int oldpixel = curr_line[i] + ( (0.3  * rgba[0])
+                                + (0.59 * rgba[1])
+                                + (0.11 * rgba[2]) );
+  if(oldpixel > 255) oldpixel = 255;
+  if(oldpixel < 0) oldpixel = 0;
+
+  int newpixel = oldpixel > 127 ? 1 : 0;
+  curr_line[i] = newpixel;
+
+  int quant_error = oldpixel - (newpixel) * 255;
+  if (i < length-1)
+  {
+    curr_line[i + 1] = curr_line[i + 1] + ((quant_error * 7)>>4);
+    next_line[i + 1] = next_line[i + 1] + ((quant_error * 1)>>4);
+  }
+  if (i > 0)
+  {
+    next_line[i - 1] = next_line[i - 1] + ((quant_error * 3)>>4);
+  }
+  next_line[i] = next_line[i] + ((quant_error * 5)/16);
+}
+
+static void legacy_frame(const uint8_t *rgba, int width, int height, unsigned char *bitmap)
+{
+  int *curr_line = calloc(width, sizeof(int));
+  int *next_line = calloc(width, sizeof(int));
+  int stride = (width + 7) / 8;
+
+  for(int y = 0; y < height; y++)
+  {
+    for(int x = 0; x < width; x++)
+    {
+      legacy_dither_patch(curr_line, next_line, x, width, &rgba[(y * width + x) * 4]);
+    }
+    for(int i = 0; i < width; i++)
+    {
+      int idx = (i / 8) + (y * stride);
+      if(curr_line[i])
+      {
+        bitmap[idx] |= 1<<(7-(i % 8));
+      }
+      else
+      {
+        bitmap[idx] &= ~(1<<(7-(i % 8)));
+      }
+    }
+    int *temp = curr_line;
+    curr_line = next_line;
+    next_line = temp;
+    memset(next_line, 0x00, width*sizeof(int));
+  }
+  free(curr_line);
+  free(next_line);
+}
+
+static void kernel_frame(const uint8_t *rgba, int width, int height, unsigned char *bitmap,
+                         enum dither_kernel kernel)
+{
+  struct dither_state dither;
+  struct arena arena;
+  void *lines = malloc(DITHER_ARENA_SIZE(width));
+  uint8_t *luma = malloc(width);
+  uint8_t *pixels = malloc(width);
+  int stride = (width + 7) / 8;
+
+  arena_init(&arena, lines, DITHER_ARENA_SIZE(width));
+  dither_init(&dither, width, kernel, &arena);
+  for(int y = 0; y < height; y++)
+  {
+    const uint8_t *src = &rgba[(size_t)y * width * 4];
+    for(int x = 0; x < width; x++)
+    {
+      luma[x] = dither_luma(&src[x * 4]);
+    }
+    dither_row(&dither, luma, pixels);
+
+    unsigned char *row = &bitmap[(size_t)y * stride];
+    for(int x = 0; x < width; x++)
+    {
+      unsigned char mask = 0x80 >> (x & 7);
+      if(pixels[x]) row[x >> 3] |= mask;
+      else row[x >> 3] &= ~mask;
+    }
+  }
+  free(lines);
+  free(luma);
+  free(pixels);
+}
+
+// Line art over white with a grey gradient band, roughly what a comic looks like.
+static void make_image(struct image *image, int width, int height)
+{
+  uint8_t *rgba = malloc((size_t)width * height * 4);
+  unsigned seed = 1;
+  for(int y = 0; y < height; y++)
+  {
+    for(int x = 0; x < width; x++)
+    {
+      uint8_t v = 255;
+      seed = seed * 1103515245 + 12345;
+      if((seed >> 16) % 23 == 0) v = 0;
+      if(y > height / 3 && y < height / 2) v = (x * 255) / width;
+      uint8_t *px = &rgba[((size_t)y * width + x) * 4];
+      px[0] = px[1] = px[2] = v;
+      px[3] = 255;
+    }
+  }
+  image->width = width;
+  image->height = height;
+  image->rgba = rgba;
+}
+
+static void on_png_init(pngle_t *pngle, uint32_t w, uint32_t h)
+{
+  struct image *image = pngle_get_user_data(pngle);
+  image->width = w;
+  image->height = h;
+  image->rgba = malloc((size_t)w * h * 4);
+}
+
+static void on_png_draw(pngle_t *pngle, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                        uint8_t rgba[4])
+{
+  struct image *image = pngle_get_user_data(pngle);
+  for(uint32_t j = y; j < y + h && j < (uint32_t)image->height; j++)
+  {
+    for(uint32_t i = x; i < x + w && i < (uint32_t)image->width; i++)
+    {
+      memcpy(&image->rgba[((size_t)j * image->width + i) * 4], rgba, 4);
+    }
+  }
+}
+
+static int load_png(struct image *image, const char *fname)
+{
+  char buf[4096];
+  int remain = 0;
+  int len;
+  int ret = 1;
+
+  memset(image, 0, sizeof(*image));
+  FILE *f = fopen(fname, "rb");
+  if(f == NULL)
+  {
+    return 1;
+  }
+  pngle_t *pngle = pngle_new();
+  pngle_set_user_data(pngle, image);
+  pngle_set_init_callback(pngle, on_png_init);
+  pngle_set_draw_callback(pngle, on_png_draw);
+  while((len = fread(buf + remain, 1, sizeof(buf) - remain, f)) > 0)
+  {
+    int fed = pngle_feed(pngle, buf, remain + len);
+    if(fed < 0)
+    {
+      fprintf(stderr, "%s: %s\n", fname, pngle_error(pngle));
+      goto exit;
+    }
+    remain = remain + len - fed;
+    if(remain > 0) memmove(buf, buf + fed, remain);
+  }
+  ret = image->rgba == NULL;
+exit:
+  pngle_destroy(pngle);
+  fclose(f);
+  return ret;
+}
+
+// Box filters a width x height plane of doubles in place using a summed area table.
+static void box_filter(double *plane, int width, int height)
+{
+  double *sum = calloc((size_t)(width + 1) * (height + 1), sizeof(double));
+  for(int y = 0; y < height; y++)
+  {
+    for(int x = 0; x < width; x++)
+    {
+      sum[(size_t)(y + 1) * (width + 1) + x + 1] = plane[(size_t)y * width + x]
+        + sum[(size_t)y * (width + 1) + x + 1]
+        + sum[(size_t)(y + 1) * (width + 1) + x]
+        - sum[(size_t)y * (width + 1) + x];
+    }
+  }
+  for(int y = 0; y < height; y++)
+  {
+    int y0 = y - BLUR_RADIUS < 0 ? 0 : y - BLUR_RADIUS;
+    int y1 = y + BLUR_RADIUS + 1 > height ? height : y + BLUR_RADIUS + 1;
+    for(int x = 0; x < width; x++)
+    {
+      int x0 = x - BLUR_RADIUS < 0 ? 0 : x - BLUR_RADIUS;
+      int x1 = x + BLUR_RADIUS + 1 > width ? width : x + BLUR_RADIUS + 1;
+      double area = sum[(size_t)y1 * (width + 1) + x1] - sum[(size_t)y0 * (width + 1) + x1]
+                  - sum[(size_t)y1 * (width + 1) + x0] + sum[(size_t)y0 * (width + 1) + x0];
+      plane[(size_t)y * width + x] = area / ((y1 - y0) * (x1 - x0));
+    }
+  }
+  free(sum);
+}
+
+// Sum of squared differences between the filtered greyscale and dithered images.
+static double filtered_error(const struct image *image, const unsigned char *bitmap)
+{
+  size_t pixels = (size_t)image->width * image->height;
+  int stride = (image->width + 7) / 8;
+  double *grey = malloc(pixels * sizeof(double));
+  double *dithered = malloc(pixels * sizeof(double));
+
+  for(int y = 0; y < image->height; y++)
+  {
+    for(int x = 0; x < image->width; x++)
+    {
+      size_t i = (size_t)y * image->width + x;
+      grey[i] = dither_luma(&image->rgba[i * 4]);
+      dithered[i] = (bitmap[(size_t)y * stride + (x >> 3)] & (0x80 >> (x & 7))) ? 255 : 0;
+    }
+  }
+  box_filter(grey, image->width, image->height);
+  box_filter(dithered, image->width, image->height);
+
+  double error = 0;
+  for(size_t i = 0; i < pixels; i++)
+  {
+    error += (grey[i] - dithered[i]) * (grey[i] - dithered[i]);
+  }
+  free(grey);
+  free(dithered);
+  return error;
+}
+
+int main(int argc, char **argv)
+{
+  int width = 740;
+  int height = 1200;
+  int repeat = 20;
+  int opt;
+
+  while((opt = getopt(argc, argv, "w:h:r:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'w': width = atoi(optarg); break;
+      case 'h': height = atoi(optarg); break;
+      case 'r': repeat = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-w width] [-h height] [-r repeat] [comic.png ...]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  int count = optind < argc ? argc - optind : 1;
+  struct image *images = calloc(count, sizeof(*images));
+  double pixels = 0;
+  for(int i = 0; i < count; i++)
+  {
+    if(optind == argc)
+    {
+      make_image(&images[i], width, height);
+    }
+    else if(load_png(&images[i], argv[optind + i]))
+    {
+      fprintf(stderr, "failed to load %s\n", argv[optind + i]);
+      return 1;
+    }
+    pixels += (double)images[i].width * images[i].height * repeat;
+  }
+
+  // Totals over the corpus, the baseline first and then each kernel.
+  int64_t legacy_us = 0;
+  int64_t kernel_us[DITHER_KERNEL_COUNT] = {0};
+  double error[DITHER_KERNEL_COUNT] = {0};
+  for(int i = 0; i < count; i++)
+  {
+    struct image *image = &images[i];
+    unsigned char *bitmap = calloc((size_t)(image->width + 7) / 8 * image->height, 1);
+
+    int64_t start = host_time_us();
+    for(int r = 0; r < repeat; r++)
+    {
+      legacy_frame(image->rgba, image->width, image->height, bitmap);
+    }
+    legacy_us += host_time_us() - start;
+
+    for(int k = 0; k < DITHER_KERNEL_COUNT; k++)
+    {
+      start = host_time_us();
+      for(int r = 0; r < repeat; r++)
+      {
+        kernel_frame(image->rgba, image->width, image->height, bitmap, k);
+      }
+      kernel_us[k] += host_time_us() - start;
+      error[k] += filtered_error(image, bitmap);
+    }
+    free(bitmap);
+    free(image->rgba);
+  }
+  free(images);
+
+  double legacy = pixels / legacy_us;
+  printf("%d image(s), %.1f Mpx x%d\n", count, pixels / repeat / 1e6, repeat);
+  printf("%-10s %10s %8s %10s\n", "kernel", "Mpx/s", "speedup", "PSNR dB");
+  printf("%-10s %10.2f %8s %10s\n", "per-pixel", legacy, "1.00x", "-");
+  for(int k = 0; k < DITHER_KERNEL_COUNT; k++)
+  {
+    // PSNR over the whole corpus, so a perfectly reproduced image doesn't make it infinite.
+    double mse = error[k] / (pixels / repeat);
+    double rate = pixels / kernel_us[k];
+    printf("%-10s %10.2f %7.2fx %10.2f\n", dither_kernel_name(k), rate, rate / legacy,
+           mse > 0 ? 10 * log10(255.0 * 255.0 / mse) : INFINITY);
+  }
+  return 0;
+}
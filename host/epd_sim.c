@@ -0,0 +1,82 @@
+#include <string.h>
+
+#include "esp_log.h"
+#include "EPD_7in5_V2.h"
+
+#include "host.h"
+
+/* Stand-in for the waveshare driver, it keeps the last frame pushed to the "panel" so the host
+ * tools can write it out or compare it. */
+
+#define EPD_FRAME_SIZE ((EPD_7IN5_V2_WIDTH / 8) * EPD_7IN5_V2_HEIGHT)
+
+static const char *TAG = "epd_sim";
+
+static UBYTE frame[EPD_FRAME_SIZE];
+static int refreshes = 0;
+static int partial_refreshes = 0;
+
+UBYTE DEV_Module_Init(void)
+{
+  return 0;
+}
+
+void DEV_Module_Exit(void)
+{
+}
+
+UBYTE EPD_7IN5_V2_Init(void)
+{
+  return 0;
+}
+
+void EPD_7IN5_V2_Clear(void)
+{
+  memset(frame, 0xFF, sizeof(frame));
+  refreshes++;
+}
+
+void EPD_7IN5_V2_Display(UBYTE *Image)
+{
+  memcpy(frame, Image, sizeof(frame));
+  refreshes++;
+  ESP_LOGI(TAG, "refresh #%d", refreshes);
+}
+
+void EPD_7IN5_V2_Sleep(void)
+{
+}
+
+UBYTE EPD_7IN5_V2_Init_Part(void)
+{
+  return 0;
+}
+
+// Like the driver, Image only holds the window: rows of (x_end - x_start) / 8 bytes.
+void EPD_7IN5_V2_Display_Part(UBYTE *Image, UDOUBLE x_start, UDOUBLE y_start, UDOUBLE x_end,
+                              UDOUBLE y_end)
+{
+  int width = (x_end - x_start + 7) / 8;
+  for(UDOUBLE y = y_start; y < y_end; y++)
+  {
+    memcpy(&frame[y * (EPD_7IN5_V2_WIDTH / 8) + x_start / 8], &Image[(y - y_start) * width], width);
+  }
+  partial_refreshes++;
+  ESP_LOGI(TAG, "partial refresh #%d, rows %u-%u", partial_refreshes, (unsigned)y_start,
+           (unsigned)y_end - 1);
+}
+
+const uint8_t *epd_sim_frame(void)
+{
+  return frame;
+}
+
+int epd_sim_refreshes(void)
+{
+  return refreshes;
+}
+
+int epd_sim_partial_refreshes(void)
+{
+  return partial_refreshes;
+}
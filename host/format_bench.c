@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "pngle.h"
+
+#include "dither.h"
+#include "render.h"
+#include "host.h"
+
+/**
+ * What each PNG format costs past the decoder: every comic is decoded on its own, with a draw
+ * callback that does nothing, and then rendered through the RGBA path every format used to take
+ * and through the native one for its format (render_set_native_formats()), all on one thread.
+ * The decode time is taken off both renders, what's left is turning pngle's pixels into a canvas.
+ * Both renders have to give the same canvas. Give it the same comic saved in different formats
+ * to compare them, e.g. 1 bit and 8 bit greyscale, palette and RGB.
+ *
+ *   format_bench [-r repeat] [-d kernel] comic.png ...
+ **/
+
+static const char *format_name(const uint8_t *png, size_t len)
+{
+  static char name[32];
+  static const char *const types[] = {
+    "grey", "?", "rgb", "palette", "grey+alpha", "?", "rgba"
+  };
+
+  // The IHDR chunk always comes first, right after the signature
+  if(len < 26 || png[25] >= sizeof(types) / sizeof(types[0]))
+  {
+    return "?";
+  }
+  snprintf(name, sizeof(name), "%d bit %s", png[24], types[png[25]]);
+  return name;
+}
+
+static unsigned char *read_file(const char *fname, size_t *len)
+{
+  FILE *f = fopen(fname, "rb");
+  if(f == NULL)
+  {
+    return NULL;
+  }
+  fseek(f, 0L, SEEK_END);
+  *len = ftell(f);
+  fseek(f, 0L, SEEK_SET);
+
+  unsigned char *buf = malloc(*len);
+  if(buf != NULL && fread(buf, 1, *len, f) != *len)
+  {
+    free(buf);
+    buf = NULL;
+  }
+  fclose(f);
+  return buf;
+}
+
+static void ignore_pixel(pngle_t *pngle, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                         uint8_t rgba[4])
+{
+}
+
+// Average us to only decode the PNG.
+static double decode_us(const uint8_t *png, size_t len, int repeat)
+{
+  pngle_t *pngle = pngle_new();
+  pngle_set_draw_callback(pngle, ignore_pixel);
+  int64_t start = host_time_us();
+  for(int i = 0; i < repeat; i++)
+  {
+    pngle_reset(pngle);
+    pngle_set_draw_callback(pngle, ignore_pixel);
+    pngle_feed(pngle, png, len);
+  }
+  int64_t elapsed = host_time_us() - start;
+  pngle_destroy(pngle);
+  return (double)elapsed / repeat;
+}
+
+// Average us to render the PNG up to the panel, the canvas checksum goes to checksum.
+static double render_us(const uint8_t *png, size_t len, int repeat, uint32_t *checksum)
+{
+  int64_t elapsed = 0;
+  for(int i = 0; i < repeat; i++)
+  {
+    struct render_session session;
+    if(render_begin(&session, "Format bench", "", 1))
+    {
+      return -1;
+    }
+    int64_t start = host_time_us();
+    int fed = render_feed(&session, png, len);
+    elapsed += host_time_us() - start;
+    if(render_end(&session) || fed < 0)
+    {
+      return -1;
+    }
+  }
+  *checksum = render_last_checksum();
+  return (double)elapsed / repeat;
+}
+
+int main(int argc, char **argv)
+{
+  int repeat = 10;
+  int failures = 0;
+  int opt;
+
+  while((opt = getopt(argc, argv, "r:d:v")) != -1)
+  {
+    switch(opt)
+    {
+      case 'r': repeat = atoi(optarg); break;
+      case 'd':
+        if(dither_kernel_find(optarg) < 0)
+        {
+          fprintf(stderr, "unknown dither kernel %s\n", optarg);
+          return 2;
+        }
+        render_set_dither(dither_kernel_find(optarg));
+        break;
+      case 'v': host_log_level++; break;
+      default:
+        fprintf(stderr, "usage: %s [-r repeat] [-d kernel] comic.png ...\n", argv[0]);
+        return 2;
+    }
+  }
+  if(optind >= argc || repeat < 1)
+  {
+    fprintf(stderr, "usage: %s [-r repeat] [-d kernel] comic.png ...\n", argv[0]);
+    return 2;
+  }
+  // The canvas only goes to the panel when it changed, so once a comic is up the timed renders
+  // don't refresh it unless the two paths disagree.
+  render_set_pipeline(0);
+
+  printf("%-24s %-16s %10s %10s %10s %8s\n", "comic", "format", "decode_ms", "rgba_ms",
+         "native_ms", "speedup");
+  for(int i = optind; i < argc; i++)
+  {
+    uint32_t rgba_checksum = 0, native_checksum = 0;
+    size_t len;
+    unsigned char *png = read_file(argv[i], &len);
+    if(png == NULL)
+    {
+      fprintf(stderr, "failed to read %s\n", argv[i]);
+      failures++;
+      continue;
+    }
+
+    // Once untimed to put it on the panel
+    render_set_native_formats(0);
+    double rgba = render_us(png, len, 1, &rgba_checksum);
+    double decode = decode_us(png, len, repeat);
+    if(rgba >= 0)
+    {
+      rgba = render_us(png, len, repeat, &rgba_checksum);
+    }
+    render_set_native_formats(1);
+    double native = render_us(png, len, repeat, &native_checksum);
+    if(rgba < 0 || native < 0)
+    {
+      fprintf(stderr, "%s never reached the display\n", argv[i]);
+      free(png);
+      failures++;
+      continue;
+    }
+
+    const char *name = strrchr(argv[i], '/') != NULL ? strrchr(argv[i], '/') + 1 : argv[i];
+    printf("%-24s %-16s %10.2f %10.2f %10.2f %7.2fx%s\n", name, format_name(png, len),
+           decode / 1000.0, (rgba - decode) / 1000.0, (native - decode) / 1000.0,
+           (rgba - decode) / (native - decode),
+           rgba_checksum != native_checksum ? "  DIFFERENT CANVAS" : "");
+    failures += rgba_checksum != native_checksum;
+    free(png);
+  }
+  return failures ? 1 : 0;
+}
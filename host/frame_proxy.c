@@ -0,0 +1,355 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "EPD_7in5_V2.h"
+
+#include "download.h"
+#include "http.h"
+#include "metadata.h"
+#include "render.h"
+#include "state.h"
+#include "telemetry.h"
+#include "host.h"
+
+/**
+ * The server half of CONFIG_XKCD_FRAME_SERVER. Fetches info.0.json and the comic like the device
+ * would and renders them through the same pipeline, offscreen, into the frame the device then
+ * fetches, PackBits over XORed rows unless -u. The metadata and the image can be URLs or local
+ * files, an image given after the metadata replaces its img. The frame goes to <out>.tmp and is
+ * renamed over out, so a server can keep serving it while it's replaced. Run it from cron and
+ * serve the directory, e.g.:
+ *
+ *   frame_proxy -o www/latest.xkfb https://xkcd.com/info.0.json
+ *   host/tls_server.py -d www --plain -p 8000
+ *
+ * -f plays the device against that: each of -c cycles makes the conditional request for the
+ * frame and unpacks it onto the simulated panel as it arrives, and reports what the cycle spent
+ * on the request, the transfer, unpacking and displaying it and the refresh the panel got. -w
+ * writes what the panel shows as a PBM, -j the cycles' telemetry.
+ *
+ *   frame_proxy [-o out] [-u] [-d kernel] [-v] metadata [comic.png]
+ *   frame_proxy -f [-c cycles] [-w out.pbm] [-j] [-v] url
+ **/
+
+#define BUFFER_LEN 1024
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [-o out] [-u] [-d kernel] [-v] metadata [comic.png]\n"
+          "       %s -f [-c cycles] [-w out.pbm] [-j] [-v] url\n", argv0, argv0);
+}
+
+static int is_url(const char *name)
+{
+  return strncmp(name, "http://", 7) == 0 || strncmp(name, "https://", 8) == 0;
+}
+
+// Keeps the validators of the response, like request.c does for conditional requests.
+static void on_header(void *ctx, const char *key, const char *value)
+{
+  struct http_validators *validators = ctx;
+  if(strcasecmp(key, "ETag") == 0)
+  {
+    snprintf(validators->etag, sizeof(validators->etag), "%s", value);
+  }
+  else if(strcasecmp(key, "Last-Modified") == 0)
+  {
+    snprintf(validators->last_modified, sizeof(validators->last_modified), "%s", value);
+  }
+}
+
+static int get_metadata(struct http_session *session, const char *name,
+                        struct xkcd_metadata *metadata)
+{
+  struct metadata_parser parser;
+  char buf[BUFFER_LEN];
+  FILE *f = NULL;
+  int status = 200;
+  int len = 0;
+
+  if(is_url(name))
+  {
+    if(http_session_get(session, name, NULL, 0, NULL, NULL, &status))
+    {
+      return 1;
+    }
+  }
+  else if((f = fopen(name, "rb")) == NULL)
+  {
+    fprintf(stderr, "failed to open %s\n", name);
+    return 1;
+  }
+
+  metadata_parser_init(&parser, metadata);
+  int failed = status != 200;
+  while(!failed && (len = f != NULL ? (int)fread(buf, 1, sizeof(buf), f)
+                                    : http_session_read(session, buf, sizeof(buf))) > 0)
+  {
+    failed = metadata_parser_feed(&parser, buf, len);
+  }
+  if(f != NULL)
+  {
+    fclose(f);
+  }
+  else
+  {
+    http_session_end(session);
+  }
+  if(failed || len < 0 || metadata_parser_finish(&parser))
+  {
+    fprintf(stderr, "no comic metadata in %s (status %d)\n", name, status);
+    return 1;
+  }
+  return 0;
+}
+
+// Renders the image at name offscreen into out, returns 0 once the frame is saved.
+static int render_comic(struct http_session *session, const char *name,
+                        const struct xkcd_metadata *metadata, const char *out,
+                        enum frame_encoding encoding)
+{
+  struct frame_location location = { out, NULL, 0 };
+  struct render_session render;
+  struct download download;
+  char buf[BUFFER_LEN];
+  FILE *f = NULL;
+  int remain = 0;
+  int len = 0;
+
+  if(is_url(name))
+  {
+    if(download_open(&download, session, name, 0, 0, NULL))
+    {
+      return 1;
+    }
+  }
+  else if((f = fopen(name, "rb")) == NULL)
+  {
+    fprintf(stderr, "failed to open %s\n", name);
+    return 1;
+  }
+
+  int failed = render_begin_offscreen(&render, metadata->safe_title, metadata->alt,
+                                      metadata->num, &location, encoding);
+  while(!failed && (len = f != NULL ? (int)fread(buf + remain, 1, sizeof(buf) - remain, f)
+                                    : download_read(&download, buf + remain,
+                                                    sizeof(buf) - remain)) > 0)
+  {
+    int fed = render_feed(&render, buf, remain + len);
+    if(fed < 0)
+    {
+      break;
+    }
+    remain = remain + len - fed;
+    memmove(buf, buf + fed, remain);
+  }
+  if(f != NULL)
+  {
+    fclose(f);
+  }
+  else
+  {
+    download_close(&download);
+  }
+  return failed || render_end(&render);
+}
+
+static int make_frame(const char *metadata_name, const char *image, const char *out,
+                      enum frame_encoding encoding)
+{
+  static struct xkcd_metadata metadata;
+  struct http_session session;
+
+  http_session_init(&session);
+  int64_t start = host_time_us();
+  int failed = get_metadata(&session, metadata_name, &metadata)
+               || render_comic(&session, image != NULL ? image : metadata.img, &metadata, out,
+                               encoding);
+  http_session_close(&session);
+  if(failed)
+  {
+    fprintf(stderr, "failed to render %s\n", image != NULL ? image : metadata_name);
+    return 1;
+  }
+  FILE *f = fopen(out, "rb");
+  long size = -1;
+  if(f != NULL)
+  {
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fclose(f);
+  }
+  printf("comic %d \"%s\": %ld byte frame in %s, %.1f ms\n", metadata.num, metadata.safe_title,
+         size, out, (host_time_us() - start) / 1000.0);
+  return 0;
+}
+
+/**
+ * One device cycle: returns 0 if the frame was unchanged or made it to the panel, shown is set in
+ * the latter case.
+ **/
+static int fetch_cycle(struct http_session *session, const char *url,
+                       struct http_validators *validators, int32_t *comic_num, int *shown)
+{
+  struct http_header headers[2];
+  struct http_validators sent = *validators;
+  struct frame_stream stream;
+  char buf[BUFFER_LEN];
+  int header_count = 0;
+  int status;
+  int len = 0;
+
+  if(sent.etag[0])
+  {
+    headers[header_count++] = (struct http_header){ "If-None-Match", sent.etag };
+  }
+  if(sent.last_modified[0])
+  {
+    headers[header_count++] = (struct http_header){ "If-Modified-Since", sent.last_modified };
+  }
+  memset(validators, 0, sizeof(*validators));
+  int64_t start = telemetry_begin(TELEMETRY_CONNECT);
+  int failed = http_session_get(session, url, headers, header_count, on_header, validators,
+                                &status);
+  telemetry_end(TELEMETRY_CONNECT, start, 0);
+  if(failed)
+  {
+    *validators = sent;
+    return 1;
+  }
+  if(status == 304)
+  {
+    *validators = sent;
+    http_session_end(session);
+    return 0;
+  }
+  failed = status != 200 || render_stream_begin(&stream);
+  while(!failed)
+  {
+    start = telemetry_now();
+    len = http_session_read(session, buf, sizeof(buf));
+    telemetry_add(TELEMETRY_TRANSFER, telemetry_now() - start, len > 0 ? len : 0);
+    if(len <= 0)
+    {
+      break;
+    }
+    failed = render_stream_feed(&stream, buf, len);
+  }
+  telemetry_sample(TELEMETRY_TRANSFER);
+  http_session_end(session);
+  if(failed || len < 0 || render_stream_end(&stream))
+  {
+    fprintf(stderr, "GET %s: status %d, no frame for the panel\n", url, status);
+    memset(validators, 0, sizeof(*validators));
+    return 1;
+  }
+  *comic_num = stream.key.comic_num;
+  *shown = 1;
+  return 0;
+}
+
+// The phase's time in the last cycle, in ms.
+static double phase_ms(enum telemetry_phase phase)
+{
+  const struct telemetry_cycle *cycle = telemetry_last();
+  return cycle != NULL && cycle->phases[phase].heap_min != UINT32_MAX
+         ? cycle->phases[phase].us / 1000.0 : 0.0;
+}
+
+static int fetch_frames(const char *url, int cycles, const char *pbm, int json)
+{
+  static const char *const refresh_names[] = { "none", "partial", "full" };
+  struct http_validators validators;
+  int32_t comic_num = -1;
+  int errors = 0;
+
+  memset(&validators, 0, sizeof(validators));
+  for(int cycle = 0; cycle < cycles; cycle++)
+  {
+    struct http_session session;
+    int shown = 0;
+
+    http_session_init(&session);
+    telemetry_cycle_begin();
+    int failed = fetch_cycle(&session, url, &validators, &comic_num, &shown);
+    // Deep sleep
+    http_session_close(&session);
+    telemetry_cycle_end(comic_num, failed);
+    errors += failed;
+    printf("cycle %d: comic %d, connect %.2f ms, transfer %.2f ms, unpack %.2f ms, display %.2f ms"
+           ", %s\n", cycle, (int)comic_num, phase_ms(TELEMETRY_CONNECT),
+           phase_ms(TELEMETRY_TRANSFER), phase_ms(TELEMETRY_DECODE), phase_ms(TELEMETRY_DISPLAY),
+           failed ? "FAILED" : !shown ? "not modified"
+                  : refresh_names[render_last_stats()->refresh]);
+  }
+  if(pbm != NULL)
+  {
+    // The panel uses 1 for white, PBM uses 1 for black
+    FILE *f = fopen(pbm, "wb");
+    const uint8_t *frame = epd_sim_frame();
+    if(f == NULL)
+    {
+      fprintf(stderr, "failed to write %s\n", pbm);
+      return 1;
+    }
+    fprintf(f, "P4\n%d %d\n", EPD_7IN5_V2_WIDTH, EPD_7IN5_V2_HEIGHT);
+    for(int i = 0; i < (EPD_7IN5_V2_WIDTH / 8) * EPD_7IN5_V2_HEIGHT; i++)
+    {
+      fputc(~frame[i] & 0xFF, f);
+    }
+    fclose(f);
+  }
+  if(json)
+  {
+    telemetry_dump(stdout, cycles);
+  }
+  return errors;
+}
+
+int main(int argc, char **argv)
+{
+  const char *out = "latest.xkfb";
+  const char *pbm = NULL;
+  enum frame_encoding encoding = FRAME_PACKBITS_DELTA;
+  int fetch = 0;
+  int cycles = 3;
+  int json = 0;
+  int opt;
+
+  while((opt = getopt(argc, argv, "o:ud:fc:w:jv")) != -1)
+  {
+    switch(opt)
+    {
+      case 'o': out = optarg; break;
+      case 'u': encoding = FRAME_RAW; break;
+      case 'd':
+        if(dither_kernel_find(optarg) < 0)
+        {
+          fprintf(stderr, "unknown dither kernel %s\n", optarg);
+          return 2;
+        }
+        render_set_dither(dither_kernel_find(optarg));
+        break;
+      case 'f': fetch = 1; break;
+      case 'c': cycles = atoi(optarg); break;
+      case 'w': pbm = optarg; break;
+      case 'j': json = 1; break;
+      case 'v': host_log_level++; break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+  if(fetch ? optind != argc - 1 : optind >= argc || optind < argc - 2)
+  {
+    usage(argv[0]);
+    return 2;
+  }
+  if(fetch)
+  {
+    return fetch_frames(argv[optind], cycles, pbm, json) ? 1 : 0;
+  }
+  return make_frame(argv[optind], optind + 1 < argc ? argv[optind + 1] : NULL, out, encoding);
+}
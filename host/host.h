@@ -0,0 +1,28 @@
+#ifndef HOST_H
+#define HOST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Simulated EPD sink (epd_sim.c) */
+const uint8_t *epd_sim_frame(void);
+int epd_sim_refreshes(void);
+int epd_sim_partial_refreshes(void);
+
+/* Counting allocator (runtime.c), wraps malloc/calloc/realloc/free at link time */
+size_t host_heap_current(void);
+size_t host_heap_peak(void);
+void host_heap_reset_peak(void);
+
+/* Flash partitions backed by files (partition_sim.c), found by esp_partition_find_first() */
+int partition_sim_attach(const char *label, const char *path, uint32_t size);
+void partition_sim_detach_all(void);
+/* Fails every write and erase after the next ops, the last one only half done, -1 to stop */
+void partition_sim_cut_after(long ops);
+/* Times each sector of the partition was erased since it was attached */
+const uint32_t *partition_sim_erase_counts(const char *label);
+
+/* Monotonic wall clock in microseconds */
+int64_t host_time_us(void);
+
+#endif
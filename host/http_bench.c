@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+
+#include "download.h"
+#include "http.h"
+#include "telemetry.h"
+#include "host.h"
+
+/**
+ * Checks the HTTP response parser on canned responses fed in every chunk size, then, given URLs,
+ * fetches them the way a refresh cycle does: one session per host, every URL -r times, and all
+ * connections closed at the end of the cycle like deep sleep closes them. -c runs that many
+ * cycles, and reports how many requests needed a handshake and how many of those resumed the
+ * TLS session kept from the cycle before. -k turns keep-alive off and -n session resumption,
+ * both together is what every cycle cost before sessions. host/tls_server.py is a local server
+ * to run it against.
+ *
+ * -o downloads the one URL into a file the way the device saves the comic, one attempt per
+ * cycle, until it's complete or the cycles run out. Against tls_server.py --cut and --fail that
+ * shows interrupted downloads carrying on from where they stopped, in the same cycle and across
+ * cycles. -a and -b override the attempts per download and the first backoff.
+ *
+ *   http_bench [-c cycles] [-r repeat] [-k] [-n] [-j] [url ...]
+ *   http_bench -o path [-c cycles] [-a attempts] [-b backoff_ms] [-j] url
+ **/
+
+#define MAX_SESSIONS 4
+
+struct parser_case
+{
+    const char *name;
+    const char *response;
+    int status;           // -1 if the response is malformed.
+    const char *body;
+    int keep_alive;
+    int needs_eof;        // The body only ends with the connection.
+    const char *etag;
+};
+
+static const struct parser_case cases[] = {
+  { "content-length",
+    "HTTP/1.1 200 OK\r\nContent-Length: 11\r\nETag:  \"abc\" \r\n\r\nhello world",
+    200, "hello world", 1, 0, "\"abc\"" },
+  { "chunked",
+    "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nETag: \"c\"\r\n\r\n"
+    "5;ext=1\r\nhello\r\n6\r\n world\r\n0\r\nX-Trailer: x\r\n\r\n",
+    200, "hello world", 1, 0, "\"c\"" },
+  { "not modified",
+    "HTTP/1.1 304 Not Modified\r\nContent-Length: 1234\r\nETag: \"n\"\r\n\r\n",
+    304, "", 1, 0, "\"n\"" },
+  { "close",
+    "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: 2\r\n\r\nok",
+    200, "ok", 0, 0, NULL },
+  { "until eof",
+    "HTTP/1.0 200 OK\r\nServer: x\r\n\r\nall of it",
+    200, "all of it", 0, 1, NULL },
+  { "continue",
+    "HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nabc",
+    200, "abc", 1, 0, NULL },
+  { "bare lf",
+    "HTTP/1.1 404 Not Found\nContent-Length: 4\n\nnope",
+    404, "nope", 1, 0, NULL },
+  { "bad version", "HTTP/2 200 OK\r\n\r\n", -1, NULL, 0, 0, NULL },
+  { "bad chunk", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n", -1, NULL, 0, 0,
+    NULL },
+  { "bad length", "HTTP/1.1 200 OK\r\nContent-Length: -1\r\n\r\n", -1, NULL, 0, 0, NULL },
+};
+
+static void save_etag(void *ctx, const char *key, const char *value)
+{
+  if(strcmp(key, "ETag") == 0)
+  {
+    snprintf(ctx, 32, "%s", value);
+  }
+}
+
+static int run_case(const struct parser_case *test, int chunk)
+{
+  struct http_parser parser;
+  char body[64] = "";
+  char etag[32] = "";
+  char buf[256];
+  int body_len = 0;
+  int len = strlen(test->response);
+  int failed = 0;
+
+  http_parser_init(&parser, 0, save_etag, etag);
+  for(int off = 0; off < len && !failed; off += chunk)
+  {
+    int n = len - off < chunk ? len - off : chunk;
+    memcpy(buf, test->response + off, n);
+    n = http_parser_feed(&parser, buf, n);
+    if(n < 0)
+    {
+      failed = 1;
+      break;
+    }
+    if(body_len + n >= (int)sizeof(body))
+    {
+      return 1;
+    }
+    memcpy(body + body_len, buf, n);
+    body_len += n;
+  }
+  body[body_len] = '\0';
+
+  if(test->status < 0)
+  {
+    return !failed;
+  }
+  if(test->needs_eof)
+  {
+    if(http_parser_done(&parser) || http_parser_eof(&parser))
+    {
+      return 1;
+    }
+  }
+  return failed || !http_parser_done(&parser) || parser.status != test->status
+         || strcmp(body, test->body) || parser.keep_alive != test->keep_alive
+         || strcmp(etag, test->etag ? test->etag : "");
+}
+
+static int verify(void)
+{
+  int errors = 0;
+  for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+  {
+    int len = strlen(cases[i].response);
+    for(int chunk = 1; chunk <= len; chunk++)
+    {
+      if(run_case(&cases[i], chunk))
+      {
+        fprintf(stderr, "parser case \"%s\" failed in %d byte chunks\n", cases[i].name, chunk);
+        errors++;
+        break;
+      }
+    }
+  }
+  return errors;
+}
+
+// Sessions are per host, like request.c keeps one for the metadata and one for the images.
+static struct http_session *session_for(struct http_session *sessions, const char **hosts,
+                                        const char *url)
+{
+  const char *start = strstr(url, "://");
+  start = start != NULL ? start + 3 : url;
+  size_t len = strcspn(start, "/");
+  for(int i = 0; i < MAX_SESSIONS; i++)
+  {
+    if(hosts[i] == NULL)
+    {
+      hosts[i] = start;
+      return &sessions[i];
+    }
+    if(strncmp(hosts[i], start, len) == 0 && strcspn(hosts[i], "/") == len)
+    {
+      return &sessions[i];
+    }
+  }
+  return NULL;
+}
+
+static int fetch(struct http_session *session, const char *url, long *bytes)
+{
+  char buf[1024];
+  int status;
+  int n;
+
+  if(http_session_get(session, url, NULL, 0, NULL, NULL, &status))
+  {
+    return 1;
+  }
+  while((n = http_session_read(session, buf, sizeof(buf))) > 0)
+  {
+    *bytes += n;
+  }
+  http_session_end(session);
+  if(n < 0 || (status != 200 && status != 304))
+  {
+    fprintf(stderr, "GET %s: status %d%s\n", url, status, n < 0 ? ", body failed" : "");
+    return 1;
+  }
+  return 0;
+}
+
+static long file_size(const char *path)
+{
+  FILE *f = fopen(path, "rb");
+  if(f == NULL)
+  {
+    return -1;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fclose(f);
+  return size;
+}
+
+static int download(const char *url, const char *path, int cycles, int resume)
+{
+  char part[256];
+
+  snprintf(part, sizeof(part), "%s.part", path);
+  for(int cycle = 0; cycle < cycles; cycle++)
+  {
+    struct http_session session;
+    uint32_t crc;
+
+    http_session_init(&session);
+    session.resume = resume;
+    telemetry_cycle_begin();
+    int64_t start = host_time_us();
+    int failed = download_file(&session, url, path, &crc);
+    http_session_close(&session);
+    int64_t us = host_time_us() - start;
+    telemetry_cycle_end(-1, failed);
+
+    if(!failed)
+    {
+      printf("cycle %d: done, %ld bytes, crc %08x, %u requests in %.1f ms\n", cycle,
+             file_size(path), crc, session.requests, us / 1000.0);
+      return 0;
+    }
+    printf("cycle %d: stopped with %ld bytes kept, %u requests in %.1f ms\n", cycle,
+           file_size(part), session.requests, us / 1000.0);
+  }
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  int cycles = 3;
+  int repeat = 1;
+  int keep_alive = 1;
+  int resume = 1;
+  int json = 0;
+  const char *output = NULL;
+  int opt;
+
+  while((opt = getopt(argc, argv, "c:r:knjo:a:b:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'c': cycles = atoi(optarg); break;
+      case 'r': repeat = atoi(optarg); break;
+      case 'k': keep_alive = 0; break;
+      case 'n': resume = 0; break;
+      case 'j': json = 1; break;
+      case 'o': output = optarg; break;
+      case 'a': download_policy.attempts = atoi(optarg); break;
+      case 'b': download_policy.backoff_ms = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-c cycles] [-r repeat] [-k] [-n] [-j] [url ...]\n"
+                "       %s -o path [-c cycles] [-a attempts] [-b backoff_ms] [-j] url\n",
+                argv[0], argv[0]);
+        return 2;
+    }
+  }
+
+  int errors = verify();
+  printf("parser: %s\n", errors ? "FAILED" : "ok");
+  if(optind >= argc)
+  {
+    return errors ? 1 : 0;
+  }
+  if(output != NULL)
+  {
+    errors += download(argv[optind], output, cycles, resume);
+    if(json)
+    {
+      telemetry_dump(stdout, cycles);
+    }
+    return errors ? 1 : 0;
+  }
+
+  uint32_t total_requests = 0, total_handshakes = 0, total_resumed = 0;
+  int64_t total_handshake_us = 0, total_us = 0;
+  for(int cycle = 0; cycle < cycles; cycle++)
+  {
+    struct http_session sessions[MAX_SESSIONS];
+    const char *hosts[MAX_SESSIONS] = { NULL };
+    uint32_t requests = 0, handshakes = 0, resumed = 0;
+    int64_t handshake_us = 0;
+    long bytes = 0;
+    int failed = 0;
+
+    for(int i = 0; i < MAX_SESSIONS; i++)
+    {
+      http_session_init(&sessions[i]);
+      sessions[i].keep_alive = keep_alive;
+      sessions[i].resume = resume;
+    }
+    telemetry_cycle_begin();
+    int64_t start = host_time_us();
+    for(int i = optind; i < argc; i++)
+    {
+      struct http_session *session = session_for(sessions, hosts, argv[i]);
+      if(session == NULL)
+      {
+        fprintf(stderr, "more than %d hosts\n", MAX_SESSIONS);
+        return 2;
+      }
+      for(int r = 0; r < repeat; r++)
+      {
+        failed |= fetch(session, argv[i], &bytes);
+      }
+    }
+    // Deep sleep
+    for(int i = 0; i < MAX_SESSIONS; i++)
+    {
+      http_session_close(&sessions[i]);
+      requests += sessions[i].requests;
+      handshakes += sessions[i].handshakes;
+      resumed += sessions[i].resumed;
+      handshake_us += sessions[i].handshake_us;
+    }
+    int64_t us = host_time_us() - start;
+    telemetry_cycle_end(-1, failed);
+
+    printf("cycle %d: %u requests, %u handshakes (%u resumed) in %.1f ms, %ld bytes in %.1f ms"
+           "%s\n", cycle, requests, handshakes, resumed, handshake_us / 1000.0, bytes,
+           us / 1000.0, failed ? ", FAILED" : "");
+    errors += failed;
+    total_requests += requests;
+    total_handshakes += handshakes;
+    total_resumed += resumed;
+    total_handshake_us += handshake_us;
+    total_us += us;
+  }
+  printf("total: %u requests, %u handshakes (%u resumed), %.1f ms handshaking of %.1f ms\n",
+         total_requests, total_handshakes, total_resumed, total_handshake_us / 1000.0,
+         total_us / 1000.0);
+  if(json)
+  {
+    telemetry_dump(stdout, cycles);
+  }
+  return errors ? 1 : 0;
+}
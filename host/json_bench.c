@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cJSON.h"
+#include "esp_log.h"
+
+#include "metadata.h"
+#include "host.h"
+
+/**
+ * Checks the streaming metadata parser against a known info.0.json for every chunk size up to 64
+ * bytes, then compares its throughput and peak heap with the cJSON path it replaced. -f runs that
+ * many random mutations of the document through the parser with random chunking, which is only
+ * useful under ASan or valgrind.
+ *
+ *   json_bench [-r repeat] [-f iterations] [-s seed]
+ **/
+
+static const char sample[] =
+  "{\"month\": \"3\", \"num\": 2916, \"link\": \"\", \"year\": \"2024\", \"news\": \"\", "
+  "\"safe_title\": \"Erd\\u0151s\\u2013Bacon \\\"Numbers\\\"\", "
+  "\"transcript\": \"[[A \\\"nested\\\" {thing}]]\\n\\t\\\\o/\", "
+  "\"alt\": \"It\\u2019s fine\\ud83d\\ude00 \\/ mostly, {[\\\"]}\", "
+  "\"img\": \"https:\\/\\/imgs.xkcd.com\\/comics\\/erdos_bacon.png\", "
+  "\"title\": \"Erd\\u0151s\\u2013Bacon \\\"Numbers\\\"\", \"day\": \"8\", "
+  "\"extra\": {\"img\": \"nested, ignored\", \"list\": [1, -2.5e3, true, false, null, []]}}";
+
+static const char *expect_img = "https://imgs.xkcd.com/comics/erdos_bacon.png";
+static const char *expect_title = "Erd\xc5\x91s\xe2\x80\x93" "Bacon \"Numbers\"";
+static const char *expect_alt = "It\xe2\x80\x99s fine\xf0\x9f\x98\x80 / mostly, {[\"]}";
+static const int expect_num = 2916;
+
+static int parse_chunked(struct xkcd_metadata *metadata, const char *doc, size_t len, int chunk)
+{
+  struct metadata_parser parser;
+  metadata_parser_init(&parser, metadata);
+  for(size_t off = 0; off < len; off += chunk)
+  {
+    size_t n = len - off < (size_t)chunk ? len - off : (size_t)chunk;
+    if(metadata_parser_feed(&parser, doc + off, n))
+    {
+      return 1;
+    }
+  }
+  return metadata_parser_finish(&parser);
+}
+
+static int check(const struct xkcd_metadata *metadata)
+{
+  return metadata->num == expect_num
+      && strcmp(metadata->img, expect_img) == 0
+      && strcmp(metadata->safe_title, expect_title) == 0
+      && strcmp(metadata->alt, expect_alt) == 0;
+}
+
+/**
+ * An alt text bigger than the whole arena fills it, the fields after it have to come out empty
+ * without anything written past its end, and a document left without an img is rejected.
+ **/
+static int oversized(void)
+{
+  static struct xkcd_metadata metadata;
+  static char doc[3 * METADATA_ARENA_LEN];
+  char alt[2001];
+  int failures = 0;
+
+  memset(alt, 'x', sizeof(alt) - 1);
+  alt[sizeof(alt) - 1] = '\0';
+  snprintf(doc, sizeof(doc), "{\"num\": 1, \"alt\": \"%s\", \"safe_title\": \"T\", "
+           "\"img\": \"https:\\/\\/imgs.xkcd.com\\/comics\\/x.png\"}", alt);
+  if(parse_chunked(&metadata, doc, strlen(doc), 7) == 0)
+  {
+    failures++;
+    fprintf(stderr, "accepted a document whose img didn't fit\n");
+  }
+
+  snprintf(doc, sizeof(doc), "{\"img\": \"%s\", \"num\": 1, \"alt\": \"%s\", "
+           "\"safe_title\": \"T\"}", expect_img, alt);
+  if(parse_chunked(&metadata, doc, strlen(doc), 7)
+     || strcmp(metadata.img, expect_img) != 0
+     || metadata.alt + strlen(metadata.alt) != metadata.arena + METADATA_ARENA_LEN - 1
+     || metadata.safe_title[0] != '\0')
+  {
+    failures++;
+    fprintf(stderr, "mishandled an alt text bigger than the arena\n");
+  }
+  return failures;
+}
+
+static int verify(void)
+{
+  static struct xkcd_metadata metadata;
+  int failures = 0;
+
+  for(int chunk = 1; chunk <= 64; chunk++)
+  {
+    if(parse_chunked(&metadata, sample, strlen(sample), chunk) || !check(&metadata))
+    {
+      if(failures++ < 10) fprintf(stderr, "mismatch with %d byte chunks\n", chunk);
+    }
+  }
+  // Truncated documents must never be accepted
+  for(size_t len = 0; len < strlen(sample); len++)
+  {
+    if(parse_chunked(&metadata, sample, len, 16) == 0)
+    {
+      if(failures++ < 10) fprintf(stderr, "accepted a document cut at %zu bytes\n", len);
+    }
+  }
+  return failures + oversized();
+}
+
+// Random byte flips, insertions of JSON punctuation and deletions, fed in random sized chunks.
+static int fuzz(int iterations, unsigned seed)
+{
+  static const char alphabet[] = "{}[]\",:\\u0123456789abcdefABCDEF-+.eE tnrfl\x80\xff";
+  static struct xkcd_metadata metadata;
+  size_t max = sizeof(sample) * 2;
+  char *doc = malloc(max);
+  int accepted = 0;
+
+  srand(seed);
+  for(int i = 0; i < iterations; i++)
+  {
+    size_t len = strlen(sample);
+    memcpy(doc, sample, len);
+    for(int edits = 1 + rand() % 8; edits > 0; edits--)
+    {
+      size_t at = rand() % (len + 1);
+      switch(rand() % 3)
+      {
+        case 0:
+          if(at < len) doc[at] = alphabet[rand() % (sizeof(alphabet) - 1)];
+          break;
+        case 1:
+          if(len < max)
+          {
+            memmove(doc + at + 1, doc + at, len - at);
+            doc[at] = alphabet[rand() % (sizeof(alphabet) - 1)];
+            len++;
+          }
+          break;
+        default:
+          if(at < len)
+          {
+            memmove(doc + at, doc + at + 1, len - at - 1);
+            len--;
+          }
+          break;
+      }
+    }
+
+    // Copy into an exact sized buffer so ASan catches any read past the end.
+    char *exact = malloc(len ? len : 1);
+    memcpy(exact, doc, len);
+    if(parse_chunked(&metadata, exact, len, 1 + rand() % 97) == 0)
+    {
+      // Whatever it accepted has to be terminated inside the arena.
+      const char *fields[] = { metadata.img, metadata.safe_title, metadata.alt };
+      for(int f = 0; f < 3; f++)
+      {
+        if(fields[f] < metadata.arena || fields[f] >= metadata.arena + METADATA_ARENA_LEN
+           || memchr(fields[f], 0, metadata.arena + METADATA_ARENA_LEN - fields[f]) == NULL)
+        {
+          fprintf(stderr, "field %d escaped the arena on iteration %d\n", f, i);
+          free(exact);
+          free(doc);
+          return 1;
+        }
+      }
+      accepted++;
+    }
+    free(exact);
+  }
+  free(doc);
+  printf("fuzz: %d iterations, %d accepted\n", iterations, accepted);
+  return 0;
+}
+
+// Not strdup(), libc's allocation inside it would bypass the heap accounting.
+static char *copy_string(const char *str)
+{
+  char *copy = malloc(strlen(str) + 1);
+  strcpy(copy, str);
+  return copy;
+}
+
+// What get_xkcd_metadata did before: parse the whole tree and copy the three strings out.
+static int cjson_extract(const char *doc, char **img, char **title, char **alt, int *num)
+{
+  cJSON *json = cJSON_Parse(doc);
+  if(json == NULL)
+  {
+    return 1;
+  }
+  cJSON *item;
+  item = cJSON_GetObjectItem(json, "img");
+  *img = copy_string(item->valuestring);
+  item = cJSON_GetObjectItem(json, "safe_title");
+  *title = copy_string(item->valuestring);
+  item = cJSON_GetObjectItem(json, "alt");
+  *alt = copy_string(item->valuestring);
+  *num = cJSON_GetObjectItem(json, "num")->valueint;
+  cJSON_Delete(json);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  int repeat = 100000;
+  int iterations = 0;
+  unsigned seed = 1;
+  int opt;
+
+  while((opt = getopt(argc, argv, "r:f:s:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'r': repeat = atoi(optarg); break;
+      case 'f': iterations = atoi(optarg); break;
+      case 's': seed = strtoul(optarg, NULL, 0); break;
+      default:
+        fprintf(stderr, "usage: %s [-r repeat] [-f iterations] [-s seed]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  // The rejected documents would otherwise each log an error
+  host_log_level = ESP_LOG_NONE;
+  int failures = verify();
+  printf("verify: %s (%d mismatches)\n", failures ? "FAILED" : "ok", failures);
+  if(iterations > 0 && fuzz(iterations, seed))
+  {
+    failures++;
+  }
+
+  static struct xkcd_metadata metadata;
+  size_t len = strlen(sample);
+  int64_t start;
+
+  host_heap_reset_peak();
+  size_t base = host_heap_current();
+  start = host_time_us();
+  for(int i = 0; i < repeat; i++)
+  {
+    parse_chunked(&metadata, sample, len, 1024);
+  }
+  double stream_mbs = (double)len * repeat / (host_time_us() - start);
+  size_t stream_heap = host_heap_peak() - base;
+
+  host_heap_reset_peak();
+  base = host_heap_current();
+  start = host_time_us();
+  for(int i = 0; i < repeat; i++)
+  {
+    char *img, *title, *alt;
+    int num;
+    // The old path also had to copy the body into a NUL terminated buffer first.
+    char *body = malloc(len + 1);
+    memcpy(body, sample, len + 1);
+    if(cjson_extract(body, &img, &title, &alt, &num) == 0)
+    {
+      free(img);
+      free(title);
+      free(alt);
+    }
+    free(body);
+  }
+  double cjson_mbs = (double)len * repeat / (host_time_us() - start);
+  size_t cjson_heap = host_heap_peak() - base;
+
+  printf("%zu byte document x%d\n", len, repeat);
+  printf("%-8s %10.1f MB/s %10zu bytes peak heap\n", "stream", stream_mbs, stream_heap);
+  printf("%-8s %10.1f MB/s %10zu bytes peak heap  (stream %.2fx)\n", "cJSON", cjson_mbs,
+         cjson_heap, stream_mbs / cjson_mbs);
+  return failures ? 1 : 0;
+}
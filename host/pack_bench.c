@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitpack.h"
+#include "host.h"
+
+/**
+ * Checks bitpack_row() against the scalar per-bit packing it replaced for every bit offset and
+ * a range of widths, then reports rows/sec for both on a full panel row.
+ *
+ *   pack_bench
+ **/
+
+#define ROW_BYTES 100
+#define ROW_PIXELS (ROW_BYTES * 8)
+
+static void scalar_pack_row(uint8_t *row, int x, const uint8_t *pixels, int width)
+{
+  for(int i = 0; i < width; i++)
+  {
+    int px = x + i;
+    unsigned char mask = 0x80 >> (px & 7);
+    if(pixels[i])
+    {
+      row[px >> 3] |= mask;
+    }
+    else
+    {
+      row[px >> 3] &= ~mask;
+    }
+  }
+}
+
+static int verify(void)
+{
+  uint8_t pixels[ROW_PIXELS];
+  uint8_t expected[ROW_BYTES];
+  uint8_t actual[ROW_BYTES];
+  int failures = 0;
+
+  srand(1);
+  for(int x = 0; x < 16; x++)
+  {
+    for(int width = 0; x + width <= ROW_PIXELS && width < 200; width++)
+    {
+      for(int i = 0; i < width; i++) pixels[i] = rand() & 1;
+      for(int i = 0; i < ROW_BYTES; i++) expected[i] = rand();
+      memcpy(actual, expected, ROW_BYTES);
+
+      scalar_pack_row(expected, x, pixels, width);
+      bitpack_row(actual, x, pixels, width);
+      if(memcmp(expected, actual, ROW_BYTES))
+      {
+        if(failures++ < 10) fprintf(stderr, "mismatch at x=%d width=%d\n", x, width);
+      }
+    }
+  }
+  return failures;
+}
+
+static double bench(void (*pack)(uint8_t *, int, const uint8_t *, int), int x, int repeat)
+{
+  uint8_t pixels[ROW_PIXELS];
+  uint8_t row[ROW_BYTES];
+  int width = ROW_PIXELS - x;
+
+  for(int i = 0; i < ROW_PIXELS; i++) pixels[i] = (i * 7 + i / 3) & 1;
+  int64_t start = host_time_us();
+  for(int i = 0; i < repeat; i++)
+  {
+    pack(row, x, pixels, width);
+    // Keep the compiler from hoisting the packing out of the loop
+    __asm__ volatile("" : : "r"(row) : "memory");
+  }
+  return repeat / ((host_time_us() - start) / 1e6);
+}
+
+int main(void)
+{
+  int failures = verify();
+  printf("verify: %s (%d mismatches)\n", failures ? "FAILED" : "ok", failures);
+
+  int repeat = 200000;
+  for(int x = 0; x < 8; x += 3)
+  {
+    double scalar = bench(scalar_pack_row, x, repeat);
+    double packed = bench(bitpack_row, x, repeat);
+    printf("x=%d  scalar %8.0f rows/s  bitpack %8.0f rows/s  (%.1fx)\n",
+           x, scalar, packed, packed / scalar);
+  }
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,222 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "esp_partition.h"
+
+#include "host.h"
+
+/* Flash partitions backed by files. Like NOR flash, an erase sets whole 4KB sectors to 0xFF and
+ * a write ANDs into what's there, so writing over data that wasn't erased corrupts it the same
+ * way it would on the device. The mapping is the file's, shared, so it sees every write. */
+
+#define SIM_SECTOR 4096
+#define SIM_PARTITIONS 4
+
+struct sim_partition
+{
+  esp_partition_t partition;
+  int fd;
+  uint8_t *map;
+  uint32_t *erase_counts;
+};
+
+static const char *TAG = "partition_sim";
+
+static struct sim_partition partitions[SIM_PARTITIONS];
+static int partition_count = 0;
+/* Writes and erases left before the power goes, -1 if it stays on */
+static long ops_left = -1;
+
+int partition_sim_attach(const char *label, const char *path, uint32_t size)
+{
+  if(partition_count == SIM_PARTITIONS || size % SIM_SECTOR)
+  {
+    return 1;
+  }
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if(fd < 0)
+  {
+    return 1;
+  }
+  struct stat st;
+  if(fstat(fd, &st) != 0)
+  {
+    close(fd);
+    return 1;
+  }
+  if((uint32_t)st.st_size < size)
+  {
+    /* New flash comes erased */
+    uint8_t erased[SIM_SECTOR];
+    memset(erased, 0xFF, sizeof(erased));
+    for(off_t offset = st.st_size - st.st_size % SIM_SECTOR; offset < size; offset += SIM_SECTOR)
+    {
+      if(pwrite(fd, erased, SIM_SECTOR, offset) != SIM_SECTOR)
+      {
+        close(fd);
+        return 1;
+      }
+    }
+  }
+  uint8_t *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if(map == MAP_FAILED)
+  {
+    close(fd);
+    return 1;
+  }
+
+  struct sim_partition *sim = &partitions[partition_count];
+  memset(sim, 0, sizeof(*sim));
+  sim->partition.type = ESP_PARTITION_TYPE_DATA;
+  sim->partition.subtype = 0x40;
+  sim->partition.address = 0x200000 + partition_count * 0x100000;
+  sim->partition.size = size;
+  strncpy(sim->partition.label, label, sizeof(sim->partition.label) - 1);
+  sim->fd = fd;
+  sim->map = map;
+  sim->erase_counts = calloc(size / SIM_SECTOR, sizeof(uint32_t));
+  partition_count++;
+  return 0;
+}
+
+void partition_sim_detach_all(void)
+{
+  for(int i = 0; i < partition_count; i++)
+  {
+    munmap(partitions[i].map, partitions[i].partition.size);
+    close(partitions[i].fd);
+    free(partitions[i].erase_counts);
+  }
+  partition_count = 0;
+}
+
+void partition_sim_cut_after(long ops)
+{
+  ops_left = ops;
+}
+
+const uint32_t *partition_sim_erase_counts(const char *label)
+{
+  const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                              ESP_PARTITION_SUBTYPE_ANY, label);
+  return partition != NULL ? ((const struct sim_partition *)partition)->erase_counts : NULL;
+}
+
+/* How much of an operation of len bytes makes it to flash, the one the power goes during only
+ * gets halfway */
+static size_t power(size_t len)
+{
+  if(ops_left < 0)
+  {
+    return len;
+  }
+  if(ops_left == 0)
+  {
+    return 0;
+  }
+  return --ops_left == 0 ? len / 2 : len;
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type,
+                                                esp_partition_subtype_t subtype,
+                                                const char *label)
+{
+  for(int i = 0; i < partition_count; i++)
+  {
+    const esp_partition_t *partition = &partitions[i].partition;
+    if(partition->type == type
+       && (subtype == ESP_PARTITION_SUBTYPE_ANY || partition->subtype == subtype)
+       && (label == NULL || strcmp(partition->label, label) == 0))
+    {
+      return partition;
+    }
+  }
+  return NULL;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst,
+                             size_t size)
+{
+  const struct sim_partition *sim = (const struct sim_partition *)partition;
+  if(src_offset + size > partition->size)
+  {
+    return ESP_FAIL;
+  }
+  memcpy(dst, &sim->map[src_offset], size);
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset,
+                              const void *src, size_t size)
+{
+  const struct sim_partition *sim = (const struct sim_partition *)partition;
+  uint8_t buf[SIM_SECTOR];
+
+  if(dst_offset + size > partition->size)
+  {
+    return ESP_FAIL;
+  }
+  size_t len = power(size);
+  for(size_t done = 0; done < len; done += sizeof(buf))
+  {
+    size_t chunk = len - done < sizeof(buf) ? len - done : sizeof(buf);
+    for(size_t i = 0; i < chunk; i++)
+    {
+      buf[i] = sim->map[dst_offset + done + i] & ((const uint8_t *)src)[done + i];
+    }
+    if(pwrite(sim->fd, buf, chunk, dst_offset + done) != (ssize_t)chunk)
+    {
+      return ESP_FAIL;
+    }
+  }
+  return len == size ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+  struct sim_partition *sim = (struct sim_partition *)partition;
+  uint8_t erased[SIM_SECTOR];
+
+  if(offset % SIM_SECTOR || size % SIM_SECTOR || offset + size > partition->size)
+  {
+    ESP_LOGE(TAG, "Unaligned erase of %zu bytes at %zu", size, offset);
+    return ESP_FAIL;
+  }
+  memset(erased, 0xFF, sizeof(erased));
+  size_t len = power(size);
+  for(size_t done = 0; done < len; done += SIM_SECTOR)
+  {
+    /* A sector the power went during is only partly erased */
+    size_t chunk = len - done < SIM_SECTOR ? len - done : SIM_SECTOR;
+    if(pwrite(sim->fd, erased, chunk, offset + done) != (ssize_t)chunk)
+    {
+      return ESP_FAIL;
+    }
+    sim->erase_counts[(offset + done) / SIM_SECTOR]++;
+  }
+  return len == size ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t esp_partition_mmap(const esp_partition_t *partition, size_t offset, size_t size,
+                             spi_flash_mmap_memory_t memory, const void **out_ptr,
+                             spi_flash_mmap_handle_t *out_handle)
+{
+  const struct sim_partition *sim = (const struct sim_partition *)partition;
+  if(offset + size > partition->size)
+  {
+    return ESP_FAIL;
+  }
+  *out_ptr = &sim->map[offset];
+  *out_handle = 0;
+  return ESP_OK;
+}
+
+void spi_flash_munmap(spi_flash_mmap_handle_t handle)
+{
+  /* The mapping lives as long as the partition is attached */
+}
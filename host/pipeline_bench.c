@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pipeline.h"
+#include "host.h"
+
+/**
+ * Pushes rows through the decode -> dither ring with random stalls on both sides and checks
+ * that the worker sees every row once, in order and intact, for a range of ring sizes. Then
+ * reports rows/sec through the ring with no work on either side, i.e. its per row overhead.
+ *
+ *   pipeline_bench [-n rows]
+ **/
+
+#define ROW_LEN 800
+#define MAX_RING 32
+
+static uint8_t arena_buffer[PIPELINE_ARENA_SIZE(ROW_LEN, MAX_RING)]
+  __attribute__((aligned(ARENA_ALIGN)));
+static struct arena arena;
+
+struct check
+{
+  int expected; // Next row the consumer should see.
+  int failures;
+  unsigned seed;
+};
+
+static uint8_t row_byte(int y, int i)
+{
+  return (uint8_t)(y * 31 + i * 7);
+}
+
+static void spin(unsigned *seed)
+{
+  *seed = *seed * 1103515245 + 12345;
+  for(volatile int i = (*seed >> 16) % 2000; i > 0; i--)
+  {
+  }
+}
+
+static void check_row(void *ctx, int y, const uint8_t *row)
+{
+  struct check *check = ctx;
+  if(y != check->expected)
+  {
+    if(check->failures++ < 10) fprintf(stderr, "got row %d, expected %d\n", y, check->expected);
+  }
+  for(int i = 0; i < ROW_LEN; i++)
+  {
+    if(row[i] != row_byte(y, i))
+    {
+      if(check->failures++ < 10) fprintf(stderr, "row %d corrupt at %d\n", y, i);
+      break;
+    }
+  }
+  check->expected = y + 1;
+  spin(&check->seed);
+}
+
+static void count_row(void *ctx, int y, const uint8_t *row)
+{
+  (*(int *)ctx)++;
+}
+
+static int verify(int rows)
+{
+  int failures = 0;
+  unsigned seed = 1;
+
+  for(int size = 2; size <= 16; size *= 2)
+  {
+    struct check check = { 0, 0, (unsigned)size };
+    arena_reset(&arena);
+    struct row_pipeline *pipeline = row_pipeline_start(ROW_LEN, size, check_row, &check, &arena);
+    if(pipeline == NULL)
+    {
+      fprintf(stderr, "failed to start a %d row pipeline\n", size);
+      return 1;
+    }
+    for(int y = 0; y < rows; y++)
+    {
+      uint8_t *row = row_pipeline_row(pipeline);
+      for(int i = 0; i < ROW_LEN; i++) row[i] = row_byte(y, i);
+      row_pipeline_push(pipeline, y);
+      spin(&seed);
+    }
+    row_pipeline_finish(pipeline);
+    if(check.expected != rows)
+    {
+      fprintf(stderr, "%d row ring: consumed %d of %d rows\n", size, check.expected, rows);
+      check.failures++;
+    }
+    failures += check.failures;
+  }
+  return failures;
+}
+
+int main(int argc, char **argv)
+{
+  int rows = 2000;
+  int opt;
+
+  while((opt = getopt(argc, argv, "n:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'n': rows = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-n rows]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  arena_init(&arena, arena_buffer, sizeof(arena_buffer));
+  int failures = verify(rows);
+  printf("verify: %s (%d failures)\n", failures ? "FAILED" : "ok", failures);
+
+  for(int size = 2; size <= MAX_RING; size *= 4)
+  {
+    int consumed = 0;
+    int total = rows * 100;
+    arena_reset(&arena);
+    struct row_pipeline *pipeline = row_pipeline_start(ROW_LEN, size, count_row, &consumed,
+                                                       &arena);
+    int64_t start = host_time_us();
+    for(int y = 0; y < total; y++)
+    {
+      row_pipeline_push(pipeline, y);
+    }
+    row_pipeline_finish(pipeline);
+    double elapsed = (host_time_us() - start) / 1e6;
+    printf("%2d row ring: %10.0f rows/s (%d consumed)\n", size, total / elapsed, consumed);
+  }
+  return failures ? 1 : 0;
+}
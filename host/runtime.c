@@ -0,0 +1,103 @@
+#include <malloc.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "esp_log.h"
+#include "esp_system.h"
+
+#include "host.h"
+
+/* Roughly what an ESP32 without PSRAM has left once Wi-Fi and TLS are up */
+#define HOST_HEAP_SIZE (160 * 1024)
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+esp_log_level_t host_log_level = ESP_LOG_WARN;
+
+static size_t heap_current = 0;
+static size_t heap_peak = 0;
+static size_t heap_all_time_peak = 0; // Never reset, for esp_get_minimum_free_heap_size().
+
+static void heap_account(void *ptr, int sign)
+{
+  if(ptr == NULL)
+  {
+    return;
+  }
+  size_t size = malloc_usable_size(ptr);
+  if(sign > 0)
+  {
+    heap_current += size;
+    if(heap_current > heap_peak) heap_peak = heap_current;
+    if(heap_current > heap_all_time_peak) heap_all_time_peak = heap_current;
+  }
+  else
+  {
+    heap_current -= size;
+  }
+}
+
+void *__wrap_malloc(size_t size)
+{
+  void *ptr = __real_malloc(size);
+  heap_account(ptr, 1);
+  return ptr;
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+  void *ptr = __real_calloc(nmemb, size);
+  heap_account(ptr, 1);
+  return ptr;
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+  heap_account(ptr, -1);
+  void *new_ptr = __real_realloc(ptr, size);
+  // On failure the original block is still live
+  heap_account(new_ptr != NULL ? new_ptr : (size ? ptr : NULL), 1);
+  return new_ptr;
+}
+
+void __wrap_free(void *ptr)
+{
+  heap_account(ptr, -1);
+  __real_free(ptr);
+}
+
+size_t host_heap_current(void)
+{
+  return heap_current;
+}
+
+size_t host_heap_peak(void)
+{
+  return heap_peak;
+}
+
+void host_heap_reset_peak(void)
+{
+  heap_peak = heap_current;
+}
+
+uint32_t esp_get_free_heap_size(void)
+{
+  return heap_current < HOST_HEAP_SIZE ? HOST_HEAP_SIZE - heap_current : 0;
+}
+
+uint32_t esp_get_minimum_free_heap_size(void)
+{
+  return heap_all_time_peak < HOST_HEAP_SIZE ? HOST_HEAP_SIZE - heap_all_time_peak : 0;
+}
+
+int64_t host_time_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
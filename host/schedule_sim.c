@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sdkconfig.h"
+
+#include "schedule.h"
+
+/**
+ * Runs the wake/sleep decisions of the device against a fake clock: app_main's schedule_wake()
+ * on every wake, a check when it asks for one and schedule_done() with the outcome. Comics come
+ * out Monday, Wednesday and Friday at 04:00 UTC plus up to jitter minutes, checks fail with the
+ * given probability and timer wakes can come early by up to the given percentage of the sleep
+ * (RTC clock drift).
+ *
+ * The same release times are replayed with the fixed interval and with adaptive polling, after
+ * warm-up weeks for the history to fill, and the checks and how long each comic took to reach
+ * the panel are reported for the days after that.
+ *
+ *   schedule_sim [-d days] [-w warm-up weeks] [-j jitter min] [-f fail %] [-e early %]
+ *                [-s seed] [-v]
+ **/
+
+#define DAY (24 * 60 * 60)
+// Monday 2024-01-01 00:00 UTC
+#define START 1704067200
+#define PUBLISH_HOUR 4
+#define MAX_COMICS 1024
+
+struct sim_result
+{
+  int wakes;
+  int early;
+  int checks;
+  int failed;
+  int fetched;
+  int64_t stale_total;
+  int64_t stale_max;
+  int errors;
+};
+
+static int64_t published[MAX_COMICS];
+static int comic_count;
+
+// Release times for every Monday, Wednesday and Friday up to end.
+static void make_releases(int64_t end, int jitter_min)
+{
+  comic_count = 0;
+  for(int64_t day = START; day < end && comic_count < MAX_COMICS; day += DAY)
+  {
+    int weekday = (day - START) / DAY % 7; // 0 is Monday
+    if(weekday == 0 || weekday == 2 || weekday == 4)
+    {
+      int jitter = jitter_min > 0 ? rand() % (jitter_min + 1) : 0;
+      published[comic_count++] = day + PUBLISH_HOUR * 3600 + jitter * 60;
+    }
+  }
+}
+
+// Number of the latest comic at time t, 0 before the first one.
+static int latest_comic(int64_t t)
+{
+  int num = 0;
+  while(num < comic_count && published[num] <= t)
+  {
+    num++;
+  }
+  return num;
+}
+
+static void simulate(struct sim_result *result, int64_t measure_from, int64_t end,
+                     int fail_percent, int early_percent, int verbose)
+{
+  struct schedule_state *state = schedule_rtc();
+  struct http_validators validators;
+  enum schedule_wake wake = SCHEDULE_WAKE_COLD;
+  uint32_t longest = schedule_policy.interval_s > schedule_policy.max_sleep_s
+                     ? schedule_policy.interval_s : schedule_policy.max_sleep_s;
+  int64_t now = START;
+  int displayed = 0;
+
+  memset(result, 0, sizeof(*result));
+  memset(state, 0xa5, sizeof(*state)); // What RTC memory holds after a power cycle
+  while(now < end)
+  {
+    uint32_t sleep_s = 0;
+    int measured = now >= measure_from;
+    enum schedule_action action = schedule_wake(state, wake, now, &sleep_s);
+    result->wakes += measured;
+    if(action == SCHEDULE_FULL && wake == SCHEDULE_WAKE_TIMER)
+    {
+      fprintf(stderr, "timer wake with a valid state asked for a full cycle\n");
+      result->errors++;
+    }
+
+    if(action == SCHEDULE_SLEEP)
+    {
+      result->early += measured;
+    }
+    else
+    {
+      int fail = rand() % 100 < fail_percent;
+      int latest = latest_comic(now);
+      result->checks += measured;
+      if(fail)
+      {
+        result->failed += measured;
+      }
+      else if(latest != displayed)
+      {
+        if(measured)
+        {
+          int64_t stale = now - published[latest - 1];
+          result->stale_total += stale;
+          if(stale > result->stale_max) result->stale_max = stale;
+          result->fetched++;
+        }
+        displayed = latest;
+      }
+      memset(&validators, 0, sizeof(validators));
+      snprintf(validators.etag, sizeof(validators.etag), "\"%d\"", displayed);
+      sleep_s = schedule_done(state, now, fail, displayed, &validators);
+      // Early wakes still do the check that was due, and sleep that much longer after it
+      if(sleep_s == 0 || sleep_s > longest + 60)
+      {
+        fprintf(stderr, "sleep of %u s out of range\n", sleep_s);
+        result->errors++;
+      }
+      if(verbose && measured)
+      {
+        const char *what = fail ? "failed" : action == SCHEDULE_FULL ? "full  " : "check ";
+        printf("day %2d %02d:%02d %s comic %d, sleep %u s\n", (int)((now - START) / DAY),
+               (int)((now - START) % DAY / 3600), (int)((now - START) % 3600 / 60), what,
+               displayed, sleep_s);
+      }
+    }
+
+    // The timer may fire early, never late
+    int64_t slept = sleep_s;
+    if(early_percent > 0)
+    {
+      slept -= (int64_t)sleep_s * (rand() % (early_percent + 1)) / 100;
+    }
+    now += slept > 0 ? slept : 1;
+    wake = SCHEDULE_WAKE_TIMER;
+  }
+}
+
+static void report(const char *name, const struct sim_result *result)
+{
+  printf("%-8s %4d checks (%d failed), %d wakes (%d early), %d comics", name, result->checks,
+         result->failed, result->wakes, result->early, result->fetched);
+  if(result->fetched > 0)
+  {
+    printf(", stale %.1f h average, %.1f h worst",
+           result->stale_total / 3600.0 / result->fetched, result->stale_max / 3600.0);
+  }
+  printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+  int days = 30;
+  int warmup_weeks = 3;
+  int jitter_min = 90;
+  int fail_percent = 0;
+  int early_percent = 0;
+  unsigned seed = 1;
+  int verbose = 0;
+  int opt;
+
+  while((opt = getopt(argc, argv, "d:w:j:f:e:s:v")) != -1)
+  {
+    switch(opt)
+    {
+      case 'd': days = atoi(optarg); break;
+      case 'w': warmup_weeks = atoi(optarg); break;
+      case 'j': jitter_min = atoi(optarg); break;
+      case 'f': fail_percent = atoi(optarg); break;
+      case 'e': early_percent = atoi(optarg); break;
+      case 's': seed = strtoul(optarg, NULL, 0); break;
+      case 'v': verbose = 1; break;
+      default:
+        fprintf(stderr, "usage: %s [-d days] [-w warm-up weeks] [-j jitter min] [-f fail %%] "
+                "[-e early %%] [-s seed] [-v]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  int64_t measure_from = START + (int64_t)warmup_weeks * 7 * DAY;
+  int64_t end = measure_from + (int64_t)days * DAY;
+  struct sim_result fixed, adaptive;
+
+  srand(seed);
+  make_releases(end, jitter_min);
+  printf("%d comics in %d days after %d weeks of warm-up\n",
+         latest_comic(end - 1) - latest_comic(measure_from - 1), days, warmup_weeks);
+
+  // Both runs see the same failures and drift
+  int adaptive_default = schedule_policy.adaptive;
+  schedule_policy.adaptive = 0;
+  srand(seed + 1);
+  simulate(&fixed, measure_from, end, fail_percent, early_percent, 0);
+  schedule_policy.adaptive = 1;
+  srand(seed + 1);
+  simulate(&adaptive, measure_from, end, fail_percent, early_percent, verbose);
+  schedule_policy.adaptive = adaptive_default;
+
+  report("fixed", &fixed);
+  report("adaptive", &adaptive);
+  printf("verify: %s\n", fixed.errors || adaptive.errors ? "FAILED" : "ok");
+  return fixed.errors || adaptive.errors ? 1 : 0;
+}
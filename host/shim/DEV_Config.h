@@ -0,0 +1,13 @@
+#ifndef HOST_DEV_CONFIG_H
+#define HOST_DEV_CONFIG_H
+
+#include <stdint.h>
+
+#define UBYTE   uint8_t
+#define UWORD   uint16_t
+#define UDOUBLE uint32_t
+
+UBYTE DEV_Module_Init(void);
+void DEV_Module_Exit(void);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef HOST_EPD_7IN5_V2_H
+#define HOST_EPD_7IN5_V2_H
+
+#include "DEV_Config.h"
+
+// Display resolution
+#define EPD_7IN5_V2_WIDTH       800
+#define EPD_7IN5_V2_HEIGHT      480
+
+/* Simulated panel, see host/epd_sim.c */
+UBYTE EPD_7IN5_V2_Init(void);
+void EPD_7IN5_V2_Clear(void);
+void EPD_7IN5_V2_Display(UBYTE *Image);
+void EPD_7IN5_V2_Sleep(void);
+UBYTE EPD_7IN5_V2_Init_Part(void);
+void EPD_7IN5_V2_Display_Part(UBYTE *Image, UDOUBLE x_start, UDOUBLE y_start, UDOUBLE x_end,
+                              UDOUBLE y_end);
+
+#endif
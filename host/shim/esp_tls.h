@@ -0,0 +1,43 @@
+#ifndef HOST_ESP_TLS_H
+#define HOST_ESP_TLS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sdkconfig.h"
+#include "esp_err.h"
+
+/*
+ * The part of esp-tls http.c uses, backed by OpenSSL and blocking sockets in host/tls_sim.c.
+ * Certificates aren't verified, the point is to talk to the local stand-in server.
+ */
+typedef struct esp_tls esp_tls_t;
+typedef struct esp_tls_client_session esp_tls_client_session_t;
+
+typedef struct esp_tls_cfg {
+    int timeout_ms;
+    bool is_plain_tcp;
+    esp_tls_client_session_t *client_session;
+} esp_tls_cfg_t;
+
+esp_tls_t *esp_tls_init(void);
+/* Returns 1 once connected, -1 on errors */
+int esp_tls_conn_new_sync(const char *hostname, int hostlen, int port, const esp_tls_cfg_t *cfg,
+                          esp_tls_t *tls);
+ssize_t esp_tls_conn_write(esp_tls_t *tls, const void *data, size_t datalen);
+/* 0 once the peer closed the connection */
+ssize_t esp_tls_conn_read(esp_tls_t *tls, void *data, size_t datalen);
+int esp_tls_conn_destroy(esp_tls_t *tls);
+esp_err_t esp_tls_get_conn_sockfd(esp_tls_t *tls, int *sockfd);
+esp_tls_client_session_t *esp_tls_get_client_session(esp_tls_t *tls);
+
+/* What the device does with mbedTLS directly */
+void tls_sim_session_free(esp_tls_client_session_t *session);
+esp_tls_client_session_t *tls_sim_session_load(const uint8_t *buf, size_t len);
+int tls_sim_session_save(esp_tls_client_session_t *session, uint8_t *buf, size_t size,
+                         size_t *len);
+int tls_sim_session_resumed(esp_tls_t *tls, const esp_tls_client_session_t *offered);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef HOST_SDKCONFIG_H
+#define HOST_SDKCONFIG_H
+
+/* The menuconfig options the host build of the render pipeline is compiled with. */
+#define CONFIG_XKCD_EPD_PARTIAL_REFRESH 1
+#define CONFIG_XKCD_FIT_TO_PANEL 1
+#define CONFIG_XKCD_FIT_TEXT_MARGIN 40
+#define CONFIG_XKCD_PAGE_TALL_COMICS 1
+#define CONFIG_XKCD_PAGE_TEXT_MARGIN 40
+#define CONFIG_XKCD_PAGE_INTERVAL_MIN 60
+#define CONFIG_XKCD_PIPELINE 1
+#define CONFIG_XKCD_PIPELINE_ROWS 8
+#define CONFIG_XKCD_TELEMETRY 1
+#define CONFIG_XKCD_TELEMETRY_CYCLES 16
+#define CONFIG_XKCD_REFRESH_INTERVAL_MIN 720
+#define CONFIG_XKCD_RETRY_INTERVAL_MIN 15
+#define CONFIG_XKCD_ADAPTIVE_POLL 1
+#define CONFIG_XKCD_POLL_BURST_MIN 20
+#define CONFIG_XKCD_POLL_MAX_SLEEP_MIN 2880
+#define CONFIG_XKCD_TLS_RESUME 1
+#define CONFIG_XKCD_TLS_SESSION_CACHE_SIZE 2048
+#define CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS 1
+#define CONFIG_XKCD_DOWNLOAD_ATTEMPTS 5
+#define CONFIG_XKCD_DOWNLOAD_BACKOFF_MS 500
+
+#endif
@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+
+#include "state.h"
+#include "host.h"
+
+/**
+ * Checks the two slot state record through the same code the device runs: a save loads back, saves
+ * alternate between the slots, the newest record wins across a sequence number wrap, a newest
+ * slot that is torn or corrupt falls back to the older one, and a record with the wrong magic or
+ * version is never loaded. Exits non-zero if any of it fails.
+ *
+ *   state_test [-v]
+ **/
+
+// Where the record header puts them, see state.c
+#define MAGIC_OFFSET 0
+#define VERSION_OFFSET 4
+#define STATE_OFFSET 12
+
+static char base[64];
+static int failures = 0;
+
+#define CHECK(cond, ...) \
+  do \
+  { \
+    if(!(cond)) \
+    { \
+      fprintf(stderr, "FAIL line %d: ", __LINE__); \
+      fprintf(stderr, __VA_ARGS__); \
+      fprintf(stderr, "\n"); \
+      failures++; \
+    } \
+  } while(0)
+
+static const char *slot_name(int slot)
+{
+  static char name[sizeof(base) + 4];
+  snprintf(name, sizeof(name), "%s.%d", base, slot);
+  return name;
+}
+
+static void clear_slots(void)
+{
+  remove(slot_name(0));
+  remove(slot_name(1));
+}
+
+static long slot_size(int slot)
+{
+  FILE *f = fopen(slot_name(slot), "rb");
+  if(f == NULL)
+  {
+    return -1;
+  }
+  fseek(f, 0L, SEEK_END);
+  long size = ftell(f);
+  fclose(f);
+  return size;
+}
+
+// Flips the bits of the byte at offset in the slot's file.
+static void corrupt(int slot, long offset)
+{
+  FILE *f = fopen(slot_name(slot), "r+b");
+  if(f == NULL)
+  {
+    return;
+  }
+  fseek(f, offset, SEEK_SET);
+  int c = fgetc(f);
+  fseek(f, offset, SEEK_SET);
+  fputc(c ^ 0xFF, f);
+  fclose(f);
+}
+
+// Cuts the slot's file short, like a write that lost power half way.
+static void tear(int slot)
+{
+  long size = slot_size(slot);
+  if(size > 0 && truncate(slot_name(slot), size / 2) != 0)
+  {
+    perror("truncate");
+  }
+}
+
+static void fill(struct xkcd_state *state, int32_t comic_num)
+{
+  memset(state, 0, sizeof(*state));
+  state->comic_num = comic_num;
+  state->image_hash = 0x1000u + comic_num;
+  state->render_checksum = 0x2000u + comic_num;
+  snprintf(state->validators.etag, sizeof(state->validators.etag), "\"etag-%d\"", (int)comic_num);
+  snprintf(state->validators.last_modified, sizeof(state->validators.last_modified),
+           "Mon, %02d Jan 2024 00:00:00 GMT", (int)comic_num % 28 + 1);
+}
+
+static int same(const struct xkcd_state *a, const struct xkcd_state *b)
+{
+  return memcmp(a, b, sizeof(*a)) == 0;
+}
+
+static void test_round_trip(void)
+{
+  struct xkcd_state saved, loaded;
+
+  clear_slots();
+  CHECK(state_load(base, &loaded) == 1 && loaded.comic_num == -1,
+        "nothing saved should load the defaults");
+
+  fill(&saved, 2916);
+  CHECK(state_save(base, &saved) == 0, "save failed");
+  CHECK(state_load(base, &loaded) == 0 && same(&saved, &loaded), "saved state didn't load back");
+}
+
+// Reads the slot's file into buf, returns its length or -1 if there is none.
+static long read_slot(int slot, char *buf, size_t size)
+{
+  FILE *f = fopen(slot_name(slot), "rb");
+  if(f == NULL)
+  {
+    return -1;
+  }
+  long len = fread(buf, 1, size, f);
+  fclose(f);
+  return len;
+}
+
+static void test_alternation(void)
+{
+  struct xkcd_state saved, loaded;
+  char before[1024], after[1024];
+  int last_slot = -1;
+
+  clear_slots();
+  fill(&saved, 1);
+  for(int i = 0; i < 6; i++)
+  {
+    // The slot with the newest record mustn't be touched by the next save
+    long before_len = last_slot < 0 ? -1 : read_slot(last_slot, before, sizeof(before));
+    saved.comic_num = 100 + i;
+    CHECK(state_save(base, &saved) == 0, "save %d failed", i);
+    int slot = saved.sequence % 2;
+    CHECK(slot != last_slot && slot_size(slot) > 0, "save %d didn't go to the other slot", i);
+    if(last_slot >= 0)
+    {
+      CHECK(read_slot(last_slot, after, sizeof(after)) == before_len
+            && memcmp(before, after, before_len) == 0, "save %d changed the newest slot", i);
+    }
+    CHECK(state_load(base, &loaded) == 0 && same(&saved, &loaded), "save %d: loaded comic %d",
+          i, (int)loaded.comic_num);
+    last_slot = slot;
+  }
+}
+
+static void test_wrap(void)
+{
+  struct xkcd_state saved, loaded;
+
+  clear_slots();
+  fill(&saved, 10);
+  saved.sequence = 0xFFFFFFFEu;
+  state_save(base, &saved); // Sequence 0xFFFFFFFF
+  saved.comic_num = 11;
+  state_save(base, &saved); // Sequence 0, the newest despite being smaller
+  CHECK(saved.sequence == 0, "sequence didn't wrap to 0 but %u", (unsigned)saved.sequence);
+  CHECK(state_load(base, &loaded) == 0 && loaded.comic_num == 11,
+        "newest record lost across the wrap, loaded comic %d", (int)loaded.comic_num);
+  saved.comic_num = 12;
+  state_save(base, &saved);
+  CHECK(state_load(base, &loaded) == 0 && loaded.comic_num == 12 && loaded.sequence == 1,
+        "save after the wrap didn't load, comic %d", (int)loaded.comic_num);
+}
+
+// The newest slot broken some way, the older one has to be loaded instead.
+static void test_fallback(const char *what, void (*damage)(int slot))
+{
+  struct xkcd_state saved, loaded;
+
+  clear_slots();
+  fill(&saved, 20);
+  state_save(base, &saved);
+  saved.comic_num = 21;
+  state_save(base, &saved);
+  damage(saved.sequence % 2);
+  CHECK(state_load(base, &loaded) == 0 && loaded.comic_num == 20,
+        "%s newest slot: loaded comic %d instead of the older 20", what, (int)loaded.comic_num);
+
+  // With both slots broken nothing is loaded
+  damage(!(saved.sequence % 2));
+  CHECK(state_load(base, &loaded) == 1 && loaded.comic_num == -1,
+        "%s slots: loaded comic %d instead of the defaults", what, (int)loaded.comic_num);
+}
+
+static void damage_torn(int slot)
+{
+  tear(slot);
+}
+
+static void damage_state(int slot)
+{
+  corrupt(slot, STATE_OFFSET + 5);
+}
+
+static void damage_magic(int slot)
+{
+  corrupt(slot, MAGIC_OFFSET);
+}
+
+static void damage_version(int slot)
+{
+  corrupt(slot, VERSION_OFFSET);
+}
+
+int main(int argc, char **argv)
+{
+  int opt;
+
+  // Every rejected record logs a warning
+  host_log_level = ESP_LOG_NONE;
+  while((opt = getopt(argc, argv, "v")) != -1)
+  {
+    switch(opt)
+    {
+      case 'v': host_log_level = ESP_LOG_INFO; break;
+      default:
+        fprintf(stderr, "usage: %s [-v]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  char tmp[] = "/tmp/state_testXXXXXX";
+  if(mkdtemp(tmp) == NULL)
+  {
+    perror("mkdtemp");
+    return 1;
+  }
+  snprintf(base, sizeof(base), "%s/state", tmp);
+
+  test_round_trip();
+  test_alternation();
+  test_wrap();
+  test_fallback("torn", damage_torn);
+  test_fallback("corrupt", damage_state);
+  test_fallback("wrong magic in", damage_magic);
+  test_fallback("wrong version in", damage_version);
+
+  clear_slots();
+  rmdir(tmp);
+  printf("state: %s (%d failures)\n", failures ? "FAILED" : "ok", failures);
+  return failures ? 1 : 0;
+}
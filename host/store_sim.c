@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+
+#include "frame.h"
+#include "store.h"
+#include "host.h"
+
+/**
+ * Runs the frame store on a file-backed partition the way the device uses it, through the same
+ * code: records of random sizes, a few up to a whole raw frame and the rest the size of packed
+ * frames, the archive index and the state, are written in random pieces, rewritten and deleted
+ * for -n operations. Every -c operations on average the power goes somewhere in the middle of
+ * one, whatever the store was doing, then the partition is mounted again and every record has
+ * to read back as last committed, the one being written as either its old or its new contents.
+ * A write may only fail for want of room if the live records, the old copy included, the new
+ * one, the free space the store keeps and what the end of the partition can waste don't fit. At the end the erase counts show how evenly the log wears the sectors of the partition.
+ *
+ *   store_sim [-n ops] [-c cut_every] [-k size_kb] [-i ids] [-s seed] [file]
+ **/
+
+#define LABEL "frames"
+#define MAX_IDS 64
+// Frames of the 800x480 panel, the largest records there are
+#define MAX_LEN FRAME_FILE_MAX(100, 480)
+// Records with an id below this get up to MAX_LEN, the others are smaller.
+#define LARGE_IDS 4
+#define SMALL_LEN 8192
+
+struct expected
+{
+    uint32_t version; // 0 if the record shouldn't exist.
+    uint32_t len;
+};
+
+static struct expected expected[MAX_IDS];
+static uint32_t rng_state = 1;
+
+static uint32_t rng(void)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+// Contents of version of record id, different for every version.
+static void fill(uint8_t *buf, uint32_t id, uint32_t version, uint32_t len)
+{
+  uint32_t x = id * 2654435761u + version * 40503u + 1;
+  for(uint32_t i = 0; i < len; i++)
+  {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    buf[i] = x;
+  }
+}
+
+static int matches(const struct store *store, uint32_t id, const struct expected *want,
+                   uint8_t *buf)
+{
+  uint32_t len;
+  const uint8_t *data = store_map(store, id, &len);
+  if(want->version == 0)
+  {
+    return data == NULL;
+  }
+  if(data == NULL || len != want->len)
+  {
+    return 0;
+  }
+  fill(buf, id, want->version, len);
+  return memcmp(data, buf, len) == 0;
+}
+
+// Writes the record in random pieces, the way frames are streamed in.
+static int write_record(struct store *store, uint32_t id, uint32_t version, uint32_t len,
+                        uint8_t *buf)
+{
+  struct store_writer writer;
+
+  fill(buf, id, version, len);
+  if(store_begin(store, &writer, id, len))
+  {
+    return 1;
+  }
+  for(uint32_t done = 0; done < len; )
+  {
+    uint32_t piece = 1 + rng() % 2048;
+    piece = piece < len - done ? piece : len - done;
+    if(store_append(&writer, &buf[done], piece))
+    {
+      store_abort(&writer);
+      return 1;
+    }
+    done += piece;
+  }
+  return store_commit(&writer);
+}
+
+// Every record has to be as expected, except in_doubt, which may also be as it was before.
+static int check_all(const struct store *store, int ids, int in_doubt,
+                     const struct expected *before, uint8_t *buf)
+{
+  int errors = 0;
+  for(int id = 0; id < ids; id++)
+  {
+    if(matches(store, id, &expected[id], buf))
+    {
+      continue;
+    }
+    if(id == in_doubt && matches(store, id, before, buf))
+    {
+      // The power went before the new copy was committed
+      expected[id] = *before;
+      continue;
+    }
+    fprintf(stderr, "record %d doesn't match version %u\n", id, (unsigned)expected[id].version);
+    errors++;
+  }
+  return errors;
+}
+
+int main(int argc, char **argv)
+{
+  long ops = 20000;
+  int cut_every = 50;
+  uint32_t size_kb = 1024;
+  int ids = 32;
+  int opt;
+
+  while((opt = getopt(argc, argv, "n:c:k:i:s:v")) != -1)
+  {
+    switch(opt)
+    {
+      case 'n': ops = atol(optarg); break;
+      case 'c': cut_every = atoi(optarg); break;
+      case 'k': size_kb = atoi(optarg); break;
+      case 'i': ids = atoi(optarg); break;
+      case 's': rng_state = strtoul(optarg, NULL, 0) * 2 + 1; break;
+      case 'v': host_log_level++; break;
+      default:
+        fprintf(stderr, "usage: %s [-n ops] [-c cut_every] [-k size_kb] [-i ids] [-s seed]"
+                " [file]\n", argv[0]);
+        return 2;
+    }
+  }
+  if(ids < 1 || ids > MAX_IDS || cut_every < 1)
+  {
+    fprintf(stderr, "-i takes 1-%d records, -c at least 1\n", MAX_IDS);
+    return 2;
+  }
+
+  char tmp[] = "/tmp/store_simXXXXXX";
+  const char *file = optind < argc ? argv[optind] : NULL;
+  if(file == NULL)
+  {
+    int fd = mkstemp(tmp);
+    if(fd < 0)
+    {
+      perror("mkstemp");
+      return 1;
+    }
+    close(fd);
+    file = tmp;
+  }
+
+  struct store store;
+  uint8_t *buf = malloc(MAX_LEN);
+  if(partition_sim_attach(LABEL, file, size_kb * 1024) || store_open(&store, LABEL, MAX_LEN))
+  {
+    fprintf(stderr, "failed to open the store in %s\n", file);
+    return 1;
+  }
+  // Whatever an earlier run left in the file goes
+  for(int id = 0; id < MAX_IDS; id++)
+  {
+    store_delete(&store, id);
+  }
+
+  int errors = 0, cuts = 0, writes = 0, deletes = 0, full = 0;
+  uint64_t written = 0;
+  uint32_t erases = 0, moves = 0;
+  int64_t start = host_time_us();
+  for(long op = 0; op < ops; op++)
+  {
+    int id = rng() % ids;
+    struct expected before = expected[id];
+    int cut = rng() % cut_every == 0;
+    if(cut)
+    {
+      // Somewhere within the erases and writes of this operation, or of the moves it needs
+      partition_sim_cut_after(1 + rng() % 40);
+    }
+
+    int failed;
+    uint32_t len = 0;
+    if(rng() % 10 == 0)
+    {
+      failed = store_delete(&store, id);
+      expected[id].version = 0;
+      deletes++;
+    }
+    else
+    {
+      uint32_t max = id < LARGE_IDS ? MAX_LEN : SMALL_LEN;
+      len = rng() % 8 == 0 ? max : 1 + rng() % max;
+      expected[id].version = before.version + 1 + rng() % 1000;
+      expected[id].len = len;
+      failed = write_record(&store, id, expected[id].version, len, buf);
+      if(!failed)
+      {
+        written += len;
+        writes++;
+      }
+    }
+
+    if(cut)
+    {
+      // Power back on, the store only has what's on flash to go by
+      erases += store.erases;
+      moves += store.moves;
+      store_close(&store);
+      partition_sim_cut_after(-1);
+      if(store_open(&store, LABEL, MAX_LEN))
+      {
+        fprintf(stderr, "store doesn't mount after cut %d\n", cuts);
+        return 1;
+      }
+      errors += check_all(&store, ids, id, &before, buf);
+      cuts++;
+    }
+    else if(failed && len > 0
+            && store_used(&store) + store_size(len) + 3 * store.reserve * STORE_SECTOR
+               > (uint32_t)store.sectors * STORE_SECTOR)
+    {
+      expected[id] = before;
+      full++;
+    }
+    else if(failed)
+    {
+      fprintf(stderr, "operation %ld on record %d failed with %u bytes in use\n", op, id,
+              (unsigned)store_used(&store));
+      expected[id] = before;
+      errors++;
+    }
+    else if(!matches(&store, id, &expected[id], buf))
+    {
+      fprintf(stderr, "record %d doesn't read back after operation %ld\n", id, op);
+      errors++;
+    }
+  }
+  erases += store.erases;
+  moves += store.moves;
+  errors += check_all(&store, ids, -1, NULL, buf);
+  int64_t elapsed = host_time_us() - start;
+
+  const uint32_t *counts = partition_sim_erase_counts(LABEL);
+  uint32_t least = counts[0], most = counts[0];
+  for(int sector = 1; sector < store.sectors; sector++)
+  {
+    least = counts[sector] < least ? counts[sector] : least;
+    most = counts[sector] > most ? counts[sector] : most;
+  }
+  printf("%ld operations, %d writes, %d deletes, %d power cuts in %.1f s\n", ops, writes, deletes,
+         cuts, elapsed / 1e6);
+  printf("%d records in %u of %d KB, %u records moved, %d writes didn't fit\n", store.count,
+         (unsigned)store_used(&store) / 1024, store.sectors * STORE_SECTOR / 1024,
+         (unsigned)moves, full);
+  printf("erases per sector %u-%u (mean %.1f), %.2f bytes erased per byte written\n", least,
+         most, (double)erases / store.sectors,
+         written ? (double)erases * STORE_SECTOR / written : 0.0);
+  printf("%d errors\n", errors);
+
+  store_close(&store);
+  partition_sim_detach_all();
+  if(file == tmp)
+  {
+    remove(tmp);
+  }
+  free(buf);
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,197 @@
+#!/usr/bin/env python3
+"""Local HTTPS stand-in for xkcd.com and imgs.xkcd.com.
+
+Serves a directory (put an info.0.json and the comic under it) over HTTP/1.1 with keep-alive and
+TLS session resumption, with a throwaway self-signed certificate, and logs every connection with
+whether its handshake resumed a session. Point CONFIG_XKCD_JSON_URL, or http_bench, at it:
+
+    host/tls_server.py -d comics -p 8443
+    build-host/http_bench -c 5 https://localhost:8443/info.0.json https://localhost:8443/comic.png
+
+--drop-after N closes connections after N responses without saying so, like servers time out idle
+connections, to exercise reconnecting.
+
+Files are served with a strong ETag and Last-Modified, answer If-None-Match and If-Modified-Since
+with a 304, and honour Range and If-Range, which is what resuming a download needs. To exercise
+that, --fail P answers a fraction P of requests with a 503 and --cut P hangs up partway through a
+fraction P of bodies, --no-range serves whole files anyway and --plain drops TLS:
+
+    host/tls_server.py -d comics --cut 0.5 --fail 0.2
+    build-host/http_bench -c 10 -o comic.png https://localhost:8443/comic.png
+"""
+
+import argparse
+import functools
+import http.server
+import email.utils
+import os
+import random
+import re
+import ssl
+import subprocess
+import sys
+import tempfile
+
+
+class Handler(http.server.SimpleHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    # Headers and body go out in separate writes, Nagle would hold the body back
+    disable_nagle_algorithm = True
+    drop_after = 0
+    fail = 0.0
+    cut = 0.0
+    ranges = True
+
+    def setup(self):
+        self.served = 0
+        if isinstance(self.request, ssl.SSLSocket):
+            # Handshake on the connection's own thread, not in accept()
+            self.request.do_handshake()
+            tls = self.request
+            sys.stderr.write("%s:%d %s %s, %s\n" % (
+                self.client_address[0], self.client_address[1], tls.version(), tls.cipher()[0],
+                "resumed" if tls.session_reused else "full handshake"))
+        super().setup()
+
+    def handle_one_request(self):
+        super().handle_one_request()
+        self.served += 1
+        if self.drop_after and self.served >= self.drop_after:
+            self.close_connection = True
+
+    def end_headers(self):
+        # Nothing should be cached between runs
+        self.send_header("Cache-Control", "no-store")
+        super().end_headers()
+
+    def do_GET(self):
+        self.serve_file(True)
+
+    def do_HEAD(self):
+        self.serve_file(False)
+
+    def not_modified(self, etag, mtime):
+        if "If-None-Match" in self.headers:
+            return etag in [tag.strip() for tag in self.headers["If-None-Match"].split(",")]
+        since = self.headers.get("If-Modified-Since")
+        if since is None:
+            return False
+        try:
+            return int(mtime) <= email.utils.parsedate_to_datetime(since).timestamp()
+        except (TypeError, ValueError):
+            return False
+
+    def serve_file(self, with_body):
+        path = self.translate_path(self.path)
+        if not os.path.isfile(path):
+            return super().do_GET() if with_body else super().do_HEAD()
+        if random.random() < self.fail:
+            self.send_error(503, "Injected failure")
+            return
+        with open(path, "rb") as f:
+            body = f.read()
+            mtime = os.fstat(f.fileno()).st_mtime
+        etag = '"%x-%x"' % (len(body), int(mtime * 1000))
+        modified = email.utils.formatdate(mtime, usegmt=True)
+
+        if self.not_modified(etag, mtime):
+            self.send_response(304)
+            self.send_header("ETag", etag)
+            self.send_header("Last-Modified", modified)
+            self.end_headers()
+            return
+
+        first, last = 0, len(body) - 1
+        status = 200
+        match = re.fullmatch(r"bytes=(\d+)-(\d*)", self.headers.get("Range", ""))
+        if_range = self.headers.get("If-Range")
+        if self.ranges and match and if_range in (None, etag, modified):
+            first = int(match.group(1))
+            if match.group(2):
+                last = min(last, int(match.group(2)))
+            if first >= len(body):
+                self.send_response(416)
+                self.send_header("Content-Range", "bytes */%d" % len(body))
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+            status = 206
+
+        part = body[first:last + 1]
+        self.send_response(status)
+        self.send_header("Content-Type", self.guess_type(path))
+        self.send_header("Content-Length", str(len(part)))
+        self.send_header("ETag", etag)
+        self.send_header("Last-Modified", modified)
+        self.send_header("Accept-Ranges", "bytes" if self.ranges else "none")
+        if status == 206:
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (first, last, len(body)))
+        self.end_headers()
+        if not with_body:
+            return
+        if len(part) > 1 and random.random() < self.cut:
+            # Hang up mid body without closing TLS properly, like a dropped link
+            cut = random.randrange(1, len(part))
+            self.wfile.write(part[:cut])
+            self.wfile.flush()
+            self.close_connection = True
+            sys.stderr.write("cut %s after %d of %d bytes\n" % (self.path, first + cut,
+                                                              len(body)))
+            return
+        self.wfile.write(part)
+
+
+def make_certificate(directory):
+    cert = os.path.join(directory, "cert.pem")
+    key = os.path.join(directory, "key.pem")
+    subprocess.run(["openssl", "req", "-x509", "-newkey", "ec",
+                    "-pkeyopt", "ec_paramgen_curve:prime256v1", "-nodes", "-days", "1",
+                    "-subj", "/CN=localhost", "-keyout", key, "-out", cert],
+                   check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    return cert, key
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("-d", "--directory", default=".")
+    parser.add_argument("-p", "--port", type=int, default=8443)
+    parser.add_argument("--drop-after", type=int, default=0, metavar="N")
+    parser.add_argument("--tls13", action="store_true",
+                        help="allow TLS 1.3, the device only speaks 1.2")
+    parser.add_argument("--no-tickets", action="store_true",
+                        help="resume with session IDs only")
+    parser.add_argument("--plain", action="store_true", help="serve plain HTTP")
+    parser.add_argument("--fail", type=float, default=0.0, metavar="P",
+                        help="answer this fraction of requests with a 503")
+    parser.add_argument("--cut", type=float, default=0.0, metavar="P",
+                        help="hang up partway through this fraction of bodies")
+    parser.add_argument("--no-range", action="store_true", help="ignore Range requests")
+    args = parser.parse_args()
+
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    if not args.tls13:
+        context.maximum_version = ssl.TLSVersion.TLSv1_2
+    if args.no_tickets:
+        context.options |= ssl.OP_NO_TICKET
+    with tempfile.TemporaryDirectory() as directory:
+        context.load_cert_chain(*make_certificate(directory))
+
+    Handler.drop_after = args.drop_after
+    Handler.fail = args.fail
+    Handler.cut = args.cut
+    Handler.ranges = not args.no_range
+    handler = functools.partial(Handler, directory=args.directory)
+    server = http.server.ThreadingHTTPServer(("", args.port), handler)
+    if not args.plain:
+        server.socket = context.wrap_socket(server.socket, server_side=True,
+                                            do_handshake_on_connect=False)
+    sys.stderr.write("serving %s on %s://localhost:%d\n" % (
+        args.directory, "http" if args.plain else "https", args.port))
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,239 @@
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "esp_log.h"
+#include "esp_tls.h"
+
+/* esp-tls over OpenSSL, enough to run http.c against a local server. The client sessions wrap
+ * an SSL_SESSION and are serialized as DER, like the device serializes mbedTLS sessions. */
+
+struct esp_tls
+{
+  int fd;
+  SSL *ssl; /* NULL for plain TCP */
+};
+
+struct esp_tls_client_session
+{
+  SSL_SESSION *session;
+};
+
+static const char *TAG = "tls_sim";
+
+static SSL_CTX *client_ctx(void)
+{
+  static SSL_CTX *ctx = NULL;
+  if(ctx == NULL)
+  {
+    /* Writes to a connection the server dropped fail with EPIPE, like lwIP, instead of killing
+     * the process */
+    signal(SIGPIPE, SIG_IGN);
+    ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+    /* The device's mbedTLS only does TLS 1.2 */
+    SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+  }
+  return ctx;
+}
+
+esp_tls_t *esp_tls_init(void)
+{
+  esp_tls_t *tls = calloc(1, sizeof(*tls));
+  if(tls != NULL)
+  {
+    tls->fd = -1;
+  }
+  return tls;
+}
+
+static int tcp_connect(const char *host, int port, int timeout_ms)
+{
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+  struct addrinfo *addrs;
+  char service[8];
+
+  snprintf(service, sizeof(service), "%d", port);
+  if(getaddrinfo(host, service, &hints, &addrs) != 0)
+  {
+    ESP_LOGE(TAG, "Can't resolve %s", host);
+    return -1;
+  }
+  int fd = -1;
+  for(struct addrinfo *addr = addrs; addr != NULL && fd < 0; addr = addr->ai_next)
+  {
+    fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if(fd < 0)
+    {
+      continue;
+    }
+    struct timeval tv = { .tv_sec = timeout_ms / 1000, .tv_usec = timeout_ms % 1000 * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if(connect(fd, addr->ai_addr, addr->ai_addrlen) != 0)
+    {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addrs);
+  return fd;
+}
+
+int esp_tls_conn_new_sync(const char *hostname, int hostlen, int port, const esp_tls_cfg_t *cfg,
+                          esp_tls_t *tls)
+{
+  char host[256];
+
+  snprintf(host, sizeof(host), "%.*s", hostlen, hostname);
+  tls->fd = tcp_connect(host, port, cfg->timeout_ms);
+  if(tls->fd < 0)
+  {
+    return -1;
+  }
+  if(cfg->is_plain_tcp)
+  {
+    return 1;
+  }
+
+  tls->ssl = SSL_new(client_ctx());
+  SSL_set_fd(tls->ssl, tls->fd);
+  SSL_set_tlsext_host_name(tls->ssl, host);
+  if(cfg->client_session != NULL)
+  {
+    SSL_set_session(tls->ssl, cfg->client_session->session);
+  }
+  if(SSL_connect(tls->ssl) != 1)
+  {
+    ESP_LOGE(TAG, "TLS handshake with %s failed: %s", host,
+             ERR_error_string(ERR_get_error(), NULL));
+    return -1;
+  }
+  return 1;
+}
+
+ssize_t esp_tls_conn_write(esp_tls_t *tls, const void *data, size_t datalen)
+{
+  if(tls->ssl == NULL)
+  {
+    return send(tls->fd, data, datalen, MSG_NOSIGNAL);
+  }
+  int ret = SSL_write(tls->ssl, data, datalen);
+  return ret > 0 ? ret : -1;
+}
+
+ssize_t esp_tls_conn_read(esp_tls_t *tls, void *data, size_t datalen)
+{
+  if(tls->ssl == NULL)
+  {
+    return recv(tls->fd, data, datalen, 0);
+  }
+  int ret = SSL_read(tls->ssl, data, datalen);
+  if(ret > 0)
+  {
+    return ret;
+  }
+  /* A close without close_notify counts as the end too, esp-tls doesn't tell them apart */
+  int err = SSL_get_error(tls->ssl, ret);
+  return err == SSL_ERROR_ZERO_RETURN || (err == SSL_ERROR_SYSCALL && ERR_peek_error() == 0)
+         || (err == SSL_ERROR_SSL && ERR_GET_REASON(ERR_peek_error())
+             == SSL_R_UNEXPECTED_EOF_WHILE_READING) ? 0 : -1;
+}
+
+int esp_tls_conn_destroy(esp_tls_t *tls)
+{
+  if(tls->ssl != NULL)
+  {
+    SSL_shutdown(tls->ssl);
+    SSL_free(tls->ssl);
+  }
+  if(tls->fd >= 0)
+  {
+    close(tls->fd);
+  }
+  ERR_clear_error();
+  free(tls);
+  return 0;
+}
+
+esp_err_t esp_tls_get_conn_sockfd(esp_tls_t *tls, int *sockfd)
+{
+  *sockfd = tls->fd;
+  return tls->fd >= 0 ? ESP_OK : ESP_FAIL;
+}
+
+esp_tls_client_session_t *esp_tls_get_client_session(esp_tls_t *tls)
+{
+  if(tls->ssl == NULL)
+  {
+    return NULL;
+  }
+  SSL_SESSION *session = SSL_get1_session(tls->ssl);
+  if(session == NULL || !SSL_SESSION_is_resumable(session))
+  {
+    SSL_SESSION_free(session);
+    return NULL;
+  }
+  esp_tls_client_session_t *client_session = malloc(sizeof(*client_session));
+  if(client_session == NULL)
+  {
+    SSL_SESSION_free(session);
+    return NULL;
+  }
+  client_session->session = session;
+  return client_session;
+}
+
+void tls_sim_session_free(esp_tls_client_session_t *session)
+{
+  if(session != NULL)
+  {
+    SSL_SESSION_free(session->session);
+    free(session);
+  }
+}
+
+esp_tls_client_session_t *tls_sim_session_load(const uint8_t *buf, size_t len)
+{
+  const unsigned char *p = buf;
+  SSL_SESSION *session = d2i_SSL_SESSION(NULL, &p, len);
+  if(session == NULL)
+  {
+    return NULL;
+  }
+  esp_tls_client_session_t *client_session = malloc(sizeof(*client_session));
+  if(client_session == NULL)
+  {
+    SSL_SESSION_free(session);
+    return NULL;
+  }
+  client_session->session = session;
+  return client_session;
+}
+
+int tls_sim_session_save(esp_tls_client_session_t *session, uint8_t *buf, size_t size,
+                         size_t *len)
+{
+  int needed = i2d_SSL_SESSION(session->session, NULL);
+  if(needed <= 0 || (size_t)needed > size)
+  {
+    *len = needed > 0 ? needed : 0;
+    return 1;
+  }
+  unsigned char *p = buf;
+  *len = i2d_SSL_SESSION(session->session, &p);
+  return 0;
+}
+
+int tls_sim_session_resumed(esp_tls_t *tls, const esp_tls_client_session_t *offered)
+{
+  return offered != NULL && tls->ssl != NULL && SSL_session_reused(tls->ssl);
+}
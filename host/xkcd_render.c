@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "EPD_7in5_V2.h"
+
+#include "render.h"
+#include "store.h"
+#include "telemetry.h"
+#include "host.h"
+
+/**
+ * Host driver for the render pipeline: decodes a PNG from disk through the same code the device
+ * runs, writes what the panel would show as a PBM and reports wall time and peak heap per stage.
+ * With -c the frame cache is used like on the device: a matching cached frame is displayed
+ * (the "cached" stage) instead of decoding, otherwise the decoded frame is saved there.
+ * -s keeps it as a record in a frame store backed by the cache file, like the frames partition,
+ * where a raw (-u) frame goes to the panel straight from the mapping.
+ * -b puts another PNG on the panel first as comic num - 1, the frame diff then shows what changed.
+ * -p sets the rows in the decode -> dither ring, -p 0 runs everything on one thread.
+ * With -r the heap line compares the first render with the ones after it: once the decoder and
+ * worker exist a render should neither leave anything behind nor reach a higher peak.
+ * -j prints the telemetry of the last renders, one JSON line each, as the device logs them.
+ * -g shows that page of a comic taller than the panel, the decode stops after its last row. A
+ * cached frame is displayed whichever page it has, like after a reboot.
+ *
+ *   xkcd_render [-t title] [-a alt] [-n num] [-r repeat] [-d kernel] [-p rows] [-g page]
+ *               [-c cache [-u] [-s]] [-b base.png] [-o out.pbm] [-j] [-v] comic.png
+ **/
+
+// Bytes per render_feed(), what the device reads from the network or SPIFFS at a time.
+#define FEED_LEN 1024
+// Same as the frames partition in partitions.csv
+#define STORE_SIZE 0x100000
+#define STORE_FRAME 2
+
+struct stage
+{
+  const char *name;
+  int64_t wall_us;
+  size_t peak_heap;
+};
+
+static size_t stage_base;
+
+// Peak heap is reported relative to what was live when the stage started.
+static void stage_begin(void)
+{
+  host_heap_reset_peak();
+  stage_base = host_heap_current();
+}
+
+static void stage_end(struct stage *stage, const char *name, int64_t start_us)
+{
+  stage->name = name;
+  stage->wall_us += host_time_us() - start_us;
+  if(host_heap_peak() - stage_base > stage->peak_heap)
+  {
+    stage->peak_heap = host_heap_peak() - stage_base;
+  }
+}
+
+static unsigned char *read_file(const char *fname, size_t *len)
+{
+  FILE *f = fopen(fname, "rb");
+  if(f == NULL)
+  {
+    return NULL;
+  }
+  fseek(f, 0L, SEEK_END);
+  *len = ftell(f);
+  fseek(f, 0L, SEEK_SET);
+
+  unsigned char *buf = malloc(*len);
+  if(buf != NULL && fread(buf, 1, *len, f) != *len)
+  {
+    free(buf);
+    buf = NULL;
+  }
+  fclose(f);
+  return buf;
+}
+
+// The panel uses 1 for white, PBM uses 1 for black.
+static int write_pbm(const char *fname, const uint8_t *frame)
+{
+  FILE *f = fopen(fname, "wb");
+  if(f == NULL)
+  {
+    return 1;
+  }
+  fprintf(f, "P4\n%d %d\n", EPD_7IN5_V2_WIDTH, EPD_7IN5_V2_HEIGHT);
+  for(int i = 0; i < (EPD_7IN5_V2_WIDTH / 8) * EPD_7IN5_V2_HEIGHT; i++)
+  {
+    fputc(~frame[i] & 0xFF, f);
+  }
+  fclose(f);
+  return 0;
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr,
+          "usage: %s [-t title] [-a alt] [-n num] [-r repeat] [-d kernel] [-p rows] [-g page]"
+          " [-c cache [-u] [-s]] [-b base.png] [-o out.pbm] [-j] [-v] comic.png\n",
+          argv0);
+}
+
+int main(int argc, char **argv)
+{
+  char *title = "Host Render";
+  char *alt = "Rendered on the host through the same pipeline as the display.";
+  int num = 0;
+  int repeat = 1;
+  const char *out = NULL;
+  const char *cache = NULL;
+  const char *base = NULL;
+  enum frame_encoding encoding = FRAME_PACKBITS;
+  int in_store = 0;
+  struct store store;
+  int json = 0;
+  int opt;
+
+  while((opt = getopt(argc, argv, "t:a:n:r:d:p:g:c:usb:o:jv")) != -1)
+  {
+    switch(opt)
+    {
+      case 't': title = optarg; break;
+      case 'a': alt = optarg; break;
+      case 'n': num = atoi(optarg); break;
+      case 'r': repeat = atoi(optarg); break;
+      case 'd':
+        if(dither_kernel_find(optarg) < 0)
+        {
+          fprintf(stderr, "unknown dither kernel %s\n", optarg);
+          return 2;
+        }
+        render_set_dither(dither_kernel_find(optarg));
+        break;
+      case 'p': render_set_pipeline(atoi(optarg)); break;
+      case 'g': render_set_page(atoi(optarg)); break;
+      case 'c': cache = optarg; break;
+      case 'u': encoding = FRAME_RAW; break;
+      case 's': in_store = 1; break;
+      case 'b': base = optarg; break;
+      case 'o': out = optarg; break;
+      case 'j': json = 1; break;
+      case 'v': host_log_level++; break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+  if(optind != argc - 1 || repeat < 1)
+  {
+    usage(argv[0]);
+    return 2;
+  }
+
+  struct stage read = {0}, decode = {0}, cached = {0}, write = {0};
+  size_t first_live = 0, first_peak = 0, later_live = 0, later_peak = 0;
+  int64_t start;
+  size_t len;
+  int hit = 0;
+
+  if(base != NULL && display_image(base, title, alt, num - 1))
+  {
+    fprintf(stderr, "%s never reached the display\n", base);
+    return 1;
+  }
+  int base_full = epd_sim_refreshes();
+  int base_partial = epd_sim_partial_refreshes();
+
+  if(cache != NULL)
+  {
+    struct frame_location location = { cache, NULL, 0 };
+    if(in_store)
+    {
+      if(partition_sim_attach("frames", cache, STORE_SIZE)
+         || store_open(&store, "frames",
+                       FRAME_FILE_MAX(EPD_7IN5_V2_WIDTH / 8, EPD_7IN5_V2_HEIGHT)))
+      {
+        fprintf(stderr, "failed to open the frame store in %s\n", cache);
+        return 1;
+      }
+      location = (struct frame_location){ NULL, &store, STORE_FRAME };
+    }
+    render_set_frame_cache(&location, encoding);
+    for(int i = 0; i < repeat; i++)
+    {
+      stage_begin();
+      start = host_time_us();
+      hit = render_cached(num) == 0;
+      stage_end(&cached, "cached", start);
+      if(!hit)
+      {
+        break;
+      }
+    }
+  }
+
+  stage_begin();
+  start = host_time_us();
+  unsigned char *png = read_file(argv[optind], &len);
+  stage_end(&read, "read", start);
+  if(png == NULL)
+  {
+    fprintf(stderr, "failed to read %s\n", argv[optind]);
+    return 1;
+  }
+
+  for(int i = 0; !hit && i < repeat; i++)
+  {
+    struct render_session session;
+    int failed = 1;
+
+    stage_begin();
+    start = host_time_us();
+    telemetry_cycle_begin();
+    if(render_begin(&session, title, alt, num) == 0)
+    {
+      // In the pieces the device reads, so the decode stops where it would there
+      for(size_t done = 0; done < len && !render_complete(&session); )
+      {
+        int fed = render_feed(&session, png + done, len - done < FEED_LEN ? len - done : FEED_LEN);
+        if(fed <= 0)
+        {
+          break;
+        }
+        done += fed;
+      }
+      failed = render_end(&session);
+    }
+    telemetry_cycle_end(num, failed);
+    stage_end(&decode, "decode", start);
+    if(i == 0)
+    {
+      first_live = host_heap_current();
+      first_peak = host_heap_peak();
+    }
+    else
+    {
+      later_live = host_heap_current();
+      if(host_heap_peak() > later_peak) later_peak = host_heap_peak();
+    }
+
+    if(failed)
+    {
+      fprintf(stderr, "%s never reached the display\n", argv[optind]);
+      free(png);
+      return 1;
+    }
+  }
+  free(png);
+
+  if(out != NULL)
+  {
+    stage_begin();
+    start = host_time_us();
+    if(write_pbm(out, epd_sim_frame()))
+    {
+      fprintf(stderr, "failed to write %s\n", out);
+      return 1;
+    }
+    stage_end(&write, "write", start);
+  }
+
+  printf("%-8s %12s %12s\n", "stage", "wall_us", "peak_heap");
+  printf("%-8s %12lld %12zu\n", read.name, (long long)read.wall_us, read.peak_heap);
+  if(hit)
+  {
+    printf("%-8s %12lld %12zu\n", cached.name, (long long)(cached.wall_us / repeat),
+           cached.peak_heap);
+  }
+  else
+  {
+    printf("%-8s %12lld %12zu\n", decode.name, (long long)(decode.wall_us / repeat),
+           decode.peak_heap);
+  }
+  if(out != NULL)
+  {
+    printf("%-8s %12lld %12zu\n", write.name, (long long)write.wall_us, write.peak_heap);
+  }
+
+  if(!hit && repeat > 1)
+  {
+    printf("heap     after render 1: %zu live, %zu peak; after %d more: %zu live, %zu peak\n",
+           first_live, first_peak, repeat - 1, later_live, later_peak);
+  }
+
+  if(json)
+  {
+    telemetry_dump(stdout, 0);
+  }
+
+  static const char *const refresh_names[] = { "none", "partial", "full" };
+  const struct render_stats *stats = render_last_stats();
+  printf("refresh  %s, %d/%d rows changed", refresh_names[stats->refresh],
+         stats->diff.changed_rows, EPD_7IN5_V2_HEIGHT);
+  if(stats->diff.changed_rows)
+  {
+    printf(" (rows %d-%d)", stats->diff.first_row, stats->diff.last_row);
+  }
+  printf(", panel updates: %d full, %d partial\n",
+         epd_sim_refreshes() - base_full, epd_sim_partial_refreshes() - base_partial);
+  if(stats->pages > 1)
+  {
+    printf("page     %d of %d\n", stats->page + 1, stats->pages);
+  }
+  return 0;
+}
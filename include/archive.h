@@ -0,0 +1,83 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+
+#include "frame.h"
+
+#define ARCHIVE_MAX_SLOTS 64
+#define ARCHIVE_PATH_LEN 32
+
+// What a slot of the archive holds.
+struct archive_entry
+{
+    int32_t comic_num;  // 0 if the slot is free.
+    uint32_t settings;  // render_settings() it was rendered with.
+    uint32_t size;      // Flash the frame takes up.
+    uint32_t used;      // Archive clock when it was added or last shown.
+    uint32_t shown;     // Times it was on the panel.
+};
+
+/**
+ * Back catalog of pre-rendered comics to show while the network is down. Every comic is a frame
+ * (see frame.h) kept by slot and a fixed size index keeps the entries of all slots. In files the
+ * frames are <path>NN and the index <path>.0/.1, in the store the index is record id and the
+ * frames the records after it, id + 1 + slot. Adding a comic needs a free slot and room for a
+ * worst case frame under the byte budget, and makes them by evicting frames rendered with other
+ * settings, then the least recently used of the comics that were already shown. Comics nobody
+ * saw yet are never evicted, so the archive stops growing once it is full of them.
+ **/
+struct archive
+{
+    struct frame_location location; // Of the index, see archive_location() for the frames.
+    int slots;               // In use, up to ARCHIVE_MAX_SLOTS.
+    uint32_t budget;         // Bytes of frames kept at most.
+    uint32_t frame_max;      // Worst case size of a frame, the room an add needs.
+    uint32_t clock;          // Ticks on every add, show and save.
+    int32_t cursor;          // Next comic number to prefetch, counting down, 0 to start over.
+    struct archive_entry entries[ARCHIVE_MAX_SLOTS];
+};
+
+/**
+ * Loads the index. An archive without a valid one starts empty, with whatever frames it had
+ * removed, and 1 is returned.
+ **/
+int archive_open(struct archive *archive, const struct frame_location *location, int slots,
+                 uint32_t budget, uint32_t frame_max);
+// Returns 0 once the index is on flash.
+int archive_save(struct archive *archive);
+// Where the frame of slot goes, path is the buffer for a file's name.
+void archive_location(const struct archive *archive, int slot, struct frame_location *location,
+                      char *path);
+
+// Slot holding comic num rendered with settings, -1 if there is none.
+int archive_find(const struct archive *archive, int32_t num, uint32_t settings);
+// Comics archived and the total size of their frames.
+int archive_count(const struct archive *archive);
+uint32_t archive_bytes(const struct archive *archive);
+
+/**
+ * The next comic older than latest that isn't archived yet, 0 once the whole back catalog was
+ * walked. archive_skip() moves past it, whether it was added or can't be.
+ **/
+int32_t archive_next(const struct archive *archive, int32_t latest, uint32_t settings);
+void archive_skip(struct archive *archive, int32_t num);
+// archive_reserve() would find a slot without evicting anything unseen.
+int archive_has_room(const struct archive *archive, uint32_t settings);
+
+// Makes room for one more frame, returns the slot to write it to or -1 if there is none.
+int archive_reserve(struct archive *archive, uint32_t settings);
+// Records the frame written to slot, returns 0 if it's there.
+int archive_commit(struct archive *archive, int slot, int32_t num, uint32_t settings);
+// Removes whatever frame was written to slot and frees it.
+void archive_drop(struct archive *archive, int slot);
+
+/**
+ * The comic to show next: the one added longest ago of those never shown, or else the least
+ * recently shown one. -1 if the archive has nothing rendered with settings.
+ **/
+int archive_pick(const struct archive *archive, uint32_t settings);
+// Marks the comic in slot as just shown.
+void archive_touch(struct archive *archive, int slot);
+
+#endif
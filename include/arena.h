@@ -0,0 +1,31 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Every allocation starts on this boundary, enough for any of the buffers the render keeps.
+#define ARENA_ALIGN 8
+// Worst case space an allocation of size bytes takes up, for sizing arenas at compile time.
+#define ARENA_SIZE(size) (((size_t)(size) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/**
+ * Bump allocator over a caller owned buffer. Nothing is freed on its own, the whole arena is
+ * reset at once, so a refresh cycle can lay its buffers out the same way every time without
+ * touching (or fragmenting) the heap.
+ **/
+struct arena
+{
+    uint8_t *base;
+    size_t size;
+    size_t used;
+    size_t high_water; // Most ever in use, for sizing the buffer.
+};
+
+void arena_init(struct arena *arena, void *buf, size_t size);
+// Zeroed like calloc(), NULL if the arena doesn't have size bytes left.
+void *arena_alloc(struct arena *arena, size_t size);
+// Drops every allocation, whatever pointed into the arena is invalid afterwards.
+void arena_reset(struct arena *arena);
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef BITPACK_H
+#define BITPACK_H
+
+#include <stdint.h>
+
+/**
+ * Packs width pixels (one byte each, 1 for white and 0 for black) into a 1bpp MSB first row,
+ * starting at bit x. Bits of row outside [x, x + width) are left untouched.
+ **/
+void bitpack_row(uint8_t *row, int x, const uint8_t *pixels, int width);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// zlib compatible CRC-32, start with crc = 0 and feed the result back in for more data.
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len);
+
+#endif
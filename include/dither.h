@@ -0,0 +1,63 @@
+#ifndef DITHER_H
+#define DITHER_H
+
+#include <stdint.h>
+
+#include "arena.h"
+
+enum dither_kernel
+{
+    DITHER_FLOYD_STEINBERG,
+    DITHER_ATKINSON,
+    DITHER_BAYER4, // Ordered dither, branch free and without error lines.
+    DITHER_BAYER8,
+    DITHER_THRESHOLD,
+    DITHER_KERNEL_COUNT
+};
+
+/**
+ * Row-at-a-time dithering with a selectable kernel. The error diffusion kernels keep one error
+ * line per row they spread error into (two for Floyd-Steinberg, three for Atkinson), padded by
+ * DITHER_LINE_PAD entries on each side so the inner loops don't special case the edges. The
+ * ordered and threshold kernels need no buffers at all.
+ **/
+#define DITHER_LINE_PAD 2
+#define DITHER_MAX_LINES 3
+// Arena space dither_init() needs at most for a row of width pixels.
+#define DITHER_ARENA_SIZE(width) \
+  (DITHER_MAX_LINES * ARENA_SIZE(((width) + 2 * DITHER_LINE_PAD) * sizeof(int16_t)))
+
+struct dither_state
+{
+    int width;
+    enum dither_kernel kernel;
+    int y;          // Rows dithered so far, selects the ordered dither matrix row.
+    int lines;      // Error lines in use.
+    int16_t *line[DITHER_MAX_LINES]; // Error carried into this row and the ones below it.
+};
+
+// Luma of an 8 bit RGB pixel using the usual 0.299/0.587/0.114 weights in 8.8 fixed point.
+static inline uint8_t dither_luma(const uint8_t rgba[4])
+{
+    return (77 * rgba[0] + 150 * rgba[1] + 29 * rgba[2]) >> 8;
+}
+
+// The error lines come out of arena and live until it's reset.
+int dither_init(struct dither_state *state, int width, enum dither_kernel kernel,
+                struct arena *arena);
+/**
+ * Dithers one row of 8 bit greyscale into out, one byte per pixel set to 1 for white and 0 for
+ * black, and advances to the next row.
+ **/
+void dither_row(struct dither_state *state, const uint8_t *luma, uint8_t *out);
+/**
+ * Moves past rows that aren't shown without dithering them. The ordered kernels stay in step
+ * with the rows above, the error diffusion ones start the next row without any carried error.
+ **/
+void dither_skip(struct dither_state *state, int rows);
+// Short name of a kernel ("fs", "atkinson", ...), NULL if it's out of range.
+const char *dither_kernel_name(enum dither_kernel kernel);
+// Looks a kernel up by its short name, returns -1 if there is none.
+int dither_kernel_find(const char *name);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef DOWNLOAD_H
+#define DOWNLOAD_H
+
+#include <stdint.h>
+
+#include "http.h"
+#include "state.h"
+
+/**
+ * How hard a download tries, set from menuconfig. Requests that fail to connect, get a 5xx or
+ * break off mid body are retried, waiting backoff_ms before the first retry and twice as long
+ * before each one after that, up to backoff_max_ms.
+ **/
+struct download_policy
+{
+    int attempts;           // Requests per download, the first one included.
+    uint32_t backoff_ms;
+    uint32_t backoff_max_ms;
+};
+
+extern struct download_policy download_policy;
+
+/**
+ * A GET whose body can be read across several requests: when the connection drops the rest is
+ * asked for with a Range request, guarded by If-Range, and the caller just keeps reading.
+ **/
+struct download
+{
+    struct http_session *session;
+    const char *url;
+    uint32_t offset;        // Bytes of the body returned so far, counted from its start.
+    uint32_t length;        // Of the whole body, 0 if the server didn't say.
+    uint32_t crc;           // CRC-32 of the body up to offset.
+    struct http_validators validators; // Of the body being read, sent as If-Range.
+    int attempts;           // Requests made so far.
+    int open;               // A response body is being read.
+    uint32_t backoff_ms;    // Before the next retry.
+    // Set while parsing the headers of a response.
+    struct http_validators response;
+    int64_t range_start;
+    int64_t range_total;    // -1 if the Content-Range didn't say.
+};
+
+/**
+ * Starts reading url at offset, where the bytes before it had the given CRC and came with the
+ * given validators (NULL if offset is 0). If the server no longer has that version, or doesn't
+ * do ranges, the download starts over and offset is 0 when this returns. Returns 0 once there
+ * is a body to read.
+ **/
+int download_open(struct download *download, struct http_session *session, const char *url,
+                  uint32_t offset, uint32_t crc, const struct http_validators *validators);
+// Reads up to len more bytes, returns 0 at the end of the body and -1 once it can't be had.
+int download_read(struct download *download, char *buf, int len);
+void download_close(struct download *download);
+
+/**
+ * Downloads url into path. The bytes go to <path>.part, with a sidecar <path>.meta recording
+ * the length, validators and CRC of what's there, so a download cut short by a dropped link or
+ * a reset carries on where it stopped, in a later cycle too. Once complete, the length and the
+ * CRC of what's on flash are checked and the file renamed to path. Returns 0 and sets crc to
+ * the CRC-32 of the file.
+ **/
+int download_file(struct http_session *session, const char *url, const char *path,
+                  uint32_t *crc);
+
+// Parses "bytes first-last/total", total is -1 for "*". Returns 0 if it's valid.
+int download_parse_content_range(const char *value, int64_t *first, int64_t *last,
+                                 int64_t *total);
+
+#endif
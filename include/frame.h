@@ -0,0 +1,121 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Identifies what a stored frame was rendered from, a frame is only used if both match.
+struct frame_key
+{
+    int32_t comic_num;
+    uint32_t settings; // render_settings() at the time it was rendered.
+    // Which page of the comic the frame shows of how many, 0 of 1 unless it's paged. Kept with
+    // the frame but not matched, frame_map() fills them in.
+    int16_t page;
+    int16_t pages;
+};
+
+// How the rows of a stored frame are encoded.
+enum frame_encoding
+{
+    FRAME_RAW,
+    FRAME_PACKBITS,       // Each row PackBits compressed on its own.
+    /**
+     * Each row XORed with the one above before PackBits, so the parts that repeat the row above
+     * (panel borders, the white between them, long strokes) become runs of zeros. A cheap take
+     * on the vertical mode of CCITT G4 that still decodes a row at a time.
+     **/
+    FRAME_PACKBITS_DELTA,
+};
+
+struct store;
+
+// Where a frame is kept: record id of store if there is one, else the file at path.
+struct frame_location
+{
+    const char *path;
+    struct store *store;
+    uint32_t id;
+};
+
+/**
+ * A 1bpp frame (rows of stride bytes) stored with a header, the key and a CRC-32 of the pixels,
+ * in a single file or a store record (see store.h). Comics are mostly white, so a compressed 48KB
+ * frame usually shrinks to a few KB. Saves to a file go to <path>.tmp and are renamed over the
+ * previous frame once complete, the store replaces records atomically anyway.
+ **/
+
+// Returns 0 once the frame is on flash.
+int frame_save(const struct frame_location *location, const struct frame_key *key,
+               const uint8_t *frame, int stride, int height, enum frame_encoding encoding);
+// Returns 0 if location holds a valid frame of this size for key, frame is undefined otherwise.
+int frame_load(const struct frame_location *location, struct frame_key *key,
+               uint8_t *frame, int stride, int height);
+/**
+ * Like frame_load() but returns the pixels, NULL if there is no valid frame. A raw frame in the
+ * store is read in place from the mapped partition and never copied into frame.
+ **/
+const uint8_t *frame_map(const struct frame_location *location, struct frame_key *key,
+                         uint8_t *frame, int stride, int height);
+
+// Which rows of a frame differ from the previous one, see frame_diff().
+struct frame_diff
+{
+    int changed_rows;
+    int first_row; // Bounding window of the changed rows, first_row > last_row if none changed.
+    int last_row;
+};
+
+// Compares the CRC-32 of each row with row_hashes (the previous frame's) and replaces them.
+void frame_diff(const uint8_t *frame, int stride, int height, uint32_t *row_hashes,
+                struct frame_diff *diff);
+
+// Worst case size of a PackBits encoded run of len bytes.
+#define FRAME_PACKED_MAX(len) ((len) + ((len) + 127) / 128)
+// Widest row frame_encode_row() and the files take.
+#define FRAME_MAX_STRIDE 256
+// Worst case size of a stored frame.
+#define FRAME_FILE_MAX(stride, height) (32 + (2 + FRAME_PACKED_MAX(stride)) * (height))
+
+// PackBits encodes len bytes from src, returns the encoded length.
+size_t frame_pack(const uint8_t *src, size_t len, uint8_t *dst);
+// Decodes exactly len bytes into dst, returns 0 if src held exactly that.
+int frame_unpack(const uint8_t *src, size_t src_len, uint8_t *dst, size_t len);
+
+/**
+ * Encodes one row, prev is the row above it (NULL for the first one) and dst has room for
+ * FRAME_PACKED_MAX(stride). Returns the encoded length.
+ **/
+size_t frame_encode_row(const uint8_t *row, const uint8_t *prev, int stride,
+                        enum frame_encoding encoding, uint8_t *dst);
+// Decodes one row encoded like that, prev is the decoded row above. Returns 0 if src was valid.
+int frame_decode_row(const uint8_t *src, size_t len, const uint8_t *prev, uint8_t *row,
+                     int stride, enum frame_encoding encoding);
+
+/**
+ * Decodes a frame in the stored format as it arrives in pieces of any size, e.g. an HTTP response
+ * body, straight into frame. The header is checked as soon as it's in, whatever comic and
+ * settings it has, the CRC once the last row is.
+ **/
+struct frame_stream
+{
+    uint8_t *frame;
+    int stride;
+    int height;
+    struct frame_key key;         // Of the frame, once the header is in.
+    enum frame_encoding encoding;
+    uint32_t crc;                 // Of the pixels, from the header.
+    int y;                        // Rows decoded so far, -1 until the header is in.
+    int in_row;                   // Collecting a row rather than its length.
+    size_t need;                  // Bytes of the header, length or row being collected.
+    size_t have;
+    uint8_t buf[FRAME_PACKED_MAX(FRAME_MAX_STRIDE)];
+};
+
+void frame_stream_init(struct frame_stream *stream, uint8_t *frame, int stride, int height);
+// Returns 0 while what came so far is the start of a valid frame of this size.
+int frame_stream_feed(struct frame_stream *stream, const void *data, size_t len);
+// Returns 0 if the whole frame came and its CRC matches.
+int frame_stream_finish(const struct frame_stream *stream);
+
+#endif
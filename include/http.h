@@ -0,0 +1,101 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stdint.h>
+
+#include "sdkconfig.h"
+#include "esp_tls.h"
+
+// Longest status or header line kept, the rest of a longer one is dropped.
+#define HTTP_LINE_LEN 256
+#define HTTP_HOST_LEN 64
+// Response headers are read through this, body bytes that come with them wait in it.
+#define HTTP_HEAD_BUFFER_LEN 512
+
+// Called for every response header, key and value are NUL terminated and trimmed.
+typedef void (*http_header_cb)(void *ctx, const char *key, const char *value);
+
+/**
+ * Incremental HTTP/1.1 response parser, fed whatever the connection returns. Handles bodies
+ * delimited by Content-Length, chunked encoding and the end of the connection, and works out
+ * whether the connection can take another request afterwards.
+ **/
+struct http_parser
+{
+    int state;
+    int status;
+    int head;               // Response to a HEAD request, no body whatever the headers say.
+    int keep_alive;         // The connection can be reused once the response is complete.
+    int chunked;
+    int64_t content_length; // -1 if the response didn't have one.
+    int64_t remain;         // Bytes of the body, or of the current chunk, still to come.
+    http_header_cb on_header;
+    void *ctx;
+    int line_len;
+    char line[HTTP_LINE_LEN];
+};
+
+void http_parser_init(struct http_parser *parser, int head, http_header_cb on_header, void *ctx);
+/**
+ * Parses len bytes of the response in place, moving the body bytes among them to the front of
+ * buf. Returns how many there are, or -1 if the response is malformed. Bytes after the end of
+ * the response are dropped and the connection isn't reused.
+ **/
+int http_parser_feed(struct http_parser *parser, char *buf, int len);
+// The connection closed, returns 0 if that was the end of the response.
+int http_parser_eof(struct http_parser *parser);
+// The status line and all headers have been parsed.
+int http_parser_headers_done(const struct http_parser *parser);
+int http_parser_done(const struct http_parser *parser);
+
+struct http_header
+{
+    const char *name;
+    const char *value;
+};
+
+/**
+ * One connection to one host at a time, kept open between requests to the same host. Closing it
+ * keeps the TLS session (ticket or ID) in RTC memory, so the next connection to that host, after
+ * deep sleep too, gets an abbreviated handshake if the server still knows the session.
+ **/
+struct http_session
+{
+    char host[HTTP_HOST_LEN];
+    int port;
+    int tls_enabled;      // https rather than http.
+    esp_tls_t *tls;       // NULL while there is no connection.
+    int keep_alive;       // Reuse the connection, set by http_session_init().
+    int resume;           // Offer the cached TLS session, CONFIG_XKCD_TLS_RESUME by default.
+    struct http_parser parser;
+    char head[HTTP_HEAD_BUFFER_LEN];
+    int head_pos;
+    int head_len;
+    // Over the session's lifetime.
+    uint32_t requests;
+    uint32_t reused;      // Requests sent on a connection a previous one opened.
+    uint32_t handshakes;  // Connections opened.
+    uint32_t resumed;     // Handshakes that resumed a cached TLS session.
+    int64_t handshake_us; // TCP connect and TLS handshake.
+};
+
+void http_session_init(struct http_session *session);
+/**
+ * Sends a GET for url (http:// or https://) with the extra headers and reads the response
+ * headers, which go to on_header. A connection the server closed while it was idle is opened
+ * again once. Returns 0 and sets status, the body is read with http_session_read().
+ **/
+int http_session_get(struct http_session *session, const char *url,
+                     const struct http_header *headers, int header_count,
+                     http_header_cb on_header, void *ctx, int *status);
+// Reads up to len bytes of the body, returns 0 at its end and -1 on errors.
+int http_session_read(struct http_session *session, char *buf, int len);
+/**
+ * Finishes the response, the connection stays open for the next request if the body was read to
+ * the end and the server allows it.
+ **/
+void http_session_end(struct http_session *session);
+// Closes the connection and caches the TLS session for the next one.
+void http_session_close(struct http_session *session);
+
+#endif
@@ -1,2 +1,9 @@
+#include <stdint.h>
+
 void wifi_init_sta(void);
+int wifi_wait_connected(int timeout_ms);
 void https_get_task( void * pvParameters );
+// Returns 0 once /spiffs is mounted.
+int spiffs_mount(void);
+// Turns Wi-Fi off and deep sleeps for seconds, the next wake starts over in app_main().
+void deep_sleep(uint32_t seconds);
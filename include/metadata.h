@@ -0,0 +1,59 @@
+#ifndef METADATA_H
+#define METADATA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Room for the unescaped img, safe_title and alt strings, alt texts run to a few hundred bytes.
+#define METADATA_ARENA_LEN 1536
+
+/**
+ * The fields of info.0.json the display needs. The strings point into arena and are always NUL
+ * terminated, a string that doesn't fit is truncated on a UTF-8 character boundary and the ones
+ * after it that find the arena full are empty.
+ **/
+struct xkcd_metadata
+{
+    char *img;
+    char *safe_title;
+    char *alt;
+    int num;
+    char arena[METADATA_ARENA_LEN];
+};
+
+/**
+ * Single pass JSON tokenizer that can be fed the HTTP body in arbitrary chunks. Only the fields
+ * above are kept (top level keys only), everything else is validated and skipped. Strings are
+ * unescaped, \uXXXX included, as they are copied into the arena.
+ **/
+struct metadata_parser
+{
+    struct xkcd_metadata *metadata;
+    size_t arena_used;
+    uint32_t containers; // One bit per nesting level, set for objects.
+    int depth;
+    int state;
+    int in_key;          // The string being scanned is an object key.
+    int field;           // Field the current value is stored in, -1 if it's skipped.
+    char key[12];        // Longest key we care about fits, anything longer can't match.
+    int key_len;
+    char *string;        // Start of the string being written to the arena.
+    int truncated;       // The arena ran out while writing string.
+    uint32_t found;      // Bit per field seen.
+    // \uXXXX decoding
+    int hex_digits;
+    uint32_t code_unit;
+    uint32_t high_surrogate;
+    // Number literal for num
+    int negative;
+    long number;
+    int number_digits;
+};
+
+void metadata_parser_init(struct metadata_parser *parser, struct xkcd_metadata *metadata);
+// Returns 0 while the input is valid JSON so far.
+int metadata_parser_feed(struct metadata_parser *parser, const char *buf, size_t len);
+// Returns 0 if the document was complete and had all the fields.
+int metadata_parser_finish(struct metadata_parser *parser);
+
+#endif
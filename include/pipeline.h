@@ -0,0 +1,40 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+/**
+ * Hands rows from a producer (the PNG decoder) to a worker that consumes them on another core,
+ * through a ring of a fixed number of rows. The producer always holds one slot to fill, pushing
+ * it blocks while the ring is full, so decode can never run more than the ring size ahead of the
+ * consumer. FreeRTOS tasks and semaphores on the device, pthreads on the host.
+ *
+ * The worker is started with the first pipeline and then kept waiting for the next one, and the
+ * ring comes out of an arena, so a render after the first one doesn't touch the heap.
+ **/
+struct row_pipeline;
+
+// Upper bound on the ring's bookkeeping (semaphores included), checked in pipeline.c.
+#define PIPELINE_HEADER_SIZE 512
+// Arena space row_pipeline_start() needs at most for rows of row_len bytes.
+#define PIPELINE_ARENA_SIZE(row_len, rows) \
+  (ARENA_SIZE(PIPELINE_HEADER_SIZE) + ARENA_SIZE((rows) * sizeof(int)) \
+   + ARENA_SIZE((size_t)(rows) * (row_len)))
+
+// Called on the worker for every pushed row, in push order.
+typedef void (*row_consumer_t)(void *ctx, int y, const uint8_t *row);
+
+// Hands a new ring to the worker, returns NULL if arena has no room for it or the worker failed.
+struct row_pipeline *row_pipeline_start(int row_len, int rows, row_consumer_t consume, void *ctx,
+                                        struct arena *arena);
+// The slot the producer fills next, row_len bytes.
+uint8_t *row_pipeline_row(struct row_pipeline *pipeline);
+// Queues the filled slot as row y and moves on to the next one.
+void row_pipeline_push(struct row_pipeline *pipeline, int y);
+// Waits until the worker consumed every pushed row, the worker then idles until the next start.
+void row_pipeline_finish(struct row_pipeline *pipeline);
+
+#endif
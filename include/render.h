@@ -0,0 +1,155 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pngle.h"
+#include "dither.h"
+#include "frame.h"
+#include "pipeline.h"
+#include "scale.h"
+
+// Bump whenever a change to the pipeline changes the pixels it produces, cached frames rendered
+// with different settings are then ignored.
+#define RENDER_SETTINGS_VERSION 3
+
+enum render_refresh
+{
+    RENDER_REFRESH_NONE,    // The panel already showed the frame.
+    RENDER_REFRESH_PARTIAL, // Only the changed rows were pushed.
+    RENDER_REFRESH_FULL
+};
+
+// How the last frame made it to the panel.
+struct render_stats
+{
+    enum render_refresh refresh;
+    struct frame_diff diff;
+    // Of the last comic put on the panel, pages is 1 unless it was paged.
+    int page;
+    int pages;
+};
+
+struct canvas_metadata
+{
+    int canvas_width;
+    int canvas_height;
+    int image_width;
+    int image_height;
+    int draw_width;  // Size of the image on the canvas, smaller than the image when it's scaled.
+    int draw_height;
+    int x_offset; // Canvas position of the image's top left corner, in pixels.
+    int y_offset;
+    int view_top;    // Draw rows from view_top up to view_bottom are on the canvas, the rest
+    int view_bottom; // are skipped.
+    int page;        // Of a comic too tall for the panel, pages is 1 if it isn't paged.
+    int pages;
+    int finished;    // Set once the last row in view is done, the rest isn't decoded.
+    unsigned char *canvas;
+    uint8_t *luma_row;  // Greyscale of the row pngle is currently decoding.
+    uint8_t *pixel_row; // Dithered output of the last completed row, one byte per pixel.
+    struct dither_state dither;
+    int scaled;            // Rows go through scaler before being dithered.
+    struct scaler scaler;
+    struct row_pipeline *pipeline; // Worker that dithers and packs rows, NULL to do it inline.
+    uint32_t transparent_pixels;
+    int displayed; // Set once the canvas has been sent to the panel (or saved, offscreen).
+    // Offscreen renders save the canvas here instead of displaying it.
+    const struct frame_location *frame_location;
+    enum frame_encoding frame_encoding;
+    // Comic related metadata TODO: this probably could be generalized a bit (header/footer)
+    char *title;
+    char *alt_text;
+    int comic_num;
+};
+
+/**
+ * A single PNG -> e-paper render. The caller owns the storage (usually the stack) and pushes
+ * the encoded PNG through render_feed() in whatever chunk sizes it has, the canvas is sent to
+ * the display from pngle's done callback. Sessions share the decoder and the buffers in the
+ * render arena, so only one can be open at a time.
+ **/
+struct render_session
+{
+    pngle_t *pngle;
+    struct canvas_metadata metadata;
+};
+
+int render_begin(struct render_session *session, char *title, char *alt, int num);
+/**
+ * Renders without touching the panel: the canvas is saved to location as a frame keyed like the
+ * frame cache, and render_end() returns 0 once it's there. Used to pre-render the archive.
+ **/
+int render_begin_offscreen(struct render_session *session, char *title, char *alt, int num,
+                           const struct frame_location *location, enum frame_encoding encoding);
+// Returns the number of bytes consumed by the decoder or a negative value on error.
+int render_feed(struct render_session *session, const void *buf, size_t len);
+/**
+ * Returns 1 once the last row that shows on the panel was decoded and the canvas sent on, the
+ * rest of the image doesn't need to be read unless it's wanted for something else.
+ **/
+int render_complete(const struct render_session *session);
+// Releases the session, returns 0 if the image made it to the display.
+int render_end(struct render_session *session);
+
+/**
+ * Displays a frame rendered elsewhere (see frame_stream in frame.h), fed in pieces as it's
+ * downloaded: the rows are unpacked into the canvas, and render_stream_end() returns 0 once the
+ * whole frame was intact and sent to the panel. The comic number comes from its header. With the
+ * frame cache set it's saved there too, keyed with render_settings() so render_cached() finds it.
+ **/
+int render_stream_begin(struct frame_stream *stream);
+// Returns 0 while the frame is valid so far.
+int render_stream_feed(struct frame_stream *stream, const void *buf, size_t len);
+int render_stream_end(struct frame_stream *stream);
+
+// Convenience wrapper that renders the PNG stored at fname, returns 0 once it is displayed.
+int display_image(const char *fname, char *title, char *alt, int num);
+// CRC-32 of the last canvas sent to the panel.
+uint32_t render_last_checksum(void);
+// Tells the renderer what is on the panel already, e.g. the saved checksum after a reboot.
+void render_set_panel_checksum(uint32_t checksum);
+const struct render_stats *render_last_stats(void);
+// Identifies the render settings in effect (version, dither, fit to panel, paging), part of the
+// frame cache key.
+uint32_t render_settings(void);
+// Overrides the dither kernel picked in menuconfig for the following renders.
+void render_set_dither(enum dither_kernel kernel);
+/**
+ * Rows in the decode -> dither ring for the following renders, 0 dithers on the decode task.
+ * Capped at CONFIG_XKCD_PIPELINE_ROWS, the render arena only has room for that many.
+ **/
+void render_set_pipeline(int rows);
+/**
+ * Greyscale PNGs skip the RGB luma weights and 1 bit ones the dither, which renders the same
+ * canvas. 0 sends every format down the RGBA path, e.g. to compare against it.
+ **/
+void render_set_native_formats(int enable);
+/**
+ * With CONFIG_XKCD_PAGE_TALL_COMICS, comics taller than the panel are shown a page at a time:
+ * this selects the page the following renders put on the panel, wrapping round after the last.
+ * Offscreen renders are always of the first page. render_last_stats() tells which page was
+ * shown of how many.
+ **/
+void render_set_page(int page);
+
+/**
+ * With a location set every displayed canvas is also saved there (see frame.h), keyed by comic
+ * number and render_settings(), and render_cached() can put it back on the panel without
+ * decoding. NULL turns the frame cache off.
+ **/
+void render_set_frame_cache(const struct frame_location *location, enum frame_encoding encoding);
+/**
+ * Displays the cached frame of comic num, returns 0 if there was a matching one. That's whichever
+ * page of a tall comic was shown last, render_last_stats() tells which.
+ **/
+int render_cached(int num);
+/**
+ * Displays the frame of comic num stored at location, returns 0 if it was there and matched. Raw
+ * frames in the store go to the panel straight from the mapped partition. Like render_cached()
+ * it sets the page in render_last_stats().
+ **/
+int render_frame(const struct frame_location *location, int num);
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef SCALE_H
+#define SCALE_H
+
+#include <stdint.h>
+
+#include "arena.h"
+
+/**
+ * Streaming box (area-averaging) downscaler for 8 bit greyscale. Source pixels are pushed one at
+ * a time in raster order and every output pixel is the area weighted mean of the source pixels it
+ * covers. Only one accumulator row per direction is kept, so memory is O(output width).
+ *
+ * Positions are tracked in integer units where a source pixel is dst wide and an output pixel is
+ * src wide, so the weights are exact and need no divides while pushing pixels.
+ **/
+struct scaler
+{
+    int src_width;
+    int src_height;
+    int dst_width;
+    int dst_height;
+    uint32_t *row;   // Weighted sums of the current source row, per output column.
+    uint32_t *acc;   // Weighted sums of the current output row, 8.8 fixed point luma.
+    uint8_t *out;    // The last completed output row.
+    uint32_t row_scale; // 2^24 / src_width, turns a row sum into 8.8 luma.
+    int col;         // Output column the next source pixel starts in.
+    int col_room;    // Units left in that column.
+    int out_y;       // Output row the next source row starts in.
+    int row_room;    // Units left in that row.
+};
+
+// Arena space scaler_init() needs at most for an output dst_width pixels wide.
+#define SCALER_ARENA_SIZE(dst_width) \
+  (2 * ARENA_SIZE((dst_width) * sizeof(uint32_t)) + ARENA_SIZE(dst_width))
+
+/**
+ * Output dimensions are clamped to the source ones, the scaler never enlarges. The row buffers
+ * come out of arena and live until it's reset.
+ **/
+int scaler_init(struct scaler *scaler, int src_width, int src_height,
+                int dst_width, int dst_height, struct arena *arena);
+
+// Adds the next source pixel of the current row.
+static inline void scaler_pixel(struct scaler *scaler, uint8_t luma)
+{
+    int weight = scaler->dst_width;
+    if(scaler->col_room > weight)
+    {
+        scaler->row[scaler->col] += luma * weight;
+        scaler->col_room -= weight;
+    }
+    else
+    {
+        // The pixel finishes this column and spills whatever is left into the next one.
+        scaler->row[scaler->col] += luma * scaler->col_room;
+        weight -= scaler->col_room;
+        scaler->col++;
+        scaler->col_room = scaler->src_width - weight;
+        if(weight)
+        {
+            scaler->row[scaler->col] += luma * weight;
+        }
+    }
+}
+
+/**
+ * Call once all pixels of a source row were pushed. Returns the index of the output row this
+ * completed, its luma is then in scaler->out, or -1 if the output row needs more source rows.
+ **/
+int scaler_row(struct scaler *scaler);
+
+#endif
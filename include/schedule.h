@@ -0,0 +1,120 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <stdint.h>
+
+#include "state.h"
+
+// Hours in a week, the resolution publication times are learned at.
+#define SCHEDULE_HOURS (7 * 24)
+
+// What woke the device up, from esp_sleep_get_wakeup_cause() on the device.
+enum schedule_wake
+{
+    SCHEDULE_WAKE_COLD,  // Power on, reset or anything other than the sleep timer.
+    SCHEDULE_WAKE_TIMER,
+};
+
+enum schedule_action
+{
+    // Woke before the next refresh was due, go straight back to sleep for sleep_s.
+    SCHEDULE_SLEEP,
+    // Ask for info.0.json with the validators below. Only mount SPIFFS and wake the panel if a
+    // new comic came back.
+    SCHEDULE_CHECK,
+    // Nothing in RTC memory to go by: mount SPIFFS, load the state, redisplay the cached frame
+    // and run a full cycle.
+    SCHEDULE_FULL,
+};
+
+/**
+ * How checks are spaced, set from menuconfig. With adaptive set, and once a few comics have been
+ * seen coming out, checks are bunched burst_s apart in the hours of the week comics have been
+ * published in, and otherwise only happen when one is overdue.
+ **/
+struct schedule_policy
+{
+    uint32_t interval_s;  // Between checks when not adaptive, or nothing has been learned yet.
+    uint32_t retry_s;     // After a failed check, doubling with every failure in a row.
+    int adaptive;
+    uint32_t burst_s;     // Between checks inside an expected publication window.
+    uint32_t max_sleep_s; // Longest sleep between windows.
+    uint32_t page_s;      // Longest sleep while a comic is paged, 0 if comics aren't paged.
+};
+
+extern struct schedule_policy schedule_policy;
+
+/**
+ * When comics have come out, learned from the checks that first saw each new comic number: the
+ * hours between the check before it and that check get the weight, spread evenly, after all
+ * weights decayed by an eighth. Kept in NVS as well, so a power cycle doesn't lose it.
+ **/
+struct schedule_history
+{
+    uint16_t weights[SCHEDULE_HOURS]; // By hour of the week, Monday 00:00 UTC first.
+    uint32_t sightings;               // New comics learned from.
+};
+
+/**
+ * What the scheduler keeps in RTC memory between deep sleeps. The comic on the panel and the
+ * validators are copies of the ones in the SPIFFS state, enough to send a conditional request
+ * without mounting anything. Times are seconds on the clock given to schedule_wake().
+ **/
+struct schedule_state
+{
+    uint32_t magic;
+    uint32_t wakes;        // Timer wakes since the last cold boot.
+    int64_t next_refresh;  // When the next check is due.
+    int64_t last_check;    // Last successful check, 0 if none since the cold boot.
+    int64_t last_new;      // Last check that found a new comic.
+    // Checked every few hours a week after a comic turned up too long after the check before it,
+    // to find out when in the hours before that comics come out.
+    int64_t probe_start;
+    int64_t probe_end;
+    uint32_t failures;     // Failed cycles in a row, for the retry backoff.
+    uint32_t overdue;      // Checks since an expected window passed without a new comic.
+    int32_t comic_num;
+    struct http_validators validators;
+    // Page of the comic on the panel and how many it has, 0 if not known since the cold boot.
+    // Set by the cycle before schedule_done().
+    int32_t page;
+    int32_t pages;
+    struct schedule_history history;
+    uint32_t crc;
+};
+
+// The copy in RTC memory (plain static memory on the host), check it with schedule_wake().
+struct schedule_state *schedule_rtc(void);
+// Seconds since the epoch on the clock that keeps running through deep sleep.
+int64_t schedule_now(void);
+
+/**
+ * The device has no RTC battery, so after a power cycle the time comes from the Date header of
+ * the first response. Returns 0 and sets t for an RFC 7231 date like
+ * "Sun, 06 Nov 1994 08:49:37 GMT".
+ **/
+int schedule_parse_http_date(const char *date, int64_t *t);
+// Sets the clock to t if it is off by more than a few seconds.
+void schedule_sync_clock(int64_t t);
+
+/**
+ * Decides what a wake up at now has to do. A cold boot, or RTC memory that doesn't hold a
+ * valid state, starts the state over and asks for a full cycle. sleep_s is only set for
+ * SCHEDULE_SLEEP.
+ **/
+enum schedule_action schedule_wake(struct schedule_state *state, enum schedule_wake wake,
+                                   int64_t now, uint32_t *sleep_s);
+
+/**
+ * Records the outcome of the cycle that ended at now and the comic now on the panel, learns
+ * from it if that's a new one, and returns the seconds to sleep until the next check.
+ **/
+uint32_t schedule_done(struct schedule_state *state, int64_t now, int failed, int comic_num,
+                       const struct http_validators *validators);
+
+// Restores the history saved in NVS after a cold boot, returns 1 if there is none.
+int schedule_history_load(struct schedule_state *state);
+// Returns 0 once the history is in NVS.
+int schedule_history_save(const struct schedule_state *state);
+
+#endif
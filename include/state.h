@@ -0,0 +1,43 @@
+#ifndef STATE_H
+#define STATE_H
+
+#include <stdint.h>
+
+#define STATE_VALIDATOR_LEN 96
+
+// Cache validators of the last info.0.json response that was fully processed
+struct http_validators
+{
+    char etag[STATE_VALIDATOR_LEN];
+    char last_modified[STATE_VALIDATOR_LEN];
+};
+
+/**
+ * Everything that has to survive a reboot to decide whether a refresh cycle has work to do.
+ **/
+struct xkcd_state
+{
+    uint32_t sequence;        // Managed by state_save(), identifies the newest copy.
+    int32_t comic_num;        // Number of the comic on the panel, -1 if none yet.
+    uint32_t image_hash;      // CRC-32 of the PNG the comic was rendered from.
+    uint32_t render_checksum; // CRC-32 of the canvas last pushed to the panel.
+    struct http_validators validators;
+};
+
+/**
+ * The state is kept in two record files, <path>.0 and <path>.1, each with a version and CRC.
+ * Saves go to the older slot, so a reset or power loss mid-write always leaves the previous
+ * record intact, regardless of what the filesystem does on rename.
+ **/
+
+// Loads the newest valid record, returns 1 and fills in defaults when there is none.
+int state_load(const char *path, struct xkcd_state *state);
+// Returns 0 once the record is on flash.
+int state_save(const char *path, struct xkcd_state *state);
+
+struct store;
+// The same kept as record id of the store (see store.h), which replaces it atomically by itself.
+int state_load_record(const struct store *store, uint32_t id, struct xkcd_state *state);
+int state_save_record(struct store *store, uint32_t id, struct xkcd_state *state);
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_partition.h"
+
+#define STORE_SECTOR 4096
+// Largest partition the record table has room for, 1MB.
+#define STORE_MAX_SECTORS 256
+
+// A record on flash, the newest copy of its id.
+struct store_record
+{
+    uint32_t id;
+    uint32_t seq;
+    uint32_t len;      // Of the payload.
+    uint16_t sector;   // First sector, the header is at its start.
+    uint16_t sectors;
+};
+
+/**
+ * Records on a raw data partition, written as an append-only log: every write of an id goes to
+ * the head of the log in whole sectors, a header with the id, a sequence number and CRCs written
+ * after the payload, and then the copy it replaces is killed by zeroing its magic in place. The
+ * head goes round the partition, so every sector is erased equally often. Once the head catches
+ * up with the oldest record, that one is copied forward to the head if it's still needed, so
+ * space is reclaimed oldest first. Twice the largest record is always kept free for that. After
+ * a power loss the log holds either the old or the new copy, never half of one.
+ *
+ * The whole partition is memory mapped, records are read in place through store_map().
+ **/
+struct store
+{
+    const esp_partition_t *partition;
+    spi_flash_mmap_handle_t mmap;
+    const uint8_t *base;     // The mapped partition.
+    int sectors;
+    int reserve;             // Sectors of the largest record.
+    uint32_t seq;            // Of the newest record.
+    int head;                // Sector the next record goes to.
+    int count;               // Live records, oldest first.
+    struct store_record records[STORE_MAX_SECTORS];
+    // Since store_open().
+    uint32_t erases;
+    uint32_t moves;
+};
+
+// Writes one record as it is streamed in, see store_begin().
+struct store_writer
+{
+    struct store *store;
+    uint32_t id;
+    int sector;
+    int erased;        // Sectors of it erased so far.
+    uint32_t len;
+    uint32_t max_len;
+    uint32_t crc;
+    int failed;
+};
+
+/**
+ * Mounts the data partition with this label, max_len is the largest record that will be
+ * written. Returns 0 once the records on it are indexed.
+ **/
+int store_open(struct store *store, const char *label, uint32_t max_len);
+void store_close(struct store *store);
+
+// Maps the record of id, returns NULL if there is none or it's corrupt.
+const uint8_t *store_map(const struct store *store, uint32_t id, uint32_t *len);
+// Writes a whole record, returns 0 once it's committed.
+int store_write(struct store *store, uint32_t id, const void *data, uint32_t len);
+// Removes the record of id, if any.
+int store_delete(struct store *store, uint32_t id);
+
+/**
+ * Starts writing a record of up to max_len bytes that's appended in pieces with
+ * store_append(). Nothing of it is visible until store_commit() returns 0, store_abort()
+ * drops it. Nothing else may be written to the store until then.
+ **/
+int store_begin(struct store *store, struct store_writer *writer, uint32_t id, uint32_t max_len);
+int store_append(struct store_writer *writer, const void *data, uint32_t len);
+int store_commit(struct store_writer *writer);
+void store_abort(struct store_writer *writer);
+
+// Bytes of live records, whole sectors.
+uint32_t store_used(const struct store *store);
+// Flash a record of len bytes takes up.
+uint32_t store_size(uint32_t len);
+
+#endif
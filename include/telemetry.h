@@ -0,0 +1,107 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "sdkconfig.h"
+
+/**
+ * Where a refresh cycle spends its time. Phases can nest and overlap (dither runs inside decode
+ * unless it's on the other core), so they don't add up to the cycle's total.
+ **/
+enum telemetry_phase
+{
+    TELEMETRY_WIFI,      // Association and DHCP.
+    TELEMETRY_CONNECT,   // TCP, TLS handshake and response headers of every request.
+    TELEMETRY_HANDSHAKE, // The TCP connect and TLS handshake part of connect.
+    TELEMETRY_TRANSFER,  // Reading response bodies.
+    TELEMETRY_PARSE,     // info.0.json.
+    TELEMETRY_DECODE,    // pngle, including whatever its callbacks do on the same task, or
+                         // unpacking a received frame.
+    TELEMETRY_DITHER,    // Dithering and packing rows, bytes are pixels.
+    TELEMETRY_TEXT,      // Title and alt text layout and drawing.
+    TELEMETRY_DISPLAY,   // Pushing the frame to the panel, bytes are frame bytes sent.
+    TELEMETRY_PHASE_COUNT
+};
+
+// Events counted per cycle.
+enum telemetry_counter
+{
+    TELEMETRY_REQUESTS,
+    TELEMETRY_REUSED,     // Requests sent on a connection kept open from an earlier one.
+    TELEMETRY_HANDSHAKES, // Connections opened.
+    TELEMETRY_RESUMED,    // Handshakes that resumed a cached TLS session.
+    TELEMETRY_COUNTER_COUNT
+};
+
+struct telemetry_phase_stats
+{
+    uint32_t us;
+    uint32_t bytes;
+    // Lowest free heap seen at the phase's edges, or the all time low if the phase set a new
+    // one. UINT32_MAX if the phase never ran this cycle.
+    uint32_t heap_min;
+    uint32_t stack_min; // Least free stack of the task(s) it ran on, in bytes, 0 on the host.
+};
+
+struct telemetry_cycle
+{
+    uint32_t id;           // Counts up for as long as the ring survives (deep sleep, resets).
+    int32_t comic_num;
+    int32_t result;        // 0 if the cycle did what it set out to, see request.c.
+    uint32_t reset_reason; // esp_reset_reason() of the boot the cycle ran in.
+    uint32_t total_us;
+    struct telemetry_phase_stats phases[TELEMETRY_PHASE_COUNT];
+    uint16_t counters[TELEMETRY_COUNTER_COUNT];
+    uint32_t crc;          // Set once the cycle completed.
+};
+
+#if CONFIG_XKCD_TELEMETRY
+/**
+ * Every cycle is timed into a record that is copied into a ring of the last
+ * CONFIG_XKCD_TELEMETRY_CYCLES ones when it ends. On the device the ring lives in RTC memory, so
+ * it survives deep sleep and software resets, on the host it's just static.
+ **/
+
+// Monotonic clock in microseconds.
+int64_t telemetry_now(void);
+void telemetry_cycle_begin(void);
+void telemetry_cycle_end(int comic_num, int result);
+
+// Times one run of a phase, the result of begin goes to end. Both sample heap and stack.
+int64_t telemetry_begin(enum telemetry_phase phase);
+void telemetry_end(enum telemetry_phase phase, int64_t start, size_t bytes);
+// For per row or per chunk work: only adds up time and bytes, call telemetry_sample() once after.
+void telemetry_add(enum telemetry_phase phase, int64_t us, size_t bytes);
+void telemetry_sample(enum telemetry_phase phase);
+void telemetry_count(enum telemetry_counter counter);
+
+/**
+ * One compact line of JSON per cycle, phases that didn't run are left out, and so are the
+ * counters if no request was made:
+ *   {"id":7,"comic":2916,"result":0,"reset":1,"us":8123456,
+ *    "wifi":[us,bytes,heap_min,stack_min],"connect":[...],...,
+ *    "http":[requests,reused,handshakes,resumed]}
+ * Returns the length like snprintf().
+ **/
+int telemetry_format(const struct telemetry_cycle *cycle, char *buf, size_t len);
+// Writes the last cycles completed cycles (all of them for 0) from the ring, oldest first.
+void telemetry_dump(FILE *out, int cycles);
+// The last completed cycle, NULL if there is none.
+const struct telemetry_cycle *telemetry_last(void);
+#else
+static inline int64_t telemetry_now(void) { return 0; }
+static inline void telemetry_cycle_begin(void) {}
+static inline void telemetry_cycle_end(int comic_num, int result) {}
+static inline int64_t telemetry_begin(enum telemetry_phase phase) { return 0; }
+static inline void telemetry_end(enum telemetry_phase phase, int64_t start, size_t bytes) {}
+static inline void telemetry_add(enum telemetry_phase phase, int64_t us, size_t bytes) {}
+static inline void telemetry_sample(enum telemetry_phase phase) {}
+static inline void telemetry_count(enum telemetry_counter counter) {}
+static inline void telemetry_dump(FILE *out, int cycles) {}
+static inline const struct telemetry_cycle *telemetry_last(void) { return NULL; }
+#endif
+
+#endif
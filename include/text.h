@@ -0,0 +1,46 @@
+#ifndef TEXT_H
+#define TEXT_H
+
+#include <stdint.h>
+
+#include "fonts.h"
+
+#define TEXT_MAX_LINES 12
+
+struct text_line
+{
+    const char *start; // Into the laid out string, not NUL terminated.
+    int len;           // In bytes.
+    int width;         // In pixels, including the ellipsis if there is one.
+    int ellipsis;      // Text was cut off after this line, draw "..." after it.
+};
+
+/**
+ * A string broken into lines of one font. The widths are measured once here, drawing only walks
+ * the lines. Anything outside printable ASCII is drawn from a small table of look-alikes (curly
+ * quotes, dashes) or as '?', one glyph per UTF-8 sequence, so the font table is never indexed
+ * out of range.
+ **/
+struct text_layout
+{
+    const sFONT *font;
+    int line_count;
+    struct text_line lines[TEXT_MAX_LINES];
+};
+
+/**
+ * Word wraps str to max_width with the first of fonts (largest first) whose lines fit in
+ * max_height. Words wider than a line are broken, a string that doesn't fit even the last font
+ * is cut off with an ellipsis. Returns 1 if it had to be cut off (or nothing fits at all).
+ **/
+int text_layout(struct text_layout *layout, const char *str, const sFONT *const *fonts,
+                int font_count, int max_width, int max_height);
+// Total height of the laid out lines in pixels.
+int text_height(const struct text_layout *layout);
+/**
+ * Draws the lines centred on a 1bpp canvas (set bits are white) of stride bytes per row, top line
+ * at y. Glyph rows are shifted into place so text can start at any x, clipped to the canvas.
+ **/
+void text_draw(uint8_t *canvas, int stride, int height, const struct text_layout *layout, int y);
+
+#endif
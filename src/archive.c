@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "esp_log.h"
+
+#include "archive.h"
+#include "crc32.h"
+#include "store.h"
+
+#define ARCHIVE_MAGIC 0x52414B58 // "XKAR"
+// Bump whenever struct archive_entry changes, the archive then starts over.
+#define ARCHIVE_VERSION 1
+// In files the index alternates between two of them like the state does, see state.h. The store
+// replaces a record atomically, one is enough there.
+#define INDEX_SLOTS 2
+
+static const char *TAG = "archive";
+
+struct archive_index
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size;
+  uint32_t sequence; // The newer of the two files wins.
+  int32_t cursor;
+  uint32_t crc;      // Over the entries.
+  struct archive_entry entries[ARCHIVE_MAX_SLOTS];
+};
+
+static void index_path(char *buf, const struct archive *archive, int slot)
+{
+  if(archive->location.store != NULL)
+  {
+    snprintf(buf, ARCHIVE_PATH_LEN, "record %u", (unsigned)archive->location.id);
+    return;
+  }
+  snprintf(buf, ARCHIVE_PATH_LEN, "%s.%d", archive->location.path, slot);
+}
+
+void archive_location(const struct archive *archive, int slot, struct frame_location *location,
+                      char *path)
+{
+  *location = archive->location;
+  location->id = archive->location.id + 1 + slot;
+  location->path = NULL;
+  if(archive->location.store == NULL)
+  {
+    snprintf(path, ARCHIVE_PATH_LEN, "%s%02d", archive->location.path, slot);
+    location->path = path;
+  }
+}
+
+static void remove_frame(const struct archive *archive, int slot)
+{
+  struct frame_location location;
+  char path[ARCHIVE_PATH_LEN];
+
+  archive_location(archive, slot, &location, path);
+  if(location.store != NULL)
+  {
+    store_delete(location.store, location.id);
+  }
+  else
+  {
+    remove(path);
+  }
+}
+
+static int index_read(const struct archive *archive, int slot, struct archive_index *index)
+{
+  char fname[ARCHIVE_PATH_LEN];
+  size_t len = 0;
+
+  index_path(fname, archive, slot);
+  if(archive->location.store != NULL)
+  {
+    uint32_t size;
+    const uint8_t *data = slot == 0 ? store_map(archive->location.store, archive->location.id,
+                                                &size) : NULL;
+    if(data == NULL)
+    {
+      return 1;
+    }
+    memcpy(index, data, size < sizeof(*index) ? size : sizeof(*index));
+    len = size;
+  }
+  else
+  {
+    FILE *f = fopen(fname, "rb");
+    if(f == NULL)
+    {
+      return 1;
+    }
+    len = fread(index, 1, sizeof(*index), f);
+    fclose(f);
+  }
+  if(len != sizeof(*index) || index->magic != ARCHIVE_MAGIC
+     || index->version != ARCHIVE_VERSION || index->size != sizeof(index->entries)
+     || index->crc != crc32_update(0, index->entries, sizeof(index->entries)))
+  {
+    ESP_LOGW(TAG, "Ignoring invalid index %s", fname);
+    return 1;
+  }
+  return 0;
+}
+
+int archive_open(struct archive *archive, const struct frame_location *location, int slots,
+                 uint32_t budget, uint32_t frame_max)
+{
+  struct archive_index index;
+  int found = 0;
+
+  memset(archive, 0, sizeof(*archive));
+  archive->location = *location;
+  archive->slots = slots < ARCHIVE_MAX_SLOTS ? slots : ARCHIVE_MAX_SLOTS;
+  archive->budget = budget;
+  archive->frame_max = frame_max;
+  for(int slot = 0; slot < INDEX_SLOTS; slot++)
+  {
+    if(index_read(archive, slot, &index) == 0
+       && (!found || index.sequence - archive->clock < 0x80000000u))
+    {
+      archive->clock = index.sequence;
+      archive->cursor = index.cursor;
+      memcpy(archive->entries, index.entries, sizeof(archive->entries));
+      found = 1;
+    }
+  }
+
+  if(!found)
+  {
+    // Frames no index knows about would only take up space
+    for(int slot = 0; slot < ARCHIVE_MAX_SLOTS; slot++)
+    {
+      remove_frame(archive, slot);
+    }
+    ESP_LOGI(TAG, "No archive index, starting empty");
+    return 1;
+  }
+  // Slots past a smaller configured count go
+  for(int slot = archive->slots; slot < ARCHIVE_MAX_SLOTS; slot++)
+  {
+    if(archive->entries[slot].comic_num != 0)
+    {
+      archive_drop(archive, slot);
+    }
+  }
+  ESP_LOGI(TAG, "%d comics archived, %u bytes", archive_count(archive),
+           (unsigned)archive_bytes(archive));
+  return 0;
+}
+
+int archive_save(struct archive *archive)
+{
+  struct archive_index index;
+  char fname[ARCHIVE_PATH_LEN];
+
+  memset(&index, 0, sizeof(index));
+  index.magic = ARCHIVE_MAGIC;
+  index.version = ARCHIVE_VERSION;
+  index.size = sizeof(index.entries);
+  index.sequence = ++archive->clock;
+  index.cursor = archive->cursor;
+  memcpy(index.entries, archive->entries, sizeof(index.entries));
+  index.crc = crc32_update(0, index.entries, sizeof(index.entries));
+
+  if(archive->location.store != NULL)
+  {
+    return store_write(archive->location.store, archive->location.id, &index, sizeof(index));
+  }
+  index_path(fname, archive, index.sequence % INDEX_SLOTS);
+  FILE *f = fopen(fname, "wb");
+  if(f == NULL)
+  {
+    ESP_LOGE(TAG, "Failed to open %s for writing", fname);
+    return 1;
+  }
+  size_t len = fwrite(&index, 1, sizeof(index), f);
+  if(fclose(f) != 0 || len != sizeof(index))
+  {
+    ESP_LOGE(TAG, "Failed to write %s", fname);
+    return 1;
+  }
+  return 0;
+}
+
+int archive_find(const struct archive *archive, int32_t num, uint32_t settings)
+{
+  for(int slot = 0; slot < archive->slots; slot++)
+  {
+    const struct archive_entry *entry = &archive->entries[slot];
+    if(entry->comic_num == num && entry->settings == settings)
+    {
+      return slot;
+    }
+  }
+  return -1;
+}
+
+int archive_count(const struct archive *archive)
+{
+  int count = 0;
+  for(int slot = 0; slot < archive->slots; slot++)
+  {
+    count += archive->entries[slot].comic_num != 0;
+  }
+  return count;
+}
+
+uint32_t archive_bytes(const struct archive *archive)
+{
+  uint32_t bytes = 0;
+  for(int slot = 0; slot < archive->slots; slot++)
+  {
+    if(archive->entries[slot].comic_num != 0)
+    {
+      bytes += archive->entries[slot].size;
+    }
+  }
+  return bytes;
+}
+
+int32_t archive_next(const struct archive *archive, int32_t latest, uint32_t settings)
+{
+  if(archive->cursor < 0)
+  {
+    return 0;
+  }
+  int32_t num = archive->cursor > 0 && archive->cursor < latest ? archive->cursor : latest - 1;
+  while(num > 0 && archive_find(archive, num, settings) >= 0)
+  {
+    num--;
+  }
+  return num > 0 ? num : 0;
+}
+
+void archive_skip(struct archive *archive, int32_t num)
+{
+  // Stays at -1 once the first comic was reached, 0 would start over from the latest
+  archive->cursor = num > 1 ? num - 1 : -1;
+}
+
+void archive_drop(struct archive *archive, int slot)
+{
+  remove_frame(archive, slot);
+  memset(&archive->entries[slot], 0, sizeof(archive->entries[slot]));
+}
+
+// Entries an add may evict: frames rendered with other settings and comics already shown.
+static int evictable(const struct archive_entry *entry, uint32_t settings)
+{
+  return entry->comic_num != 0 && (entry->settings != settings || entry->shown);
+}
+
+// Slot an add evicts next, stale frames first, then the least recently used. -1 if none.
+static int eviction_candidate(const struct archive *archive, uint32_t settings)
+{
+  int victim = -1;
+  for(int slot = 0; slot < archive->slots; slot++)
+  {
+    const struct archive_entry *entry = &archive->entries[slot];
+    if(!evictable(entry, settings))
+    {
+      continue;
+    }
+    if(entry->settings != settings)
+    {
+      return slot;
+    }
+    if(victim < 0 || entry->used - archive->entries[victim].used >= 0x80000000u)
+    {
+      victim = slot;
+    }
+  }
+  return victim;
+}
+
+// There is a free slot and the frame would fit the budget.
+static int fits(const struct archive *archive, int *free_slot)
+{
+  *free_slot = -1;
+  for(int slot = 0; slot < archive->slots && *free_slot < 0; slot++)
+  {
+    if(archive->entries[slot].comic_num == 0)
+    {
+      *free_slot = slot;
+    }
+  }
+  return *free_slot >= 0 && archive_bytes(archive) + archive->frame_max <= archive->budget;
+}
+
+int archive_has_room(const struct archive *archive, uint32_t settings)
+{
+  // What's left once everything evictable went
+  int slot_left = 0;
+  uint32_t kept = 0;
+  for(int slot = 0; slot < archive->slots; slot++)
+  {
+    const struct archive_entry *entry = &archive->entries[slot];
+    if(entry->comic_num == 0 || evictable(entry, settings))
+    {
+      slot_left = 1;
+    }
+    else
+    {
+      kept += entry->size;
+    }
+  }
+  return slot_left && kept + archive->frame_max <= archive->budget;
+}
+
+int archive_reserve(struct archive *archive, uint32_t settings)
+{
+  int slot;
+
+  while(!fits(archive, &slot))
+  {
+    int victim = eviction_candidate(archive, settings);
+    if(victim < 0)
+    {
+      return -1;
+    }
+    ESP_LOGI(TAG, "Evicting comic %d", (int)archive->entries[victim].comic_num);
+    archive_drop(archive, victim);
+  }
+  return slot;
+}
+
+int archive_commit(struct archive *archive, int slot, int32_t num, uint32_t settings)
+{
+  struct frame_location location;
+  char path[ARCHIVE_PATH_LEN];
+  uint32_t size;
+  struct stat st;
+
+  archive_location(archive, slot, &location, path);
+  if(location.store != NULL)
+  {
+    // What it takes up in the store is whole sectors
+    if(store_map(location.store, location.id, &size) == NULL)
+    {
+      return 1;
+    }
+    size = store_size(size);
+  }
+  else
+  {
+    if(stat(path, &st) != 0)
+    {
+      return 1;
+    }
+    size = st.st_size;
+  }
+  struct archive_entry *entry = &archive->entries[slot];
+  entry->comic_num = num;
+  entry->settings = settings;
+  entry->size = size;
+  entry->used = ++archive->clock;
+  entry->shown = 0;
+  ESP_LOGI(TAG, "Archived comic %d, %u bytes", (int)num, (unsigned)entry->size);
+  return 0;
+}
+
+int archive_pick(const struct archive *archive, uint32_t settings)
+{
+  int pick = -1;
+  for(int slot = 0; slot < archive->slots; slot++)
+  {
+    const struct archive_entry *entry = &archive->entries[slot];
+    if(entry->comic_num == 0 || entry->settings != settings)
+    {
+      continue;
+    }
+    if(pick < 0)
+    {
+      pick = slot;
+      continue;
+    }
+    const struct archive_entry *best = &archive->entries[pick];
+    // Unseen ones first, then whichever was used longest ago
+    if((!entry->shown && best->shown)
+       || (!entry->shown == !best->shown && entry->used - best->used >= 0x80000000u))
+    {
+      pick = slot;
+    }
+  }
+  return pick;
+}
+
+void archive_touch(struct archive *archive, int slot)
+{
+  archive->entries[slot].used = ++archive->clock;
+  archive->entries[slot].shown++;
+}
@@ -0,0 +1,33 @@
+#include <string.h>
+
+#include "arena.h"
+
+void arena_init(struct arena *arena, void *buf, size_t size)
+{
+  arena->base = buf;
+  arena->size = size;
+  arena->used = 0;
+  arena->high_water = 0;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+  size_t aligned = ARENA_SIZE(size);
+  if(aligned < size || aligned > arena->size - arena->used)
+  {
+    return NULL;
+  }
+  void *ptr = arena->base + arena->used;
+  arena->used += aligned;
+  if(arena->used > arena->high_water)
+  {
+    arena->high_water = arena->used;
+  }
+  memset(ptr, 0, size);
+  return ptr;
+}
+
+void arena_reset(struct arena *arena)
+{
+  arena->used = 0;
+}
@@ -0,0 +1,90 @@
+#include <string.h>
+
+#include "bitpack.h"
+
+/**
+ * Collects 8 pixels into one byte, first pixel in the MSB. On little endian targets (the ESP32
+ * and any host we build on) each group of 4 pixels is loaded as a word and a single multiply
+ * moves pixel k to bit 31 - k: the magic has a bit at 31 - 9k for every k, and all the cross
+ * terms land below bit 28 without overlapping.
+ **/
+static inline uint8_t gather8(const uint8_t *pixels)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint32_t lo, hi;
+  memcpy(&lo, pixels, 4);
+  memcpy(&hi, pixels + 4, 4);
+  return (((lo * 0x80402010u) >> 28) << 4) | ((hi * 0x80402010u) >> 28);
+#else
+  return (pixels[0] << 7) | (pixels[1] << 6) | (pixels[2] << 5) | (pixels[3] << 4)
+       | (pixels[4] << 3) | (pixels[5] << 2) | (pixels[6] << 1) | pixels[7];
+#endif
+}
+
+// Fewer than 8 pixels, MSB aligned.
+static inline uint8_t gather_tail(const uint8_t *pixels, int width)
+{
+  uint8_t bits = 0;
+  for(int i = 0; i < width; i++)
+  {
+    bits |= pixels[i] << (7 - i);
+  }
+  return bits;
+}
+
+void bitpack_row(uint8_t *row, int x, const uint8_t *pixels, int width)
+{
+  uint8_t *dst = row + (x >> 3);
+  int shift = x & 7;
+  // High bits of the current output byte that are already decided.
+  int pending = shift;
+  uint8_t carry = shift ? dst[0] & (uint8_t)(0xFF << (8 - shift)) : 0;
+
+  if(width <= 0)
+  {
+    return;
+  }
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  // Byte aligned, 32 pixels per store
+  if(shift == 0)
+  {
+    for(; width >= 32; width -= 32, pixels += 32, dst += 4)
+    {
+      uint32_t word = gather8(pixels)
+                    | (gather8(pixels + 8) << 8)
+                    | (gather8(pixels + 16) << 16)
+                    | ((uint32_t)gather8(pixels + 24) << 24);
+      memcpy(dst, &word, 4);
+    }
+  }
+#endif
+
+  // 8 pixels per store, merging with the previous byte when x isn't byte aligned
+  for(; width >= 8; width -= 8, pixels += 8)
+  {
+    uint8_t bits = gather8(pixels);
+    *dst++ = carry | (bits >> shift);
+    carry = shift ? (uint8_t)(bits << (8 - shift)) : 0;
+  }
+
+  if(width > 0)
+  {
+    uint8_t bits = gather_tail(pixels, width);
+    carry |= bits >> shift;
+    pending = shift + width;
+    if(pending >= 8)
+    {
+      *dst++ = carry;
+      carry = (uint8_t)(bits << (8 - shift));
+      pending -= 8;
+    }
+  }
+
+  // Merge the last partial byte with what's already on the canvas
+  if(pending)
+  {
+    uint8_t mask = 0xFF << (8 - pending);
+    *dst = (*dst & ~mask) | (carry & mask);
+  }
+}
@@ -0,0 +1,197 @@
+#include <string.h>
+
+#include "dither.h"
+
+struct dither_kernel_info
+{
+    const char *name;
+    int lines; // Error lines the kernel needs.
+    void (*row)(struct dither_state *state, const uint8_t *luma, uint8_t *out);
+};
+
+void dither_skip(struct dither_state *state, int rows)
+{
+  state->y += rows;
+  for(int i = 0; i < state->lines; i++)
+  {
+    memset(state->line[i], 0x00, (state->width + 2 * DITHER_LINE_PAD) * sizeof(int16_t));
+  }
+}
+
+static void floyd_steinberg_row(struct dither_state *state, const uint8_t *luma, uint8_t *out);
+static void atkinson_row(struct dither_state *state, const uint8_t *luma, uint8_t *out);
+static void bayer4_row(struct dither_state *state, const uint8_t *luma, uint8_t *out);
+static void bayer8_row(struct dither_state *state, const uint8_t *luma, uint8_t *out);
+static void threshold_row(struct dither_state *state, const uint8_t *luma, uint8_t *out);
+
+static const struct dither_kernel_info kernels[DITHER_KERNEL_COUNT] = {
+  [DITHER_FLOYD_STEINBERG] = { "fs",        2, floyd_steinberg_row },
+  [DITHER_ATKINSON]        = { "atkinson",  3, atkinson_row },
+  [DITHER_BAYER4]          = { "bayer4",    0, bayer4_row },
+  [DITHER_BAYER8]          = { "bayer8",    0, bayer8_row },
+  [DITHER_THRESHOLD]       = { "threshold", 0, threshold_row },
+};
+
+// Bayer index matrices scaled to thresholds in 0..255, (index + 0.5) * 256 / n^2.
+static const uint8_t bayer4[4][4] = {
+  {   8, 136,  40, 168 },
+  { 200,  72, 232, 104 },
+  {  56, 184,  24, 152 },
+  { 248, 120, 216,  88 },
+};
+
+static const uint8_t bayer8[8][8] = {
+  {   2, 130,  34, 162,  10, 138,  42, 170 },
+  { 194,  66, 226,  98, 202,  74, 234, 106 },
+  {  50, 178,  18, 146,  58, 186,  26, 154 },
+  { 242, 114, 210,  82, 250, 122, 218,  90 },
+  {  14, 142,  46, 174,   6, 134,  38, 166 },
+  { 206,  78, 238, 110, 198,  70, 230, 102 },
+  {  62, 190,  30, 158,  54, 182,  22, 150 },
+  { 254, 126, 222,  94, 246, 118, 214,  86 },
+};
+
+int dither_init(struct dither_state *state, int width, enum dither_kernel kernel,
+                struct arena *arena)
+{
+  memset(state, 0, sizeof(*state));
+  if((unsigned)kernel >= DITHER_KERNEL_COUNT)
+  {
+    return 1;
+  }
+  state->width = width;
+  state->kernel = kernel;
+  state->lines = kernels[kernel].lines;
+  for(int i = 0; i < state->lines; i++)
+  {
+    state->line[i] = arena_alloc(arena, (width + 2 * DITHER_LINE_PAD) * sizeof(int16_t));
+    if(state->line[i] == NULL)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+const char *dither_kernel_name(enum dither_kernel kernel)
+{
+  if((unsigned)kernel >= DITHER_KERNEL_COUNT)
+  {
+    return NULL;
+  }
+  return kernels[kernel].name;
+}
+
+int dither_kernel_find(const char *name)
+{
+  for(int i = 0; i < DITHER_KERNEL_COUNT; i++)
+  {
+    if(strcmp(kernels[i].name, name) == 0)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void dither_row(struct dither_state *state, const uint8_t *luma, uint8_t *out)
+{
+  kernels[state->kernel].row(state, luma, out);
+  state->y++;
+
+  if(state->lines)
+  {
+    // Every line moves up a row, the old current row is recycled as the last one.
+    int16_t *temp = state->line[0];
+    for(int i = 1; i < state->lines; i++)
+    {
+      state->line[i - 1] = state->line[i];
+    }
+    state->line[state->lines - 1] = temp;
+    memset(temp, 0x00, (state->width + 2 * DITHER_LINE_PAD) * sizeof(int16_t));
+  }
+}
+
+static void floyd_steinberg_row(struct dither_state *state, const uint8_t *luma, uint8_t *out)
+{
+  // Skip the padding so that [i - 1] and [i + 1] are always valid.
+  int16_t *curr = state->line[0] + DITHER_LINE_PAD;
+  int16_t *next = state->line[1] + DITHER_LINE_PAD;
+  int width = state->width;
+  int carry = curr[0]; // Error pushed right from the previous pixel plus the row above's share.
+
+  for(int i = 0; i < width; i++)
+  {
+    int oldpixel = luma[i] + carry;
+    // Clip to the valid range so the error terms stay within an int16_t
+    if(oldpixel > 255) oldpixel = 255;
+    if(oldpixel < 0) oldpixel = 0;
+
+    int newpixel = oldpixel >> 7;
+    int quant_error = oldpixel - (newpixel ? 255 : 0);
+    out[i] = newpixel;
+
+    carry = curr[i + 1] + ((quant_error * 7) >> 4);
+    next[i - 1] += (quant_error * 3) >> 4;
+    next[i]     += (quant_error * 5) >> 4;
+    next[i + 1] += (quant_error * 1) >> 4;
+  }
+}
+
+/**
+ * Atkinson only spreads 6/8 of the error (1/8 each to two pixels right, three below and one two
+ * rows down), so highlights and shadows clip to solid white/black, which suits line art.
+ **/
+static void atkinson_row(struct dither_state *state, const uint8_t *luma, uint8_t *out)
+{
+  int16_t *curr = state->line[0] + DITHER_LINE_PAD;
+  int16_t *next = state->line[1] + DITHER_LINE_PAD;
+  int16_t *after = state->line[2] + DITHER_LINE_PAD;
+  int width = state->width;
+  int carry = curr[0];     // Error for pixel i
+  int carry_next = curr[1]; // and for pixel i + 1
+
+  for(int i = 0; i < width; i++)
+  {
+    int oldpixel = luma[i] + carry;
+    if(oldpixel > 255) oldpixel = 255;
+    if(oldpixel < 0) oldpixel = 0;
+
+    int newpixel = oldpixel >> 7;
+    int error = (oldpixel - (newpixel ? 255 : 0)) >> 3;
+    out[i] = newpixel;
+
+    carry = carry_next + error;
+    carry_next = curr[i + 2] + error;
+    next[i - 1] += error;
+    next[i]     += error;
+    next[i + 1] += error;
+    after[i]    += error;
+  }
+}
+
+static void bayer4_row(struct dither_state *state, const uint8_t *luma, uint8_t *out)
+{
+  const uint8_t *threshold = bayer4[state->y & 3];
+  for(int i = 0; i < state->width; i++)
+  {
+    out[i] = luma[i] >= threshold[i & 3];
+  }
+}
+
+static void bayer8_row(struct dither_state *state, const uint8_t *luma, uint8_t *out)
+{
+  const uint8_t *threshold = bayer8[state->y & 7];
+  for(int i = 0; i < state->width; i++)
+  {
+    out[i] = luma[i] >= threshold[i & 7];
+  }
+}
+
+static void threshold_row(struct dither_state *state, const uint8_t *luma, uint8_t *out)
+{
+  for(int i = 0; i < state->width; i++)
+  {
+    out[i] = luma[i] >> 7;
+  }
+}
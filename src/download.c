@@ -0,0 +1,520 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "sdkconfig.h"
+#include "esp_log.h"
+
+#include "crc32.h"
+#include "download.h"
+#include "telemetry.h"
+
+#if ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#else
+#include <unistd.h>
+#endif
+
+#define DOWNLOAD_META_MAGIC 0x4D4C4458 // "XDLM"
+// The sidecar is brought up to date every this many bytes written.
+#define DOWNLOAD_CHECKPOINT (16 * 1024)
+#define DOWNLOAD_BUFFER_LEN 1024
+#define DOWNLOAD_PATH_LEN 64
+
+// The sidecar of <path>.part.
+struct download_meta
+{
+  uint32_t magic;
+  uint32_t url_crc;
+  uint32_t length;  // Of the whole file, 0 if unknown.
+  uint32_t written; // Bytes at the start of the part file that are known to be good.
+  uint32_t crc;     // CRC-32 of those.
+  struct http_validators validators;
+  uint32_t meta_crc;
+};
+
+struct download_policy download_policy = {
+  .attempts = CONFIG_XKCD_DOWNLOAD_ATTEMPTS,
+  .backoff_ms = CONFIG_XKCD_DOWNLOAD_BACKOFF_MS,
+  .backoff_max_ms = 8000,
+};
+
+static const char *TAG = "download";
+
+static void backoff_delay(uint32_t ms)
+{
+#if ESP_PLATFORM
+  vTaskDelay(pdMS_TO_TICKS(ms));
+#else
+  usleep(ms * 1000);
+#endif
+}
+
+int download_parse_content_range(const char *value, int64_t *first, int64_t *last,
+                                 int64_t *total)
+{
+  char *end;
+
+  if(strncasecmp(value, "bytes ", 6) != 0)
+  {
+    return 1;
+  }
+  value += 6;
+  if(*value == '*')
+  {
+    // Unsatisfied range, only the total
+    *first = -1;
+    *last = -1;
+    value++;
+  }
+  else
+  {
+    *first = strtoll(value, &end, 10);
+    if(end == value || *end != '-' || *first < 0)
+    {
+      return 1;
+    }
+    value = end + 1;
+    *last = strtoll(value, &end, 10);
+    if(end == value || *last < *first)
+    {
+      return 1;
+    }
+    value = end;
+  }
+  if(*value++ != '/')
+  {
+    return 1;
+  }
+  if(strcmp(value, "*") == 0)
+  {
+    *total = -1;
+    return *first < 0;
+  }
+  *total = strtoll(value, &end, 10);
+  return end == value || *end != '\0' || (*last >= 0 && *last >= *total);
+}
+
+static void on_header(void *ctx, const char *key, const char *value)
+{
+  struct download *download = ctx;
+
+  if(strcasecmp(key, "ETag") == 0)
+  {
+    snprintf(download->response.etag, sizeof(download->response.etag), "%s", value);
+  }
+  else if(strcasecmp(key, "Last-Modified") == 0)
+  {
+    snprintf(download->response.last_modified, sizeof(download->response.last_modified), "%s",
+             value);
+  }
+  else if(strcasecmp(key, "Content-Range") == 0)
+  {
+    int64_t last;
+    if(download_parse_content_range(value, &download->range_start, &last,
+                                    &download->range_total))
+    {
+      ESP_LOGW(TAG, "Ignoring Content-Range: %s", value);
+      download->range_start = -1;
+    }
+  }
+}
+
+// Starts over from the first byte of a (possibly different) file.
+static void restart(struct download *download)
+{
+  download->offset = 0;
+  download->crc = 0;
+  download->length = 0;
+}
+
+enum
+{
+  REQUEST_OK,
+  REQUEST_RETRY,
+  REQUEST_FAIL,
+};
+
+/**
+ * Asks for the body from offset on. A 200 to a Range request means the server sent all of it,
+ * that can only be used if nothing was returned to the caller yet (first).
+ **/
+static int request(struct download *download, int first)
+{
+  struct http_header headers[2];
+  int header_count = 0;
+  char range[32];
+  int status;
+
+  if(download->offset > 0)
+  {
+    snprintf(range, sizeof(range), "bytes=%u-", (unsigned)download->offset);
+    headers[header_count++] = (struct http_header){ "Range", range };
+    // If-Range only takes a strong ETag, otherwise the date has to do
+    const char *etag = download->validators.etag;
+    if(etag[0] && strncmp(etag, "W/", 2) != 0)
+    {
+      headers[header_count++] = (struct http_header){ "If-Range", etag };
+    }
+    else if(download->validators.last_modified[0])
+    {
+      headers[header_count++] = (struct http_header){ "If-Range",
+                                                      download->validators.last_modified };
+    }
+  }
+
+  memset(&download->response, 0, sizeof(download->response));
+  download->range_start = -1;
+  download->range_total = -1;
+  download->attempts++;
+  int64_t start = telemetry_begin(TELEMETRY_CONNECT);
+  int failed = http_session_get(download->session, download->url, headers, header_count,
+                                on_header, download, &status);
+  telemetry_end(TELEMETRY_CONNECT, start, 0);
+  if(failed)
+  {
+    return REQUEST_RETRY;
+  }
+  download->open = 1;
+  int64_t content_length = download->session->parser.content_length;
+
+  if(status == 200)
+  {
+    if(download->offset > 0)
+    {
+      if(!first)
+      {
+        // Changed, or doesn't do ranges, either way what was returned so far is no good
+        ESP_LOGE(TAG, "%s came back whole instead of from byte %u", download->url,
+                 (unsigned)download->offset);
+        return REQUEST_FAIL;
+      }
+      ESP_LOGW(TAG, "%s can't be resumed, starting over", download->url);
+      restart(download);
+    }
+    download->length = content_length > 0 ? content_length : 0;
+    download->validators = download->response;
+    return REQUEST_OK;
+  }
+
+  if(status == 206 && download->offset > 0 && download->range_start == download->offset)
+  {
+    int64_t total = download->range_total;
+    // The validators the body was started with have to still hold
+    if((download->length > 0 && total >= 0 && total != download->length)
+       || (download->response.etag[0] && download->validators.etag[0]
+           && strcmp(download->response.etag, download->validators.etag) != 0))
+    {
+      ESP_LOGE(TAG, "%s changed in the middle of the download", download->url);
+      return REQUEST_FAIL;
+    }
+    if(download->length == 0 && total > 0)
+    {
+      download->length = total;
+    }
+    return REQUEST_OK;
+  }
+
+  if(status == 416 && download->offset > 0 && download->range_total == download->offset)
+  {
+    // Everything was there already
+    download->length = download->offset;
+    return REQUEST_OK;
+  }
+
+  ESP_LOGE(TAG, "Unexpected status %d for %s", status, download->url);
+  return status >= 500 || status == 408 || status == 429 ? REQUEST_RETRY : REQUEST_FAIL;
+}
+
+// Requests until one gives a body to read, backing off between attempts.
+static int request_with_retries(struct download *download, int first)
+{
+  for(;;)
+  {
+    int ret = request(download, first);
+    if(ret == REQUEST_OK)
+    {
+      return 0;
+    }
+    download_close(download);
+    if(ret == REQUEST_FAIL || download->attempts >= download_policy.attempts)
+    {
+      return 1;
+    }
+    ESP_LOGW(TAG, "Retrying %s at byte %u in %u ms", download->url, (unsigned)download->offset,
+             (unsigned)download->backoff_ms);
+    backoff_delay(download->backoff_ms);
+    download->backoff_ms *= 2;
+    if(download->backoff_ms > download_policy.backoff_max_ms)
+    {
+      download->backoff_ms = download_policy.backoff_max_ms;
+    }
+  }
+}
+
+int download_open(struct download *download, struct http_session *session, const char *url,
+                  uint32_t offset, uint32_t crc, const struct http_validators *validators)
+{
+  memset(download, 0, sizeof(*download));
+  download->session = session;
+  download->url = url;
+  download->backoff_ms = download_policy.backoff_ms;
+  if(offset > 0 && validators != NULL)
+  {
+    download->offset = offset;
+    download->crc = crc;
+    download->validators = *validators;
+  }
+  return request_with_retries(download, 1);
+}
+
+int download_read(struct download *download, char *buf, int len)
+{
+  for(;;)
+  {
+    if(download->length > 0 && download->offset >= download->length)
+    {
+      download_close(download);
+      return 0;
+    }
+    if(!download->open && request_with_retries(download, 0))
+    {
+      return -1;
+    }
+
+    int64_t start = telemetry_now();
+    int n = http_session_read(download->session, buf, len);
+    telemetry_add(TELEMETRY_TRANSFER, telemetry_now() - start, n > 0 ? n : 0);
+    if(n > 0)
+    {
+      if(download->length > 0 && download->offset + n > download->length)
+      {
+        ESP_LOGE(TAG, "%s is longer than the %u bytes it said", download->url,
+                 (unsigned)download->length);
+        download_close(download);
+        return -1;
+      }
+      download->offset += n;
+      download->crc = crc32_update(download->crc, buf, n);
+      return n;
+    }
+    download_close(download);
+    if(n == 0 && (download->length == 0 || download->offset == download->length))
+    {
+      return 0;
+    }
+    // Broke off or came up short, ask for the rest
+    ESP_LOGW(TAG, "Transfer of %s stopped at %u of %u bytes", download->url,
+             (unsigned)download->offset, (unsigned)download->length);
+    if(download->attempts >= download_policy.attempts)
+    {
+      return -1;
+    }
+  }
+}
+
+void download_close(struct download *download)
+{
+  if(download->open)
+  {
+    telemetry_sample(TELEMETRY_TRANSFER);
+    http_session_end(download->session);
+    download->open = 0;
+  }
+}
+
+static uint32_t meta_crc(const struct download_meta *meta)
+{
+  return crc32_update(0, meta, offsetof(struct download_meta, meta_crc));
+}
+
+static int meta_load(const char *path, struct download_meta *meta)
+{
+  FILE *f = fopen(path, "r");
+  if(f == NULL)
+  {
+    return 1;
+  }
+  int ok = fread(meta, sizeof(*meta), 1, f) == 1;
+  fclose(f);
+  return !ok || meta->magic != DOWNLOAD_META_MAGIC || meta->meta_crc != meta_crc(meta);
+}
+
+static int meta_save(const char *path, struct download_meta *meta)
+{
+  meta->magic = DOWNLOAD_META_MAGIC;
+  meta->meta_crc = meta_crc(meta);
+  FILE *f = fopen(path, "w");
+  if(f == NULL)
+  {
+    return 1;
+  }
+  int ok = fwrite(meta, sizeof(*meta), 1, f) == 1;
+  return fclose(f) != 0 || !ok;
+}
+
+/**
+ * CRC-32 of the first len bytes of the file, returns 1 if it's shorter than that, or with exact
+ * set, longer.
+ **/
+static int file_crc(const char *path, uint32_t len, int exact, uint32_t *crc)
+{
+  char buf[DOWNLOAD_BUFFER_LEN];
+  FILE *f = fopen(path, "r");
+  if(f == NULL)
+  {
+    return 1;
+  }
+  *crc = 0;
+  while(len > 0)
+  {
+    size_t n = fread(buf, 1, len < sizeof(buf) ? len : sizeof(buf), f);
+    if(n == 0)
+    {
+      break;
+    }
+    *crc = crc32_update(*crc, buf, n);
+    len -= n;
+  }
+  int longer = exact && fgetc(f) != EOF;
+  fclose(f);
+  return len != 0 || longer;
+}
+
+// Moves part over path. SPIFFS won't rename onto an existing file, in between the sidecar still
+// says part is complete, so the next call finishes the job.
+static int replace(const char *part, const char *path)
+{
+  if(rename(part, path) == 0)
+  {
+    return 0;
+  }
+  remove(path);
+  return rename(part, path);
+}
+
+int download_file(struct http_session *session, const char *url, const char *path,
+                  uint32_t *crc)
+{
+  char part[DOWNLOAD_PATH_LEN];
+  char meta_path[DOWNLOAD_PATH_LEN];
+  char buf[DOWNLOAD_BUFFER_LEN];
+  struct download_meta meta;
+  struct download download;
+  uint32_t url_crc = crc32_update(0, url, strlen(url));
+  uint32_t prefix_crc;
+  FILE *f = NULL;
+  int ret = 1;
+
+  snprintf(part, sizeof(part), "%s.part", path);
+  snprintf(meta_path, sizeof(meta_path), "%s.meta", path);
+
+  // Only carry on with a part file that still holds what the sidecar says it does
+  if(meta_load(meta_path, &meta) || meta.url_crc != url_crc
+     || file_crc(part, meta.written, 0, &prefix_crc) || prefix_crc != meta.crc)
+  {
+    memset(&meta, 0, sizeof(meta));
+    meta.url_crc = url_crc;
+  }
+  else if(meta.length > 0 && meta.written == meta.length)
+  {
+    ESP_LOGI(TAG, "%s is already complete", part);
+    goto verify;
+  }
+  else if(meta.written > 0)
+  {
+    ESP_LOGI(TAG, "Resuming %s at %u of %u bytes", url, (unsigned)meta.written,
+             (unsigned)meta.length);
+  }
+
+  if(download_open(&download, session, url, meta.written, meta.crc, &meta.validators))
+  {
+    return 1;
+  }
+  if(download.offset > 0)
+  {
+    f = fopen(part, "r+");
+    if(f != NULL && fseek(f, download.offset, SEEK_SET) != 0)
+    {
+      fclose(f);
+      f = NULL;
+    }
+  }
+  else
+  {
+    f = fopen(part, "w");
+  }
+  if(f == NULL)
+  {
+    ESP_LOGE(TAG, "Failed to open %s for writing", part);
+    download_close(&download);
+    return 1;
+  }
+  meta.written = download.offset;
+  meta.crc = download.crc;
+  meta.length = download.length;
+  meta.validators = download.validators;
+  meta_save(meta_path, &meta);
+
+  int read_len;
+  uint32_t checkpoint = download.offset + DOWNLOAD_CHECKPOINT;
+  while((read_len = download_read(&download, buf, sizeof(buf))) > 0)
+  {
+    if((int)fwrite(buf, 1, read_len, f) != read_len)
+    {
+      ESP_LOGE(TAG, "Failed to write %s", part);
+      break;
+    }
+    meta.written = download.offset;
+    meta.crc = download.crc;
+    // The sidecar never gets ahead of what's on flash
+    if(download.offset >= checkpoint && fflush(f) == 0)
+    {
+      meta_save(meta_path, &meta);
+      checkpoint = download.offset + DOWNLOAD_CHECKPOINT;
+    }
+  }
+  download_close(&download);
+  if(fclose(f) != 0)
+  {
+    // Whatever didn't make it to flash has to come again
+    memset(&meta, 0, sizeof(meta));
+    meta.url_crc = url_crc;
+    read_len = -1;
+  }
+  if(read_len == 0)
+  {
+    meta.length = meta.written;
+  }
+  meta_save(meta_path, &meta);
+  if(read_len != 0)
+  {
+    ESP_LOGW(TAG, "Download of %s stopped at %u of %u bytes, keeping it for later", url,
+             (unsigned)meta.written, (unsigned)meta.length);
+    return 1;
+  }
+
+verify:
+  // What's on flash has to be what came over the wire
+  if(file_crc(part, meta.length, 1, &prefix_crc) || prefix_crc != meta.crc)
+  {
+    ESP_LOGE(TAG, "%s doesn't match what was downloaded, dropping it", part);
+    remove(part);
+    remove(meta_path);
+    return 1;
+  }
+  if(replace(part, path) == 0)
+  {
+    remove(meta_path);
+    *crc = meta.crc;
+    ret = 0;
+  }
+  else
+  {
+    ESP_LOGE(TAG, "Failed to rename %s to %s", part, path);
+  }
+  return ret;
+}
@@ -0,0 +1,574 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "crc32.h"
+#include "frame.h"
+#include "store.h"
+
+#define FRAME_MAGIC 0x42464B58 // "XKFB"
+#define FRAME_VERSION 2
+#define FRAME_PACKED 0x0001
+#define FRAME_DELTA 0x0002
+#define FRAME_PATH_LEN 64
+
+static const char *TAG = "frame";
+
+struct frame_header
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t flags;
+  struct frame_key key;
+  uint16_t stride;
+  uint16_t height;
+  uint32_t crc; // Over the unpacked frame.
+};
+
+size_t frame_pack(const uint8_t *src, size_t len, uint8_t *dst)
+{
+  size_t in = 0;
+  size_t out = 0;
+
+  while(in < len)
+  {
+    // Length of the run starting at in
+    size_t run = 1;
+    while(in + run < len && run < 128 && src[in + run] == src[in])
+    {
+      run++;
+    }
+    if(run >= 2)
+    {
+      dst[out++] = (uint8_t)(257 - run);
+      dst[out++] = src[in];
+      in += run;
+      continue;
+    }
+
+    // Literals up to the next run of at least 3, a run of 2 isn't worth breaking a literal for.
+    size_t start = in;
+    size_t count = 0;
+    while(in < len && count < 128)
+    {
+      if(in + 2 < len && src[in] == src[in + 1] && src[in] == src[in + 2])
+      {
+        break;
+      }
+      in++;
+      count++;
+    }
+    dst[out++] = (uint8_t)(count - 1);
+    memcpy(&dst[out], &src[start], count);
+    out += count;
+  }
+  return out;
+}
+
+int frame_unpack(const uint8_t *src, size_t src_len, uint8_t *dst, size_t len)
+{
+  size_t in = 0;
+  size_t out = 0;
+
+  while(in < src_len)
+  {
+    uint8_t header = src[in++];
+    if(header < 128)
+    {
+      size_t count = header + 1;
+      if(in + count > src_len || out + count > len)
+      {
+        return 1;
+      }
+      memcpy(&dst[out], &src[in], count);
+      in += count;
+      out += count;
+    }
+    else if(header > 128)
+    {
+      size_t count = 257 - header;
+      if(in >= src_len || out + count > len)
+      {
+        return 1;
+      }
+      memset(&dst[out], src[in++], count);
+      out += count;
+    }
+    // 128 is a no-op in PackBits
+  }
+  return out == len ? 0 : 1;
+}
+
+void frame_diff(const uint8_t *frame, int stride, int height, uint32_t *row_hashes,
+                struct frame_diff *diff)
+{
+  diff->changed_rows = 0;
+  diff->first_row = height;
+  diff->last_row = -1;
+  for(int y = 0; y < height; y++)
+  {
+    uint32_t hash = crc32_update(0, &frame[y * stride], stride);
+    if(hash != row_hashes[y])
+    {
+      row_hashes[y] = hash;
+      diff->changed_rows++;
+      if(y < diff->first_row) diff->first_row = y;
+      diff->last_row = y;
+    }
+  }
+}
+
+size_t frame_encode_row(const uint8_t *row, const uint8_t *prev, int stride,
+                        enum frame_encoding encoding, uint8_t *dst)
+{
+  uint8_t delta[FRAME_MAX_STRIDE];
+
+  if(encoding == FRAME_RAW)
+  {
+    memcpy(dst, row, stride);
+    return stride;
+  }
+  if(encoding == FRAME_PACKBITS_DELTA && prev != NULL)
+  {
+    for(int x = 0; x < stride; x++)
+    {
+      delta[x] = row[x] ^ prev[x];
+    }
+    row = delta;
+  }
+  return frame_pack(row, stride, dst);
+}
+
+int frame_decode_row(const uint8_t *src, size_t len, const uint8_t *prev, uint8_t *row,
+                     int stride, enum frame_encoding encoding)
+{
+  if(encoding == FRAME_RAW)
+  {
+    if(len != (size_t)stride)
+    {
+      return 1;
+    }
+    memcpy(row, src, stride);
+    return 0;
+  }
+  if(frame_unpack(src, len, row, stride))
+  {
+    return 1;
+  }
+  if(encoding == FRAME_PACKBITS_DELTA && prev != NULL)
+  {
+    for(int x = 0; x < stride; x++)
+    {
+      row[x] ^= prev[x];
+    }
+  }
+  return 0;
+}
+
+static uint16_t encoding_flags(enum frame_encoding encoding)
+{
+  switch(encoding)
+  {
+    case FRAME_PACKBITS: return FRAME_PACKED;
+    case FRAME_PACKBITS_DELTA: return FRAME_PACKED | FRAME_DELTA;
+    default: return 0;
+  }
+}
+
+static enum frame_encoding flags_encoding(uint16_t flags)
+{
+  if(!(flags & FRAME_PACKED))
+  {
+    return FRAME_RAW;
+  }
+  return flags & FRAME_DELTA ? FRAME_PACKBITS_DELTA : FRAME_PACKBITS;
+}
+
+// Where a frame is written to: a file, or a store record while it's being written.
+struct frame_sink
+{
+  FILE *f;
+  struct store_writer *writer;
+};
+
+// Where a frame is read from: a file, or a store record in the mapped partition.
+struct frame_source
+{
+  FILE *f;
+  const uint8_t *data;
+  size_t len;
+  size_t pos;
+};
+
+static int sink_write(struct frame_sink *sink, const void *buf, size_t len)
+{
+  if(sink->writer != NULL)
+  {
+    return store_append(sink->writer, buf, len);
+  }
+  return fwrite(buf, 1, len, sink->f) != len;
+}
+
+// The next len bytes, read into buf unless they're mapped already. NULL past the end.
+static const uint8_t *source_read(struct frame_source *source, void *buf, size_t len)
+{
+  if(source->f != NULL)
+  {
+    return fread(buf, 1, len, source->f) == len ? buf : NULL;
+  }
+  if(len > source->len - source->pos)
+  {
+    return NULL;
+  }
+  const uint8_t *data = &source->data[source->pos];
+  source->pos += len;
+  return data;
+}
+
+// The next len bytes into buf, returns 0 if there were that many.
+static int source_copy(struct frame_source *source, void *buf, size_t len)
+{
+  const uint8_t *data = source_read(source, buf, len);
+  if(data != NULL && data != buf)
+  {
+    memcpy(buf, data, len);
+  }
+  return data == NULL;
+}
+
+// For the log, the file or the record.
+static const char *location_name(const struct frame_location *location, char *buf)
+{
+  if(location->store == NULL)
+  {
+    return location->path;
+  }
+  snprintf(buf, FRAME_PATH_LEN, "record %u", (unsigned)location->id);
+  return buf;
+}
+
+static int write_rows(struct frame_sink *sink, const uint8_t *frame, int stride, int height,
+                      enum frame_encoding encoding)
+{
+  uint8_t buf[FRAME_PACKED_MAX(FRAME_MAX_STRIDE)];
+
+  if(encoding == FRAME_RAW)
+  {
+    return sink_write(sink, frame, (size_t)stride * height);
+  }
+  for(int y = 0; y < height; y++)
+  {
+    const uint8_t *prev = y > 0 ? &frame[(y - 1) * stride] : NULL;
+    uint16_t len = frame_encode_row(&frame[y * stride], prev, stride, encoding, buf);
+    if(sink_write(sink, &len, sizeof(len)) || sink_write(sink, buf, len))
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int save_record(const struct frame_location *location, const struct frame_header *header,
+                       const uint8_t *frame, enum frame_encoding encoding)
+{
+  struct store_writer writer;
+  struct frame_sink sink = { NULL, &writer };
+
+  if(store_begin(location->store, &writer, location->id,
+                 FRAME_FILE_MAX(header->stride, header->height)))
+  {
+    return 1;
+  }
+  if(sink_write(&sink, header, sizeof(*header))
+     || write_rows(&sink, frame, header->stride, header->height, encoding)
+     || store_commit(&writer))
+  {
+    ESP_LOGE(TAG, "Failed to write frame record %u", (unsigned)location->id);
+    store_abort(&writer);
+    return 1;
+  }
+  ESP_LOGI(TAG, "Saved frame for comic %d, %u bytes", (int)header->key.comic_num,
+           (unsigned)writer.len);
+  return 0;
+}
+
+int frame_save(const struct frame_location *location, const struct frame_key *key,
+               const uint8_t *frame, int stride, int height, enum frame_encoding encoding)
+{
+  struct frame_header header;
+  char tmp[FRAME_PATH_LEN];
+
+  if(stride > FRAME_MAX_STRIDE)
+  {
+    return 1;
+  }
+  memset(&header, 0, sizeof(header));
+  header.magic = FRAME_MAGIC;
+  header.version = FRAME_VERSION;
+  header.flags = encoding_flags(encoding);
+  header.key = *key;
+  header.stride = stride;
+  header.height = height;
+  header.crc = crc32_update(0, frame, (size_t)stride * height);
+  if(location->store != NULL)
+  {
+    return save_record(location, &header, frame, encoding);
+  }
+
+  const char *path = location->path;
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  struct frame_sink sink = { fopen(tmp, "wb"), NULL };
+  if(sink.f == NULL)
+  {
+    ESP_LOGE(TAG, "Failed to open %s for writing", tmp);
+    return 1;
+  }
+  int failed = sink_write(&sink, &header, sizeof(header))
+            || write_rows(&sink, frame, stride, height, encoding);
+  long size = ftell(sink.f);
+  if(fclose(sink.f) != 0 || failed)
+  {
+    ESP_LOGE(TAG, "Failed to write %s", tmp);
+    remove(tmp);
+    return 1;
+  }
+
+  remove(path);
+  if(rename(tmp, path) != 0)
+  {
+    ESP_LOGE(TAG, "Failed to replace %s", path);
+    return 1;
+  }
+  ESP_LOGI(TAG, "Saved frame for comic %d, %ld bytes", (int)key->comic_num, size);
+  return 0;
+}
+
+static int read_rows(struct frame_source *source, uint8_t *frame, int stride, int height,
+                     enum frame_encoding encoding)
+{
+  uint8_t buf[FRAME_PACKED_MAX(FRAME_MAX_STRIDE)];
+
+  if(encoding == FRAME_RAW)
+  {
+    return source_copy(source, frame, (size_t)stride * height);
+  }
+  for(int y = 0; y < height; y++)
+  {
+    const uint8_t *prev = y > 0 ? &frame[(y - 1) * stride] : NULL;
+    uint16_t len;
+    const uint8_t *row;
+    if(source_copy(source, &len, sizeof(len))
+       || len > sizeof(buf)
+       || (row = source_read(source, buf, len)) == NULL
+       || frame_decode_row(row, len, prev, &frame[y * stride], stride, encoding))
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Returns 0 if the frame at name is one of this size for key, any key if that's NULL.
+static int header_check(const struct frame_header *header, const char *name,
+                        const struct frame_key *key, int stride, int height)
+{
+  if(header == NULL
+     || header->magic != FRAME_MAGIC
+     || header->version != FRAME_VERSION
+     || header->stride != stride
+     || header->height != height
+     || header->key.pages < 1
+     || header->key.page < 0
+     || header->key.page >= header->key.pages)
+  {
+    ESP_LOGW(TAG, "Ignoring invalid frame %s", name);
+    return 1;
+  }
+  if(key != NULL
+     && (header->key.comic_num != key->comic_num || header->key.settings != key->settings))
+  {
+    ESP_LOGI(TAG, "Cached frame is for comic %d (settings %08x), not %d (%08x)",
+             (int)header->key.comic_num, (unsigned)header->key.settings,
+             (int)key->comic_num, (unsigned)key->settings);
+    return 1;
+  }
+  return 0;
+}
+
+const uint8_t *frame_map(const struct frame_location *location, struct frame_key *key,
+                         uint8_t *frame, int stride, int height)
+{
+  struct frame_source source;
+  struct frame_header buf;
+  char name[FRAME_PATH_LEN];
+
+  memset(&source, 0, sizeof(source));
+  if(location->store != NULL)
+  {
+    uint32_t len;
+    source.data = store_map(location->store, location->id, &len);
+    source.len = len;
+    if(source.data == NULL)
+    {
+      return NULL;
+    }
+  }
+  else if((source.f = fopen(location->path, "rb")) == NULL)
+  {
+    return NULL;
+  }
+
+  const char *where = location_name(location, name);
+  const struct frame_header *header = (const struct frame_header *)source_read(&source, &buf,
+                                                                               sizeof(buf));
+  const uint8_t *pixels = NULL;
+  if(header_check(header, where, key, stride, height) == 0)
+  {
+    enum frame_encoding encoding = flags_encoding(header->flags);
+    if(encoding == FRAME_RAW && source.f == NULL)
+    {
+      // Straight from flash
+      pixels = source_read(&source, NULL, (size_t)stride * height);
+    }
+    else if(read_rows(&source, frame, stride, height, encoding) == 0)
+    {
+      pixels = frame;
+    }
+    if(pixels == NULL || header->crc != crc32_update(0, pixels, (size_t)stride * height))
+    {
+      ESP_LOGW(TAG, "Cached frame %s is corrupt", where);
+      pixels = NULL;
+    }
+    else
+    {
+      key->page = header->key.page;
+      key->pages = header->key.pages;
+    }
+  }
+  if(source.f != NULL)
+  {
+    fclose(source.f);
+  }
+  return pixels;
+}
+
+int frame_load(const struct frame_location *location, struct frame_key *key,
+               uint8_t *frame, int stride, int height)
+{
+  const uint8_t *pixels = frame_map(location, key, frame, stride, height);
+  if(pixels == NULL)
+  {
+    return 1;
+  }
+  if(pixels != frame)
+  {
+    memcpy(frame, pixels, (size_t)stride * height);
+  }
+  return 0;
+}
+
+void frame_stream_init(struct frame_stream *stream, uint8_t *frame, int stride, int height)
+{
+  memset(stream, 0, sizeof(*stream));
+  stream->frame = frame;
+  stream->stride = stride;
+  stream->height = height;
+  stream->y = -1;
+  stream->need = sizeof(struct frame_header);
+}
+
+// Takes the header, a row length or a row once it's all in buf.
+static int stream_piece(struct frame_stream *stream)
+{
+  int stride = stream->stride;
+
+  if(stream->y < 0)
+  {
+    struct frame_header header;
+    memcpy(&header, stream->buf, sizeof(header));
+    if(stride > FRAME_MAX_STRIDE
+       || header_check(&header, "received", NULL, stride, stream->height))
+    {
+      return 1;
+    }
+    stream->key = header.key;
+    stream->encoding = flags_encoding(header.flags);
+    stream->crc = header.crc;
+    stream->y = 0;
+  }
+  else if(!stream->in_row)
+  {
+    uint16_t len;
+    memcpy(&len, stream->buf, sizeof(len));
+    if(len > sizeof(stream->buf))
+    {
+      return 1;
+    }
+    stream->need = len;
+    stream->in_row = 1;
+    return 0;
+  }
+  else
+  {
+    uint8_t *row = &stream->frame[stream->y * stride];
+    if(frame_decode_row(stream->buf, stream->need, stream->y > 0 ? row - stride : NULL, row,
+                        stride, stream->encoding))
+    {
+      return 1;
+    }
+    stream->y++;
+  }
+  // Raw rows come without a length
+  stream->in_row = stream->encoding == FRAME_RAW;
+  stream->need = stream->in_row ? (size_t)stride : sizeof(uint16_t);
+  return 0;
+}
+
+int frame_stream_feed(struct frame_stream *stream, const void *data, size_t len)
+{
+  const uint8_t *in = data;
+
+  for(;;)
+  {
+    if(stream->y == stream->height)
+    {
+      // Nothing may follow the last row
+      return len > 0;
+    }
+    if(stream->have == stream->need)
+    {
+      if(stream_piece(stream))
+      {
+        return 1;
+      }
+      stream->have = 0;
+      continue;
+    }
+    if(len == 0)
+    {
+      return 0;
+    }
+    size_t n = stream->need - stream->have < len ? stream->need - stream->have : len;
+    memcpy(&stream->buf[stream->have], in, n);
+    stream->have += n;
+    in += n;
+    len -= n;
+  }
+}
+
+int frame_stream_finish(const struct frame_stream *stream)
+{
+  if(stream->y != stream->height)
+  {
+    ESP_LOGW(TAG, "Received frame ends after %d of %d rows", stream->y > 0 ? stream->y : 0,
+             stream->height);
+    return 1;
+  }
+  if(crc32_update(0, stream->frame, (size_t)stream->stride * stream->height) != stream->crc)
+  {
+    ESP_LOGW(TAG, "Received frame is corrupt");
+    return 1;
+  }
+  return 0;
+}
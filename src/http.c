@@ -0,0 +1,826 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_tls.h"
+
+#include "crc32.h"
+#include "http.h"
+#include "telemetry.h"
+
+#if ESP_PLATFORM
+#include "esp_attr.h"
+#include "lwip/sockets.h"
+#include "mbedtls/ssl.h"
+#if CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
+#include "esp_crt_bundle.h"
+#endif
+#else
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define RTC_NOINIT_ATTR
+#endif
+
+#define HTTP_TIMEOUT_MS 10000
+#define HTTP_USER_AGENT "xkcd-display"
+
+#define HTTP_TLS_RESUME (CONFIG_XKCD_TLS_RESUME && CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS)
+
+enum
+{
+  STATE_STATUS,
+  STATE_HEADER,
+  STATE_BODY,       // Content-Length bytes.
+  STATE_BODY_EOF,   // Everything until the connection closes.
+  STATE_CHUNK_SIZE,
+  STATE_CHUNK_DATA,
+  STATE_CHUNK_END,  // CRLF after the chunk data.
+  STATE_TRAILER,
+  STATE_DONE,
+  STATE_ERROR,
+};
+
+static const char *TAG = "http";
+
+void http_parser_init(struct http_parser *parser, int head, http_header_cb on_header, void *ctx)
+{
+  memset(parser, 0, sizeof(*parser));
+  parser->state = STATE_STATUS;
+  parser->head = head;
+  parser->content_length = -1;
+  parser->on_header = on_header;
+  parser->ctx = ctx;
+}
+
+int http_parser_headers_done(const struct http_parser *parser)
+{
+  return parser->state > STATE_HEADER && parser->state != STATE_ERROR;
+}
+
+int http_parser_done(const struct http_parser *parser)
+{
+  return parser->state == STATE_DONE;
+}
+
+// Collects a line, returns 1 once c ended it. The CR before the LF is dropped.
+static int line_push(struct http_parser *parser, char c)
+{
+  if(c == '\n')
+  {
+    if(parser->line_len > 0 && parser->line[parser->line_len - 1] == '\r')
+    {
+      parser->line_len--;
+    }
+    parser->line[parser->line_len] = '\0';
+    parser->line_len = 0;
+    return 1;
+  }
+  if(parser->line_len < HTTP_LINE_LEN - 1)
+  {
+    parser->line[parser->line_len++] = c;
+  }
+  return 0;
+}
+
+static int parse_status(struct http_parser *parser, const char *line)
+{
+  if(strncmp(line, "HTTP/1.", 7) != 0 || (line[7] != '0' && line[7] != '1') || line[8] != ' ')
+  {
+    return 1;
+  }
+  int status = 0;
+  for(int i = 9; i < 12; i++)
+  {
+    if(line[i] < '0' || line[i] > '9')
+    {
+      return 1;
+    }
+    status = status * 10 + line[i] - '0';
+  }
+  parser->status = status;
+  // HTTP/1.1 connections persist unless the server says otherwise, 1.0 ones the other way round
+  parser->keep_alive = line[7] == '1';
+  return 0;
+}
+
+static char *trim(char *s)
+{
+  while(*s == ' ' || *s == '\t')
+  {
+    s++;
+  }
+  size_t len = strlen(s);
+  while(len > 0 && (s[len - 1] == ' ' || s[len - 1] == '\t'))
+  {
+    s[--len] = '\0';
+  }
+  return s;
+}
+
+static int parse_header(struct http_parser *parser, char *line)
+{
+  char *colon = strchr(line, ':');
+  if(colon == NULL)
+  {
+    // Folded continuation lines and other oddities carry nothing we need
+    return 0;
+  }
+  *colon = '\0';
+  char *key = trim(line);
+  char *value = trim(colon + 1);
+
+  if(strcasecmp(key, "Content-Length") == 0)
+  {
+    char *end;
+    long long length = strtoll(value, &end, 10);
+    if(end == value || *end != '\0' || length < 0)
+    {
+      return 1;
+    }
+    parser->content_length = length;
+  }
+  else if(strcasecmp(key, "Transfer-Encoding") == 0)
+  {
+    // chunked has to be the last coding applied
+    size_t len = strlen(value);
+    parser->chunked = len >= 7 && strcasecmp(value + len - 7, "chunked") == 0;
+  }
+  else if(strcasecmp(key, "Connection") == 0)
+  {
+    if(strcasecmp(value, "close") == 0)
+    {
+      parser->keep_alive = 0;
+    }
+    else if(strcasecmp(value, "keep-alive") == 0)
+    {
+      parser->keep_alive = 1;
+    }
+  }
+  if(parser->on_header != NULL)
+  {
+    parser->on_header(parser->ctx, key, value);
+  }
+  return 0;
+}
+
+// The empty line after the headers, works out how the body is delimited.
+static void headers_end(struct http_parser *parser)
+{
+  if(parser->status >= 100 && parser->status < 200)
+  {
+    // Interim response, the real one follows
+    parser->state = STATE_STATUS;
+    parser->content_length = -1;
+    parser->chunked = 0;
+  }
+  else if(parser->head || parser->status == 204 || parser->status == 304)
+  {
+    parser->state = STATE_DONE;
+  }
+  else if(parser->chunked)
+  {
+    parser->content_length = -1;
+    parser->state = STATE_CHUNK_SIZE;
+  }
+  else if(parser->content_length >= 0)
+  {
+    parser->remain = parser->content_length;
+    parser->state = parser->remain > 0 ? STATE_BODY : STATE_DONE;
+  }
+  else
+  {
+    parser->keep_alive = 0;
+    parser->state = STATE_BODY_EOF;
+  }
+}
+
+static int parse_chunk_size(struct http_parser *parser, const char *line)
+{
+  int64_t size = 0;
+  int digits = 0;
+
+  for(; *line != '\0' && *line != ';' && *line != ' ' && *line != '\t'; line++, digits++)
+  {
+    char c = *line;
+    int value = c >= '0' && c <= '9' ? c - '0'
+                : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+    if(value < 0 || digits >= 15)
+    {
+      return 1;
+    }
+    size = size * 16 + value;
+  }
+  if(digits == 0)
+  {
+    return 1;
+  }
+  parser->remain = size;
+  parser->state = size > 0 ? STATE_CHUNK_DATA : STATE_TRAILER;
+  return 0;
+}
+
+// A complete line in one of the line based states.
+static int parse_line(struct http_parser *parser)
+{
+  char *line = parser->line;
+
+  switch(parser->state)
+  {
+    case STATE_STATUS:
+      if(parse_status(parser, line))
+      {
+        return 1;
+      }
+      parser->state = STATE_HEADER;
+      return 0;
+    case STATE_HEADER:
+      if(line[0] == '\0')
+      {
+        headers_end(parser);
+        return 0;
+      }
+      return parse_header(parser, line);
+    case STATE_CHUNK_SIZE:
+      return parse_chunk_size(parser, line);
+    case STATE_CHUNK_END:
+      if(line[0] != '\0')
+      {
+        return 1;
+      }
+      parser->state = STATE_CHUNK_SIZE;
+      return 0;
+    case STATE_TRAILER:
+      if(line[0] == '\0')
+      {
+        parser->state = STATE_DONE;
+      }
+      return 0;
+  }
+  return 1;
+}
+
+int http_parser_feed(struct http_parser *parser, char *buf, int len)
+{
+  int out = 0;
+  int i = 0;
+
+  while(i < len)
+  {
+    switch(parser->state)
+    {
+      case STATE_BODY:
+      case STATE_CHUNK_DATA:
+      {
+        int n = len - i;
+        if(n > parser->remain)
+        {
+          n = parser->remain;
+        }
+        memmove(buf + out, buf + i, n);
+        out += n;
+        i += n;
+        parser->remain -= n;
+        if(parser->remain == 0)
+        {
+          parser->state = parser->state == STATE_BODY ? STATE_DONE : STATE_CHUNK_END;
+        }
+        break;
+      }
+      case STATE_BODY_EOF:
+        memmove(buf + out, buf + i, len - i);
+        out += len - i;
+        i = len;
+        break;
+      case STATE_DONE:
+        ESP_LOGW(TAG, "%d bytes after the end of the response", len - i);
+        parser->keep_alive = 0;
+        return out;
+      case STATE_ERROR:
+        return -1;
+      default:
+        if(line_push(parser, buf[i++]) && parse_line(parser))
+        {
+          parser->state = STATE_ERROR;
+          return -1;
+        }
+        break;
+    }
+  }
+  return out;
+}
+
+int http_parser_eof(struct http_parser *parser)
+{
+  if(parser->state == STATE_BODY_EOF)
+  {
+    parser->state = STATE_DONE;
+  }
+  parser->keep_alive = 0;
+  return parser->state != STATE_DONE;
+}
+
+#if HTTP_TLS_RESUME
+/**
+ * The TLS sessions of the last hosts, serialized, so a connection after deep sleep can resume
+ * instead of going through a full handshake. RTC slow memory is short, a session only fits if
+ * the peer certificate isn't kept in it (MBEDTLS_SSL_KEEP_PEER_CERTIFICATE off).
+ **/
+#define TICKET_MAGIC 0x4B435458 // "XTCK"
+#define TICKET_SLOTS 2
+
+struct ticket_slot
+{
+  char host[HTTP_HOST_LEN];
+  uint16_t port;
+  uint16_t len;  // 0 if the slot is empty.
+  uint8_t data[CONFIG_XKCD_TLS_SESSION_CACHE_SIZE];
+  uint32_t crc;
+};
+
+struct ticket_cache
+{
+  uint32_t magic;
+  uint32_t next;  // Slot the next new host goes in.
+  struct ticket_slot slots[TICKET_SLOTS];
+};
+
+// Survives deep sleep, garbage after a power cycle.
+static RTC_NOINIT_ATTR struct ticket_cache tickets;
+
+static uint32_t ticket_crc(const struct ticket_slot *slot)
+{
+  uint32_t crc = crc32_update(0, slot, offsetof(struct ticket_slot, data));
+  return crc32_update(crc, slot->data, slot->len <= sizeof(slot->data) ? slot->len : 0);
+}
+
+static void ticket_check(void)
+{
+  if(tickets.magic != TICKET_MAGIC || tickets.next >= TICKET_SLOTS)
+  {
+    memset(&tickets, 0, sizeof(tickets));
+    tickets.magic = TICKET_MAGIC;
+    for(int i = 0; i < TICKET_SLOTS; i++)
+    {
+      tickets.slots[i].crc = ticket_crc(&tickets.slots[i]);
+    }
+  }
+}
+
+static struct ticket_slot *ticket_find(const struct http_session *session)
+{
+  ticket_check();
+  for(int i = 0; i < TICKET_SLOTS; i++)
+  {
+    struct ticket_slot *slot = &tickets.slots[i];
+    if(slot->len > 0 && slot->len <= sizeof(slot->data) && slot->port == session->port
+       && strcmp(slot->host, session->host) == 0 && slot->crc == ticket_crc(slot))
+    {
+      return slot;
+    }
+  }
+  return NULL;
+}
+
+static void ticket_forget(const struct http_session *session)
+{
+  struct ticket_slot *slot = ticket_find(session);
+  if(slot != NULL)
+  {
+    slot->len = 0;
+    slot->crc = ticket_crc(slot);
+  }
+}
+
+#if ESP_PLATFORM
+static void session_free(esp_tls_client_session_t *session)
+{
+  if(session != NULL)
+  {
+    mbedtls_ssl_session_free(&session->saved_session);
+    free(session);
+  }
+}
+
+static esp_tls_client_session_t *session_load(const uint8_t *buf, size_t len)
+{
+  esp_tls_client_session_t *session = calloc(1, sizeof(*session));
+  if(session == NULL)
+  {
+    return NULL;
+  }
+  mbedtls_ssl_session_init(&session->saved_session);
+  // Fails for sessions saved by a build with another mbedTLS configuration
+  if(mbedtls_ssl_session_load(&session->saved_session, buf, len) != 0)
+  {
+    session_free(session);
+    return NULL;
+  }
+  return session;
+}
+
+// Returns 0 and sets len, or 1 and sets len to the size it needs.
+static int session_save(esp_tls_client_session_t *session, uint8_t *buf, size_t size,
+                        size_t *len)
+{
+  return mbedtls_ssl_session_save(&session->saved_session, buf, size, len) != 0;
+}
+
+// An abbreviated handshake carries the master secret over, a full one derives a new one.
+static int session_resumed(esp_tls_t *tls, const esp_tls_client_session_t *offered)
+{
+  return offered != NULL && tls->ssl.session != NULL
+         && memcmp(tls->ssl.session->master, offered->saved_session.master,
+                   sizeof(offered->saved_session.master)) == 0;
+}
+#else
+// host/tls_sim.c does the same with OpenSSL
+#define session_free tls_sim_session_free
+#define session_load tls_sim_session_load
+#define session_save tls_sim_session_save
+#define session_resumed tls_sim_session_resumed
+#endif
+
+static esp_tls_client_session_t *ticket_load(const struct http_session *session)
+{
+  struct ticket_slot *slot = ticket_find(session);
+  return slot != NULL ? session_load(slot->data, slot->len) : NULL;
+}
+
+static void ticket_save(const struct http_session *session)
+{
+  esp_tls_client_session_t *saved = esp_tls_get_client_session(session->tls);
+  if(saved == NULL)
+  {
+    return;
+  }
+  struct ticket_slot *slot = ticket_find(session);
+  if(slot == NULL)
+  {
+    slot = &tickets.slots[tickets.next];
+    tickets.next = (tickets.next + 1) % TICKET_SLOTS;
+  }
+  memset(slot, 0, offsetof(struct ticket_slot, data));
+  snprintf(slot->host, sizeof(slot->host), "%s", session->host);
+  slot->port = session->port;
+
+  size_t len = 0;
+  if(session_save(saved, slot->data, sizeof(slot->data), &len))
+  {
+    ESP_LOGW(TAG, "TLS session for %s needs %u bytes, the cache holds %u", session->host,
+             (unsigned)len, (unsigned)sizeof(slot->data));
+    len = 0;
+  }
+  slot->len = len;
+  slot->crc = ticket_crc(slot);
+  session_free(saved);
+}
+#endif
+
+void http_session_init(struct http_session *session)
+{
+  memset(session, 0, sizeof(*session));
+  session->keep_alive = 1;
+  session->resume = HTTP_TLS_RESUME;
+}
+
+// Splits http[s]://host[:port][/path], path points into url.
+static int parse_url(const char *url, char *host, int *port, int *tls, const char **path)
+{
+  if(strncmp(url, "https://", 8) == 0)
+  {
+    *tls = 1;
+    *port = 443;
+    url += 8;
+  }
+  else if(strncmp(url, "http://", 7) == 0)
+  {
+    *tls = 0;
+    *port = 80;
+    url += 7;
+  }
+  else
+  {
+    return 1;
+  }
+
+  size_t len = strcspn(url, ":/");
+  if(len == 0 || len >= HTTP_HOST_LEN)
+  {
+    return 1;
+  }
+  memcpy(host, url, len);
+  host[len] = '\0';
+  url += len;
+  if(*url == ':')
+  {
+    char *end;
+    long value = strtol(url + 1, &end, 10);
+    if(end == url + 1 || value <= 0 || value > 65535 || (*end != '\0' && *end != '/'))
+    {
+      return 1;
+    }
+    *port = value;
+    url = end;
+  }
+  *path = *url == '/' ? url : "/";
+  return 0;
+}
+
+static int session_connect(struct http_session *session)
+{
+  esp_tls_cfg_t cfg = {
+    .timeout_ms = HTTP_TIMEOUT_MS,
+  };
+#if HTTP_TLS_RESUME
+  esp_tls_client_session_t *offered = NULL;
+#endif
+
+  cfg.is_plain_tcp = !session->tls_enabled;
+#if ESP_PLATFORM && CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
+  cfg.crt_bundle_attach = esp_crt_bundle_attach;
+#endif
+#if HTTP_TLS_RESUME
+  if(session->tls_enabled && session->resume)
+  {
+    offered = ticket_load(session);
+    cfg.client_session = offered;
+  }
+#endif
+
+  int64_t start = telemetry_begin(TELEMETRY_HANDSHAKE);
+  session->tls = esp_tls_init();
+  int ret = session->tls == NULL ? -1
+            : esp_tls_conn_new_sync(session->host, strlen(session->host), session->port, &cfg,
+                                    session->tls);
+  int64_t us = telemetry_now() - start;
+  telemetry_end(TELEMETRY_HANDSHAKE, start, 0);
+
+  int resumed = 0;
+  if(ret == 1)
+  {
+#if HTTP_TLS_RESUME
+    resumed = session_resumed(session->tls, offered);
+#endif
+  }
+  else
+  {
+    ESP_LOGE(TAG, "Connection to %s:%d failed", session->host, session->port);
+#if ESP_PLATFORM
+    if(session->tls != NULL)
+    {
+      int mbedtls_err = 0;
+      esp_err_t err = esp_tls_get_and_clear_last_error(session->tls->error_handle, &mbedtls_err,
+                                                       NULL);
+      if(err != 0)
+      {
+        ESP_LOGI(TAG, "Last esp error code: 0x%x", err);
+        ESP_LOGI(TAG, "Last mbedtls failure: 0x%x", mbedtls_err);
+      }
+    }
+#endif
+#if HTTP_TLS_RESUME
+    // Don't keep offering a session the server might be choking on
+    if(offered != NULL)
+    {
+      ticket_forget(session);
+    }
+#endif
+    if(session->tls != NULL)
+    {
+      esp_tls_conn_destroy(session->tls);
+      session->tls = NULL;
+    }
+  }
+#if HTTP_TLS_RESUME
+  session_free(offered);
+#endif
+  if(session->tls == NULL)
+  {
+    return 1;
+  }
+
+  // Requests go out in one write. Nagle would hold one back after the last flight of a resumed
+  // handshake, until the server's delayed ACK for it.
+  int fd;
+  if(esp_tls_get_conn_sockfd(session->tls, &fd) == ESP_OK)
+  {
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  }
+
+  session->handshakes++;
+  session->handshake_us += us;
+  telemetry_count(TELEMETRY_HANDSHAKES);
+  if(resumed)
+  {
+    session->resumed++;
+    telemetry_count(TELEMETRY_RESUMED);
+  }
+  ESP_LOGI(TAG, "Connected to %s:%d in %d ms%s", session->host, session->port,
+           (int)(us / 1000), !session->tls_enabled ? " (no TLS)"
+           : resumed ? ", TLS session resumed" : "");
+  return 0;
+}
+
+static int send_request(struct http_session *session, const char *path,
+                        const struct http_header *headers, int header_count)
+{
+  // The request is written into the head buffer, the response only arrives after it's sent
+  char *buf = session->head;
+  size_t size = sizeof(session->head);
+  int n;
+
+  if(session->port == (session->tls_enabled ? 443 : 80))
+  {
+    n = snprintf(buf, size, "GET %s HTTP/1.1\r\nHost: %s\r\n", path, session->host);
+  }
+  else
+  {
+    n = snprintf(buf, size, "GET %s HTTP/1.1\r\nHost: %s:%d\r\n", path, session->host,
+                 session->port);
+  }
+  n += snprintf(buf + n, n < (int)size ? size - n : 0, "User-Agent: " HTTP_USER_AGENT "\r\n%s",
+                session->keep_alive ? "" : "Connection: close\r\n");
+  for(int i = 0; i < header_count; i++)
+  {
+    n += snprintf(buf + n, n < (int)size ? size - n : 0, "%s: %s\r\n", headers[i].name,
+                  headers[i].value);
+  }
+  n += snprintf(buf + n, n < (int)size ? size - n : 0, "\r\n");
+  if(n >= (int)size)
+  {
+    ESP_LOGE(TAG, "Request for %s is too long", path);
+    return 1;
+  }
+
+  for(int sent = 0; sent < n; )
+  {
+    ssize_t ret = esp_tls_conn_write(session->tls, buf + sent, n - sent);
+    if(ret <= 0)
+    {
+      return 1;
+    }
+    sent += ret;
+  }
+  return 0;
+}
+
+// Reads until the headers are parsed, body bytes that came with them stay in head.
+static int read_head(struct http_session *session, http_header_cb on_header, void *ctx)
+{
+  http_parser_init(&session->parser, 0, on_header, ctx);
+  session->head_pos = 0;
+  session->head_len = 0;
+  while(!http_parser_headers_done(&session->parser))
+  {
+    ssize_t n = esp_tls_conn_read(session->tls, session->head, sizeof(session->head));
+    if(n <= 0)
+    {
+      return 1;
+    }
+    n = http_parser_feed(&session->parser, session->head, n);
+    if(n < 0)
+    {
+      ESP_LOGE(TAG, "Malformed response from %s", session->host);
+      return 1;
+    }
+    session->head_len = n;
+  }
+  return 0;
+}
+
+int http_session_get(struct http_session *session, const char *url,
+                     const struct http_header *headers, int header_count,
+                     http_header_cb on_header, void *ctx, int *status)
+{
+  char host[HTTP_HOST_LEN];
+  const char *path;
+  int port;
+  int tls_enabled;
+
+  if(parse_url(url, host, &port, &tls_enabled, &path))
+  {
+    ESP_LOGE(TAG, "Unsupported URL %s", url);
+    return 1;
+  }
+  if(session->tls != NULL && (strcmp(host, session->host) || port != session->port
+                              || tls_enabled != session->tls_enabled))
+  {
+    http_session_close(session);
+  }
+  if(session->tls == NULL)
+  {
+    snprintf(session->host, sizeof(session->host), "%s", host);
+    session->port = port;
+    session->tls_enabled = tls_enabled;
+  }
+
+  for(int attempt = 0; ; attempt++)
+  {
+    int reused = session->tls != NULL;
+    if(!reused && session_connect(session))
+    {
+      return 1;
+    }
+    if(send_request(session, path, headers, header_count) == 0
+       && read_head(session, on_header, ctx) == 0)
+    {
+      session->requests++;
+      telemetry_count(TELEMETRY_REQUESTS);
+      if(reused)
+      {
+        session->reused++;
+        telemetry_count(TELEMETRY_REUSED);
+      }
+      *status = session->parser.status;
+      return 0;
+    }
+    http_session_close(session);
+    // Servers close idle connections whenever they like, GETs can just be sent again
+    if(!reused || attempt > 0)
+    {
+      ESP_LOGE(TAG, "GET %s failed", url);
+      return 1;
+    }
+    ESP_LOGI(TAG, "Kept connection to %s was closed, reconnecting", session->host);
+  }
+}
+
+int http_session_read(struct http_session *session, char *buf, int len)
+{
+  if(session->head_pos < session->head_len)
+  {
+    int n = session->head_len - session->head_pos;
+    if(n > len)
+    {
+      n = len;
+    }
+    memcpy(buf, session->head + session->head_pos, n);
+    session->head_pos += n;
+    return n;
+  }
+
+  // The body is parsed in place in the caller's buffer
+  while(!http_parser_done(&session->parser))
+  {
+    if(session->tls == NULL)
+    {
+      return -1;
+    }
+    ssize_t n = esp_tls_conn_read(session->tls, buf, len);
+    if(n < 0)
+    {
+      ESP_LOGE(TAG, "Reading from %s failed", session->host);
+      return -1;
+    }
+    if(n == 0)
+    {
+      if(http_parser_eof(&session->parser))
+      {
+        ESP_LOGE(TAG, "%s closed the connection before the end of the response", session->host);
+        return -1;
+      }
+      return 0;
+    }
+    n = http_parser_feed(&session->parser, buf, n);
+    if(n != 0)
+    {
+      return n;
+    }
+  }
+  return 0;
+}
+
+void http_session_end(struct http_session *session)
+{
+  session->head_pos = 0;
+  session->head_len = 0;
+  if(!session->keep_alive || !session->parser.keep_alive || !http_parser_done(&session->parser))
+  {
+    http_session_close(session);
+  }
+}
+
+void http_session_close(struct http_session *session)
+{
+  if(session->tls == NULL)
+  {
+    return;
+  }
+#if HTTP_TLS_RESUME
+  // Taken at the end, TLS 1.3 servers only send tickets after the handshake
+  if(session->tls_enabled && session->resume)
+  {
+    ticket_save(session);
+  }
+#endif
+  esp_tls_conn_destroy(session->tls);
+  session->tls = NULL;
+}
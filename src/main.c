@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <sys/unistd.h>
@@ -12,6 +13,7 @@
 #include "esp_event.h"
 #include "esp_log.h"
 #include "esp_spiffs.h"
+#include "esp_sleep.h"
 #include "nvs_flash.h"
 #include "esp_spi_flash.h"
 #include "EPD_7in5_V2.h"
@@ -20,38 +22,16 @@
 #include "lwip/sys.h"
 
 #include "main.h"
+#include "schedule.h"
+#include "telemetry.h"
 
 SemaphoreHandle_t xSemaphore = NULL;
 static const char *TAG = "main";
 
-void app_main(void)
+int spiffs_mount(void)
 {
-  /* Print chip information */
-  esp_chip_info_t chip_info;
-  esp_chip_info(&chip_info);
-  printf("This is %s chip with %dd CPU cores, Wifi%s%s, ",
-          CONFIG_IDF_TARGET,
-          chip_info.cores,
-          (chip_info.features & CHIP_FEATURE_BT) ? "/BT" : "",
-          (chip_info.features & CHIP_FEATURE_BLE) ? "/BLE" : "");
-
-  printf("silicon revision %d, ", chip_info.revision);
-
-  printf("%zuMB %s flash\n", spi_flash_get_chip_size() / (1024 * 1024),
-          (chip_info.features & CHIP_FEATURE_EMB_FLASH) ? "embedded" : "external");
-
-  printf("Free heap: %u\n", esp_get_free_heap_size());
-
   esp_err_t ret;
 
-  //Initialize NVS
-  ret = nvs_flash_init();
-  if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-    ESP_ERROR_CHECK(nvs_flash_erase());
-    ret = nvs_flash_init();
-  }
-  ESP_ERROR_CHECK(ret);
-
   ESP_LOGI(TAG, "Initializing SPIFFS");
 
   esp_vfs_spiffs_conf_t conf = {
@@ -73,7 +53,7 @@ void app_main(void)
       } else {
           ESP_LOGE(TAG, "Failed to initialize SPIFFS (%s)", esp_err_to_name(ret));
       }
-      return;
+      return 1;
   }
 
   size_t total = 0, used = 0;
@@ -83,6 +63,44 @@ void app_main(void)
   } else {
       ESP_LOGI(TAG, "Partition size: total: %d, used: %d", total, used);
   }
+  return 0;
+}
+
+void deep_sleep(uint32_t seconds)
+{
+  ESP_LOGI(TAG, "Sleeping for %u s", seconds);
+  esp_wifi_stop();
+  esp_sleep_enable_timer_wakeup((uint64_t)seconds * 1000000);
+  esp_deep_sleep_start();
+}
+
+void app_main(void)
+{
+  /* Print chip information */
+  esp_chip_info_t chip_info;
+  esp_chip_info(&chip_info);
+  printf("This is %s chip with %dd CPU cores, Wifi%s%s, ",
+          CONFIG_IDF_TARGET,
+          chip_info.cores,
+          (chip_info.features & CHIP_FEATURE_BT) ? "/BT" : "",
+          (chip_info.features & CHIP_FEATURE_BLE) ? "/BLE" : "");
+
+  printf("silicon revision %d, ", chip_info.revision);
+
+  printf("%zuMB %s flash\n", spi_flash_get_chip_size() / (1024 * 1024),
+          (chip_info.features & CHIP_FEATURE_EMB_FLASH) ? "embedded" : "external");
+
+  printf("Free heap: %u\n", esp_get_free_heap_size());
+
+  esp_err_t ret;
+
+  //Initialize NVS
+  ret = nvs_flash_init();
+  if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+    ESP_ERROR_CHECK(nvs_flash_erase());
+    ret = nvs_flash_init();
+  }
+  ESP_ERROR_CHECK(ret);
 
   //vSemaphoreCreateBinary( xSemaphore );
 
@@ -92,12 +110,34 @@ void app_main(void)
   //  return;
   //}
 
+  uint32_t sleep_s = 0;
+  enum schedule_wake wake = esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER
+                            ? SCHEDULE_WAKE_TIMER : SCHEDULE_WAKE_COLD;
+  enum schedule_action action = schedule_wake(schedule_rtc(), wake, schedule_now(), &sleep_s);
+  if(action == SCHEDULE_SLEEP)
+  {
+    ESP_LOGI(TAG, "Woke up %u s early", sleep_s);
+    deep_sleep(sleep_s);
+  }
+
+  if(action == SCHEDULE_FULL)
+  {
+    // Whatever the ring kept from before this boot, timer wakes only print their own cycle.
+    telemetry_dump(stdout, 0);
+    schedule_history_load(schedule_rtc());
+  }
+  telemetry_cycle_begin();
+
+  // Connects in the background, https_get_task waits for the IP once the panel is up
   ESP_LOGI(TAG, "ESP_WIFI_MODE_STA");
   wifi_init_sta();
 
-  vTaskDelay(5000 / portTICK_PERIOD_MS);
-
-  xTaskCreate(&https_get_task, "https_get_task", 8192, NULL, 5, NULL);
+#if CONFIG_XKCD_PIPELINE
+  // Decode on core 0, render.c puts the dither task on core 1
+  xTaskCreatePinnedToCore(&https_get_task, "https_get_task", 8192, (void *)(intptr_t)action, 5,
+                          NULL, 0);
+#else
+  xTaskCreate(&https_get_task, "https_get_task", 8192, (void *)(intptr_t)action, 5, NULL);
+#endif
   //xTaskCreate(&image_display_task, "image_display_task", 8192, NULL, 5, NULL);
 }
-
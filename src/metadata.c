@@ -0,0 +1,518 @@
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "metadata.h"
+
+// Maximum nesting, one bit of parser->containers per level.
+#define MAX_DEPTH 32
+
+enum {
+  FIELD_IMG,
+  FIELD_SAFE_TITLE,
+  FIELD_ALT,
+  FIELD_NUM,
+  FIELD_COUNT
+};
+
+static const char *const field_keys[FIELD_COUNT] = { "img", "safe_title", "alt", "num" };
+
+enum {
+  P_VALUE,          // Expecting any value
+  P_VALUE_OR_CLOSE, // Just after '['
+  P_KEY_OR_CLOSE,   // Just after '{'
+  P_KEY,            // After ',' inside an object
+  P_COLON,
+  P_NEXT,           // After a value, expecting ',' or the end of the container
+  P_STRING,
+  P_ESCAPE,
+  P_UNICODE,
+  P_LITERAL,
+  P_DONE,
+  P_ERROR
+};
+
+static const char *TAG = "metadata";
+
+// What a string field gets if the arena was already full when it started.
+static char empty_value[1];
+
+void metadata_parser_init(struct metadata_parser *parser, struct xkcd_metadata *metadata)
+{
+  memset(parser, 0, sizeof(*parser));
+  parser->metadata = metadata;
+  parser->state = P_VALUE;
+  parser->field = -1;
+
+  metadata->img = NULL;
+  metadata->safe_title = NULL;
+  metadata->alt = NULL;
+  metadata->num = -1;
+}
+
+static int is_space(char c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static int hex_value(char c)
+{
+  if(c >= '0' && c <= '9') return c - '0';
+  if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Appends one byte of the string being scanned to wherever it is going.
+static void emit_byte(struct metadata_parser *parser, uint8_t c)
+{
+  if(parser->in_key)
+  {
+    // Keys longer than the buffer can't be one of ours, remember that they overflowed.
+    if(parser->key_len < (int)sizeof(parser->key) - 1)
+    {
+      parser->key[parser->key_len++] = c;
+    }
+    else
+    {
+      parser->key_len = sizeof(parser->key);
+    }
+  }
+  else if(parser->string != NULL)
+  {
+    // Always leave room for the terminator
+    if(!parser->truncated && parser->arena_used < METADATA_ARENA_LEN - 1)
+    {
+      parser->metadata->arena[parser->arena_used++] = c;
+    }
+    else
+    {
+      parser->truncated = 1;
+    }
+  }
+}
+
+static void emit_code_point(struct metadata_parser *parser, uint32_t cp)
+{
+  // NUL would end the C string early
+  if(cp == 0) cp = 0xFFFD;
+
+  if(cp < 0x80)
+  {
+    emit_byte(parser, cp);
+  }
+  else if(cp < 0x800)
+  {
+    emit_byte(parser, 0xC0 | (cp >> 6));
+    emit_byte(parser, 0x80 | (cp & 0x3F));
+  }
+  else if(cp < 0x10000)
+  {
+    emit_byte(parser, 0xE0 | (cp >> 12));
+    emit_byte(parser, 0x80 | ((cp >> 6) & 0x3F));
+    emit_byte(parser, 0x80 | (cp & 0x3F));
+  }
+  else
+  {
+    emit_byte(parser, 0xF0 | (cp >> 18));
+    emit_byte(parser, 0x80 | ((cp >> 12) & 0x3F));
+    emit_byte(parser, 0x80 | ((cp >> 6) & 0x3F));
+    emit_byte(parser, 0x80 | (cp & 0x3F));
+  }
+}
+
+// A high surrogate that isn't followed by a low one is replaced rather than dropped.
+static void flush_surrogate(struct metadata_parser *parser)
+{
+  if(parser->high_surrogate)
+  {
+    parser->high_surrogate = 0;
+    emit_code_point(parser, 0xFFFD);
+  }
+}
+
+static void emit_code_unit(struct metadata_parser *parser, uint32_t unit)
+{
+  if(unit >= 0xD800 && unit <= 0xDBFF)
+  {
+    flush_surrogate(parser);
+    parser->high_surrogate = unit;
+  }
+  else if(unit >= 0xDC00 && unit <= 0xDFFF)
+  {
+    if(parser->high_surrogate)
+    {
+      uint32_t cp = 0x10000 + ((parser->high_surrogate - 0xD800) << 10) + (unit - 0xDC00);
+      parser->high_surrogate = 0;
+      emit_code_point(parser, cp);
+    }
+    else
+    {
+      emit_code_point(parser, 0xFFFD);
+    }
+  }
+  else
+  {
+    flush_surrogate(parser);
+    emit_code_point(parser, unit);
+  }
+}
+
+// Drops a multi-byte sequence that was cut short by the end of the arena.
+static void trim_utf8(struct metadata_parser *parser)
+{
+  char *arena = parser->metadata->arena;
+  size_t start = parser->string - arena;
+  size_t i = parser->arena_used;
+
+  while(i > start && (arena[i - 1] & 0xC0) == 0x80) i--;
+  if(i == start)
+  {
+    return;
+  }
+  uint8_t lead = arena[i - 1];
+  size_t len = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+  if(parser->arena_used - (i - 1) < len)
+  {
+    parser->arena_used = i - 1;
+  }
+}
+
+static void value_done(struct metadata_parser *parser)
+{
+  parser->field = -1;
+  parser->state = parser->depth == 0 ? P_DONE : P_NEXT;
+}
+
+static void string_done(struct metadata_parser *parser)
+{
+  struct xkcd_metadata *metadata = parser->metadata;
+
+  flush_surrogate(parser);
+  if(parser->in_key)
+  {
+    parser->key[parser->key_len < (int)sizeof(parser->key) ? parser->key_len : 0] = '\0';
+    parser->in_key = 0;
+    parser->state = P_COLON;
+    return;
+  }
+
+  if(parser->field >= 0 && parser->field != FIELD_NUM)
+  {
+    char *value = parser->string;
+    if(value == NULL)
+    {
+      ESP_LOGW(TAG, "No room left in the metadata arena for '%s'", field_keys[parser->field]);
+      value = empty_value;
+    }
+    else
+    {
+      if(parser->truncated)
+      {
+        ESP_LOGW(TAG, "'%s' doesn't fit in the metadata arena, truncating it",
+                 field_keys[parser->field]);
+        trim_utf8(parser);
+      }
+      metadata->arena[parser->arena_used++] = '\0';
+    }
+    switch(parser->field)
+    {
+      case FIELD_IMG: metadata->img = value; break;
+      case FIELD_SAFE_TITLE: metadata->safe_title = value; break;
+      case FIELD_ALT: metadata->alt = value; break;
+    }
+    parser->found |= 1 << parser->field;
+    parser->string = NULL;
+  }
+  value_done(parser);
+}
+
+static void literal_done(struct metadata_parser *parser)
+{
+  if(parser->field == FIELD_NUM && parser->number_digits > 0)
+  {
+    parser->metadata->num = parser->negative ? -parser->number : parser->number;
+    parser->found |= 1 << FIELD_NUM;
+  }
+  value_done(parser);
+}
+
+static int push(struct metadata_parser *parser, int object)
+{
+  if(parser->depth >= MAX_DEPTH)
+  {
+    return 1;
+  }
+  if(object)
+  {
+    parser->containers |= 1u << parser->depth;
+  }
+  else
+  {
+    parser->containers &= ~(1u << parser->depth);
+  }
+  parser->depth++;
+  parser->field = -1;
+  parser->state = object ? P_KEY_OR_CLOSE : P_VALUE_OR_CLOSE;
+  return 0;
+}
+
+static int in_object(struct metadata_parser *parser)
+{
+  return parser->depth > 0 && (parser->containers >> (parser->depth - 1)) & 1;
+}
+
+static int pop(struct metadata_parser *parser, char c)
+{
+  if(parser->depth == 0 || in_object(parser) != (c == '}'))
+  {
+    return 1;
+  }
+  parser->depth--;
+  value_done(parser);
+  return 0;
+}
+
+static int start_value(struct metadata_parser *parser, char c)
+{
+  switch(c)
+  {
+    case '{':
+      return push(parser, 1);
+    case '[':
+      return push(parser, 0);
+    case '"':
+      parser->in_key = 0;
+      parser->truncated = 0;
+      parser->string = NULL;
+      // A string that filled the arena leaves none for the next one, not even its terminator
+      if(parser->field >= 0 && parser->field != FIELD_NUM
+         && parser->arena_used < METADATA_ARENA_LEN)
+      {
+        parser->string = &parser->metadata->arena[parser->arena_used];
+      }
+      parser->state = P_STRING;
+      return 0;
+    default:
+      if(c == '-' || (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z'))
+      {
+        parser->negative = 0;
+        parser->number = 0;
+        parser->number_digits = 0;
+        parser->state = P_LITERAL;
+        return 0;
+      }
+      return 1;
+  }
+}
+
+// Picks the field a top level key's value goes to, a repeated key keeps its first value.
+static void match_key(struct metadata_parser *parser)
+{
+  parser->field = -1;
+  if(parser->depth != 1 || parser->key_len >= (int)sizeof(parser->key))
+  {
+    return;
+  }
+  for(int i = 0; i < FIELD_COUNT; i++)
+  {
+    if(strcmp(parser->key, field_keys[i]) == 0 && !(parser->found & (1 << i)))
+    {
+      parser->field = i;
+      return;
+    }
+  }
+}
+
+static int literal_char(struct metadata_parser *parser, char c)
+{
+  if(!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+       || c == '-' || c == '+' || c == '.'))
+  {
+    return 0;
+  }
+  if(parser->field == FIELD_NUM && parser->number_digits >= 0)
+  {
+    if(c == '-' && parser->number_digits == 0 && !parser->negative)
+    {
+      parser->negative = 1;
+    }
+    else if(c >= '0' && c <= '9' && parser->number_digits < 9)
+    {
+      parser->number = parser->number * 10 + (c - '0');
+      parser->number_digits++;
+    }
+    else
+    {
+      // Fractions, exponents and absurdly long numbers aren't a comic number
+      parser->number_digits = -1;
+    }
+  }
+  return 1;
+}
+
+int metadata_parser_feed(struct metadata_parser *parser, const char *buf, size_t len)
+{
+  size_t i = 0;
+
+  while(i < len && parser->state != P_ERROR)
+  {
+    char c = buf[i];
+
+    switch(parser->state)
+    {
+      case P_VALUE:
+      case P_VALUE_OR_CLOSE:
+        if(is_space(c)) break;
+        if(parser->state == P_VALUE_OR_CLOSE && c == ']')
+        {
+          if(pop(parser, c)) parser->state = P_ERROR;
+          break;
+        }
+        if(start_value(parser, c))
+        {
+          parser->state = P_ERROR;
+        }
+        else if(parser->state == P_LITERAL)
+        {
+          // The first character is part of the literal
+          continue;
+        }
+        break;
+      case P_KEY_OR_CLOSE:
+      case P_KEY:
+        if(is_space(c)) break;
+        if(parser->state == P_KEY_OR_CLOSE && c == '}')
+        {
+          if(pop(parser, c)) parser->state = P_ERROR;
+        }
+        else if(c == '"')
+        {
+          parser->in_key = 1;
+          parser->key_len = 0;
+          parser->state = P_STRING;
+        }
+        else
+        {
+          parser->state = P_ERROR;
+        }
+        break;
+      case P_COLON:
+        if(is_space(c)) break;
+        if(c == ':')
+        {
+          match_key(parser);
+          parser->state = P_VALUE;
+        }
+        else
+        {
+          parser->state = P_ERROR;
+        }
+        break;
+      case P_NEXT:
+        if(is_space(c)) break;
+        if(c == ',')
+        {
+          parser->state = in_object(parser) ? P_KEY : P_VALUE;
+        }
+        else if(c == '}' || c == ']')
+        {
+          if(pop(parser, c)) parser->state = P_ERROR;
+        }
+        else
+        {
+          parser->state = P_ERROR;
+        }
+        break;
+      case P_STRING:
+        if(c == '"')
+        {
+          string_done(parser);
+        }
+        else if(c == '\\')
+        {
+          parser->state = P_ESCAPE;
+        }
+        else if((uint8_t)c < 0x20)
+        {
+          parser->state = P_ERROR;
+        }
+        else
+        {
+          flush_surrogate(parser);
+          emit_byte(parser, c);
+        }
+        break;
+      case P_ESCAPE:
+        parser->state = P_STRING;
+        if(c == 'u')
+        {
+          parser->hex_digits = 0;
+          parser->code_unit = 0;
+          parser->state = P_UNICODE;
+          break;
+        }
+        flush_surrogate(parser);
+        switch(c)
+        {
+          case '"':
+          case '\\':
+          case '/': emit_byte(parser, c); break;
+          case 'b': emit_byte(parser, '\b'); break;
+          case 'f': emit_byte(parser, '\f'); break;
+          case 'n': emit_byte(parser, '\n'); break;
+          case 'r': emit_byte(parser, '\r'); break;
+          case 't': emit_byte(parser, '\t'); break;
+          default: parser->state = P_ERROR; break;
+        }
+        break;
+      case P_UNICODE:
+      {
+        int digit = hex_value(c);
+        if(digit < 0)
+        {
+          parser->state = P_ERROR;
+          break;
+        }
+        parser->code_unit = (parser->code_unit << 4) | digit;
+        if(++parser->hex_digits == 4)
+        {
+          emit_code_unit(parser, parser->code_unit);
+          parser->state = P_STRING;
+        }
+        break;
+      }
+      case P_LITERAL:
+        if(literal_char(parser, c)) break;
+        literal_done(parser);
+        // The delimiter still has to be handled by the new state
+        continue;
+      case P_DONE:
+        if(!is_space(c)) parser->state = P_ERROR;
+        break;
+    }
+    i++;
+  }
+
+  return parser->state == P_ERROR ? -1 : 0;
+}
+
+int metadata_parser_finish(struct metadata_parser *parser)
+{
+  if(parser->state != P_DONE)
+  {
+    ESP_LOGE(TAG, "Incomplete or malformed JSON");
+    return 1;
+  }
+  if(parser->found != (1 << FIELD_COUNT) - 1)
+  {
+    ESP_LOGE(TAG, "JSON is missing fields (found 0x%x)", (unsigned)parser->found);
+    return 1;
+  }
+  if(parser->metadata->img[0] == '\0')
+  {
+    ESP_LOGE(TAG, "JSON has no image URL");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,244 @@
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "esp_log.h"
+
+#include "pipeline.h"
+
+#if ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+// The decoder runs wherever the refresh task is pinned, the worker takes the other core.
+#define PIPELINE_CORE 1
+#define PIPELINE_STACK 4096
+#define PIPELINE_PRIORITY 5
+
+// Statically allocated, creating one doesn't touch the heap.
+typedef struct
+{
+  SemaphoreHandle_t handle;
+  StaticSemaphore_t buffer;
+} pipeline_sem_t;
+#else
+#include <pthread.h>
+#include <semaphore.h>
+
+typedef sem_t pipeline_sem_t;
+#endif
+
+static const char *TAG = "pipeline";
+
+struct row_pipeline
+{
+  int rows;
+  int row_len;
+  int head;             // Slot the producer holds, only touched by the producer.
+  int tail;             // Next slot to consume, only touched by the worker.
+  pipeline_sem_t free;  // Slots the producer may take.
+  pipeline_sem_t filled;
+  row_consumer_t consume;
+  void *ctx;
+  int *ys;              // Row number in each slot, -1 tells the worker to stop.
+  uint8_t *ring;        // rows slots of row_len bytes.
+};
+
+_Static_assert(sizeof(struct row_pipeline) <= PIPELINE_HEADER_SIZE,
+               "PIPELINE_HEADER_SIZE is too small");
+
+// The one worker, started with the first pipeline and reused by every one after it.
+static struct
+{
+  int started;
+  pipeline_sem_t start; // Given once pipeline is set up.
+  pipeline_sem_t done;  // Given once it consumed the stop marker.
+  struct row_pipeline *pipeline;
+#if ESP_PLATFORM
+  StaticTask_t task;
+  StackType_t stack[PIPELINE_STACK];
+#else
+  pthread_t thread;
+#endif
+} worker;
+
+#if ESP_PLATFORM
+static int pipeline_sem_create(pipeline_sem_t *sem, int max, int initial)
+{
+  sem->handle = xSemaphoreCreateCountingStatic(max, initial, &sem->buffer);
+  return sem->handle == NULL;
+}
+
+static void pipeline_sem_destroy(pipeline_sem_t *sem)
+{
+  if(sem->handle != NULL)
+  {
+    vSemaphoreDelete(sem->handle);
+    sem->handle = NULL;
+  }
+}
+
+static void pipeline_sem_take(pipeline_sem_t *sem)
+{
+  xSemaphoreTake(sem->handle, portMAX_DELAY);
+}
+
+static void pipeline_sem_give(pipeline_sem_t *sem)
+{
+  xSemaphoreGive(sem->handle);
+}
+#else
+static int pipeline_sem_create(pipeline_sem_t *sem, int max, int initial)
+{
+  return sem_init(sem, 0, initial) != 0;
+}
+
+static void pipeline_sem_destroy(pipeline_sem_t *sem)
+{
+  sem_destroy(sem);
+}
+
+static void pipeline_sem_take(pipeline_sem_t *sem)
+{
+  while(sem_wait(sem) != 0)
+  {
+    // Interrupted by a signal, keep waiting
+  }
+}
+
+static void pipeline_sem_give(pipeline_sem_t *sem)
+{
+  sem_post(sem);
+}
+#endif
+
+static void consume_rows(struct row_pipeline *pipeline)
+{
+  while(1)
+  {
+    pipeline_sem_take(&pipeline->filled);
+    int y = pipeline->ys[pipeline->tail];
+    if(y < 0)
+    {
+      return;
+    }
+    pipeline->consume(pipeline->ctx, y, pipeline->ring + (size_t)pipeline->tail * pipeline->row_len);
+    pipeline->tail = (pipeline->tail + 1) % pipeline->rows;
+    pipeline_sem_give(&pipeline->free);
+  }
+}
+
+static void run_worker(void)
+{
+  while(1)
+  {
+    pipeline_sem_take(&worker.start);
+    consume_rows(worker.pipeline);
+    pipeline_sem_give(&worker.done);
+  }
+}
+
+#if ESP_PLATFORM
+static void worker_task(void *arg)
+{
+  run_worker();
+}
+#else
+static void *worker_thread(void *arg)
+{
+  run_worker();
+  return NULL;
+}
+#endif
+
+static int start_worker(void)
+{
+  if(worker.started)
+  {
+    return 0;
+  }
+  if(pipeline_sem_create(&worker.start, 1, 0))
+  {
+    return 1;
+  }
+  if(pipeline_sem_create(&worker.done, 1, 0))
+  {
+    pipeline_sem_destroy(&worker.start);
+    return 1;
+  }
+#if ESP_PLATFORM
+  if(xTaskCreateStaticPinnedToCore(worker_task, "dither", PIPELINE_STACK, NULL, PIPELINE_PRIORITY,
+                                   worker.stack, &worker.task, PIPELINE_CORE) == NULL)
+#else
+  if(pthread_create(&worker.thread, NULL, worker_thread, NULL) != 0)
+#endif
+  {
+    ESP_LOGE(TAG, "Failed to start the worker");
+    pipeline_sem_destroy(&worker.start);
+    pipeline_sem_destroy(&worker.done);
+    return 1;
+  }
+  worker.started = 1;
+  return 0;
+}
+
+struct row_pipeline *row_pipeline_start(int row_len, int rows, row_consumer_t consume, void *ctx,
+                                        struct arena *arena)
+{
+  if(rows < 2 || start_worker())
+  {
+    return NULL;
+  }
+  struct row_pipeline *pipeline = arena_alloc(arena, sizeof(*pipeline));
+  int *ys = arena_alloc(arena, rows * sizeof(int));
+  uint8_t *ring = arena_alloc(arena, (size_t)rows * row_len);
+  if(pipeline == NULL || ys == NULL || ring == NULL)
+  {
+    ESP_LOGE(TAG, "No room for a %d row ring", rows);
+    return NULL;
+  }
+  pipeline->rows = rows;
+  pipeline->row_len = row_len;
+  pipeline->consume = consume;
+  pipeline->ctx = ctx;
+  pipeline->ys = ys;
+  pipeline->ring = ring;
+
+  // The producer starts out holding slot 0.
+  if(pipeline_sem_create(&pipeline->free, rows, rows - 1))
+  {
+    return NULL;
+  }
+  if(pipeline_sem_create(&pipeline->filled, rows, 0))
+  {
+    pipeline_sem_destroy(&pipeline->free);
+    return NULL;
+  }
+  worker.pipeline = pipeline;
+  pipeline_sem_give(&worker.start);
+  return pipeline;
+}
+
+uint8_t *row_pipeline_row(struct row_pipeline *pipeline)
+{
+  return pipeline->ring + (size_t)pipeline->head * pipeline->row_len;
+}
+
+void row_pipeline_push(struct row_pipeline *pipeline, int y)
+{
+  pipeline->ys[pipeline->head] = y;
+  pipeline->head = (pipeline->head + 1) % pipeline->rows;
+  pipeline_sem_give(&pipeline->filled);
+  // Backpressure: wait for the worker to hand a slot back before decoding on.
+  pipeline_sem_take(&pipeline->free);
+}
+
+void row_pipeline_finish(struct row_pipeline *pipeline)
+{
+  // The held slot carries the stop marker, rows queued before it are consumed first.
+  pipeline->ys[pipeline->head] = -1;
+  pipeline_sem_give(&pipeline->filled);
+  pipeline_sem_take(&worker.done);
+  pipeline_sem_destroy(&pipeline->free);
+  pipeline_sem_destroy(&pipeline->filled);
+}
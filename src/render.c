@@ -0,0 +1,927 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "DEV_Config.h"
+#include "EPD_7in5_V2.h"
+#include "fonts.h"
+
+#include "arena.h"
+#include "bitpack.h"
+#include "crc32.h"
+#include "dither.h"
+#include "frame.h"
+#include "pipeline.h"
+#include "scale.h"
+#include "telemetry.h"
+#include "text.h"
+#include "render.h"
+
+#define MAX_BUFFER_LEN 1024
+
+// Bytes per canvas row, one bit per pixel.
+#define CANVAS_STRIDE (EPD_7IN5_V2_WIDTH / 8)
+#define CANVAS_SIZE (CANVAS_STRIDE * EPD_7IN5_V2_HEIGHT)
+#if CONFIG_XKCD_FIT_TO_PANEL
+// Rows kept clear above and below a scaled down comic for the title and alt text.
+#define FIT_TEXT_MARGIN CONFIG_XKCD_FIT_TEXT_MARGIN
+#endif
+#if CONFIG_XKCD_PAGE_TALL_COMICS
+// Rows kept clear above and below each page of a tall comic, and the comic rows on a page.
+#define PAGE_TEXT_MARGIN CONFIG_XKCD_PAGE_TEXT_MARGIN
+#define PAGE_ROWS (EPD_7IN5_V2_HEIGHT - 2 * PAGE_TEXT_MARGIN)
+#endif
+#if CONFIG_XKCD_DITHER_ATKINSON
+#define DEFAULT_DITHER DITHER_ATKINSON
+#elif CONFIG_XKCD_DITHER_BAYER4
+#define DEFAULT_DITHER DITHER_BAYER4
+#elif CONFIG_XKCD_DITHER_BAYER8
+#define DEFAULT_DITHER DITHER_BAYER8
+#elif CONFIG_XKCD_DITHER_THRESHOLD
+#define DEFAULT_DITHER DITHER_THRESHOLD
+#else
+#define DEFAULT_DITHER DITHER_FLOYD_STEINBERG
+#endif
+#if CONFIG_XKCD_FIT_TO_PANEL
+// Oversized comics are scaled down to the panel, so no row is wider than it.
+#define MAX_ROW_WIDTH EPD_7IN5_V2_WIDTH
+#define SCALER_ARENA SCALER_ARENA_SIZE(EPD_7IN5_V2_WIDTH)
+#else
+// Wider comics are refused rather than sizing the arena for the odd one.
+#define MAX_ROW_WIDTH 2048
+#define SCALER_ARENA 0
+#endif
+#if CONFIG_XKCD_PIPELINE
+#define MAX_PIPELINE_ROWS CONFIG_XKCD_PIPELINE_ROWS
+#define PIPELINE_ARENA PIPELINE_ARENA_SIZE(MAX_ROW_WIDTH, MAX_PIPELINE_ROWS)
+#else
+#define MAX_PIPELINE_ROWS 0
+#define PIPELINE_ARENA 0
+#endif
+// Canvas, luma and dithered rows, scaler, dither error lines and the decode -> dither ring.
+#define RENDER_ARENA_SIZE \
+  (ARENA_SIZE(CANVAS_SIZE) + 2 * ARENA_SIZE(MAX_ROW_WIDTH) + SCALER_ARENA \
+   + DITHER_ARENA_SIZE(MAX_ROW_WIDTH) + PIPELINE_ARENA)
+// Partial refreshes leave some ghosting behind, do a full one after this many in a row.
+#define MAX_PARTIAL_REFRESHES 5
+// PNG colour types that are greyscale, with and without alpha.
+#define PNG_COLOR_GREY 0
+#define PNG_COLOR_GREY_ALPHA 4
+
+static const char *TAG = "render";
+
+// What is on the panel: CRC-32 of the whole frame and of each row, each only if known.
+static uint32_t last_checksum = 0;
+static int checksum_valid = 0;
+static uint32_t row_hashes[EPD_7IN5_V2_HEIGHT];
+static int row_hashes_valid = 0;
+static int partial_refreshes = 0;
+static struct render_stats last_stats;
+static enum dither_kernel dither_kernel = DEFAULT_DITHER;
+/**
+ * Every buffer a refresh uses comes out of this arena, which is reset at the start of each one,
+ * and the decoder is created once and reset between images. A long running unit then allocates
+ * the same way every cycle instead of slowly fragmenting the heap.
+ **/
+static uint8_t arena_buffer[RENDER_ARENA_SIZE] __attribute__((aligned(ARENA_ALIGN)));
+static struct arena arena = { arena_buffer, sizeof(arena_buffer), 0, 0 };
+static pngle_t *decoder = NULL;
+#if CONFIG_XKCD_PIPELINE
+static int pipeline_rows = CONFIG_XKCD_PIPELINE_ROWS;
+#else
+static int pipeline_rows = 0;
+#endif
+static int native_formats = 1;
+static int panel_page = 0;
+// Pixels kept clear between the text and the panel edges or the comic.
+#define TEXT_PADDING 8
+#define TITLE_LEN 160
+// Largest first, text_layout settles on the first one that fits the margin.
+static const sFONT *const title_fonts[] = { &Font24, &Font20, &Font16, &Font12, &Font8 };
+static const sFONT *const alt_fonts[] = { &Font16, &Font12, &Font8 };
+// Where flush_screen keeps the rendered frame, the frame cache is off while it's unset.
+static struct frame_location frame_cache;
+static int frame_cache_set = 0;
+static enum frame_encoding frame_cache_encoding = FRAME_RAW;
+
+// Copies the dithered row into the canvas, clipping whatever falls outside of it.
+static void pack_row(struct canvas_metadata *metadata, int y)
+{
+  int canvas_y = metadata->y_offset + y;
+  if(canvas_y < 0 || canvas_y >= metadata->canvas_height)
+  {
+    return;
+  }
+
+  int x_offset = metadata->x_offset;
+  int start = x_offset < 0 ? -x_offset : 0;
+  int end = metadata->draw_width;
+  if(x_offset + end > EPD_7IN5_V2_WIDTH) end = EPD_7IN5_V2_WIDTH - x_offset;
+
+  bitpack_row(&metadata->canvas[canvas_y * CANVAS_STRIDE], x_offset + start,
+              &metadata->pixel_row[start], end - start);
+}
+
+/**
+ * Dithers and packs one row of greyscale, runs on the pipeline worker when there is one. Rows of
+ * bilevel images are in pixel_row already, luma is NULL for those and they're only packed.
+ **/
+static void consume_row(void *ctx, int y, const uint8_t *luma)
+{
+  struct canvas_metadata *metadata = ctx;
+  int64_t start = telemetry_now();
+  if(luma != NULL)
+  {
+    dither_row(&metadata->dither, luma, metadata->pixel_row);
+  }
+  pack_row(metadata, y);
+  telemetry_add(TELEMETRY_DITHER, telemetry_now() - start, metadata->draw_width);
+  if(y == metadata->view_bottom - 1)
+  {
+    telemetry_sample(TELEMETRY_DITHER);
+  }
+}
+
+// Hands a finished row of greyscale on, the decoder only blocks here if the ring is full.
+static void finish_row(struct canvas_metadata *metadata, const uint8_t *luma, int y)
+{
+  if(metadata->pipeline != NULL)
+  {
+    memcpy(row_pipeline_row(metadata->pipeline), luma, metadata->draw_width);
+    row_pipeline_push(metadata->pipeline, y);
+  }
+  else
+  {
+    consume_row(metadata, y, luma);
+  }
+}
+
+// Waits for the worker to catch up, the canvas is complete once this returns.
+static void stop_pipeline(struct canvas_metadata *metadata)
+{
+  if(metadata->pipeline != NULL)
+  {
+    row_pipeline_finish(metadata->pipeline);
+    metadata->pipeline = NULL;
+  }
+}
+
+// Lays out text in the free rows between top and bottom and draws it vertically centred there.
+static void draw_margin_text(struct canvas_metadata *metadata, const char *str,
+                             const sFONT *const *fonts, int font_count, int top, int bottom,
+                             const char *what)
+{
+  struct text_layout layout;
+
+  if(text_layout(&layout, str, fonts, font_count, EPD_7IN5_V2_WIDTH - 2 * TEXT_PADDING,
+                 bottom - top - 2 * TEXT_PADDING))
+  {
+    ESP_LOGW(TAG, "The %s doesn't fit in %d rows, cut it short", what, bottom - top);
+  }
+  text_draw(metadata->canvas, CANVAS_STRIDE, metadata->canvas_height, &layout,
+            top + (bottom - top - text_height(&layout)) / 2);
+}
+
+/**
+ * The title and comic number go above the comic, the alt text below it. Every page of a tall
+ * comic gets the title and the page number, only the last one the alt text.
+ **/
+static void draw_text(struct canvas_metadata *metadata)
+{
+  char title[TITLE_LEN];
+  int top = metadata->y_offset + metadata->view_top;
+  int bottom = metadata->y_offset + metadata->view_bottom;
+
+  if(metadata->pages > 1)
+  {
+    snprintf(title, sizeof(title), "#%d: %s (%d/%d)", metadata->comic_num,
+             metadata->title ? metadata->title : "", metadata->page + 1, metadata->pages);
+  }
+  else
+  {
+    snprintf(title, sizeof(title), "#%d: %s", metadata->comic_num,
+             metadata->title ? metadata->title : "");
+  }
+  draw_margin_text(metadata, title, title_fonts, sizeof(title_fonts) / sizeof(title_fonts[0]),
+                   0, top, "title");
+  if(metadata->alt_text && metadata->page == metadata->pages - 1)
+  {
+    draw_margin_text(metadata, metadata->alt_text, alt_fonts,
+                     sizeof(alt_fonts) / sizeof(alt_fonts[0]), bottom, metadata->canvas_height,
+                     "alt text");
+  }
+}
+
+static void flush_screen(pngle_t *pngle);
+
+static void ignore_pixel(pngle_t *pngle, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                         uint8_t rgba[4])
+{
+}
+
+/**
+ * Called once the last row in view is handed on: the canvas is finished and sent on its way
+ * right away, and whatever pngle decodes after that is ignored. render_feed() stops feeding it.
+ **/
+static void finish_view(pngle_t *pngle)
+{
+  struct canvas_metadata *metadata = pngle_get_user_data(pngle);
+
+  metadata->finished = 1;
+  pngle_set_draw_callback(pngle, ignore_pixel);
+  pngle_set_done_callback(pngle, NULL);
+  flush_screen(pngle);
+}
+
+/**
+ * Collects the greyscale of pixel x of row y, a full row goes on to be dithered. Rows above the
+ * viewport are dropped as they come, dither_skip() already accounted for them.
+ **/
+static void draw_luma(pngle_t *pngle, struct canvas_metadata *metadata, uint32_t x, uint32_t y,
+                      uint8_t luma)
+{
+  int row = y;
+
+  if(metadata->scaled)
+  {
+    scaler_pixel(&metadata->scaler, luma);
+    if(x != (metadata->image_width-1) || (row = scaler_row(&metadata->scaler)) < 0)
+    {
+      return;
+    }
+    if(row >= metadata->view_top)
+    {
+      finish_row(metadata, metadata->scaler.out, row);
+    }
+  }
+  else if(row >= metadata->view_top)
+  {
+    metadata->luma_row[x] = luma;
+    if(x != (metadata->image_width-1))
+    {
+      return;
+    }
+    finish_row(metadata, metadata->luma_row, row);
+  }
+  if(row == metadata->view_bottom - 1)
+  {
+    finish_view(pngle);
+  }
+}
+
+/**
+ * pngle hands us one RGBA pixel at a time, collect a full row of greyscale and then dither and
+ * pack the whole row in one go (on the other core with CONFIG_XKCD_PIPELINE).
+ **/
+static void on_draw(pngle_t *pngle, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                    uint8_t rgba[4])
+{
+  struct canvas_metadata *metadata = pngle_get_user_data(pngle);
+
+  if(metadata->canvas == NULL)
+  {
+    return;
+  }
+  // Note: transparency is ignored, it's only counted so we can warn about it once.
+  if(rgba[3] < 255)
+  {
+    metadata->transparent_pixels++;
+  }
+  draw_luma(pngle, metadata, x, y, dither_luma(rgba));
+}
+
+// on_draw for greyscale PNGs, pngle copies the grey level into all three channels.
+static void on_draw_grey(pngle_t *pngle, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                         uint8_t rgba[4])
+{
+  struct canvas_metadata *metadata = pngle_get_user_data(pngle);
+
+  if(rgba[3] < 255)
+  {
+    metadata->transparent_pixels++;
+  }
+  draw_luma(pngle, metadata, x, y, rgba[0]);
+}
+
+/**
+ * on_draw for 1 bit greyscale PNGs drawn at their own size. Their pixels are black or white
+ * already, which every kernel leaves as it is, so they go straight into the dithered row and
+ * each row is packed into the canvas as soon as it's complete.
+ **/
+static void on_draw_bilevel(pngle_t *pngle, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                            uint8_t rgba[4])
+{
+  struct canvas_metadata *metadata = pngle_get_user_data(pngle);
+
+  if(rgba[3] < 255)
+  {
+    metadata->transparent_pixels++;
+  }
+  if((int)y < metadata->view_top)
+  {
+    return;
+  }
+  metadata->pixel_row[x] = rgba[0] != 0;
+
+  if(x == (metadata->image_width-1))
+  {
+    consume_row(metadata, y, NULL);
+    if((int)y == metadata->view_bottom - 1)
+    {
+      finish_view(pngle);
+    }
+  }
+}
+
+static void init_screen(pngle_t *pngle, uint32_t w, uint32_t h)
+{
+  struct canvas_metadata *metadata = pngle_get_user_data(pngle);
+  const pngle_ihdr_t *ihdr = pngle_get_ihdr(pngle);
+  int x_offset;
+  int y_offset;
+  ESP_LOGI(TAG, "image:   w=%d h=%d", w, h);
+  ESP_LOGI(TAG, "display: w=%d h=%d", EPD_7IN5_V2_WIDTH, EPD_7IN5_V2_HEIGHT);
+
+  // Initialize the display
+  metadata->image_width   = w;
+  metadata->image_height  = h;
+  metadata->canvas_width  = CANVAS_STRIDE;
+  metadata->canvas_height = EPD_7IN5_V2_HEIGHT;
+  metadata->draw_width    = w;
+  metadata->draw_height   = h;
+
+#if CONFIG_XKCD_PAGE_TALL_COMICS
+  /**
+   * Comics get pages once they're half as tall again as a page at the panel width, shrinking a
+   * shorter one to fit keeps it readable. Without fit to panel, once they'd be cropped.
+   **/
+#if CONFIG_XKCD_FIT_TO_PANEL
+  uint64_t width_fit_height = (int)w > EPD_7IN5_V2_WIDTH
+                              ? ((uint64_t)h * EPD_7IN5_V2_WIDTH + w / 2) / w : h;
+  int paged = width_fit_height > PAGE_ROWS * 3 / 2;
+#else
+  int paged = (int)h > EPD_7IN5_V2_HEIGHT;
+#endif
+#endif
+
+#if CONFIG_XKCD_FIT_TO_PANEL
+  // Shrink oversized comics to fit, keeping the aspect ratio. Only the scaled rows get dithered.
+  int fit_width = EPD_7IN5_V2_WIDTH;
+  int fit_height = EPD_7IN5_V2_HEIGHT - 2 * FIT_TEXT_MARGIN;
+#if CONFIG_XKCD_PAGE_TALL_COMICS
+  // Paged comics only have to fit the width
+  if(paged)
+  {
+    fit_height = h;
+  }
+#endif
+  if((int)w > fit_width || (int)h > fit_height)
+  {
+    if((uint64_t)w * fit_height > (uint64_t)h * fit_width)
+    {
+      metadata->draw_width = fit_width;
+      metadata->draw_height = ((uint64_t)h * fit_width + w / 2) / w;
+    }
+    else
+    {
+      metadata->draw_width = ((uint64_t)w * fit_height + h / 2) / h;
+      metadata->draw_height = fit_height;
+    }
+    if(metadata->draw_width < 1) metadata->draw_width = 1;
+    if(metadata->draw_height < 1) metadata->draw_height = 1;
+    metadata->scaled = 1;
+    ESP_LOGI(TAG, "scaled:  w=%d h=%d", metadata->draw_width, metadata->draw_height);
+  }
+#endif
+
+  x_offset = (EPD_7IN5_V2_WIDTH - metadata->draw_width) / 2;
+  y_offset = (metadata->canvas_height - metadata->draw_height) / 2;
+  metadata->page = 0;
+  metadata->pages = 1;
+#if CONFIG_XKCD_PAGE_TALL_COMICS
+  // Archived frames always show the first page
+  if(paged)
+  {
+    metadata->pages = (metadata->draw_height + PAGE_ROWS - 1) / PAGE_ROWS;
+    metadata->page = metadata->frame_location == NULL ? panel_page % metadata->pages : 0;
+    y_offset = PAGE_TEXT_MARGIN - metadata->page * PAGE_ROWS;
+    ESP_LOGI(TAG, "page %d of %d", metadata->page + 1, metadata->pages);
+  }
+#endif
+  metadata->x_offset = x_offset;
+  metadata->y_offset = y_offset;
+
+  /**
+   * Only the draw rows in the viewport end up on the canvas: the ones above it are dropped as
+   * they're decoded, and decoding stops after the last one. Columns that don't fit are clipped
+   * in pack_row.
+   **/
+  metadata->view_top = y_offset < 0 ? -y_offset : 0;
+  metadata->view_bottom = metadata->canvas_height - y_offset;
+#if CONFIG_XKCD_PAGE_TALL_COMICS
+  if(metadata->pages > 1)
+  {
+    metadata->view_top = metadata->page * PAGE_ROWS;
+    metadata->view_bottom = metadata->view_top + PAGE_ROWS;
+  }
+#endif
+  if(metadata->view_bottom > metadata->draw_height)
+  {
+    metadata->view_bottom = metadata->draw_height;
+  }
+  if(x_offset < 0 || metadata->view_top > 0 || metadata->view_bottom < metadata->draw_height)
+  {
+    ESP_LOGI(TAG, "Image doesn't fit within the bounds of the canvas, showing rows %d-%d",
+             metadata->view_top, metadata->view_bottom - 1);
+  }
+
+  /**
+   * xkcd comics are nearly all greyscale, pngle still expands them to RGBA. Their luma is any of
+   * the channels, and 1 bit ones need no dithering either.
+   **/
+  int grey = native_formats
+             && (ihdr->color_type == PNG_COLOR_GREY || ihdr->color_type == PNG_COLOR_GREY_ALPHA);
+  int bilevel = grey && ihdr->depth == 1 && !metadata->scaled;
+
+  metadata->canvas = arena_alloc(&arena, CANVAS_SIZE);
+  if(metadata->scaled)
+  {
+    metadata->luma_row = NULL;
+  }
+  else
+  {
+    metadata->luma_row = arena_alloc(&arena, metadata->image_width);
+  }
+  metadata->pixel_row = arena_alloc(&arena, metadata->draw_width);
+  if(metadata->canvas == NULL || metadata->pixel_row == NULL
+     || (metadata->scaled
+         ? scaler_init(&metadata->scaler, w, h, metadata->draw_width, metadata->draw_height,
+                       &arena)
+         : metadata->luma_row == NULL)
+     || dither_init(&metadata->dither, metadata->draw_width, dither_kernel, &arena))
+  {
+    ESP_LOGE(TAG, "A %dx%d image doesn't fit the %u byte render arena", w, h,
+             (unsigned)arena.size);
+    metadata->canvas = NULL;
+    return;
+  }
+  dither_skip(&metadata->dither, metadata->view_top);
+  if(pipeline_rows > 0 && !bilevel)
+  {
+    metadata->pipeline = row_pipeline_start(metadata->draw_width, pipeline_rows, consume_row,
+                                            metadata, &arena);
+    if(metadata->pipeline == NULL)
+    {
+      ESP_LOGW(TAG, "Dithering on the decode task instead");
+    }
+  }
+  pngle_set_draw_callback(pngle, bilevel ? on_draw_bilevel : grey ? on_draw_grey : on_draw);
+  memset(metadata->canvas, 0xFF, CANVAS_SIZE);
+
+  int64_t start = telemetry_begin(TELEMETRY_TEXT);
+  draw_text(metadata);
+  telemetry_end(TELEMETRY_TEXT, start, 0);
+}
+
+static const char *refresh_name(enum render_refresh refresh)
+{
+  return refresh == RENDER_REFRESH_PARTIAL ? "partial" : "full";
+}
+
+/**
+ * Sends the canvas to the panel, unless it's already showing exactly that. The whole frame hash
+ * is checked first, then the row hashes give the window of rows that changed, which is all a
+ * partial refresh has to push. The canvas may be a frame mapped from flash, the driver only
+ * reads it.
+ **/
+static void present_frame(const unsigned char *canvas)
+{
+  struct render_stats *stats = &last_stats;
+  uint32_t checksum = crc32_update(0, canvas, CANVAS_SIZE);
+  int had_rows = row_hashes_valid;
+
+  if(checksum_valid && checksum == last_checksum && had_rows)
+  {
+    stats->diff.changed_rows = 0;
+    stats->diff.first_row = EPD_7IN5_V2_HEIGHT;
+    stats->diff.last_row = -1;
+  }
+  else
+  {
+    frame_diff(canvas, CANVAS_STRIDE, EPD_7IN5_V2_HEIGHT, row_hashes, &stats->diff);
+    row_hashes_valid = 1;
+  }
+
+  if(checksum_valid && checksum == last_checksum)
+  {
+    // The panel keeps its image without power, there is nothing to do.
+    stats->refresh = RENDER_REFRESH_NONE;
+  }
+  else if(!had_rows)
+  {
+    // Nothing to diff against, every row counts as changed.
+    stats->refresh = RENDER_REFRESH_FULL;
+    stats->diff.changed_rows = EPD_7IN5_V2_HEIGHT;
+    stats->diff.first_row = 0;
+    stats->diff.last_row = EPD_7IN5_V2_HEIGHT - 1;
+  }
+#if CONFIG_XKCD_EPD_PARTIAL_REFRESH
+  else if(partial_refreshes < MAX_PARTIAL_REFRESHES
+          && stats->diff.last_row - stats->diff.first_row + 1 < EPD_7IN5_V2_HEIGHT)
+  {
+    stats->refresh = RENDER_REFRESH_PARTIAL;
+  }
+#endif
+  else
+  {
+    stats->refresh = RENDER_REFRESH_FULL;
+  }
+
+  if(stats->refresh == RENDER_REFRESH_NONE)
+  {
+    ESP_LOGI(TAG, "Frame diff: panel already shows this frame, no refresh");
+  }
+  else
+  {
+    ESP_LOGI(TAG, "Frame diff: %d/%d rows changed (rows %d-%d), %s refresh",
+             stats->diff.changed_rows, EPD_7IN5_V2_HEIGHT, stats->diff.first_row,
+             stats->diff.last_row, refresh_name(stats->refresh));
+  }
+
+  int64_t start = telemetry_begin(TELEMETRY_DISPLAY);
+  size_t sent = 0;
+  switch(stats->refresh)
+  {
+    case RENDER_REFRESH_NONE:
+      break;
+#if CONFIG_XKCD_EPD_PARTIAL_REFRESH
+    case RENDER_REFRESH_PARTIAL:
+      // The driver takes the window as its own packed image, full width rows are contiguous.
+      EPD_7IN5_V2_Init_Part();
+      EPD_7IN5_V2_Display_Part((UBYTE *)&canvas[stats->diff.first_row * CANVAS_STRIDE],
+                               0, stats->diff.first_row,
+                               EPD_7IN5_V2_WIDTH, stats->diff.last_row + 1);
+      sent = (stats->diff.last_row - stats->diff.first_row + 1) * CANVAS_STRIDE;
+      partial_refreshes++;
+      break;
+#endif
+    default:
+      if(partial_refreshes)
+      {
+        // Back to the full refresh waveform
+        EPD_7IN5_V2_Init();
+      }
+      EPD_7IN5_V2_Display((UBYTE *)canvas);
+      sent = CANVAS_SIZE;
+      partial_refreshes = 0;
+      break;
+  }
+  telemetry_end(TELEMETRY_DISPLAY, start, sent);
+  last_checksum = checksum;
+  checksum_valid = 1;
+}
+
+static void flush_screen(pngle_t *pngle)
+{
+  struct canvas_metadata *metadata = pngle_get_user_data(pngle);
+  if(metadata->canvas == NULL)
+  {
+    return;
+  }
+  stop_pipeline(metadata);
+  if(metadata->transparent_pixels)
+  {
+    ESP_LOGI(TAG, "Image has %u pixels with transparency that was ignored!",
+             (unsigned)metadata->transparent_pixels);
+  }
+  struct frame_key key = { metadata->comic_num, render_settings(), metadata->page,
+                           metadata->pages };
+  if(metadata->frame_location != NULL)
+  {
+    // Offscreen, the frame only goes to flash
+    metadata->displayed = frame_save(metadata->frame_location, &key, metadata->canvas,
+                                     CANVAS_STRIDE, EPD_7IN5_V2_HEIGHT,
+                                     metadata->frame_encoding) == 0;
+    return;
+  }
+  present_frame(metadata->canvas);
+  metadata->displayed = 1;
+  last_stats.page = metadata->page;
+  last_stats.pages = metadata->pages;
+
+  if(frame_cache_set)
+  {
+    frame_save(&frame_cache, &key, metadata->canvas, CANVAS_STRIDE, EPD_7IN5_V2_HEIGHT,
+               frame_cache_encoding);
+  }
+}
+
+uint32_t render_last_checksum(void)
+{
+  return last_checksum;
+}
+
+void render_set_panel_checksum(uint32_t checksum)
+{
+  last_checksum = checksum;
+  checksum_valid = 1;
+}
+
+const struct render_stats *render_last_stats(void)
+{
+  return &last_stats;
+}
+
+uint32_t render_settings(void)
+{
+  uint32_t settings = RENDER_SETTINGS_VERSION | (uint32_t)dither_kernel << 24;
+#if CONFIG_XKCD_FIT_TO_PANEL
+  settings |= 1u << 8 | (uint32_t)FIT_TEXT_MARGIN << 16;
+#endif
+#if CONFIG_XKCD_PAGE_TALL_COMICS
+  // The page is left out, it's kept with the frame (see frame_key)
+  settings |= (uint32_t)PAGE_TEXT_MARGIN << 9;
+#endif
+  return settings;
+}
+
+void render_set_dither(enum dither_kernel kernel)
+{
+  if((unsigned)kernel < DITHER_KERNEL_COUNT)
+  {
+    dither_kernel = kernel;
+  }
+}
+
+void render_set_pipeline(int rows)
+{
+  // The arena only has room for the configured ring.
+  pipeline_rows = rows < MAX_PIPELINE_ROWS ? rows : MAX_PIPELINE_ROWS;
+}
+
+void render_set_native_formats(int enable)
+{
+  native_formats = enable;
+}
+
+void render_set_page(int page)
+{
+  panel_page = page > 0 ? page : 0;
+}
+
+void render_set_frame_cache(const struct frame_location *location, enum frame_encoding encoding)
+{
+  frame_cache_set = location != NULL;
+  if(frame_cache_set)
+  {
+    frame_cache = *location;
+  }
+  frame_cache_encoding = encoding;
+}
+
+int render_cached(int num)
+{
+  if(!frame_cache_set)
+  {
+    return 1;
+  }
+  return render_frame(&frame_cache, num);
+}
+
+// The stored frame of comic num at location, NULL if there is none. key gets its page.
+static const uint8_t *map_frame(const struct frame_location *location, int num,
+                                struct frame_key *key)
+{
+  key->comic_num = num;
+  key->settings = render_settings();
+
+  arena_reset(&arena);
+  unsigned char *canvas = arena_alloc(&arena, CANVAS_SIZE);
+  if(canvas == NULL)
+  {
+    ESP_LOGE(TAG, "Failed to allocate the canvas for the cached frame");
+    return NULL;
+  }
+  // Raw frames in the store come straight from flash, the canvas is only for decoding
+  const uint8_t *frame = frame_map(location, key, canvas, CANVAS_STRIDE, EPD_7IN5_V2_HEIGHT);
+  if(frame != NULL)
+  {
+    ESP_LOGI(TAG, "Stored frame of comic %d is page %d of %d%s", num, key->page + 1, key->pages,
+             frame != canvas ? ", mapped in place" : "");
+  }
+  return frame;
+}
+
+// Puts a stored or received frame on the panel, the stats tell its page like a decoded one.
+static void present_stored(const uint8_t *frame, const struct frame_key *key)
+{
+  present_frame(frame);
+  last_stats.page = key->page;
+  last_stats.pages = key->pages;
+}
+
+int render_frame(const struct frame_location *location, int num)
+{
+  struct frame_key key;
+  const uint8_t *frame = map_frame(location, num, &key);
+
+  if(frame == NULL)
+  {
+    return 1;
+  }
+  present_stored(frame, &key);
+  return 0;
+}
+
+int render_stream_begin(struct frame_stream *stream)
+{
+  arena_reset(&arena);
+  unsigned char *canvas = arena_alloc(&arena, CANVAS_SIZE);
+  if(canvas == NULL)
+  {
+    ESP_LOGE(TAG, "Failed to allocate the canvas for the received frame");
+    return 1;
+  }
+  frame_stream_init(stream, canvas, CANVAS_STRIDE, EPD_7IN5_V2_HEIGHT);
+  return 0;
+}
+
+int render_stream_feed(struct frame_stream *stream, const void *buf, size_t len)
+{
+  int64_t start = telemetry_begin(TELEMETRY_DECODE);
+  int failed = frame_stream_feed(stream, buf, len);
+  telemetry_end(TELEMETRY_DECODE, start, len);
+  return failed;
+}
+
+int render_stream_end(struct frame_stream *stream)
+{
+  if(frame_stream_finish(stream))
+  {
+    return 1;
+  }
+  ESP_LOGI(TAG, "Displaying the received frame of comic %d", (int)stream->key.comic_num);
+  present_stored(stream->frame, &stream->key);
+  if(frame_cache_set)
+  {
+    struct frame_key key = stream->key;
+    key.settings = render_settings();
+    frame_save(&frame_cache, &key, stream->frame, CANVAS_STRIDE, EPD_7IN5_V2_HEIGHT,
+               frame_cache_encoding);
+  }
+  return 0;
+}
+
+int render_begin(struct render_session *session, char *title, char *alt, int num)
+{
+  struct canvas_metadata *metadata = &session->metadata;
+
+  memset(metadata, 0, sizeof(*metadata));
+  metadata->title     = title;
+  metadata->alt_text  = alt;
+  metadata->comic_num = num;
+
+  arena_reset(&arena);
+  if(decoder == NULL)
+  {
+    decoder = pngle_new();
+    if(decoder == NULL)
+    {
+      ESP_LOGE(TAG, "Failed to allocate the PNG decoder");
+      return 1;
+    }
+  }
+  else
+  {
+    pngle_reset(decoder);
+  }
+  session->pngle = decoder;
+  pngle_set_user_data(session->pngle, metadata);
+  pngle_set_init_callback(session->pngle, init_screen);
+  pngle_set_draw_callback(session->pngle, on_draw);
+  pngle_set_done_callback(session->pngle, flush_screen);
+
+  return 0;
+}
+
+int render_begin_offscreen(struct render_session *session, char *title, char *alt, int num,
+                           const struct frame_location *location, enum frame_encoding encoding)
+{
+  if(render_begin(session, title, alt, num))
+  {
+    return 1;
+  }
+  session->metadata.frame_location = location;
+  session->metadata.frame_encoding = encoding;
+  return 0;
+}
+
+int render_feed(struct render_session *session, const void *buf, size_t len)
+{
+  if(session->metadata.finished)
+  {
+    // The rest of the image isn't in view
+    return len;
+  }
+  int64_t start = telemetry_begin(TELEMETRY_DECODE);
+  int fed = pngle_feed(session->pngle, buf, len);
+  telemetry_end(TELEMETRY_DECODE, start, fed > 0 ? fed : 0);
+  if (fed < 0)
+  {
+    ESP_LOGE(TAG, "%s", pngle_error(session->pngle));
+  }
+  return fed;
+}
+
+int render_complete(const struct render_session *session)
+{
+  return session->metadata.finished;
+}
+
+int render_end(struct render_session *session)
+{
+  struct canvas_metadata *metadata = &session->metadata;
+
+  // The decoder is kept for the next render, pngle_reset() then drops its per image buffers.
+  session->pngle = NULL;
+
+  // Only still running if the decode failed part way
+  stop_pipeline(metadata);
+  ESP_LOGI(TAG, "Render arena: %u of %u bytes used", (unsigned)arena.high_water,
+           (unsigned)arena.size);
+  // Everything below lives in the arena until the next render resets it.
+  metadata->canvas = NULL;
+  metadata->luma_row = NULL;
+  metadata->pixel_row = NULL;
+
+  return metadata->displayed ? 0 : 1;
+}
+
+int display_image(const char *fname, char *title, char *alt, int num)
+{
+  struct render_session session;
+  char buf[MAX_BUFFER_LEN];
+  int remain = 0;
+  int len;
+
+  ESP_LOGI(TAG, "Refreshing Display");
+  ESP_LOGI(TAG, "Free heap: %d\n", esp_get_free_heap_size());
+
+  // Same comic, settings and page: the canvas would come out identical, skip the decode.
+  if(frame_cache_set)
+  {
+    struct frame_key key;
+    const uint8_t *frame = map_frame(&frame_cache, num, &key);
+    if(frame != NULL && key.page == panel_page % key.pages)
+    {
+      present_stored(frame, &key);
+      return 0;
+    }
+  }
+
+  // Check if destination file exists
+  struct stat st;
+  if (stat(fname, &st) != 0) {
+      ESP_LOGI(TAG, "File doesn't exist, sleeping task...");
+      return 1;
+  }
+  ESP_LOGI(TAG, "File to display exists, proceeding...");
+  FILE * f = fopen(fname, "r");
+  if (f == NULL) {
+      ESP_LOGE(TAG, "Failed to open %s for reading", fname);
+      return 1;
+  }
+
+  if (render_begin(&session, title, alt, num)) {
+      fclose(f);
+      return 1;
+  }
+
+  // Feed data to pngle
+  while ((len = fread(buf + remain, 1, sizeof(buf) - remain, f)) > 0) {
+    int fed = render_feed(&session, buf, remain + len);
+    if (fed < 0)
+    {
+      break;
+    }
+
+    if(render_complete(&session))
+    {
+      break;
+    }
+
+    remain = remain + len - fed;
+    if (remain > 0) memmove(buf, buf + fed, remain);
+  }
+
+  int ret = render_end(&session);
+
+  fclose(f);
+
+  ESP_LOGI(TAG, "Display refreshed, sleeping task");
+  return ret;
+}
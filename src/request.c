@@ -1,512 +1,908 @@
-#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <strings.h>
 
+#include "sdkconfig.h"
+#include "esp_attr.h"
 #include "esp_log.h"
-#include "esp_http_client.h"
-#include "esp_tls.h"
-#include "cJSON.h"
-#include "pngle.h"
 #include "esp_spi_flash.h"
 #include "DEV_Config.h"
 #include "EPD_7in5_V2.h"
-#include "fonts.h"
 
 #include "main.h"
-
-#define XKCD_JSON_URL "https://xkcd.com/info.0.json"
-#define XKCD_JSON "/spiffs/xkcd.json"
+#include "archive.h"
+#include "crc32.h"
+#include "download.h"
+#include "http.h"
+#include "metadata.h"
+#include "render.h"
+#include "schedule.h"
+#include "state.h"
+#include "store.h"
+#include "telemetry.h"
+
+#define XKCD_JSON_URL CONFIG_XKCD_JSON_URL
+#if CONFIG_XKCD_FRAME_SERVER
+#define XKCD_FRAME_URL CONFIG_XKCD_FRAME_URL
+#endif
 #define XKCD_PNG "/spiffs/xkcd.png"
+#define XKCD_PNG_TMP "/spiffs/xkcd.png.tmp"
+#define XKCD_STATE "/spiffs/state"
+#define XKCD_FRAME "/spiffs/frame"
+#define XKCD_ARCHIVE "/spiffs/arc"
+// Label of the frame store partition and its records, see partitions.csv.
+#define XKCD_STORE "frames"
+#define STORE_STATE 1
+#define STORE_FRAME 2
+#define STORE_ARCHIVE 16 // The index, then a frame per slot.
 
 #define MAX_BUFFER_LEN 1024
-#define MAX_TEXT_WIDTH 80
+#define WIFI_CONNECT_TIMEOUT_MS 30000
+
+#define FETCH_OK 0
+#define FETCH_ERROR 1
+#define FETCH_NOT_MODIFIED 2
+#define FETCH_MISSING 3
 
 static const char *TAG = "request";
 
-static int get_xkcd_metadata(char **url, char **title, char **alt, int *num);
-static int get_xkcd_image(char *url);
-static void display_image(char *title, char *alt, int num);
+#if !CONFIG_XKCD_FRAME_SERVER
+// Filled in by get_xkcd_metadata, the strings live in its arena.
+static struct xkcd_metadata metadata;
+#endif
+// info.0.json and the images come from different hosts, each keeps its own connection. A
+// rendered frame comes through the image one.
+static struct http_session json_session;
+static struct http_session image_session;
+
+#if CONFIG_XKCD_FRAME_STORE
+static struct store store;
+#if CONFIG_XKCD_FRAME_CACHE
+static const struct frame_location frame_cache = { NULL, &store, STORE_FRAME };
+#endif
+#if CONFIG_XKCD_ARCHIVE
+static const struct frame_location archive_home = { NULL, &store, STORE_ARCHIVE };
+#endif
+#else
+#if CONFIG_XKCD_FRAME_CACHE
+static const struct frame_location frame_cache = { XKCD_FRAME, NULL, 0 };
+#endif
+#if CONFIG_XKCD_ARCHIVE
+static const struct frame_location archive_home = { XKCD_ARCHIVE, NULL, 0 };
+#endif
+#endif
+
+#if CONFIG_XKCD_ARCHIVE
+// Failed cycles in a row before an archived comic takes over the panel.
+#define ARCHIVE_OFFLINE_FAILURES 2
+static struct archive archive;
+static int archive_loaded = 0;
+/**
+ * The archived comic on the panel, 0 while it shows the latest one. A power cycle puts the latest
+ * back up anyway, so RTC memory is enough.
+ **/
+static RTC_DATA_ATTR int32_t archive_on_panel = 0;
+// Cleared once prefetching has nothing to do, so timer wakes don't open storage to find that out.
+static RTC_DATA_ATTR int archive_room = 1;
+#endif
+
+#if CONFIG_XKCD_FRAME_SERVER
+static int get_rendered_frame(const char *url, struct xkcd_state *state,
+                              struct http_validators *validators);
+#else
+static int get_xkcd_metadata(const char *url, struct xkcd_metadata *metadata,
+                             struct http_validators *validators);
+static int get_xkcd_image(char *url, char *title, char *alt, int num, uint32_t *hash);
+#endif
+#if CONFIG_XKCD_PAGE_TALL_COMICS
+static void turn_page(struct xkcd_state *state, struct schedule_state *schedule);
+#endif
+#if CONFIG_XKCD_ARCHIVE
+static void show_archived(struct xkcd_state *state);
+static void restore_latest(struct xkcd_state *state);
+static void prefetch_archive(struct xkcd_state *state);
+#endif
 
-static esp_err_t _http_event_handler(esp_http_client_event_t *evt)
+/**
+ * Response headers of every request. Requests made with validators want the new ones back, ctx
+ * is NULL for the others.
+ **/
+static void on_header(void *ctx, const char *key, const char *value)
 {
-    switch(evt->event_id) {
-        case HTTP_EVENT_ERROR:
-            ESP_LOGD(TAG, "HTTP_EVENT_ERROR");
-            break;
-        case HTTP_EVENT_ON_CONNECTED:
-            ESP_LOGD(TAG, "HTTP_EVENT_ON_CONNECTED");
-            break;
-        case HTTP_EVENT_HEADER_SENT:
-            ESP_LOGD(TAG, "HTTP_EVENT_HEADER_SENT");
-            break;
-        case HTTP_EVENT_ON_HEADER:
-            ESP_LOGD(TAG, "HTTP_EVENT_ON_HEADER, key=%s, value=%s",
-                     evt->header_key, evt->header_value);
-            break;
-        case HTTP_EVENT_ON_DATA:
-            ESP_LOGD(TAG, "HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
-            break;
-        case HTTP_EVENT_ON_FINISH:
-            ESP_LOGD(TAG, "HTTP_EVENT_ON_FINISH");
-            break;
-        case HTTP_EVENT_DISCONNECTED:
-            ESP_LOGI(TAG, "HTTP_EVENT_DISCONNECTED");
-            int mbedtls_err = 0;
-            esp_err_t err = esp_tls_get_and_clear_last_error(evt->data,
-                                                            &mbedtls_err, NULL);
-            if (err != 0) {
-                ESP_LOGI(TAG, "Last esp error code: 0x%x", err);
-                ESP_LOGI(TAG, "Last mbedtls failure: 0x%x", mbedtls_err);
-            }
-            break;
+  ESP_LOGD(TAG, "header %s: %s", key, value);
+  if(ctx != NULL)
+  {
+    struct http_validators *validators = ctx;
+    if(strcasecmp(key, "ETag") == 0)
+    {
+      snprintf(validators->etag, sizeof(validators->etag), "%s", value);
+    }
+    else if(strcasecmp(key, "Last-Modified") == 0)
+    {
+      snprintf(validators->last_modified, sizeof(validators->last_modified), "%s", value);
     }
-    return ESP_OK;
+  }
+  // Nothing else sets the clock after a power cycle
+  if(strcasecmp(key, "Date") == 0)
+  {
+    int64_t date;
+    if(schedule_parse_http_date(value, &date) == 0)
+    {
+      schedule_sync_clock(date);
+    }
+  }
 }
 
-void https_get_task(void *pvParameters)
+// Mounts SPIFFS, once per wake.
+static int mount_files(void)
 {
-  int ret;
-  char *image_url = NULL;
-  char *title = NULL;
-  char *alt = NULL;
-  int old_num = -1;
-  int num;
-
-  while(1) {
-    ESP_LOGI(TAG, "Starting request!");
+  static int mounted = 0;
+
+  if(!mounted && spiffs_mount() == 0)
+  {
+    mounted = 1;
+  }
+  return !mounted;
+}
+
+/**
+ * Opens the frame store, or mounts SPIFFS without it, and loads the saved state, once per wake.
+ * Timer wakes only get here if the cycle has something to write.
+ **/
+static int open_storage(struct xkcd_state *state)
+{
+  static int open = 0;
+  int failed;
+
+  if(open)
+  {
+    return 0;
+  }
+#if CONFIG_XKCD_FRAME_STORE
+  if(store_open(&store, XKCD_STORE, FRAME_FILE_MAX(EPD_7IN5_V2_WIDTH / 8, EPD_7IN5_V2_HEIGHT)))
+  {
+    return 1;
+  }
+  // Older firmware kept the state in SPIFFS, it moves over with the next save
+  failed = state_load_record(&store, STORE_STATE, state)
+           && (mount_files() || state_load(XKCD_STATE, state));
+#else
+  if(mount_files())
+  {
+    return 1;
+  }
+  failed = state_load(XKCD_STATE, state);
+#endif
+  if(!failed && state->comic_num >= 0)
+  {
+    render_set_panel_checksum(state->render_checksum);
+  }
+#if CONFIG_XKCD_FRAME_CACHE_PACKBITS
+  render_set_frame_cache(&frame_cache, FRAME_PACKBITS);
+#elif CONFIG_XKCD_FRAME_CACHE
+  render_set_frame_cache(&frame_cache, FRAME_RAW);
+#endif
+  open = 1;
+  return 0;
+}
+
+static void save_state(struct xkcd_state *state)
+{
+#if CONFIG_XKCD_FRAME_STORE
+  state_save_record(&store, STORE_STATE, state);
+#else
+  state_save(XKCD_STATE, state);
+#endif
+}
+
+static int panel_awake = 0;
+
+static void open_panel(void)
+{
+  if(!panel_awake)
+  {
     DEV_Module_Init();
     EPD_7IN5_V2_Init();
     ESP_LOGI(TAG, "Initialize display");
-    static int request_count = 0;
-    ESP_LOGI(TAG, "\tFetching metadata");
-    ret = get_xkcd_metadata(&image_url, &title, &alt, &num);
+    panel_awake = 1;
+  }
+}
 
-    if(!ret)
+/**
+ * Runs one refresh cycle and puts the device into deep sleep until the next one, pvParameters is
+ * the schedule_action app_main got for this wake.
+ **/
+void https_get_task(void *pvParameters)
+{
+  enum schedule_action action = (enum schedule_action)(intptr_t)pvParameters;
+  struct schedule_state *schedule = schedule_rtc();
+  int ret;
+#if !CONFIG_XKCD_FRAME_SERVER
+  uint32_t image_hash;
+#endif
+  struct http_validators validators;
+  struct xkcd_state state;
+
+  ESP_LOGI(TAG, "Starting request!");
+  http_session_init(&json_session);
+  http_session_init(&image_session);
+  if(action == SCHEDULE_FULL)
+  {
+    if(open_storage(&state))
     {
-      if (access(XKCD_JSON, F_OK) != -1)
+      memset(&state, 0, sizeof(state));
+      state.comic_num = -1;
+    }
+    // Put the last comic back up straight after boot, before Wi-Fi and the fetch
+    else if(state.comic_num >= 0)
+    {
+      open_panel();
+#if CONFIG_XKCD_PAGE_TALL_COMICS
+      // The frame tells which page is up, the paging carries on from there
+      if(render_cached(state.comic_num) == 0)
       {
-        ESP_LOGI(TAG, "Found XKCD_JSON, reading number");
-        FILE *json = fopen(XKCD_JSON, "r");
-        if (json != NULL)
-        {
-          fread(&old_num, sizeof(int), 1, json);
-          fclose(json);
-        }
-        ESP_LOGI(TAG, "old_num: %d", old_num);
+        schedule->page = render_last_stats()->page;
+        schedule->pages = render_last_stats()->pages;
       }
-      FILE *json = fopen(XKCD_JSON, "w");
-      if (json != NULL)
+#else
+      render_cached(state.comic_num);
+#endif
+    }
+  }
+  else
+  {
+    // The copy in RTC memory is enough to ask whether anything changed
+    memset(&state, 0, sizeof(state));
+    state.comic_num = schedule->comic_num;
+    state.validators = schedule->validators;
+  }
+
+#if CONFIG_XKCD_FRAME_SERVER
+  ESP_LOGI(TAG, "\tFetching the rendered frame");
+#else
+  ESP_LOGI(TAG, "\tFetching metadata");
+#endif
+#if CONFIG_XKCD_CONDITIONAL_GET
+  validators = state.validators;
+#else
+  memset(&validators, 0, sizeof(validators));
+#endif
+#if CONFIG_XKCD_PAGE_TALL_COMICS
+  /**
+   * Turning the page needs the title and alt text, a 304 doesn't have them. Neither does finding
+   * out how many pages the comic has, pages is 0 after a cold boot that had no frame to put back.
+   **/
+  if(schedule->pages > 1 || schedule->pages == 0)
+  {
+    memset(&validators, 0, sizeof(validators));
+  }
+#endif
+  if(wifi_wait_connected(WIFI_CONNECT_TIMEOUT_MS))
+  {
+    ret = FETCH_ERROR;
+  }
+  else
+  {
+#if CONFIG_XKCD_FRAME_SERVER
+    ret = get_rendered_frame(XKCD_FRAME_URL, &state, &validators);
+#else
+    ret = get_xkcd_metadata(XKCD_JSON_URL, &metadata, &validators);
+#endif
+  }
+  int result = ret == FETCH_MISSING ? FETCH_ERROR : ret;
+
+  if(ret == FETCH_NOT_MODIFIED)
+  {
+#if CONFIG_XKCD_FRAME_SERVER
+    ESP_LOGI(TAG, "Frame not modified, nothing to refresh");
+#else
+    ESP_LOGI(TAG, "info.0.json not modified, nothing to refresh");
+#endif
+  }
+#if !CONFIG_XKCD_FRAME_SERVER
+  else if(!ret)
+  {
+    ESP_LOGI(TAG, "comic on display: %d, latest: %d", (int)state.comic_num, metadata.num);
+    if(state.comic_num != metadata.num)
+    {
+      ESP_LOGI(TAG, "\tFetching image");
+      if(open_storage(&state))
       {
-        ESP_LOGI(TAG, "Writing number to XKCD_JSON");
-        fwrite(&num, sizeof(int), 1, json);
-        fclose(json);
+        result = FETCH_ERROR;
       }
       else
       {
-        ESP_LOGE(TAG, "Failed to open file for writing");
+        open_panel();
+#if CONFIG_XKCD_PAGE_TALL_COMICS
+        render_set_page(0);
+#endif
+        if(get_xkcd_image(metadata.img, metadata.safe_title, metadata.alt, metadata.num,
+                          &image_hash))
+        {
+          ESP_LOGE(TAG, "Failed to fetch and display the new comic");
+          result = FETCH_ERROR;
+        }
+        else
+        {
+          state.comic_num = metadata.num;
+          state.image_hash = image_hash;
+          state.render_checksum = render_last_checksum();
+          state.validators = validators;
+          save_state(&state);
+#if CONFIG_XKCD_PAGE_TALL_COMICS
+          schedule->page = render_last_stats()->page;
+          schedule->pages = render_last_stats()->pages;
+#endif
+#if CONFIG_XKCD_ARCHIVE
+          archive_on_panel = 0;
+#endif
+        }
       }
-
-      if(old_num != num)
+    }
+    else
+    {
+      ESP_LOGI(TAG, "no new comic, no need to fetch a new image");
+#if CONFIG_XKCD_PAGE_TALL_COMICS
+      if(schedule->pages > 1 || schedule->pages == 0)
       {
-        ESP_LOGI(TAG, "\tFetching image");
-        get_xkcd_image(image_url);
-        free(image_url);
+        turn_page(&state, schedule);
       }
-      else
+#endif
+      // The panel keeps showing the comic, only remember that this response was seen.
+      if((strcmp(state.validators.etag, validators.etag)
+          || strcmp(state.validators.last_modified, validators.last_modified))
+         && open_storage(&state) == 0)
       {
-        ESP_LOGI(TAG, "no new comic, no need to fetch a new image");
+        state.validators = validators;
+        save_state(&state);
       }
     }
+  }
+#endif
 
-    display_image(title, alt, num);
-    ESP_LOGI(TAG, "Completed %d requests", ++request_count);
-
-    ESP_LOGI(TAG, "Delaying task execution for next 12 hours");
-    vTaskDelay((12*60*60*1000) / portTICK_PERIOD_MS);
-    ESP_LOGI(TAG, "Starting again!");
+#if CONFIG_XKCD_ARCHIVE
+  if(result == FETCH_ERROR)
+  {
+    if(schedule->failures + 1 >= ARCHIVE_OFFLINE_FAILURES)
+    {
+      show_archived(&state);
+    }
   }
+  else
+  {
+    if(archive_on_panel)
+    {
+      restore_latest(&state);
+    }
+    if(archive_room && state.comic_num > 0)
+    {
+      prefetch_archive(&state);
+    }
+  }
+#endif
+
+  // Keeps the TLS sessions in RTC memory for the next wake
+  http_session_close(&json_session);
+  http_session_close(&image_session);
+  ESP_LOGI(TAG, "Refresh done, %u requests, %u handshakes (%u resumed) taking %d ms",
+           (unsigned)(json_session.requests + image_session.requests),
+           (unsigned)(json_session.handshakes + image_session.handshakes),
+           (unsigned)(json_session.resumed + image_session.resumed),
+           (int)((json_session.handshake_us + image_session.handshake_us) / 1000));
+  telemetry_cycle_end(state.comic_num, result);
+  telemetry_dump(stdout, 1);
+
+  uint32_t sightings = schedule->history.sightings;
+  uint32_t sleep_s = schedule_done(schedule, schedule_now(), result == FETCH_ERROR,
+                                   state.comic_num, &state.validators);
+  if(schedule->history.sightings != sightings)
+  {
+    schedule_history_save(schedule);
+  }
+  if(panel_awake)
+  {
+    // The panel keeps its image without power
+    EPD_7IN5_V2_Sleep();
+  }
+  deep_sleep(sleep_s);
 }
 
-static int fetch_to_file(char *url, char *fname)
+/**
+ * Sends a GET request and reads the response headers. When validators are given they're sent as
+ * If-None-Match/If-Modified-Since and replaced with the ones from the response.
+ **/
+static int fetch_open(struct http_session *session, const char *url,
+                      struct http_validators *validators, int *status_code)
 {
-  int content_length;
-  int status_code;
-  char buf[MAX_BUFFER_LEN];
-  int read_len = 0;
-  int ret = 0;
-
-  esp_http_client_config_t config = {
-    .event_handler = _http_event_handler,
-  };
-  config.url = url;
+  struct http_validators sent;
+  struct http_header headers[2];
+  int header_count = 0;
 
-  ESP_LOGI(TAG, "Opening_file");
-  FILE *f = fopen(fname, "w");
-  if (f == NULL) {
-    ESP_LOGE(TAG, "Failed to open file for writing");
-    ret = 1;
-    goto exit;
-  }
-  else
+  if(validators != NULL)
   {
-    ESP_LOGI(TAG, "Successfully opened file. Continuing...");
+    // The struct is free to collect the response's once the request is out
+    sent = *validators;
+    if(sent.etag[0])
+    {
+      headers[header_count++] = (struct http_header){ "If-None-Match", sent.etag };
+    }
+    if(sent.last_modified[0])
+    {
+      headers[header_count++] = (struct http_header){ "If-Modified-Since", sent.last_modified };
+    }
+    memset(validators, 0, sizeof(*validators));
   }
 
-  esp_http_client_handle_t client = esp_http_client_init(&config);
-  esp_err_t err = esp_http_client_open(client, 0);
-
-  if(err)
+  int64_t start = telemetry_begin(TELEMETRY_CONNECT);
+  int ret = http_session_get(session, url, headers, header_count, on_header, validators,
+                             status_code);
+  telemetry_end(TELEMETRY_CONNECT, start, 0);
+  if(ret)
   {
     ESP_LOGE(TAG, "Request failed.");
-    ret = 1;
-    goto cleanup;
+    return 1;
   }
+  ESP_LOGI(TAG, "Status = %d, content_length = %d", *status_code,
+           (int)session->parser.content_length);
+  return 0;
+}
 
-  content_length = esp_http_client_fetch_headers(client);
-  status_code = esp_http_client_get_status_code(client);
-  ESP_LOGI(TAG, "Status = %d, content_length = %d", status_code,
-           content_length);
+// http_session_read() that counts towards the transfer phase.
+static int fetch_read(struct http_session *session, char *buf, int len)
+{
+  int64_t start = telemetry_now();
+  int read_len = http_session_read(session, buf, len);
+  telemetry_add(TELEMETRY_TRANSFER, telemetry_now() - start, read_len > 0 ? read_len : 0);
+  return read_len;
+}
 
-  while((read_len = esp_http_client_read(client, buf, MAX_BUFFER_LEN)))
+static void fetch_close(struct http_session *session)
+{
+  telemetry_sample(TELEMETRY_TRANSFER);
+  http_session_end(session);
+}
+
+// Maps the response status to FETCH_OK, FETCH_NOT_MODIFIED, FETCH_MISSING or FETCH_ERROR.
+static int fetch_status(const char *url, int status_code)
+{
+  if(status_code == 200)
   {
-      fwrite(buf, sizeof(char),read_len, f);
+    return FETCH_OK;
   }
-
-cleanup:
-  fclose(f);
-  esp_http_client_close(client);
-  esp_http_client_cleanup(client);
-exit:
-  return ret;
+  if(status_code == 304)
+  {
+    return FETCH_NOT_MODIFIED;
+  }
+  if(status_code == 404)
+  {
+    ESP_LOGW(TAG, "%s doesn't exist", url);
+    return FETCH_MISSING;
+  }
+  ESP_LOGE(TAG, "Unexpected status %d for %s", status_code, url);
+  return FETCH_ERROR;
 }
 
-static int get_xkcd_metadata(char **url, char **title, char **alt, int *num)
+#if CONFIG_XKCD_STREAM_DECODE || CONFIG_XKCD_ARCHIVE
+/**
+ * Feeds the response body straight into the PNG decoder as it arrives, so the download and the
+ * decode/dither overlap and the image never has to round trip through SPIFFS. With
+ * CONFIG_XKCD_CACHE_PNG the body is also teed into a temporary file that replaces XKCD_PNG once
+ * the comic is on the panel, which keeps the last good PNG around for redisplay. Without it the
+ * download stops after the last row that shows, and hash only covers what was read. A connection
+ * that drops mid image is picked up with a Range request and the decoder just carries on, the
+ * decoder state doesn't survive deep sleep though, so a later cycle starts over. With frame set
+ * the comic is rendered offscreen into that frame instead, for the archive.
+ **/
+static int fetch_and_render(char *url, char *title, char *alt, int num, uint32_t *hash,
+                            const struct frame_location *frame)
 {
-  int str_len;
-  fetch_to_file(XKCD_JSON_URL, XKCD_JSON);
-  ESP_LOGI(TAG, "Opening file to read JSON from");
-  FILE *f = fopen(XKCD_JSON, "r");
-  if(f == NULL)
+  struct render_session session;
+  struct download download;
+  char buf[MAX_BUFFER_LEN];
+  int remain = 0;
+  int read_len;
+  int ret = 0;
+  FILE *cache = NULL;
+
+  *hash = 0;
+  if(download_open(&download, &image_session, url, 0, 0, NULL))
   {
-    ESP_LOGE(TAG, "Failed to open JSON file to read.");
     return 1;
   }
 
-  fseek(f, 0L, SEEK_END);
-  size_t buf_size = ftell(f);
-  fseek(f, 0L, SEEK_SET);
-
-  char *buf = malloc(buf_size*sizeof(char));
-  fread(buf, sizeof(char), buf_size, f);
-  fclose(f);
-
-  ESP_LOGI(TAG, "Parsing as a JSON");
-  // Attempt to parse the buffer as json
-  cJSON *root = cJSON_Parse(buf);
-
-  str_len = strlen(cJSON_GetObjectItem(root,"img")->valuestring)*sizeof(char);
-  *url = malloc((str_len+1)*sizeof(char));
-  (*url)[str_len] = '\0';
-  strcpy(*url, cJSON_GetObjectItem(root,"img")->valuestring);
-  ESP_LOGI(TAG, "url: %s", *url);
-
-  str_len = strlen(cJSON_GetObjectItem(root, "safe_title")->valuestring)*sizeof(char);
-  *title = malloc((str_len+1)*sizeof(char));
-  (*title)[str_len] = '\0';
-  strcpy(*title, cJSON_GetObjectItem(root, "safe_title")->valuestring);
-  ESP_LOGI(TAG, "title: %s", *title);
-
-  str_len = strlen(cJSON_GetObjectItem(root, "alt")->valuestring)*sizeof(char);
-  *alt = malloc((str_len+1)*sizeof(char));
-  (*alt)[str_len] = '\0';
-  strcpy(*alt, cJSON_GetObjectItem(root, "alt")->valuestring);
-  ESP_LOGI(TAG, "alt: %s", *alt);
-
-  *num = cJSON_GetObjectItem(root, "num")->valueint;
-
-  free(buf);
+  if(frame != NULL
+     ? render_begin_offscreen(&session, title, alt, num, frame, FRAME_PACKBITS_DELTA)
+     : render_begin(&session, title, alt, num))
+  {
+    download_close(&download);
+    return 1;
+  }
 
-  return 0;
-}
+#if CONFIG_XKCD_CACHE_PNG
+  if(frame == NULL)
+  {
+    cache = fopen(XKCD_PNG_TMP, "w");
+    if(cache == NULL)
+    {
+      ESP_LOGW(TAG, "Failed to open PNG cache for writing, continuing without it");
+    }
+  }
+#endif
 
-static int get_xkcd_image(char *url)
-{
-  return fetch_to_file(url, XKCD_PNG);
-}
+  while((read_len = download_read(&download, buf + remain, sizeof(buf) - remain)) > 0)
+  {
+    if(cache != NULL && (int)fwrite(buf + remain, 1, read_len, cache) != read_len)
+    {
+      ESP_LOGW(TAG, "Failed to write PNG cache, dropping it");
+      fclose(cache);
+      cache = NULL;
+      remove(XKCD_PNG_TMP);
+    }
 
-struct canvas_metadata
-{
-    int canvas_width;
-    int canvas_height;
-    int image_width;
-    int image_height;
-    unsigned char *image_bitmap;
-    unsigned char *canvas;
-    // TODO: We're dealing with values of 0-255 so should be able to use uint8_t here
-    // (the floyd-steinberg dithering algorithm might have cause an integer overflow here).
-    int *curr_line; // Buffer of the current line used to perform dithering.
-    int *next_line; // Buffer of the next line used to perform dithering.
-    // Comic related metadata TODO: this probably could be generalized a bit (header/footer)
-    char *title;
-    char *alt_text;
-    int comic_num;
-};
-
-void draw_centered_text(unsigned char *canvas,
-                        int            canvas_width,
-                        int            canvas_height,
-                        char          *str,
-                        int            str_len,
-                        int            y)
-{
-    if(y < 0 || y > canvas_height)
+    int fed = render_feed(&session, buf, remain + read_len);
+    if(fed < 0)
     {
-        ESP_LOGI(TAG, "Can't draw text, y coords out of bounds");
-        return;
+      ret = 1;
+      break;
     }
-    sFONT font = Font12;
-    int font_byte_width = (font.Width % 8) ? (font.Width/8 + 1) : (font.Width/8);
-    int text_width = MAX_TEXT_WIDTH;
+    // The rest of a comic taller than the panel is only read for the PNG copy
+    if(cache == NULL && render_complete(&session))
+    {
+      break;
+    }
+    remain = remain + read_len - fed;
+    if(remain > 0)
+    {
+      memmove(buf, buf + fed, remain);
+    }
+  }
+  download_close(&download);
+  *hash = download.crc;
+
+  if(render_end(&session))
+  {
+    ESP_LOGE(TAG, "Image stream ended before the comic was displayed");
+    ret = 1;
+  }
 
-    ESP_LOGI(TAG, "str_len: %d text_width: %d", str_len, text_width);
-    // If the string is larger than we're able to display let's recursivly break it down.
-    if(text_width < str_len)
+  if(cache != NULL)
+  {
+    fclose(cache);
+    // Only replace the cached copy with one that is known to decode
+    if(ret == 0)
     {
-      ESP_LOGI(TAG, "Got Here");
-      while(str[text_width] != ' ') text_width--;
-
-      // Draw first Chunk
-      draw_centered_text(canvas,
-                         canvas_width,
-                         canvas_height,
-                         str,
-                         text_width,
-                         y);
-      // Recursivly draw the next chunk
-      draw_centered_text(canvas,
-                         canvas_width,
-                         canvas_height,
-                         &str[text_width+1],
-                         str_len-text_width-1,
-                         y+font.Height);
+      remove(XKCD_PNG);
+      rename(XKCD_PNG_TMP, XKCD_PNG);
     }
     else
     {
-      int x = (canvas_width - (str_len*font_byte_width)) / 2;
-      for(int i=0; i<str_len; i++)
-      {
-        for(int j=0; j<font.Height; j++)
-        {
-          for(int k=0; k<font_byte_width; k++)
-          {
-            int font_idx = (str[i]-32)*(font.Height*font_byte_width)
-                            +(j*font_byte_width)+k;
-            int canvas_idx = (x+(i*font_byte_width)) + (y+j)*(canvas_width-1)+k;
-            canvas[canvas_idx] = ~font.table[font_idx];
-          }
-        }
-      }
+      remove(XKCD_PNG_TMP);
     }
+  }
+
+  return ret;
 }
+#endif
 
-void init_screen(pngle_t *pngle, uint32_t w, uint32_t h)
+#if CONFIG_XKCD_FRAME_SERVER
+/**
+ * Fetches the latest comic as a frame host/frame_proxy rendered and puts it on the panel, the
+ * rows are unpacked as they arrive. Nothing is decoded, dithered or laid out on the device, and a
+ * 304 leaves everything as it is.
+ **/
+static int get_rendered_frame(const char *url, struct xkcd_state *state,
+                              struct http_validators *validators)
 {
-  struct canvas_metadata *metadata = pngle_get_user_data(pngle);
-  int x_offset;
-  int y_offset;
-  char *str;
-  int str_len;
-  /* TODO: using the given image width and height I can scale the image to the
-   * display and then set the start corner of the picture */
-  ESP_LOGI(TAG, "image:   w=%d h=%d", w, h);
-  ESP_LOGI(TAG, "display: w=%d h=%d", EPD_7IN5_V2_WIDTH, EPD_7IN5_V2_HEIGHT);
-
-  // Initialize the display
-  metadata->image_width   = w;
-  metadata->image_height  = h;
-  metadata->canvas_width  = (EPD_7IN5_V2_WIDTH/8 + 1);
-  metadata->canvas_height = EPD_7IN5_V2_HEIGHT;
-
-  x_offset = (metadata->canvas_width - (metadata->image_width>>3)) / 2;
-  y_offset = (metadata->canvas_height - metadata->image_height) / 2;
-
-  // Full image can't be displayed since it is larger than the avaliable canvas
-  // Currently I'm handling this w/ bounds checking in on_draw
-  if(x_offset < 0 || y_offset < 0)
-  {
-    ESP_LOGI(TAG, "Image doesn't fit within the bounds of the canvas");
-  }
-  metadata->canvas = malloc((metadata->canvas_width * metadata->canvas_height)*sizeof(char));
-  memset(metadata->canvas, 0xFF, metadata->canvas_width * metadata->canvas_height);
-  metadata->image_bitmap = &(metadata->canvas[x_offset + (y_offset*(metadata->canvas_width-1))]);
-  //metadata->image_bitmap = malloc((metadata->image_width>>3 * metadata->image_height) * sizeof(char));
-  metadata->curr_line = calloc(metadata->image_width, sizeof(int));
-  metadata->next_line = calloc(metadata->image_width, sizeof(int));
-  ESP_LOGI(TAG, "malloc'd:   %d",
-          ((metadata->image_width/8 + 1) * metadata->image_height));
-
-  // Draw the Title and Comic number above the comic
-  str_len = strlen(metadata->title);
-  // Adjust the str_len to fit the possible number of places.
-  str_len += 13;
-  str = malloc(str_len + 1);
-  str[str_len] = 0x00;
-  sprintf(str, "#%d: %s", metadata->comic_num, metadata->title);
-
-  draw_centered_text(metadata->canvas,
-                     metadata->canvas_width,
-                     metadata->canvas_height,
-                     str,
-                     strlen(str), y_offset / 2);
-  free(str);
-
-  // NOTE: this roughly centers the text as the draw_centered_text function avoids breaking up words
-  // TODO: Maybe break this word-wrapping out of the draw_centered_text function.
-  int lines = strlen(metadata->alt_text)/MAX_TEXT_WIDTH;
-  lines += (strlen(metadata->alt_text)%MAX_TEXT_WIDTH) ? 1 : 0;
-
-  // Draw the Alt-text under the comic
-  draw_centered_text(metadata->canvas,
-                     metadata->canvas_width,
-                     metadata->canvas_height,
-                     metadata->alt_text,
-                     strlen(metadata->alt_text),
-                     metadata->canvas_height - (y_offset/2) - (lines/2));
+  struct frame_stream stream;
+  char buf[MAX_BUFFER_LEN];
+  int read_len = 0;
+  int status_code;
 
-}
+  if(fetch_open(&image_session, url, validators, &status_code))
+  {
+    return FETCH_ERROR;
+  }
+  int ret = fetch_status(url, status_code);
+  if(ret != FETCH_OK)
+  {
+    goto cleanup;
+  }
+  if(open_storage(state) || render_stream_begin(&stream))
+  {
+    ret = FETCH_ERROR;
+    goto cleanup;
+  }
+  open_panel();
+  while((read_len = fetch_read(&image_session, buf, sizeof(buf))) > 0)
+  {
+    if(render_stream_feed(&stream, buf, read_len))
+    {
+      ESP_LOGE(TAG, "%s isn't a frame for this panel", url);
+      ret = FETCH_ERROR;
+      goto cleanup;
+    }
+  }
+  if(read_len < 0 || render_stream_end(&stream))
+  {
+    ESP_LOGE(TAG, "Failed to display the rendered frame");
+    ret = FETCH_ERROR;
+    goto cleanup;
+  }
+  ESP_LOGI(TAG, "comic on display: %d, was %d", (int)stream.key.comic_num,
+           (int)state->comic_num);
+  state->comic_num = stream.key.comic_num;
+  state->image_hash = stream.crc;
+  state->render_checksum = render_last_checksum();
+  state->validators = *validators;
+  save_state(state);
 
+cleanup:
+  fetch_close(&image_session);
+  return ret;
+}
+#else
 /**
- * Dither's the values in the (2 x length) matrix around the given position (0,i) with the rgba input
- * for the position (0,i). Function does fixed dithering from 4byte space to 1bit space.
+ * Streams info.0.json through the metadata parser, only the fields we need are kept and nothing
+ * is allocated.
  **/
-void dither_patch(int *curr_line, int *next_line, int i, uint32_t length, uint8_t rgba[4])
+static int get_xkcd_metadata(const char *url, struct xkcd_metadata *metadata,
+                             struct http_validators *validators)
 {
-  // Note: This method assumes no transparencies in the photo.
-  if(rgba[3] < 255)
+  struct metadata_parser parser;
+  char buf[MAX_BUFFER_LEN];
+  int read_len;
+  int status_code;
+  int ret;
+
+  if(fetch_open(&json_session, url, validators, &status_code))
   {
-    ESP_LOGI(TAG, "Pixel has transparency that's being ignored! %d", rgba[3]);
+    return FETCH_ERROR;
+  }
+  ret = fetch_status(url, status_code);
+  if(ret != FETCH_OK)
+  {
+    goto cleanup;
   }
-  // Convert center pixel to greyscale and add the influencing values from previous passes
-  int oldpixel = curr_line[i] + ( (0.3  * rgba[0])
-                                + (0.59 * rgba[1])
-                                + (0.11 * rgba[2]) );
 
-  // Clip the oldpixel value to valid range
-  if(oldpixel > 255) oldpixel = 255;
-  if(oldpixel < 0) oldpixel = 0;
+  ESP_LOGI(TAG, "Parsing as a JSON");
+  metadata_parser_init(&parser, metadata);
+  while((read_len = fetch_read(&json_session, buf, MAX_BUFFER_LEN)) > 0)
+  {
+    int64_t start = telemetry_now();
+    int failed = metadata_parser_feed(&parser, buf, read_len);
+    telemetry_add(TELEMETRY_PARSE, telemetry_now() - start, read_len);
+    if(failed)
+    {
+      break;
+    }
+  }
+  telemetry_sample(TELEMETRY_PARSE);
+  if(read_len < 0 || metadata_parser_finish(&parser))
+  {
+    ESP_LOGE(TAG, "Failed to parse the comic metadata");
+    ret = FETCH_ERROR;
+    goto cleanup;
+  }
 
+  ESP_LOGI(TAG, "url: %s", metadata->img);
+  ESP_LOGI(TAG, "title: %s", metadata->safe_title);
+  ESP_LOGI(TAG, "alt: %s", metadata->alt);
 
-  // Covert from 1 byte greyscale to 1 bit b/w
-  int newpixel = oldpixel > 127 ? 1 : 0;
-  curr_line[i] = newpixel;
+cleanup:
+  fetch_close(&json_session);
+  return ret;
+}
 
-  // Carry forward the influencing values of the window
-  int quant_error = oldpixel - (newpixel) * 255;
-  if (i < length-1)
+// Downloads and displays the comic image, hash is set to the CRC-32 of the PNG.
+static int get_xkcd_image(char *url, char *title, char *alt, int num, uint32_t *hash)
+{
+#if CONFIG_XKCD_STREAM_DECODE
+#if CONFIG_XKCD_FRAME_STORE && CONFIG_XKCD_CACHE_PNG
+  // The PNG copy is all that still goes to SPIFFS, the comic streams without it if need be
+  mount_files();
+#endif
+  return fetch_and_render(url, title, alt, num, hash, NULL);
+#else
+#if CONFIG_XKCD_FRAME_STORE
+  if(mount_files())
   {
-    curr_line[i + 1] = curr_line[i + 1] + ((quant_error * 7)>>4);
-    next_line[i + 1] = next_line[i + 1] + ((quant_error * 1)>>4);
+    return 1;
   }
-  if (i > 0)
+#endif
+  if(download_file(&image_session, url, XKCD_PNG, hash))
   {
-    next_line[i - 1] = next_line[i - 1] + ((quant_error * 3)>>4);
+    return 1;
   }
-  next_line[i] = next_line[i] + ((quant_error * 5)/16);
+  return display_image(XKCD_PNG, title, alt, num);
+#endif
 }
+#endif
 
-void on_draw(pngle_t *pngle, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
-             uint8_t rgba[4])
+#if CONFIG_XKCD_PAGE_TALL_COMICS
+// CRC-32 of the file at path, like download_file() computes it, returns 1 if it can't be read.
+static int file_crc(const char *path, uint32_t *crc)
 {
-  struct canvas_metadata *metadata = pngle_get_user_data(pngle);
+  char buf[MAX_BUFFER_LEN];
+  size_t len;
+  FILE *f = fopen(path, "r");
 
-  int *curr_line = metadata->curr_line;
-  int *next_line = metadata->next_line;
-  unsigned char *image_bitmap = metadata->image_bitmap;
-  int image_width = metadata->image_width;
-  int canvas_y = ((metadata->canvas_height - metadata->image_height) / 2) + y;
-  dither_patch(curr_line, next_line, x, image_width, rgba);
+  if(f == NULL)
+  {
+    return 1;
+  }
+  *crc = 0;
+  while((len = fread(buf, 1, sizeof(buf), f)) > 0)
+  {
+    *crc = crc32_update(*crc, buf, len);
+  }
+  int failed = ferror(f);
+  fclose(f);
+  return failed;
+}
 
-  // translate current row into image bitmap
-  if(x == (image_width-1))
+/**
+ * Puts the next page of the tall comic on the panel, decoded again from the PNG kept in SPIFFS
+ * down to the last row of the page instead of downloading it. With pages 0 (unknown) the first
+ * one is rendered once to find out, which also ends the paging of a comic that isn't tall.
+ * Paging stops if the PNG isn't the one the comic on the panel was rendered from, until the next
+ * comic.
+ **/
+static void turn_page(struct xkcd_state *state, struct schedule_state *schedule)
+{
+  int page = schedule->pages > 1 ? (schedule->page + 1) % schedule->pages : 0;
+  uint32_t crc;
+
+  if(open_storage(state) || mount_files() || file_crc(XKCD_PNG, &crc)
+     || crc != state->image_hash)
   {
-    if(canvas_y >= 0 && canvas_y < metadata->canvas_height)
-    {
-      for(int i = 0; i < image_width; i++)
-      {
-        int idx = (i / 8) + (y * (metadata->canvas_width - 1));
-        if(curr_line[i])
-        {
-          image_bitmap[idx] |= 1<<(7-(i % 8));
-        }
-        else
-        {
-          image_bitmap[idx] &= ~(1<<(7-(i % 8)));
-        }
+    ESP_LOGW(TAG, "No PNG of comic %d to page through", (int)state->comic_num);
+    schedule->pages = 1;
+    return;
+  }
+  open_panel();
+  render_set_page(page);
+  if(display_image(XKCD_PNG, metadata.safe_title, metadata.alt, metadata.num))
+  {
+    ESP_LOGE(TAG, "Failed to display page %d of comic %d", page + 1, metadata.num);
+    schedule->pages = 1;
+    return;
+  }
+  schedule->page = render_last_stats()->page;
+  schedule->pages = render_last_stats()->pages;
+  ESP_LOGI(TAG, "Page %d of %d on display", (int)schedule->page + 1, (int)schedule->pages);
+  state->render_checksum = render_last_checksum();
+  save_state(state);
+}
+#endif
 
-      }
-    }
-    // Swap the line buffers for the next row in the image
-    int *temp = curr_line;
-    curr_line = next_line;
-    next_line = temp;
-    memset(next_line, 0x00, w*sizeof(int));
+#if CONFIG_XKCD_ARCHIVE
+// Opens the storage and loads the archive index, once per wake.
+static int open_archive(struct xkcd_state *state)
+{
+  uint32_t frame_max = FRAME_FILE_MAX(EPD_7IN5_V2_WIDTH / 8, EPD_7IN5_V2_HEIGHT);
+
+  if(open_storage(state))
+  {
+    return 1;
   }
+  if(!archive_loaded)
+  {
+#if CONFIG_XKCD_FRAME_STORE
+    frame_max = store_size(frame_max);
+#endif
+    archive_open(&archive, &archive_home, CONFIG_XKCD_ARCHIVE_SLOTS,
+                 CONFIG_XKCD_ARCHIVE_BUDGET_KB * 1024, frame_max);
+    archive_loaded = 1;
+  }
+  return 0;
 }
 
-void flush_screen(pngle_t *pngle)
+// Puts the next comic from the archive on the panel while the latest can't be checked.
+static void show_archived(struct xkcd_state *state)
 {
-  struct canvas_metadata *metadata = pngle_get_user_data(pngle);
-  EPD_7IN5_V2_Display(metadata->canvas);
-  free(metadata->canvas);
-  free(metadata->curr_line);
-  free(metadata->next_line);
+  struct frame_location location;
+  char path[ARCHIVE_PATH_LEN];
+
+  if(open_archive(state))
+  {
+    return;
+  }
+  int slot = archive_pick(&archive, render_settings());
+  if(slot < 0)
+  {
+    ESP_LOGI(TAG, "Offline and nothing archived to show");
+    return;
+  }
+  int32_t num = archive.entries[slot].comic_num;
+  archive_location(&archive, slot, &location, path);
+  open_panel();
+  if(render_frame(&location, num))
+  {
+    ESP_LOGW(TAG, "Archived comic %d is unreadable, dropping it", (int)num);
+    archive_drop(&archive, slot);
+    archive_save(&archive);
+    return;
+  }
+  ESP_LOGI(TAG, "Offline, showing archived comic %d", (int)num);
+  archive_touch(&archive, slot);
+  archive_save(&archive);
+  archive_on_panel = num;
+  // Shown comics can make room for new ones
+  archive_room = 1;
+  state->render_checksum = render_last_checksum();
+  save_state(state);
 }
 
+// Back online with an archived comic on the panel, the latest one goes back up.
+static void restore_latest(struct xkcd_state *state)
+{
+  if(open_storage(state))
+  {
+    return;
+  }
+  open_panel();
+  if(render_cached(state->comic_num))
+  {
+    ESP_LOGW(TAG, "No frame of comic %d to put back", (int)state->comic_num);
+    return;
+  }
+  archive_on_panel = 0;
+  state->render_checksum = render_last_checksum();
+  save_state(state);
+}
 
-static void display_image(char *title, char *alt, int num)
+/**
+ * Pre-renders up to CONFIG_XKCD_ARCHIVE_PREFETCH comics older than the latest into the archive,
+ * walking back through the catalog a few per cycle. The metadata of the latest comic isn't
+ * needed by now, so its struct is reused.
+ **/
+static void prefetch_archive(struct xkcd_state *state)
 {
-  pngle_t *pngle;
-  char buf[1024];
-  int remain = 0;
-  int len;
-  struct canvas_metadata metadata;
-
-  metadata.title     = title;
-  metadata.alt_text  = alt;
-  metadata.comic_num = num;
-
-  ESP_LOGI(TAG, "Refreshing Display");
-  ESP_LOGI(TAG, "Free heap: %d\n", esp_get_free_heap_size());
-
-  // Check if destination file exists
-  struct stat st;
-  if (stat(XKCD_PNG, &st) == 1) {
-      ESP_LOGI(TAG, "File doesn't exist, sleeping task...");
-      return;
-  }
-  ESP_LOGI(TAG, "File to display exists, proceeding...");
-  FILE * f = fopen(XKCD_PNG, "r");
-
-  pngle = pngle_new();
-  pngle_set_user_data(pngle, &metadata);
-  pngle_set_init_callback(pngle, init_screen);
-  pngle_set_draw_callback(pngle, on_draw);
-  pngle_set_done_callback(pngle, flush_screen);
-  // Feed data to pngle
-  while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
-    int fed = pngle_feed(pngle, buf, 1024);
-    if (fed < 0)
+  char json_url[128];
+  struct frame_location location;
+  char path[ARCHIVE_PATH_LEN];
+  uint32_t settings = render_settings();
+  uint32_t hash;
+  // info.0.json of comic n lives at <dir>/n/info.0.json
+  const char *name = strrchr(XKCD_JSON_URL, '/');
+  int dir_len = name != NULL ? name - XKCD_JSON_URL : 0;
+
+  if(open_archive(state))
+  {
+    return;
+  }
+  for(int i = 0; i < CONFIG_XKCD_ARCHIVE_PREFETCH; i++)
+  {
+    int32_t num = archive_next(&archive, state->comic_num, settings);
+    int slot = num > 0 ? archive_reserve(&archive, settings) : -1;
+    if(slot < 0)
     {
-      ESP_LOGE(TAG, "%s", pngle_error(pngle));
       break;
     }
-
-    remain = remain + len - fed;
-    if (remain > 0) memmove(buf, buf + fed, remain);
+    snprintf(json_url, sizeof(json_url), "%.*s/%d/info.0.json", dir_len, XKCD_JSON_URL,
+             (int)num);
+    int ret = get_xkcd_metadata(json_url, &metadata, NULL);
+    if(ret == FETCH_ERROR)
+    {
+      // Try it again next cycle
+      break;
+    }
+    archive_skip(&archive, num);
+    if(ret == FETCH_MISSING)
+    {
+      continue;
+    }
+    archive_location(&archive, slot, &location, path);
+    if(fetch_and_render(metadata.img, metadata.safe_title, metadata.alt, num, &hash, &location)
+       || archive_commit(&archive, slot, num, settings))
+    {
+      ESP_LOGW(TAG, "Failed to archive comic %d, skipping it", (int)num);
+      archive_drop(&archive, slot);
+    }
   }
-
-  pngle_destroy(pngle);
-
-  fclose(f);
-
-  ESP_LOGI(TAG, "Display refreshed, sleeping task");
+  archive_save(&archive);
+  archive_room = archive_next(&archive, state->comic_num, settings) > 0
+                 && archive_has_room(&archive, settings);
 }
-
+#endif
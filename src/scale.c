@@ -0,0 +1,86 @@
+#include <string.h>
+
+#include "scale.h"
+
+int scaler_init(struct scaler *scaler, int src_width, int src_height,
+                int dst_width, int dst_height, struct arena *arena)
+{
+  memset(scaler, 0, sizeof(*scaler));
+  if(src_width <= 0 || src_height <= 0 || dst_width <= 0 || dst_height <= 0)
+  {
+    return 1;
+  }
+  scaler->src_width = src_width;
+  scaler->src_height = src_height;
+  scaler->dst_width = dst_width < src_width ? dst_width : src_width;
+  scaler->dst_height = dst_height < src_height ? dst_height : src_height;
+  scaler->row_scale = (1u << 24) / src_width;
+  scaler->col_room = src_width;
+  scaler->row_room = src_height;
+
+  scaler->row = arena_alloc(arena, scaler->dst_width * sizeof(uint32_t));
+  scaler->acc = arena_alloc(arena, scaler->dst_width * sizeof(uint32_t));
+  scaler->out = arena_alloc(arena, scaler->dst_width);
+  if(scaler->row == NULL || scaler->acc == NULL || scaler->out == NULL)
+  {
+    return 1;
+  }
+  return 0;
+}
+
+// Turns the accumulated output row into luma.
+static void emit_row(struct scaler *scaler)
+{
+  uint32_t total = scaler->src_height;
+  for(int x = 0; x < scaler->dst_width; x++)
+  {
+    uint32_t luma = (scaler->acc[x] / total + 128) >> 8;
+    scaler->out[x] = luma > 255 ? 255 : luma;
+  }
+}
+
+int scaler_row(struct scaler *scaler)
+{
+  int width = scaler->dst_width;
+  uint32_t weight = scaler->dst_height;
+  uint32_t *row = scaler->row;
+  uint32_t *acc = scaler->acc;
+  int done = -1;
+
+  if(scaler->out_y >= scaler->dst_height)
+  {
+    // Source rows past the expected height, nothing left to fill.
+    memset(row, 0, width * sizeof(uint32_t));
+    return -1;
+  }
+
+  if((uint32_t)scaler->row_room > weight)
+  {
+    for(int x = 0; x < width; x++)
+    {
+      acc[x] += ((row[x] * scaler->row_scale) >> 16) * weight;
+    }
+    scaler->row_room -= weight;
+  }
+  else
+  {
+    // This source row completes the output row, the rest of it starts the next one.
+    uint32_t first = scaler->row_room;
+    uint32_t rest = weight - first;
+    for(int x = 0; x < width; x++)
+    {
+      uint32_t luma = (row[x] * scaler->row_scale) >> 16;
+      acc[x] += luma * first;
+      row[x] = luma * rest; // Reused as the carry into the next output row.
+    }
+    emit_row(scaler);
+    done = scaler->out_y++;
+    memcpy(acc, row, width * sizeof(uint32_t));
+    scaler->row_room = scaler->src_height - rest;
+  }
+
+  memset(row, 0, width * sizeof(uint32_t));
+  scaler->col = 0;
+  scaler->col_room = scaler->src_width;
+  return done;
+}
@@ -0,0 +1,378 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "sdkconfig.h"
+
+#include "crc32.h"
+#include "schedule.h"
+
+#if ESP_PLATFORM
+#include <sys/time.h>
+
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "nvs.h"
+
+#define HISTORY_NAMESPACE "schedule"
+#define HISTORY_KEY "history"
+
+static const char *TAG = "schedule";
+#else
+#define RTC_NOINIT_ATTR
+#endif
+
+#define SCHEDULE_MAGIC 0x44484353 // "SCHD"
+// A timer wake this close to the due time counts as on time.
+#define WAKE_SLACK_S 60
+// Anything before 2020 means the clock hasn't been set since the last power cycle.
+#define CLOCK_VALID_AFTER 1577836800
+// Sightings needed before adaptive polling trusts the history.
+#define MIN_SIGHTINGS 3
+/**
+ * Checks are this far apart until then. A sighting after a longer gap says too little about when
+ * the comic came out and isn't learned from, so a late comic or a long sleep doesn't smear the
+ * history.
+ **/
+#define LEARN_INTERVAL_S (3 * 60 * 60)
+#define SIGHTING_WEIGHT 4096
+#define NEIGHBOURHOOD_HOURS 12
+#define WEEK_S (SCHEDULE_HOURS * 60 * 60)
+// How far back from a comic that turned up late the probe the week after starts.
+#define PROBE_S (12 * 60 * 60)
+// 1970-01-01 was a Thursday, three days into a week that starts on Monday.
+#define EPOCH_HOUR_OF_WEEK (3 * 24)
+
+struct schedule_policy schedule_policy = {
+  .interval_s = CONFIG_XKCD_REFRESH_INTERVAL_MIN * 60,
+  .retry_s = CONFIG_XKCD_RETRY_INTERVAL_MIN * 60,
+#if CONFIG_XKCD_ADAPTIVE_POLL
+  .adaptive = 1,
+  .burst_s = CONFIG_XKCD_POLL_BURST_MIN * 60,
+  .max_sleep_s = CONFIG_XKCD_POLL_MAX_SLEEP_MIN * 60,
+#endif
+#if CONFIG_XKCD_PAGE_TALL_COMICS
+  .page_s = CONFIG_XKCD_PAGE_INTERVAL_MIN * 60,
+#endif
+};
+
+// Survives deep sleep, garbage after a power cycle, hence the magic and CRC.
+static RTC_NOINIT_ATTR struct schedule_state rtc_state;
+
+struct schedule_state *schedule_rtc(void)
+{
+  return &rtc_state;
+}
+
+int64_t schedule_now(void)
+{
+  // The RTC timer keeps the system time going through deep sleep.
+  return time(NULL);
+}
+
+// Days from 1970-01-01 to year-month-day, for any Gregorian date.
+static int64_t days_from_civil(int64_t year, int month, int day)
+{
+  year -= month <= 2;
+  int64_t era = (year >= 0 ? year : year - 399) / 400;
+  int64_t yoe = year - era * 400;
+  int64_t doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+int schedule_parse_http_date(const char *date, int64_t *t)
+{
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  char month[4];
+  int day, year, hour, min, sec;
+
+  if(sscanf(date, "%*3s, %d %3s %d %d:%d:%d GMT", &day, month, &year, &hour, &min, &sec) != 6)
+  {
+    return 1;
+  }
+  const char *found = strstr(months, month);
+  if(strlen(month) != 3 || found == NULL || (found - months) % 3 || day < 1 || day > 31
+     || hour > 23 || min > 59 || sec > 60)
+  {
+    return 1;
+  }
+  int64_t days = days_from_civil(year, (found - months) / 3 + 1, day);
+  *t = ((days * 24 + hour) * 60 + min) * 60 + sec;
+  return 0;
+}
+
+void schedule_sync_clock(int64_t t)
+{
+#if ESP_PLATFORM
+  int64_t now = schedule_now();
+  if(now - t > 2 || t - now > 2)
+  {
+    struct timeval tv = { .tv_sec = t };
+    settimeofday(&tv, NULL);
+    ESP_LOGI(TAG, "Clock set from the server, was %lld s off", (long long)(t - now));
+  }
+#endif
+}
+
+static uint32_t state_crc(const struct schedule_state *state)
+{
+  return crc32_update(0, state, offsetof(struct schedule_state, crc));
+}
+
+static int hour_of_week(int64_t hour)
+{
+  return (hour + EPOCH_HOUR_OF_WEEK) % SCHEDULE_HOURS;
+}
+
+static void learn(struct schedule_history *history, int64_t from, int64_t to)
+{
+  int64_t first = from / 3600;
+  int64_t last = (to - 1) / 3600;
+  int share = SIGHTING_WEIGHT / (last - first + 1);
+
+  for(int i = 0; i < SCHEDULE_HOURS; i++)
+  {
+    history->weights[i] -= history->weights[i] / 8;
+  }
+  for(int64_t hour = first; hour <= last; hour++)
+  {
+    uint16_t *weight = &history->weights[hour_of_week(hour)];
+    *weight = *weight + share > UINT16_MAX ? UINT16_MAX : *weight + share;
+  }
+  history->sightings++;
+}
+
+/**
+ * Comics are expected in the hours that have at least a quarter of the weight of the heaviest
+ * hour within half a day, in stretches of the week that have at least a sixteenth of the weight
+ * of the heaviest stretch. Judging each release day against its neighbourhood keeps one well
+ * pinned down day from drowning out the ones only seen through wider gaps, and a day that was
+ * missed a few times from dropping out of the schedule altogether.
+ **/
+static void expected_hours(const struct schedule_history *history, uint8_t *expected)
+{
+  uint32_t mass[SCHEDULE_HOURS];
+  uint16_t peak[SCHEDULE_HOURS];
+  uint32_t max_mass = 0;
+
+  for(int h = 0; h < SCHEDULE_HOURS; h++)
+  {
+    mass[h] = 0;
+    peak[h] = 0;
+    for(int d = -NEIGHBOURHOOD_HOURS; d <= NEIGHBOURHOOD_HOURS; d++)
+    {
+      uint16_t weight = history->weights[(h + d + SCHEDULE_HOURS) % SCHEDULE_HOURS];
+      mass[h] += weight;
+      if(weight > peak[h]) peak[h] = weight;
+    }
+    if(mass[h] > max_mass) max_mass = mass[h];
+  }
+  for(int h = 0; h < SCHEDULE_HOURS; h++)
+  {
+    expected[h] = history->weights[h] > 0 && 4 * history->weights[h] >= peak[h]
+                  && 16 * mass[h] >= max_mass;
+  }
+}
+
+// Seconds until the next check under the adaptive policy.
+static int64_t adaptive_delay(struct schedule_state *state, int64_t now)
+{
+  uint8_t expected[SCHEDULE_HOURS];
+  int64_t hour = now / 3600;
+  int64_t window = -1;
+  int64_t next = -1;
+
+  expected_hours(&state->history, expected);
+  // Start of the latest window that began up to a week ago, and of the next one
+  for(int64_t h = hour; h > hour - SCHEDULE_HOURS && window < 0; h--)
+  {
+    if(expected[hour_of_week(h)] && !expected[hour_of_week(h - 1)]) window = h * 3600;
+  }
+  for(int64_t h = hour + 1; h <= hour + SCHEDULE_HOURS && next < 0; h++)
+  {
+    if(expected[hour_of_week(h)] && !expected[hour_of_week(h - 1)]) next = h * 3600 - now;
+  }
+  if(window < 0 || next < 0)
+  {
+    // Every hour or none of them are expected, nothing to go by
+    return schedule_policy.interval_s;
+  }
+
+  int64_t delay;
+  if(state->last_new >= window)
+  {
+    // This window's comic is already up, sleep until the next window
+    state->overdue = 0;
+    delay = next < schedule_policy.max_sleep_s ? next : schedule_policy.max_sleep_s;
+  }
+  else if(expected[hour_of_week(hour)])
+  {
+    state->overdue = 0;
+    delay = schedule_policy.burst_s;
+  }
+  else
+  {
+    // Late, back off from the burst interval up to the fixed one
+    delay = schedule_policy.burst_s;
+    for(uint32_t i = 0; i < state->overdue && delay < schedule_policy.interval_s; i++)
+    {
+      delay *= 2;
+    }
+    if(delay > schedule_policy.interval_s) delay = schedule_policy.interval_s;
+    state->overdue++;
+  }
+  // Never sleep through the start of a window or a probe
+  if(delay > next) delay = next;
+  if(now >= state->probe_start && now < state->probe_end && delay > LEARN_INTERVAL_S)
+  {
+    delay = LEARN_INTERVAL_S;
+  }
+  if(state->probe_start > now && delay > state->probe_start - now)
+  {
+    delay = state->probe_start - now;
+  }
+  return delay < WAKE_SLACK_S ? WAKE_SLACK_S : delay;
+}
+
+enum schedule_action schedule_wake(struct schedule_state *state, enum schedule_wake wake,
+                                   int64_t now, uint32_t *sleep_s)
+{
+  if(wake != SCHEDULE_WAKE_TIMER || state->magic != SCHEDULE_MAGIC
+     || state->crc != state_crc(state))
+  {
+    memset(state, 0, sizeof(*state));
+    state->magic = SCHEDULE_MAGIC;
+    state->next_refresh = now;
+    state->comic_num = -1;
+    state->crc = state_crc(state);
+    return SCHEDULE_FULL;
+  }
+
+  state->wakes++;
+  state->crc = state_crc(state);
+  if(state->next_refresh - now > WAKE_SLACK_S)
+  {
+    *sleep_s = state->next_refresh - now;
+    return SCHEDULE_SLEEP;
+  }
+  return SCHEDULE_CHECK;
+}
+
+uint32_t schedule_done(struct schedule_state *state, int64_t now, int failed, int comic_num,
+                       const struct http_validators *validators)
+{
+  int64_t delay = schedule_policy.interval_s;
+
+  if(failed)
+  {
+    state->failures++;
+    delay = schedule_policy.retry_s;
+    for(uint32_t i = 1; i < state->failures && delay < schedule_policy.interval_s; i++)
+    {
+      delay *= 2;
+    }
+    if(delay > schedule_policy.interval_s)
+    {
+      delay = schedule_policy.interval_s;
+    }
+  }
+  else
+  {
+    state->failures = 0;
+    if(comic_num != state->comic_num && state->comic_num >= 0)
+    {
+      // Came out after the last check, as far as a clock that has been set all along can tell
+      if(state->last_check >= CLOCK_VALID_AFTER && now > state->last_check)
+      {
+        if(now - state->last_check <= LEARN_INTERVAL_S)
+        {
+          learn(&state->history, state->last_check, now);
+        }
+        else if(now - state->last_check < WEEK_S)
+        {
+          // Most likely it came out not long before, so that's where to look
+          int64_t from = now - PROBE_S > state->last_check ? now - PROBE_S : state->last_check;
+          state->probe_start = from + WEEK_S;
+          state->probe_end = now + WEEK_S;
+        }
+      }
+      state->last_new = now;
+    }
+    state->last_check = now;
+    if(schedule_policy.adaptive && now >= CLOCK_VALID_AFTER)
+    {
+      if(state->history.sightings >= MIN_SIGHTINGS)
+      {
+        // A wake a little early still does the check that was due
+        int64_t due = now < state->next_refresh ? state->next_refresh : now;
+        delay = adaptive_delay(state, due) + due - now;
+      }
+      else if(delay > LEARN_INTERVAL_S)
+      {
+        delay = LEARN_INTERVAL_S;
+      }
+    }
+  }
+
+  // Every check turns the page of a tall comic
+  if(!failed && state->pages > 1 && schedule_policy.page_s > 0 && delay > schedule_policy.page_s)
+  {
+    delay = schedule_policy.page_s;
+  }
+  state->next_refresh = now + delay;
+  state->comic_num = comic_num;
+  state->validators = *validators;
+  state->crc = state_crc(state);
+  return delay;
+}
+
+int schedule_history_load(struct schedule_state *state)
+{
+#if ESP_PLATFORM
+  nvs_handle_t handle;
+  size_t size = sizeof(state->history);
+
+  if(nvs_open(HISTORY_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+  {
+    return 1;
+  }
+  esp_err_t err = nvs_get_blob(handle, HISTORY_KEY, &state->history, &size);
+  nvs_close(handle);
+  if(err != ESP_OK || size != sizeof(state->history))
+  {
+    memset(&state->history, 0, sizeof(state->history));
+    state->crc = state_crc(state);
+    return 1;
+  }
+  state->crc = state_crc(state);
+  ESP_LOGI(TAG, "Publication history of %u comics", (unsigned)state->history.sightings);
+  return 0;
+#else
+  return 1;
+#endif
+}
+
+int schedule_history_save(const struct schedule_state *state)
+{
+#if ESP_PLATFORM
+  nvs_handle_t handle;
+  int ret = 0;
+
+  if(nvs_open(HISTORY_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+  {
+    return 1;
+  }
+  if(nvs_set_blob(handle, HISTORY_KEY, &state->history, sizeof(state->history)) != ESP_OK
+     || nvs_commit(handle) != ESP_OK)
+  {
+    ESP_LOGW(TAG, "Failed to save the publication history");
+    ret = 1;
+  }
+  nvs_close(handle);
+  return ret;
+#else
+  return 1;
+#endif
+}
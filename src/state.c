@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "crc32.h"
+#include "state.h"
+#include "store.h"
+
+#define STATE_MAGIC 0x54534B58 // "XKST"
+// Bump whenever struct xkcd_state changes, older records are then ignored.
+#define STATE_VERSION 1
+#define STATE_SLOTS 2
+#define STATE_PATH_LEN 64
+
+static const char *TAG = "state";
+
+struct state_record
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size;
+  uint32_t crc; // Over the state that follows.
+  struct xkcd_state state;
+};
+
+static void state_defaults(struct xkcd_state *state)
+{
+  memset(state, 0, sizeof(*state));
+  state->comic_num = -1;
+}
+
+static void slot_path(char *buf, const char *path, int slot)
+{
+  snprintf(buf, STATE_PATH_LEN, "%s.%d", path, slot);
+}
+
+// Returns 0 if the len bytes read from name are a valid record.
+static int record_check(const struct state_record *record, size_t len, const char *name)
+{
+  if(len != sizeof(*record)
+     || record->magic != STATE_MAGIC
+     || record->version != STATE_VERSION
+     || record->size != sizeof(record->state)
+     || record->crc != crc32_update(0, &record->state, sizeof(record->state)))
+  {
+    ESP_LOGW(TAG, "Ignoring invalid state record %s", name);
+    return 1;
+  }
+  return 0;
+}
+
+// Bumps the sequence number and wraps the state up for saving.
+static void record_fill(struct state_record *record, struct xkcd_state *state)
+{
+  state->sequence++;
+  memset(record, 0, sizeof(*record));
+  record->magic = STATE_MAGIC;
+  record->version = STATE_VERSION;
+  record->size = sizeof(record->state);
+  record->state = *state;
+  record->crc = crc32_update(0, &record->state, sizeof(record->state));
+}
+
+static void log_loaded(const struct xkcd_state *state)
+{
+  ESP_LOGI(TAG, "Loaded state #%u: comic %d", (unsigned)state->sequence, (int)state->comic_num);
+}
+
+static int slot_read(const char *path, int slot, struct state_record *record)
+{
+  char fname[STATE_PATH_LEN];
+
+  slot_path(fname, path, slot);
+  FILE *f = fopen(fname, "rb");
+  if(f == NULL)
+  {
+    return 1;
+  }
+  size_t len = fread(record, 1, sizeof(*record), f);
+  fclose(f);
+  return record_check(record, len, fname);
+}
+
+int state_load(const char *path, struct xkcd_state *state)
+{
+  struct state_record record;
+  int found = 0;
+
+  state_defaults(state);
+  for(int slot = 0; slot < STATE_SLOTS; slot++)
+  {
+    if(slot_read(path, slot, &record) == 0
+       && (!found || record.state.sequence - state->sequence < 0x80000000u))
+    {
+      *state = record.state;
+      found = 1;
+    }
+  }
+
+  if(!found)
+  {
+    ESP_LOGI(TAG, "No saved state, starting fresh");
+    return 1;
+  }
+  log_loaded(state);
+  return 0;
+}
+
+int state_save(const char *path, struct xkcd_state *state)
+{
+  struct state_record record;
+  char fname[STATE_PATH_LEN];
+
+  record_fill(&record, state);
+  // Alternate slots by sequence so the newest record is never the one being overwritten
+  slot_path(fname, path, state->sequence % STATE_SLOTS);
+  FILE *f = fopen(fname, "wb");
+  if(f == NULL)
+  {
+    ESP_LOGE(TAG, "Failed to open %s for writing", fname);
+    return 1;
+  }
+  size_t len = fwrite(&record, 1, sizeof(record), f);
+  if(fclose(f) != 0 || len != sizeof(record))
+  {
+    ESP_LOGE(TAG, "Failed to write %s", fname);
+    return 1;
+  }
+  return 0;
+}
+
+int state_load_record(const struct store *store, uint32_t id, struct xkcd_state *state)
+{
+  struct state_record record;
+  char name[STATE_PATH_LEN];
+  uint32_t len;
+
+  state_defaults(state);
+  const uint8_t *data = store_map(store, id, &len);
+  if(data == NULL)
+  {
+    ESP_LOGI(TAG, "No saved state, starting fresh");
+    return 1;
+  }
+  memcpy(&record, data, len < sizeof(record) ? len : sizeof(record));
+  snprintf(name, sizeof(name), "record %u", (unsigned)id);
+  if(record_check(&record, len, name))
+  {
+    return 1;
+  }
+  *state = record.state;
+  log_loaded(state);
+  return 0;
+}
+
+int state_save_record(struct store *store, uint32_t id, struct xkcd_state *state)
+{
+  struct state_record record;
+
+  record_fill(&record, state);
+  if(store_write(store, id, &record, sizeof(record)))
+  {
+    ESP_LOGE(TAG, "Failed to write state record %u", (unsigned)id);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,449 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "crc32.h"
+#include "store.h"
+
+#define STORE_MAGIC 0x53524B58 // "XKRS"
+// Records are copied between sectors through a buffer in RAM, flash writes can't source flash.
+#define COPY_CHUNK 512
+
+static const char *TAG = "store";
+
+// At the start of a record's first sector, the payload follows right after it.
+struct store_header
+{
+  uint32_t magic;      // Zeroed in place once a newer copy of the record is committed.
+  uint32_t id;
+  uint32_t seq;
+  uint32_t len;
+  uint32_t crc;        // Of the payload.
+  uint32_t header_crc; // Of the fields from id to crc.
+};
+
+static int sectors_for(uint32_t len)
+{
+  return (sizeof(struct store_header) + len + STORE_SECTOR - 1) / STORE_SECTOR;
+}
+
+uint32_t store_size(uint32_t len)
+{
+  return sectors_for(len) * STORE_SECTOR;
+}
+
+static uint32_t header_crc(const struct store_header *header)
+{
+  size_t len = offsetof(struct store_header, header_crc) - offsetof(struct store_header, id);
+  return crc32_update(0, &header->id, len);
+}
+
+static const struct store_header *header_at(const struct store *store, int sector)
+{
+  return (const struct store_header *)(store->base + (size_t)sector * STORE_SECTOR);
+}
+
+static int find(const struct store *store, uint32_t id)
+{
+  for(int i = 0; i < store->count; i++)
+  {
+    if(store->records[i].id == id)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void forget(struct store *store, int i)
+{
+  store->count--;
+  memmove(&store->records[i], &store->records[i + 1],
+          (store->count - i) * sizeof(store->records[0]));
+}
+
+static int erase(struct store *store, int sector, int count)
+{
+  if(esp_partition_erase_range(store->partition, (size_t)sector * STORE_SECTOR,
+                               (size_t)count * STORE_SECTOR) != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Failed to erase sectors %d-%d", sector, sector + count - 1);
+    return 1;
+  }
+  store->erases += count;
+  return 0;
+}
+
+// Kills the record at sector, clearing bits is the one write that needs no erase.
+static void kill(struct store *store, int sector)
+{
+  uint32_t dead = 0;
+  if(esp_partition_write(store->partition, (size_t)sector * STORE_SECTOR, &dead,
+                         sizeof(dead)) != ESP_OK)
+  {
+    // Mounting kills it again, it's older than the copy that replaced it
+    ESP_LOGW(TAG, "Failed to kill the record at sector %d", sector);
+  }
+}
+
+/**
+ * Writes the header that commits the record of len bytes at sector, which kills the previous
+ * copy of id and moves the head past it.
+ **/
+static int finish(struct store *store, int sector, uint32_t id, uint32_t len, uint32_t crc)
+{
+  struct store_header header = { STORE_MAGIC, id, store->seq + 1, len, crc, 0 };
+
+  header.header_crc = header_crc(&header);
+  if(esp_partition_write(store->partition, (size_t)sector * STORE_SECTOR, &header,
+                         sizeof(header)) != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Failed to commit record %u", (unsigned)id);
+    return 1;
+  }
+  store->seq = header.seq;
+  int old = find(store, id);
+  if(old >= 0)
+  {
+    kill(store, store->records[old].sector);
+    forget(store, old);
+  }
+  struct store_record *record = &store->records[store->count++];
+  record->id = id;
+  record->seq = header.seq;
+  record->len = len;
+  record->sector = sector;
+  record->sectors = sectors_for(len);
+  store->head = (sector + record->sectors) % store->sectors;
+  return 0;
+}
+
+/**
+ * Sector a record of n sectors goes to with the log running from tail to head, -1 if it would
+ * run into the tail. A record that doesn't fit before the end of the partition starts over at
+ * sector 0, the sectors it skips are free again on the next lap.
+ **/
+static int place(const struct store *store, int head, int tail, int n)
+{
+  if(tail < 0)
+  {
+    return head + n <= store->sectors ? head : n <= store->sectors ? 0 : -1;
+  }
+  if(head < tail)
+  {
+    return head + n <= tail ? head : -1;
+  }
+  if(head == tail)
+  {
+    // The log goes all the way round
+    return -1;
+  }
+  if(head + n <= store->sectors)
+  {
+    return head;
+  }
+  return n <= tail ? 0 : -1;
+}
+
+/**
+ * Where a record of n sectors can go, or -1 if that leaves less than twice the largest record
+ * free. Free space that the end of the partition splits in two then still has one part the
+ * oldest record fits in, so it can always be moved.
+ **/
+static int room(const struct store *store, int n)
+{
+  int tail = store->count > 0 ? store->records[0].sector : -1;
+  int at = place(store, store->head, tail, n);
+  if(at < 0)
+  {
+    return -1;
+  }
+  if(tail < 0)
+  {
+    tail = at;
+  }
+  int head = (at + n) % store->sectors;
+  int left = (tail - head + store->sectors) % store->sectors;
+  return left >= 2 * store->reserve ? at : -1;
+}
+
+// Copies the oldest record to the head, which frees its sectors and any dead ones behind it.
+static int move_tail(struct store *store)
+{
+  uint8_t buf[COPY_CHUNK];
+  struct store_record old = store->records[0];
+  const struct store_header *header = header_at(store, old.sector);
+  const uint8_t *payload = (const uint8_t *)(header + 1);
+
+  int at = place(store, store->head, old.sector, old.sectors);
+  if(at < 0 || erase(store, at, old.sectors))
+  {
+    return 1;
+  }
+  size_t offset = (size_t)at * STORE_SECTOR + sizeof(*header);
+  for(uint32_t done = 0; done < old.len; done += COPY_CHUNK)
+  {
+    size_t len = old.len - done < COPY_CHUNK ? old.len - done : COPY_CHUNK;
+    memcpy(buf, &payload[done], len);
+    if(esp_partition_write(store->partition, offset + done, buf, len) != ESP_OK)
+    {
+      ESP_LOGE(TAG, "Failed to move record %u", (unsigned)old.id);
+      return 1;
+    }
+  }
+  if(finish(store, at, old.id, old.len, header->crc))
+  {
+    return 1;
+  }
+  store->moves++;
+  return 0;
+}
+
+// Reclaims the tail until a record of n sectors fits at the head, returns its sector or -1.
+static int make_room(struct store *store, int n)
+{
+  // A whole lap of moves compacts the log, if there's no room after that there is none
+  for(int moves = store->count; ; moves--)
+  {
+    int at = room(store, n);
+    if(at >= 0)
+    {
+      return at;
+    }
+    if(moves <= 0 || store->count == 0 || move_tail(store))
+    {
+      ESP_LOGE(TAG, "No room for %d more sectors, %u bytes in use", n,
+               (unsigned)store_used(store));
+      return -1;
+    }
+  }
+}
+
+static int header_valid(const struct store *store, const struct store_header *header, int sector)
+{
+  return header->magic == STORE_MAGIC
+      && header->header_crc == header_crc(header)
+      && header->len <= (uint32_t)(store->sectors - sector) * STORE_SECTOR
+      && sector + sectors_for(header->len) <= store->sectors;
+}
+
+// Indexes the records on flash, oldest first, and kills copies a power loss left behind.
+static void scan(struct store *store)
+{
+  for(int sector = 0; sector < store->sectors; )
+  {
+    const struct store_header *header = header_at(store, sector);
+    if(!header_valid(store, header, sector))
+    {
+      sector++;
+      continue;
+    }
+    // Sorted by sequence number as they go in
+    int i = store->count++;
+    while(i > 0 && (int32_t)(store->records[i - 1].seq - header->seq) > 0)
+    {
+      i--;
+    }
+    memmove(&store->records[i + 1], &store->records[i],
+            (store->count - 1 - i) * sizeof(store->records[0]));
+    struct store_record *record = &store->records[i];
+    record->id = header->id;
+    record->seq = header->seq;
+    record->len = header->len;
+    record->sector = sector;
+    record->sectors = sectors_for(header->len);
+    sector += record->sectors;
+  }
+
+  for(int i = store->count - 1; i > 0; i--)
+  {
+    for(int j = i - 1; j >= 0; j--)
+    {
+      if(store->records[j].id == store->records[i].id)
+      {
+        ESP_LOGI(TAG, "Killing the older copy of record %u", (unsigned)store->records[j].id);
+        kill(store, store->records[j].sector);
+        forget(store, j);
+        i--;
+      }
+    }
+  }
+  if(store->count > 0)
+  {
+    const struct store_record *newest = &store->records[store->count - 1];
+    store->seq = newest->seq;
+    store->head = (newest->sector + newest->sectors) % store->sectors;
+  }
+}
+
+int store_open(struct store *store, const char *label, uint32_t max_len)
+{
+  const void *base;
+
+  memset(store, 0, sizeof(*store));
+  store->partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                              label);
+  if(store->partition == NULL)
+  {
+    ESP_LOGE(TAG, "No %s partition", label);
+    return 1;
+  }
+  store->sectors = store->partition->size / STORE_SECTOR;
+  if(store->sectors > STORE_MAX_SECTORS)
+  {
+    ESP_LOGW(TAG, "Only using the first %d sectors of %s", STORE_MAX_SECTORS, label);
+    store->sectors = STORE_MAX_SECTORS;
+  }
+  store->reserve = sectors_for(max_len);
+  // Room for the largest record and what room() keeps free
+  if(store->sectors < 3 * store->reserve)
+  {
+    ESP_LOGE(TAG, "%s is too small for %u byte records", label, (unsigned)max_len);
+    return 1;
+  }
+  if(esp_partition_mmap(store->partition, 0, (size_t)store->sectors * STORE_SECTOR,
+                        SPI_FLASH_MMAP_DATA, &base, &store->mmap) != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Failed to map %s", label);
+    return 1;
+  }
+  store->base = base;
+  scan(store);
+  ESP_LOGI(TAG, "%d records in %u of %d KB", store->count, (unsigned)store_used(store) / 1024,
+           store->sectors * STORE_SECTOR / 1024);
+  return 0;
+}
+
+void store_close(struct store *store)
+{
+  if(store->base != NULL)
+  {
+    spi_flash_munmap(store->mmap);
+    store->base = NULL;
+  }
+}
+
+const uint8_t *store_map(const struct store *store, uint32_t id, uint32_t *len)
+{
+  int i = find(store, id);
+  if(i < 0)
+  {
+    return NULL;
+  }
+  const struct store_header *header = header_at(store, store->records[i].sector);
+  const uint8_t *payload = (const uint8_t *)(header + 1);
+  if(header->crc != crc32_update(0, payload, header->len))
+  {
+    ESP_LOGW(TAG, "Record %u is corrupt", (unsigned)id);
+    return NULL;
+  }
+  *len = header->len;
+  return payload;
+}
+
+int store_begin(struct store *store, struct store_writer *writer, uint32_t id, uint32_t max_len)
+{
+  memset(writer, 0, sizeof(*writer));
+  writer->failed = 1;
+  int n = sectors_for(max_len);
+  if(n > store->reserve)
+  {
+    ESP_LOGE(TAG, "Record %u of up to %u bytes is larger than the store takes", (unsigned)id,
+             (unsigned)max_len);
+    return 1;
+  }
+  int at = make_room(store, n);
+  // The rest is erased as the record reaches it
+  if(at < 0 || erase(store, at, 1))
+  {
+    return 1;
+  }
+  writer->store = store;
+  writer->id = id;
+  writer->sector = at;
+  writer->erased = 1;
+  writer->max_len = max_len;
+  writer->failed = 0;
+  return 0;
+}
+
+int store_append(struct store_writer *writer, const void *data, uint32_t len)
+{
+  struct store *store = writer->store;
+
+  if(writer->failed || len > writer->max_len - writer->len)
+  {
+    writer->failed = 1;
+    return 1;
+  }
+  int n = sectors_for(writer->len + len);
+  if(n > writer->erased)
+  {
+    if(erase(store, writer->sector + writer->erased, n - writer->erased))
+    {
+      writer->failed = 1;
+      return 1;
+    }
+    writer->erased = n;
+  }
+  size_t offset = (size_t)writer->sector * STORE_SECTOR + sizeof(struct store_header)
+                  + writer->len;
+  if(esp_partition_write(store->partition, offset, data, len) != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Failed to write record %u", (unsigned)writer->id);
+    writer->failed = 1;
+    return 1;
+  }
+  writer->crc = crc32_update(writer->crc, data, len);
+  writer->len += len;
+  return 0;
+}
+
+int store_commit(struct store_writer *writer)
+{
+  if(writer->failed)
+  {
+    return 1;
+  }
+  writer->failed = 1;
+  return finish(writer->store, writer->sector, writer->id, writer->len, writer->crc);
+}
+
+void store_abort(struct store_writer *writer)
+{
+  // Without a header the sectors are free as they are
+  writer->failed = 1;
+}
+
+int store_write(struct store *store, uint32_t id, const void *data, uint32_t len)
+{
+  struct store_writer writer;
+
+  if(store_begin(store, &writer, id, len) || store_append(&writer, data, len))
+  {
+    return 1;
+  }
+  return store_commit(&writer);
+}
+
+int store_delete(struct store *store, uint32_t id)
+{
+  int i = find(store, id);
+  if(i >= 0)
+  {
+    kill(store, store->records[i].sector);
+    forget(store, i);
+  }
+  return 0;
+}
+
+uint32_t store_used(const struct store *store)
+{
+  uint32_t sectors = 0;
+  for(int i = 0; i < store->count; i++)
+  {
+    sectors += store->records[i].sectors;
+  }
+  return sectors * STORE_SECTOR;
+}
@@ -0,0 +1,246 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "esp_system.h"
+
+#include "crc32.h"
+#include "telemetry.h"
+
+#if CONFIG_XKCD_TELEMETRY
+
+#if ESP_PLATFORM
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#else
+#include <time.h>
+
+#define RTC_NOINIT_ATTR
+#endif
+
+#define TELEMETRY_MAGIC 0x324C5458 // "XTL2"
+#define TELEMETRY_CYCLES CONFIG_XKCD_TELEMETRY_CYCLES
+// Longest line telemetry_format() produces, with every phase present.
+#define TELEMETRY_LINE_LEN 768
+
+struct telemetry_ring
+{
+  uint32_t magic;
+  uint32_t next_id;
+  uint32_t head;  // Slot the next completed cycle goes in.
+  uint32_t count;
+  struct telemetry_cycle cycles[TELEMETRY_CYCLES];
+};
+
+static const char *const phase_names[] = {
+  "wifi", "connect", "handshake", "transfer", "parse", "decode", "dither", "text", "display",
+};
+_Static_assert(sizeof(phase_names) / sizeof(phase_names[0]) == TELEMETRY_PHASE_COUNT,
+               "every phase needs a name");
+
+// Survives deep sleep and software resets, the bootloader doesn't clear it. Checked before use
+// since it's garbage after a power cycle.
+static RTC_NOINIT_ATTR struct telemetry_ring ring;
+static struct telemetry_cycle current;
+static int64_t cycle_start;
+// esp_get_minimum_free_heap_size() when each phase last began.
+static uint32_t phase_low[TELEMETRY_PHASE_COUNT];
+
+int64_t telemetry_now(void)
+{
+#if ESP_PLATFORM
+  return esp_timer_get_time();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static uint32_t stack_free(void)
+{
+#if ESP_PLATFORM
+  // StackType_t is a byte on ESP-IDF, so this is in bytes.
+  return uxTaskGetStackHighWaterMark(NULL);
+#else
+  return 0;
+#endif
+}
+
+static uint32_t cycle_crc(const struct telemetry_cycle *cycle)
+{
+  return crc32_update(0, cycle, offsetof(struct telemetry_cycle, crc));
+}
+
+// Starts the ring over unless it's one we wrote.
+static void ring_check(void)
+{
+  if(ring.magic != TELEMETRY_MAGIC || ring.head >= TELEMETRY_CYCLES
+     || ring.count > TELEMETRY_CYCLES)
+  {
+    memset(&ring, 0, sizeof(ring));
+    ring.magic = TELEMETRY_MAGIC;
+  }
+}
+
+/**
+ * The all time low only moves when a new one is set, so if it dropped since low_before the
+ * phase reached it. Otherwise all we know is the free heap right now.
+ **/
+static void sample(struct telemetry_phase_stats *stats, uint32_t low_before)
+{
+  uint32_t free_heap = esp_get_free_heap_size();
+  uint32_t low = esp_get_minimum_free_heap_size();
+  if(low < low_before && low < free_heap)
+  {
+    free_heap = low;
+  }
+  if(free_heap < stats->heap_min)
+  {
+    stats->heap_min = free_heap;
+  }
+  uint32_t stack = stack_free();
+  if(stack < stats->stack_min)
+  {
+    stats->stack_min = stack;
+  }
+}
+
+void telemetry_cycle_begin(void)
+{
+  ring_check();
+  memset(&current, 0, sizeof(current));
+  current.id = ring.next_id++;
+  current.comic_num = -1;
+#if ESP_PLATFORM
+  current.reset_reason = esp_reset_reason();
+#endif
+  for(int i = 0; i < TELEMETRY_PHASE_COUNT; i++)
+  {
+    current.phases[i].heap_min = UINT32_MAX;
+    current.phases[i].stack_min = UINT32_MAX;
+  }
+  cycle_start = telemetry_now();
+}
+
+void telemetry_cycle_end(int comic_num, int result)
+{
+  current.comic_num = comic_num;
+  current.result = result;
+  current.total_us = telemetry_now() - cycle_start;
+  current.crc = cycle_crc(&current);
+
+  ring_check();
+  ring.cycles[ring.head] = current;
+  ring.head = (ring.head + 1) % TELEMETRY_CYCLES;
+  if(ring.count < TELEMETRY_CYCLES)
+  {
+    ring.count++;
+  }
+}
+
+int64_t telemetry_begin(enum telemetry_phase phase)
+{
+  phase_low[phase] = esp_get_minimum_free_heap_size();
+  sample(&current.phases[phase], 0);
+  return telemetry_now();
+}
+
+void telemetry_end(enum telemetry_phase phase, int64_t start, size_t bytes)
+{
+  telemetry_add(phase, telemetry_now() - start, bytes);
+  sample(&current.phases[phase], phase_low[phase]);
+}
+
+void telemetry_add(enum telemetry_phase phase, int64_t us, size_t bytes)
+{
+  current.phases[phase].us += us;
+  current.phases[phase].bytes += bytes;
+}
+
+void telemetry_sample(enum telemetry_phase phase)
+{
+  sample(&current.phases[phase], 0);
+}
+
+void telemetry_count(enum telemetry_counter counter)
+{
+  if(current.counters[counter] < UINT16_MAX)
+  {
+    current.counters[counter]++;
+  }
+}
+
+// snprintf() onto the end of what's in buf so far, n is the length the line would have.
+static int append(char *buf, size_t len, int n, const char *format, ...)
+{
+  va_list args;
+  size_t used = (size_t)n < len ? (size_t)n : len;
+
+  va_start(args, format);
+  int added = vsnprintf(buf + used, len - used, format, args);
+  va_end(args);
+  return added < 0 ? n : n + added;
+}
+
+int telemetry_format(const struct telemetry_cycle *cycle, char *buf, size_t len)
+{
+  int n = append(buf, len, 0, "{\"id\":%u,\"comic\":%d,\"result\":%d,\"reset\":%u,\"us\":%u",
+                 (unsigned)cycle->id, (int)cycle->comic_num, (int)cycle->result,
+                 (unsigned)cycle->reset_reason, (unsigned)cycle->total_us);
+  for(int i = 0; i < TELEMETRY_PHASE_COUNT; i++)
+  {
+    const struct telemetry_phase_stats *stats = &cycle->phases[i];
+    if(stats->heap_min == UINT32_MAX)
+    {
+      continue;
+    }
+    n = append(buf, len, n, ",\"%s\":[%u,%u,%u,%u]", phase_names[i], (unsigned)stats->us,
+               (unsigned)stats->bytes, (unsigned)stats->heap_min, (unsigned)stats->stack_min);
+  }
+  if(cycle->counters[TELEMETRY_REQUESTS] > 0)
+  {
+    n = append(buf, len, n, ",\"http\":[%u,%u,%u,%u]", cycle->counters[TELEMETRY_REQUESTS],
+               cycle->counters[TELEMETRY_REUSED], cycle->counters[TELEMETRY_HANDSHAKES],
+               cycle->counters[TELEMETRY_RESUMED]);
+  }
+  return append(buf, len, n, "}");
+}
+
+void telemetry_dump(FILE *out, int cycles)
+{
+  char line[TELEMETRY_LINE_LEN];
+
+  ring_check();
+  if(cycles <= 0 || cycles > (int)ring.count)
+  {
+    cycles = ring.count;
+  }
+  for(int i = cycles; i > 0; i--)
+  {
+    const struct telemetry_cycle *cycle =
+      &ring.cycles[(ring.head + TELEMETRY_CYCLES - i) % TELEMETRY_CYCLES];
+    // A reset mid-write can leave a torn record behind
+    if(cycle->crc != cycle_crc(cycle))
+    {
+      continue;
+    }
+    telemetry_format(cycle, line, sizeof(line));
+    fprintf(out, "%s\n", line);
+  }
+}
+
+const struct telemetry_cycle *telemetry_last(void)
+{
+  ring_check();
+  if(ring.count == 0)
+  {
+    return NULL;
+  }
+  return &ring.cycles[(ring.head + TELEMETRY_CYCLES - 1) % TELEMETRY_CYCLES];
+}
+
+#endif
@@ -0,0 +1,313 @@
+#include <string.h>
+
+#include "text.h"
+
+// The waveshare font tables cover printable ASCII only.
+#define FIRST_GLYPH ' '
+#define LAST_GLYPH '~'
+#define FALLBACK_GLYPH '?'
+#define ELLIPSIS_LEN 3
+// Glyph rows are shifted through a 32 bit word, wider fonts would lose pixels.
+#define MAX_GLYPH_WIDTH 24
+
+struct lookalike
+{
+  uint32_t code_point;
+  char glyph;
+};
+
+// Characters that turn up in titles and alt text, drawn with the nearest ASCII glyph.
+static const struct lookalike lookalikes[] = {
+  { 0x00A0, ' ' },  // No-break space
+  { 0x00D7, 'x' },  // Multiplication sign
+  { 0x2010, '-' }, { 0x2011, '-' }, { 0x2012, '-' }, { 0x2013, '-' }, { 0x2014, '-' },
+  { 0x2212, '-' },
+  { 0x2018, '\'' }, { 0x2019, '\'' }, { 0x201A, ',' }, { 0x2032, '\'' },
+  { 0x201C, '"' }, { 0x201D, '"' }, { 0x201E, '"' }, { 0x2033, '"' },
+  { 0x2022, '*' },
+};
+
+// Decodes one UTF-8 sequence, anything malformed comes back as U+FFFD one byte at a time.
+static int utf8_decode(const char *str, int len, uint32_t *code_point)
+{
+  const uint8_t *s = (const uint8_t *)str;
+  uint32_t cp;
+  uint32_t min;
+  int n;
+
+  if(s[0] < 0x80)
+  {
+    *code_point = s[0];
+    return 1;
+  }
+  else if((s[0] & 0xE0) == 0xC0) { n = 2; cp = s[0] & 0x1F; min = 0x80; }
+  else if((s[0] & 0xF0) == 0xE0) { n = 3; cp = s[0] & 0x0F; min = 0x800; }
+  else if((s[0] & 0xF8) == 0xF0) { n = 4; cp = s[0] & 0x07; min = 0x10000; }
+  else goto invalid;
+
+  if(n > len)
+  {
+    goto invalid;
+  }
+  for(int i = 1; i < n; i++)
+  {
+    if((s[i] & 0xC0) != 0x80)
+    {
+      goto invalid;
+    }
+    cp = (cp << 6) | (s[i] & 0x3F);
+  }
+  // Overlong encodings, surrogates and out of range values
+  if(cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+  {
+    goto invalid;
+  }
+  *code_point = cp;
+  return n;
+
+invalid:
+  *code_point = 0xFFFD;
+  return 1;
+}
+
+// Character to draw for a code point, always one the font table has.
+static char glyph_for(uint32_t code_point)
+{
+  if(code_point >= FIRST_GLYPH && code_point <= LAST_GLYPH)
+  {
+    return code_point;
+  }
+  if(code_point == '\t')
+  {
+    return ' ';
+  }
+  for(size_t i = 0; i < sizeof(lookalikes) / sizeof(lookalikes[0]); i++)
+  {
+    if(lookalikes[i].code_point == code_point)
+    {
+      return lookalikes[i].glyph;
+    }
+  }
+  return FALLBACK_GLYPH;
+}
+
+// Width in pixels of len bytes of text, every glyph is advance wide.
+static int measure(const char *str, int len, int advance)
+{
+  int width = 0;
+  uint32_t cp;
+  for(int pos = 0; pos < len; pos += utf8_decode(&str[pos], len - pos, &cp))
+  {
+    width += advance;
+  }
+  return width;
+}
+
+/**
+ * Greedy word wrap. Stores up to max_lines lines and returns how many the whole text needs, or
+ * -1 if not even a single glyph fits in max_width.
+ **/
+static int wrap(struct text_layout *layout, const char *str, int len, int advance,
+                int max_width, int max_lines)
+{
+  int count = 0;
+  int pos = 0;
+
+  while(pos < len)
+  {
+    // Lines never start with the spaces they were broken at
+    while(pos < len && str[pos] == ' ') pos++;
+    if(pos >= len)
+    {
+      break;
+    }
+
+    int start = pos;
+    int width = 0;
+    int end, next;
+    int break_end = -1; // Last space in the line, where it can be broken.
+    int break_width = 0;
+    while(1)
+    {
+      if(pos >= len || str[pos] == '\n')
+      {
+        end = pos;
+        next = pos < len ? pos + 1 : pos;
+        break;
+      }
+      uint32_t cp;
+      int n = utf8_decode(&str[pos], len - pos, &cp);
+      if(cp == ' ')
+      {
+        break_end = pos;
+        break_width = width;
+      }
+      if(width + advance > max_width)
+      {
+        if(cp == ' ')
+        {
+          end = pos;
+          next = pos;
+        }
+        else if(break_end > start)
+        {
+          end = break_end;
+          width = break_width;
+          next = break_end;
+        }
+        else
+        {
+          // One long word, break it wherever the line is full
+          if(pos == start)
+          {
+            return -1;
+          }
+          end = pos;
+          next = pos;
+        }
+        break;
+      }
+      width += advance;
+      pos += n;
+    }
+
+    while(end > start && str[end - 1] == ' ')
+    {
+      end--;
+      width -= advance;
+    }
+    if(count < max_lines)
+    {
+      layout->lines[count].start = &str[start];
+      layout->lines[count].len = end - start;
+      layout->lines[count].width = width;
+      layout->lines[count].ellipsis = 0;
+    }
+    count++;
+    pos = next;
+  }
+  return count;
+}
+
+int text_layout(struct text_layout *layout, const char *str, const sFONT *const *fonts,
+                int font_count, int max_width, int max_height)
+{
+  int len = strlen(str);
+  const sFONT *fallback = NULL;
+  int fallback_lines = 0;
+
+  memset(layout, 0, sizeof(*layout));
+  for(int f = 0; f < font_count; f++)
+  {
+    const sFONT *font = fonts[f];
+    int max_lines = max_height / font->Height;
+    if(max_lines > TEXT_MAX_LINES) max_lines = TEXT_MAX_LINES;
+    if(max_lines < 1 || font->Width > MAX_GLYPH_WIDTH)
+    {
+      continue;
+    }
+
+    int count = wrap(layout, str, len, font->Width, max_width, max_lines);
+    if(count >= 0 && count <= max_lines)
+    {
+      layout->font = font;
+      layout->line_count = count;
+      return 0;
+    }
+    if(count >= 0)
+    {
+      fallback = font;
+      fallback_lines = max_lines;
+    }
+  }
+
+  if(fallback == NULL)
+  {
+    return 1;
+  }
+
+  // Too long for every font: fill the smallest one that fits at all and cut the last line short.
+  int advance = fallback->Width;
+  wrap(layout, str, len, advance, max_width, fallback_lines);
+  layout->font = fallback;
+  layout->line_count = fallback_lines;
+
+  struct text_line *last = &layout->lines[fallback_lines - 1];
+  int room = max_width - ELLIPSIS_LEN * advance;
+  while(last->len > 0 && (last->width > room || last->start[last->len - 1] == ' '))
+  {
+    last->len--;
+    while(last->len > 0 && (last->start[last->len] & 0xC0) == 0x80) last->len--;
+    last->width = measure(last->start, last->len, advance);
+  }
+  last->width += ELLIPSIS_LEN * advance;
+  last->ellipsis = 1;
+  return 1;
+}
+
+int text_height(const struct text_layout *layout)
+{
+  return layout->font ? layout->line_count * layout->font->Height : 0;
+}
+
+// ANDs the glyph's ink into the canvas, a set font bit is black and a set canvas bit white.
+static void draw_glyph(uint8_t *canvas, int stride, int height, const sFONT *font, char c,
+                       int x, int y)
+{
+  int row_bytes = (font->Width + 7) / 8;
+  const uint8_t *glyph = &font->table[(c - FIRST_GLYPH) * font->Height * row_bytes];
+  uint32_t mask = ~0u << (32 - font->Width);
+  int shift = x & 7;
+  int byte = x >> 3;
+
+  for(int j = 0; j < font->Height; j++, glyph += row_bytes)
+  {
+    int row = y + j;
+    if(row < 0 || row >= height)
+    {
+      continue;
+    }
+    // The glyph row left aligned in a word, then shifted to the pixel it starts at.
+    uint32_t ink = 0;
+    for(int k = 0; k < row_bytes; k++)
+    {
+      ink |= (uint32_t)glyph[k] << (24 - 8 * k);
+    }
+    ink = (ink & mask) >> shift;
+
+    uint8_t *dst = &canvas[row * stride];
+    for(int k = byte; ink; k++, ink <<= 8)
+    {
+      if(k >= 0 && k < stride)
+      {
+        dst[k] &= ~(ink >> 24);
+      }
+    }
+  }
+}
+
+void text_draw(uint8_t *canvas, int stride, int height, const struct text_layout *layout, int y)
+{
+  const sFONT *font = layout->font;
+  if(font == NULL)
+  {
+    return;
+  }
+
+  for(int l = 0; l < layout->line_count; l++, y += font->Height)
+  {
+    const struct text_line *line = &layout->lines[l];
+    int x = (stride * 8 - line->width) / 2;
+    uint32_t cp;
+
+    for(int pos = 0; pos < line->len; x += font->Width)
+    {
+      pos += utf8_decode(&line->start[pos], line->len - pos, &cp);
+      draw_glyph(canvas, stride, height, font, glyph_for(cp), x, y);
+    }
+    for(int i = 0; line->ellipsis && i < ELLIPSIS_LEN; i++, x += font->Width)
+    {
+      draw_glyph(canvas, stride, height, font, '.', x, y);
+    }
+  }
+}
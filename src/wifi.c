@@ -9,12 +9,16 @@
 #include "esp_event.h"
 #include "esp_log.h"
 #include "nvs_flash.h"
+#include "nvs.h"
 #include "esp_spi_flash.h"
 
 #include "lwip/err.h"
 #include "lwip/sys.h"
+#include "lwip/ip_addr.h"
 
 #include "main.h"
+#include "crc32.h"
+#include "telemetry.h"
 
 /* FreeRTOS event group to signal when we are connected */
 static EventGroupHandle_t s_wifi_event_group;
@@ -25,16 +29,127 @@ static EventGroupHandle_t s_wifi_event_group;
 #define WIFI_CONNECTED_BIT BIT0
 #define WIFI_FAIL_BIT      BIT1
 
+#define AP_CACHE_NAMESPACE "wifi"
+#define AP_CACHE_KEY "ap"
+
 static const char *TAG = "wifi station";
 
 static int s_retry_num = 0;
 
+// The AP we last got an IP from, so the next boot can skip the scan and connect to it directly
+struct wifi_ap_cache {
+  uint32_t ssid_crc;
+  uint8_t bssid[6];
+  uint8_t channel;
+};
+
+static wifi_config_t s_wifi_config;
+static struct wifi_ap_cache s_cached;
+static struct wifi_ap_cache s_connected;
+// Set while the station is trying the cached BSSID/channel instead of scanning
+static volatile int s_directed = 0;
+static volatile int s_associated = 0;
+static TickType_t s_connect_start;
+static int64_t s_telemetry_start;
+static int s_telemetry_done = 0;
+
+static uint32_t ssid_crc(void)
+{
+  return crc32_update(0, CONFIG_ESP_WIFI_SSID, strlen(CONFIG_ESP_WIFI_SSID));
+}
+
+static int ap_cache_load(struct wifi_ap_cache *cache)
+{
+  nvs_handle_t handle;
+  size_t size = sizeof(*cache);
+
+  if(nvs_open(AP_CACHE_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+  {
+    return 1;
+  }
+  esp_err_t err = nvs_get_blob(handle, AP_CACHE_KEY, cache, &size);
+  nvs_close(handle);
+  if(err != ESP_OK || size != sizeof(*cache)
+     || cache->ssid_crc != ssid_crc() || cache->channel == 0)
+  {
+    return 1;
+  }
+  return 0;
+}
+
+static void ap_cache_save(const struct wifi_ap_cache *cache)
+{
+  nvs_handle_t handle;
+
+  if(nvs_open(AP_CACHE_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+  {
+    ESP_LOGW(TAG, "Failed to open NVS, AP not cached");
+    return;
+  }
+  if(nvs_set_blob(handle, AP_CACHE_KEY, cache, sizeof(*cache)) != ESP_OK
+     || nvs_commit(handle) != ESP_OK)
+  {
+    ESP_LOGW(TAG, "Failed to cache the AP");
+  }
+  nvs_close(handle);
+}
+
+#if CONFIG_XKCD_WIFI_STATIC_IP
+// Skips DHCP altogether, tcpip_adapter posts IP_EVENT_STA_GOT_IP once the address is set.
+static void set_static_ip(void)
+{
+  tcpip_adapter_ip_info_t ip_info;
+  tcpip_adapter_dns_info_t dns;
+
+  memset(&ip_info, 0, sizeof(ip_info));
+  memset(&dns, 0, sizeof(dns));
+  if(!ip4addr_aton(CONFIG_XKCD_WIFI_IP, &ip_info.ip)
+     || !ip4addr_aton(CONFIG_XKCD_WIFI_NETMASK, &ip_info.netmask)
+     || !ip4addr_aton(CONFIG_XKCD_WIFI_GATEWAY, &ip_info.gw)
+     || !ip4addr_aton(CONFIG_XKCD_WIFI_DNS, &dns.ip.u_addr.ip4))
+  {
+    ESP_LOGE(TAG, "Invalid static IP configuration, using DHCP");
+    return;
+  }
+  dns.ip.type = IPADDR_TYPE_V4;
+
+  tcpip_adapter_dhcpc_stop(TCPIP_ADAPTER_IF_STA);
+  if(tcpip_adapter_set_ip_info(TCPIP_ADAPTER_IF_STA, &ip_info) != ESP_OK
+     || tcpip_adapter_set_dns_info(TCPIP_ADAPTER_IF_STA, TCPIP_ADAPTER_DNS_MAIN, &dns) != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Failed to set the static IP, using DHCP");
+    tcpip_adapter_dhcpc_start(TCPIP_ADAPTER_IF_STA);
+  }
+}
+#endif
+
 static void event_handler(void* arg, esp_event_base_t event_base,
                                 int32_t event_id, void* event_data)
 {
   if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
     esp_wifi_connect();
+  } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+    wifi_event_sta_connected_t* event = (wifi_event_sta_connected_t*) event_data;
+    s_associated = 1;
+    s_connected.ssid_crc = ssid_crc();
+    memcpy(s_connected.bssid, event->bssid, sizeof(s_connected.bssid));
+    s_connected.channel = event->channel;
+#if CONFIG_XKCD_WIFI_STATIC_IP
+    set_static_ip();
+#endif
   } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+    s_associated = 0;
+    xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+    if (s_directed) {
+      // The cached AP is gone or moved channel, forget it and scan like a first boot would
+      s_directed = 0;
+      s_wifi_config.sta.bssid_set = false;
+      s_wifi_config.sta.channel = 0;
+      esp_wifi_set_config(ESP_IF_WIFI_STA, &s_wifi_config);
+      esp_wifi_connect();
+      ESP_LOGI(TAG, "cached AP not reachable, scanning");
+      return;
+    }
     if (s_retry_num < CONFIG_ESP_MAXIMUM_RETRY) {
       esp_wifi_connect();
       s_retry_num++;
@@ -45,14 +160,22 @@ static void event_handler(void* arg, esp_event_base_t event_base,
     ESP_LOGI(TAG, "connect to the AP fail");
   } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
     ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-    ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
+    ESP_LOGI(TAG, "got ip:" IPSTR " after %u ms", IP2STR(&event->ip_info.ip),
+             (unsigned)((xTaskGetTickCount() - s_connect_start) * portTICK_PERIOD_MS));
     s_retry_num = 0;
+    s_directed = 0;
+    if (!s_telemetry_done) {
+      telemetry_end(TELEMETRY_WIFI, s_telemetry_start, 0);
+      s_telemetry_done = 1;
+    }
     xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
   }
 }
 
+// Starts connecting and returns straight away, wifi_wait_connected() blocks until there is an IP.
 void wifi_init_sta(void)
 {
+  s_telemetry_start = telemetry_begin(TELEMETRY_WIFI);
   s_wifi_event_group = xEventGroupCreate();
 
   tcpip_adapter_init();
@@ -63,6 +186,7 @@ void wifi_init_sta(void)
   wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
   ESP_ERROR_CHECK(esp_wifi_init(&cfg));
 
+  // Stay registered, the handler reconnects and keeps the event bits current between cycles
   ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT,
                                              ESP_EVENT_ANY_ID,
                                              &event_handler,
@@ -87,35 +211,76 @@ void wifi_init_sta(void)
       },
     },
   };
+  s_wifi_config = wifi_config;
+
+#if CONFIG_XKCD_WIFI_FAST_CONNECT
+  if (ap_cache_load(&s_cached) == 0) {
+    s_wifi_config.sta.bssid_set = true;
+    memcpy(s_wifi_config.sta.bssid, s_cached.bssid, sizeof(s_cached.bssid));
+    s_wifi_config.sta.channel = s_cached.channel;
+    s_directed = 1;
+    ESP_LOGI(TAG, "connecting to cached AP " MACSTR " on channel %d",
+             MAC2STR(s_cached.bssid), s_cached.channel);
+  }
+#endif
   ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
-  ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config) );
+  ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &s_wifi_config) );
+  s_connect_start = xTaskGetTickCount();
   ESP_ERROR_CHECK(esp_wifi_start() );
 
   ESP_LOGI(TAG, "wifi_init_sta finished.");
+}
+
+int wifi_wait_connected(int timeout_ms)
+{
+  TickType_t start = xTaskGetTickCount();
+  TickType_t timeout = pdMS_TO_TICKS(timeout_ms);
+  EventBits_t bits;
 
-  /* Waiting until either the connection is established (WIFI_CONNECTED_BIT) or connection failed
-   * for the maximum number of re-tries (WIFI_FAIL_BIT). The bits are set by event_handler() (see
-   * above) */
-  EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
+#if CONFIG_XKCD_WIFI_FAST_CONNECT
+  if (s_directed) {
+    /* Give the cached AP a bounded head start. A missing AP usually shows up as a disconnect
+     * event long before this, but an AP that does not answer at all would otherwise cost the
+     * full association timeout before the scan even starts. */
+    TickType_t deadline = s_connect_start + pdMS_TO_TICKS(CONFIG_XKCD_WIFI_FAST_CONNECT_MS);
+    TickType_t now = xTaskGetTickCount();
+    TickType_t wait = (int32_t)(deadline - now) > 0 ? deadline - now : 0;
+    bits = xEventGroupWaitBits(s_wifi_event_group, WIFI_CONNECTED_BIT, pdFALSE, pdFALSE, wait);
+    if (!(bits & WIFI_CONNECTED_BIT) && s_directed && !s_associated) {
+      ESP_LOGW(TAG, "no answer from the cached AP after %d ms, scanning",
+               CONFIG_XKCD_WIFI_FAST_CONNECT_MS);
+      // The disconnect event falls back to the scan
+      esp_wifi_disconnect();
+    }
+  }
+#endif
+
+  if (xEventGroupGetBits(s_wifi_event_group) & WIFI_FAIL_BIT) {
+    // The retries ran out during an earlier cycle, start over with a fresh set
+    xEventGroupClearBits(s_wifi_event_group, WIFI_FAIL_BIT);
+    s_retry_num = 0;
+    esp_wifi_connect();
+  }
+
+  TickType_t elapsed = xTaskGetTickCount() - start;
+  bits = xEventGroupWaitBits(s_wifi_event_group,
       WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
       pdFALSE,
       pdFALSE,
-      portMAX_DELAY);
-
-  /* xEventGroupWaitBits() returns the bits before the call returned, hence we can test which event
-   * actually happened */
-  if (bits & WIFI_CONNECTED_BIT) {
-    ESP_LOGI(TAG, "connected to ap SSID:%s password:%s",
-              CONFIG_ESP_WIFI_SSID, CONFIG_ESP_WIFI_PASS);
-  } else if (bits & WIFI_FAIL_BIT) {
-    ESP_LOGI(TAG, "Failed to conect to SSID:%s, password:%s",
-             CONFIG_ESP_WIFI_SSID, CONFIG_ESP_WIFI_PASS);
-  } else {
-    ESP_LOGE(TAG, "UNEXPECTED EVENT");
-  }
+      elapsed < timeout ? timeout - elapsed : 0);
 
-  /* The event will not be processed after unregister */
-  ESP_ERROR_CHECK(esp_event_handler_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler));
-  ESP_ERROR_CHECK(esp_event_handler_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler));
-  vEventGroupDelete(s_wifi_event_group);
+  if (!(bits & WIFI_CONNECTED_BIT)) {
+    ESP_LOGE(TAG, "Failed to connect to SSID:%s", CONFIG_ESP_WIFI_SSID);
+    return 1;
+  }
+#if CONFIG_XKCD_WIFI_FAST_CONNECT
+  if (memcmp(s_connected.bssid, s_cached.bssid, sizeof(s_cached.bssid))
+      || s_connected.channel != s_cached.channel || s_connected.ssid_crc != s_cached.ssid_crc) {
+    ESP_LOGI(TAG, "caching AP " MACSTR " on channel %d",
+             MAC2STR(s_connected.bssid), s_connected.channel);
+    ap_cache_save(&s_connected);
+    s_cached = s_connected;
+  }
+#endif
+  return 0;
 }